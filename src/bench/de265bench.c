@@ -0,0 +1,497 @@
+/*****************************************************************************
+ * de265bench.c: demuxer and decoder benchmark for the libde265 plugins
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Preamble
+ *****************************************************************************
+ * Plays files headlessly through libvlc with the plugins of the build tree
+ * and reports the throughput, the time per picture spent in the stages of
+ * the decoder (taken from its statistics log), CPU time, heap usage and
+ * peak RSS, either as text or as one JSON object per run.
+ *
+ * In "decode" mode, the video is decoded by a stream output that throws
+ * the pictures away, so the input is not paced by the clock. "demux" only
+ * demuxes, "play" plays in real time to a dummy video output, which shows
+ * late and lost pictures.
+ *****************************************************************************/
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#if defined(HAVE_MALLINFO2) || defined(HAVE_MALLINFO)
+#include <malloc.h>
+#endif
+
+#include <vlc/vlc.h>
+
+// Interval of the decoder statistics log in seconds
+#define STATS_INTERVAL          1
+
+// Give up on a run after this many seconds without the end of the file
+#define DEFAULT_TIMEOUT         3600
+
+#define DECODE_SOUT "#transcode{vcodec=I420,venc=dummy}:dummy"
+#define DEMUX_SOUT  "#dummy"
+
+#define MAX_VLC_ARGS            32
+
+/*****************************************************************************
+ * bench_options_t: command line
+ *****************************************************************************/
+typedef struct bench_options_t
+{
+    const char *mode;
+    const char *demux;
+    const char *sout;
+    const char *plugin_path;
+    int threads;
+    int copy_threads;
+    bool disable_deblocking;
+    bool disable_sao;
+    bool no_direct_rendering;
+    bool pipeline;
+    int repeat;
+    int timeout;
+    bool json;
+    bool verbose;
+} bench_options_t;
+
+/*****************************************************************************
+ * bench_run_t: state and results of playing a file once
+ *****************************************************************************/
+typedef struct bench_run_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool verbose;
+    bool done;
+    bool failed;
+
+    // accumulated from the statistics log of the decoder
+    unsigned blocks;
+    unsigned dropped_blocks;
+    unsigned pictures;
+    unsigned skipped_pictures;
+    unsigned late_pictures;
+    unsigned last_pictures;
+    long long push_time;
+    long long decode_time;
+    long long copy_time;
+    long long direct_pictures;
+} bench_run_t;
+
+static void Usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options] file...\n"
+        "\n"
+        "  -m, --mode MODE          decode (default), demux or play\n"
+        "  -d, --demux NAME         force a demuxer (libde265demux, ts, mp4, mkv)\n"
+        "  -s, --sout CHAIN         stream output used instead of the one of the mode\n"
+        "  -p, --plugin-path DIR    load the plugins from DIR (e.g. .libs)\n"
+        "  -t, --threads N          decoder threads, 0 meaning auto (default)\n"
+        "  -c, --copy-threads N     threads to copy pictures (default 0)\n"
+        "  -D, --disable-deblocking disable the deblocking filter\n"
+        "  -S, --disable-sao        disable the sample adaptive offset filter\n"
+        "  -n, --no-direct-rendering copy all pictures\n"
+        "  -P, --pipeline           decode on a separate thread\n"
+        "  -r, --repeat N           play every file N times (default 1)\n"
+        "  -T, --timeout SECONDS    abort a run after SECONDS (default %d)\n"
+        "  -j, --json               print one JSON object per run\n"
+        "  -v, --verbose            print the log of vlc\n"
+        "  -h, --help               show this help\n",
+        name, DEFAULT_TIMEOUT);
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double CpuTime(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static long PeakRSS(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static long HeapUsed(void)
+{
+#if defined(HAVE_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    return (long) ((info.uordblks + info.hblkhd) / 1024);
+#elif defined(HAVE_MALLINFO)
+    struct mallinfo info = mallinfo();
+    return (long) ((unsigned) info.uordblks + (unsigned) info.hblkhd) / 1024;
+#else
+    return -1;
+#endif
+}
+
+/*****************************************************************************
+ * Log: collect the statistics of the decoder
+ *****************************************************************************/
+static void Log(void *data, int level, const libvlc_log_t *ctx,
+                const char *fmt, va_list args)
+{
+    bench_run_t *run = (bench_run_t *) data;
+    char msg[512];
+    unsigned blocks, dropped, pictures, skipped, late, direct;
+    long long push, decode, copy;
+    (void) level;
+    (void) ctx;
+
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    if (run->verbose) {
+        fprintf(stderr, "%s\n", msg);
+    }
+
+    pthread_mutex_lock(&run->lock);
+    if (sscanf(msg, "%u blocks (%u dropped), %u pictures (%u skipped, %u late)",
+               &blocks, &dropped, &pictures, &skipped, &late) == 5) {
+        run->blocks += blocks;
+        run->dropped_blocks += dropped;
+        run->pictures += pictures;
+        run->skipped_pictures += skipped;
+        run->late_pictures += late;
+        run->last_pictures = pictures;
+    } else if (sscanf(msg, "per picture: push %lld us, decode %lld us, copy %lld us",
+                      &push, &decode, &copy) == 3) {
+        // the times are averages of the pictures of the previous line
+        run->push_time += push * run->last_pictures;
+        run->decode_time += decode * run->last_pictures;
+        run->copy_time += copy * run->last_pictures;
+    } else if (sscanf(msg, "direct rendering %u%%", &direct) == 1) {
+        run->direct_pictures += (long long) direct * run->last_pictures / 100;
+    }
+    pthread_mutex_unlock(&run->lock);
+}
+
+static void Event(const libvlc_event_t *event, void *data)
+{
+    bench_run_t *run = (bench_run_t *) data;
+
+    pthread_mutex_lock(&run->lock);
+    run->done = true;
+    run->failed = event->type == libvlc_MediaPlayerEncounteredError;
+    pthread_cond_signal(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+}
+
+/*****************************************************************************
+ * Report: print the results of a run
+ *****************************************************************************/
+static void Report(const bench_options_t *opts, const char *path, int iteration,
+                   const bench_run_t *run, const libvlc_media_stats_t *stats,
+                   double seconds, double cpu, long heap_kb)
+{
+    unsigned pictures = run->pictures - run->skipped_pictures;
+    unsigned per = run->pictures > 0 ? run->pictures : 1;
+    int decoded = stats ? stats->i_decoded_video : 0;
+    double fps = seconds > 0 ? (run->pictures > 0 ? pictures : (unsigned) decoded) / seconds : 0;
+    long long demux_bytes = stats ? stats->i_demux_read_bytes : 0;
+
+    if (opts->json) {
+        // no escaping of the path, keep corpus file names plain
+        printf("{\"file\": \"%s\", \"iteration\": %d, \"mode\": \"%s\", "
+               "\"demux\": \"%s\", \"threads\": %d, \"copy_threads\": %d, "
+               "\"deblocking\": %s, \"sao\": %s, \"direct_rendering\": %s, "
+               "\"pipeline\": %s, \"failed\": %s, "
+               "\"seconds\": %.3f, \"cpu_seconds\": %.3f, \"fps\": %.2f, "
+               "\"blocks\": %u, \"dropped_blocks\": %u, \"pictures\": %u, "
+               "\"skipped_pictures\": %u, \"late_pictures\": %u, "
+               "\"decoded_video\": %d, \"lost_pictures\": %d, "
+               "\"push_us\": %lld, \"decode_us\": %lld, \"copy_us\": %lld, "
+               "\"direct_percent\": %lld, \"demux_bytes\": %lld, "
+               "\"demux_mbps\": %.2f, \"heap_kb\": %ld, \"max_rss_kb\": %ld}\n",
+               path, iteration, opts->mode, opts->demux ? opts->demux : "",
+               opts->threads, opts->copy_threads,
+               opts->disable_deblocking ? "false" : "true",
+               opts->disable_sao ? "false" : "true",
+               opts->no_direct_rendering ? "false" : "true",
+               opts->pipeline ? "true" : "false",
+               run->failed ? "true" : "false",
+               seconds, cpu, fps,
+               run->blocks, run->dropped_blocks, run->pictures,
+               run->skipped_pictures, run->late_pictures,
+               decoded, stats ? stats->i_lost_pictures : 0,
+               run->push_time / per, run->decode_time / per, run->copy_time / per,
+               run->direct_pictures * 100 / per, demux_bytes,
+               seconds > 0 ? demux_bytes * 8 / seconds / 1e6 : 0,
+               heap_kb, PeakRSS());
+    } else {
+        printf("%s (run %d, %s)%s\n", path, iteration, opts->mode,
+               run->failed ? ": FAILED" : "");
+        printf("  %.3f s, %.3f s CPU (%.0f%%), %.2f fps\n",
+               seconds, cpu, seconds > 0 ? cpu * 100 / seconds : 0, fps);
+        printf("  %u blocks (%u dropped), %u pictures (%u skipped, %u late), "
+               "%d decoded, %d lost\n",
+               run->blocks, run->dropped_blocks, run->pictures,
+               run->skipped_pictures, run->late_pictures,
+               decoded, stats ? stats->i_lost_pictures : 0);
+        printf("  per picture: push %lld us, decode %lld us, copy %lld us, "
+               "direct rendering %lld%%\n",
+               run->push_time / per, run->decode_time / per, run->copy_time / per,
+               run->direct_pictures * 100 / per);
+        printf("  demuxed %lld bytes (%.2f Mbit/s), heap %ld kB, peak RSS %ld kB\n",
+               demux_bytes, seconds > 0 ? demux_bytes * 8 / seconds / 1e6 : 0,
+               heap_kb, PeakRSS());
+    }
+    fflush(stdout);
+}
+
+/*****************************************************************************
+ * Run: play a file once
+ *****************************************************************************/
+static int Run(const bench_options_t *opts, const char *path, int iteration)
+{
+    const char *args[MAX_VLC_ARGS];
+    char threads[32], copy_threads[32], stats_interval[32];
+    int argc = 0;
+    bench_run_t run;
+
+    memset(&run, 0, sizeof(run));
+    run.verbose = opts->verbose;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    snprintf(threads, sizeof(threads), "--libde265-threads=%d", opts->threads);
+    snprintf(copy_threads, sizeof(copy_threads), "--libde265-copy-threads=%d", opts->copy_threads);
+    snprintf(stats_interval, sizeof(stats_interval), "--libde265-stats-interval=%d", STATS_INTERVAL);
+    args[argc++] = "--intf=dummy";
+    args[argc++] = "--no-video-title-show";
+    args[argc++] = "--no-sub-autodetect-file";
+    args[argc++] = "--no-audio";
+    args[argc++] = "--vout=dummy";
+    args[argc++] = "--stats";
+    args[argc++] = threads;
+    args[argc++] = copy_threads;
+    args[argc++] = stats_interval;
+    args[argc++] = opts->disable_deblocking ? "--libde265-disable-deblocking" : "--no-libde265-disable-deblocking";
+    args[argc++] = opts->disable_sao ? "--libde265-disable-sao" : "--no-libde265-disable-sao";
+    args[argc++] = opts->no_direct_rendering ? "--no-libde265-direct-rendering" : "--libde265-direct-rendering";
+    args[argc++] = opts->pipeline ? "--libde265-pipeline" : "--no-libde265-pipeline";
+
+    libvlc_instance_t *vlc = libvlc_new(argc, args);
+    if (vlc == NULL) {
+        fprintf(stderr, "Failed to initialize libvlc\n");
+        return -1;
+    }
+    libvlc_log_set(vlc, Log, &run);
+
+    libvlc_media_t *media = libvlc_media_new_path(vlc, path);
+    if (media == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        libvlc_release(vlc);
+        return -1;
+    }
+
+    char option[256];
+    if (opts->demux) {
+        snprintf(option, sizeof(option), ":demux=%s", opts->demux);
+        libvlc_media_add_option(media, option);
+    }
+    const char *sout = opts->sout;
+    if (sout == NULL && !strcmp(opts->mode, "decode")) {
+        sout = DECODE_SOUT;
+    } else if (sout == NULL && !strcmp(opts->mode, "demux")) {
+        sout = DEMUX_SOUT;
+    }
+    if (sout) {
+        snprintf(option, sizeof(option), ":sout=%s", sout);
+        libvlc_media_add_option(media, option);
+        libvlc_media_add_option(media, ":no-sout-audio");
+        libvlc_media_add_option(media, ":no-sout-spu");
+    }
+
+    libvlc_media_player_t *player = libvlc_media_player_new_from_media(media);
+    libvlc_event_manager_t *events = libvlc_media_player_event_manager(player);
+    libvlc_event_attach(events, libvlc_MediaPlayerEndReached, Event, &run);
+    libvlc_event_attach(events, libvlc_MediaPlayerEncounteredError, Event, &run);
+
+    double cpu_start = CpuTime();
+    double start = Now();
+    if (libvlc_media_player_play(player) != 0) {
+        run.failed = true;
+        run.done = true;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += opts->timeout;
+    pthread_mutex_lock(&run.lock);
+    while (!run.done) {
+        if (pthread_cond_timedwait(&run.cond, &run.lock, &deadline) == ETIMEDOUT) {
+            fprintf(stderr, "%s: timeout after %d seconds\n", path, opts->timeout);
+            run.failed = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&run.lock);
+    double seconds = Now() - start;
+
+    // the statistics of the input are gone once it is stopped
+    libvlc_media_stats_t stats;
+    bool have_stats = libvlc_media_get_stats(media, &stats);
+    long heap_kb = HeapUsed();
+
+    // the decoder reports its remaining statistics when it is closed
+    libvlc_media_player_stop(player);
+    double cpu = CpuTime() - cpu_start;
+    libvlc_event_detach(events, libvlc_MediaPlayerEndReached, Event, &run);
+    libvlc_event_detach(events, libvlc_MediaPlayerEncounteredError, Event, &run);
+    libvlc_media_player_release(player);
+    libvlc_media_release(media);
+    libvlc_log_unset(vlc);
+    libvlc_release(vlc);
+
+    Report(opts, path, iteration, &run, have_stats ? &stats : NULL, seconds, cpu, heap_kb);
+
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+    return run.failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "demux", required_argument, NULL, 'd' },
+        { "sout", required_argument, NULL, 's' },
+        { "plugin-path", required_argument, NULL, 'p' },
+        { "threads", required_argument, NULL, 't' },
+        { "copy-threads", required_argument, NULL, 'c' },
+        { "disable-deblocking", no_argument, NULL, 'D' },
+        { "disable-sao", no_argument, NULL, 'S' },
+        { "no-direct-rendering", no_argument, NULL, 'n' },
+        { "pipeline", no_argument, NULL, 'P' },
+        { "repeat", required_argument, NULL, 'r' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "json", no_argument, NULL, 'j' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    bench_options_t opts;
+    int c;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.mode = "decode";
+    opts.repeat = 1;
+    opts.timeout = DEFAULT_TIMEOUT;
+    while ((c = getopt_long(argc, argv, "m:d:s:p:t:c:DSnPr:T:jvh", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'm':
+            opts.mode = optarg;
+            break;
+        case 'd':
+            opts.demux = optarg;
+            break;
+        case 's':
+            opts.sout = optarg;
+            break;
+        case 'p':
+            opts.plugin_path = optarg;
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 'c':
+            opts.copy_threads = atoi(optarg);
+            break;
+        case 'D':
+            opts.disable_deblocking = true;
+            break;
+        case 'S':
+            opts.disable_sao = true;
+            break;
+        case 'n':
+            opts.no_direct_rendering = true;
+            break;
+        case 'P':
+            opts.pipeline = true;
+            break;
+        case 'r':
+            opts.repeat = atoi(optarg);
+            break;
+        case 'T':
+            opts.timeout = atoi(optarg);
+            break;
+        case 'j':
+            opts.json = true;
+            break;
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 'h':
+            Usage(argv[0]);
+            return 0;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind >= argc || opts.repeat < 1 || opts.timeout < 1 ||
+        (strcmp(opts.mode, "decode") && strcmp(opts.mode, "demux") &&
+         strcmp(opts.mode, "play"))) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    // vlc 2.x only loads plugins from other directories this way
+    if (opts.plugin_path && setenv("VLC_PLUGIN_PATH", opts.plugin_path, 1) != 0) {
+        fprintf(stderr, "Failed to set plugin path: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        for (int iteration = 1; iteration <= opts.repeat; iteration++) {
+            if (Run(&opts, argv[i], iteration) != 0) {
+                failed++;
+            }
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,576 @@
+/*****************************************************************************
+ * copy.c: plane copy and bit-depth conversion helpers
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Preamble
+ *****************************************************************************/
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+
+#include <vlc_common.h>
+#include <vlc_cpu.h>
+
+#include "copy.h"
+
+// Don't split planes into bands of less than 16 lines
+#define MIN_BAND_LINES          16
+
+// Maximum number of threads in a copy pool
+#define MAX_POOL_THREADS        16
+
+// Every plane is split into at most one band per thread (plus the caller)
+#define MAX_BANDS               ((MAX_POOL_THREADS + 1) * COPY_POOL_MAX_PLANES)
+
+// The SIMD kernels are compiled with function specific target attributes,
+// so the plugin itself can still be built for the baseline architecture.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CAN_COMPILE_SSE2
+#define CAN_COMPILE_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON__))
+#define CAN_COMPILE_NEON
+#include <arm_neon.h>
+#endif
+
+// VLC 2.0 only reports capability flags through vlc_CPU()
+#if !defined(vlc_CPU_SSE2) && defined(CPU_CAPABILITY_SSE2)
+#define vlc_CPU_SSE2() ((vlc_CPU() & CPU_CAPABILITY_SSE2) != 0)
+#endif
+
+/*****************************************************************************
+ * Scalar fallback
+ *****************************************************************************/
+static void ShiftDownC(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[pos] = src[pos] >> shift;
+    }
+}
+
+static void ShiftUpC(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[pos] = src[pos] << shift;
+    }
+}
+
+static void WidenC(uint16_t *dst, const uint8_t *src, int count, int shift)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[pos] = src[pos] << shift;
+    }
+}
+
+static void NarrowC(uint8_t *dst, const uint16_t *src, int count, int shift)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[pos] = src[pos] >> shift;
+    }
+}
+
+static void InterleaveC(uint8_t *dst, const uint8_t *u, const uint8_t *v, int count)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[2*pos] = u[pos];
+        dst[2*pos+1] = v[pos];
+    }
+}
+
+static void Interleave16C(uint16_t *dst, const uint16_t *u, const uint16_t *v,
+                          int count, int shift)
+{
+    for (int pos=0; pos<count; pos++) {
+        dst[2*pos] = u[pos] << shift;
+        dst[2*pos+1] = v[pos] << shift;
+    }
+}
+
+#ifdef CAN_COMPILE_SSE2
+/*****************************************************************************
+ * SSE2 (16 bytes per iteration)
+ *****************************************************************************/
+__attribute__((__target__("sse2")))
+static void ShiftDownSSE2(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + pos));
+        _mm_storeu_si128((__m128i *) (dst + pos), _mm_srl_epi16(v, s));
+    }
+    ShiftDownC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("sse2")))
+static void ShiftUpSSE2(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + pos));
+        _mm_storeu_si128((__m128i *) (dst + pos), _mm_sll_epi16(v, s));
+    }
+    ShiftUpC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("sse2")))
+static void WidenSSE2(uint16_t *dst, const uint8_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    const __m128i zero = _mm_setzero_si128();
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + pos));
+        __m128i lo = _mm_sll_epi16(_mm_unpacklo_epi8(v, zero), s);
+        __m128i hi = _mm_sll_epi16(_mm_unpackhi_epi8(v, zero), s);
+        _mm_storeu_si128((__m128i *) (dst + pos), lo);
+        _mm_storeu_si128((__m128i *) (dst + pos + 8), hi);
+    }
+    WidenC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("sse2")))
+static void NarrowSSE2(uint8_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m128i lo = _mm_srl_epi16(_mm_loadu_si128((const __m128i *) (src + pos)), s);
+        __m128i hi = _mm_srl_epi16(_mm_loadu_si128((const __m128i *) (src + pos + 8)), s);
+        _mm_storeu_si128((__m128i *) (dst + pos), _mm_packus_epi16(lo, hi));
+    }
+    NarrowC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("sse2")))
+static void InterleaveSSE2(uint8_t *dst, const uint8_t *u, const uint8_t *v, int count)
+{
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (u + pos));
+        __m128i b = _mm_loadu_si128((const __m128i *) (v + pos));
+        _mm_storeu_si128((__m128i *) (dst + 2*pos), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *) (dst + 2*pos + 16), _mm_unpackhi_epi8(a, b));
+    }
+    InterleaveC(dst + 2*pos, u + pos, v + pos, count - pos);
+}
+
+__attribute__((__target__("sse2")))
+static void Interleave16SSE2(uint16_t *dst, const uint16_t *u, const uint16_t *v,
+                             int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        __m128i a = _mm_sll_epi16(_mm_loadu_si128((const __m128i *) (u + pos)), s);
+        __m128i b = _mm_sll_epi16(_mm_loadu_si128((const __m128i *) (v + pos)), s);
+        _mm_storeu_si128((__m128i *) (dst + 2*pos), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i *) (dst + 2*pos + 8), _mm_unpackhi_epi16(a, b));
+    }
+    Interleave16C(dst + 2*pos, u + pos, v + pos, count - pos, shift);
+}
+#endif
+
+#if defined(CAN_COMPILE_AVX2) && defined(vlc_CPU_AVX2)
+/*****************************************************************************
+ * AVX2 (32 bytes per iteration)
+ *****************************************************************************/
+__attribute__((__target__("avx2")))
+static void ShiftDownAVX2(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + pos));
+        _mm256_storeu_si256((__m256i *) (dst + pos), _mm256_srl_epi16(v, s));
+    }
+    ShiftDownC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("avx2")))
+static void ShiftUpAVX2(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + pos));
+        _mm256_storeu_si256((__m256i *) (dst + pos), _mm256_sll_epi16(v, s));
+    }
+    ShiftUpC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("avx2")))
+static void WidenAVX2(uint16_t *dst, const uint8_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (src + pos)));
+        _mm256_storeu_si256((__m256i *) (dst + pos), _mm256_sll_epi16(v, s));
+    }
+    WidenC(dst + pos, src + pos, count - pos, shift);
+}
+
+__attribute__((__target__("avx2")))
+static void NarrowAVX2(uint8_t *dst, const uint16_t *src, int count, int shift)
+{
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    int pos = 0;
+    for (; pos + 32 <= count; pos += 32) {
+        __m256i lo = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) (src + pos)), s);
+        __m256i hi = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *) (src + pos + 16)), s);
+        // the pack works on 128 bit lanes, restore the order of the samples
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + pos), v);
+    }
+    NarrowC(dst + pos, src + pos, count - pos, shift);
+}
+#endif
+
+#ifdef CAN_COMPILE_NEON
+/*****************************************************************************
+ * NEON (16 bytes per iteration)
+ *****************************************************************************/
+static void ShiftDownNEON(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    // shifting left by a negative amount is a right shift
+    const int16x8_t s = vdupq_n_s16(-shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        vst1q_u16(dst + pos, vshlq_u16(vld1q_u16(src + pos), s));
+    }
+    ShiftDownC(dst + pos, src + pos, count - pos, shift);
+}
+
+static void ShiftUpNEON(uint16_t *dst, const uint16_t *src, int count, int shift)
+{
+    const int16x8_t s = vdupq_n_s16(shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        vst1q_u16(dst + pos, vshlq_u16(vld1q_u16(src + pos), s));
+    }
+    ShiftUpC(dst + pos, src + pos, count - pos, shift);
+}
+
+static void WidenNEON(uint16_t *dst, const uint8_t *src, int count, int shift)
+{
+    const int16x8_t s = vdupq_n_s16(shift);
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        uint8x16_t v = vld1q_u8(src + pos);
+        vst1q_u16(dst + pos, vshlq_u16(vmovl_u8(vget_low_u8(v)), s));
+        vst1q_u16(dst + pos + 8, vshlq_u16(vmovl_u8(vget_high_u8(v)), s));
+    }
+    WidenC(dst + pos, src + pos, count - pos, shift);
+}
+
+static void NarrowNEON(uint8_t *dst, const uint16_t *src, int count, int shift)
+{
+    const int16x8_t s = vdupq_n_s16(-shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        vst1_u8(dst + pos, vqmovn_u16(vshlq_u16(vld1q_u16(src + pos), s)));
+    }
+    NarrowC(dst + pos, src + pos, count - pos, shift);
+}
+
+static void InterleaveNEON(uint8_t *dst, const uint8_t *u, const uint8_t *v, int count)
+{
+    int pos = 0;
+    for (; pos + 16 <= count; pos += 16) {
+        uint8x16x2_t uv;
+        uv.val[0] = vld1q_u8(u + pos);
+        uv.val[1] = vld1q_u8(v + pos);
+        vst2q_u8(dst + 2*pos, uv);
+    }
+    InterleaveC(dst + 2*pos, u + pos, v + pos, count - pos);
+}
+
+static void Interleave16NEON(uint16_t *dst, const uint16_t *u, const uint16_t *v,
+                             int count, int shift)
+{
+    const int16x8_t s = vdupq_n_s16(shift);
+    int pos = 0;
+    for (; pos + 8 <= count; pos += 8) {
+        uint16x8x2_t uv;
+        uv.val[0] = vshlq_u16(vld1q_u16(u + pos), s);
+        uv.val[1] = vshlq_u16(vld1q_u16(v + pos), s);
+        vst2q_u16(dst + 2*pos, uv);
+    }
+    Interleave16C(dst + 2*pos, u + pos, v + pos, count - pos, shift);
+}
+#endif
+
+/*****************************************************************************
+ * CopyKernelsInit: select the fastest kernels supported by the CPU
+ *****************************************************************************/
+void CopyKernelsInit(copy_kernels_t *kernels)
+{
+    kernels->shift_down = ShiftDownC;
+    kernels->shift_up = ShiftUpC;
+    kernels->widen = WidenC;
+    kernels->narrow = NarrowC;
+    kernels->interleave = InterleaveC;
+    kernels->interleave16 = Interleave16C;
+    kernels->name = "C";
+
+#ifdef CAN_COMPILE_SSE2
+    if (vlc_CPU_SSE2()) {
+        kernels->shift_down = ShiftDownSSE2;
+        kernels->shift_up = ShiftUpSSE2;
+        kernels->widen = WidenSSE2;
+        kernels->narrow = NarrowSSE2;
+        kernels->interleave = InterleaveSSE2;
+        kernels->interleave16 = Interleave16SSE2;
+        kernels->name = "SSE2";
+    }
+#endif
+#if defined(CAN_COMPILE_AVX2) && defined(vlc_CPU_AVX2)
+    if (vlc_CPU_AVX2()) {
+        kernels->shift_down = ShiftDownAVX2;
+        kernels->shift_up = ShiftUpAVX2;
+        kernels->widen = WidenAVX2;
+        kernels->narrow = NarrowAVX2;
+        // the interleave kernels of SSE2 are kept, unpacking 256 bit
+        // registers works on 128 bit lanes
+        kernels->name = "AVX2";
+    }
+#endif
+#ifdef CAN_COMPILE_NEON
+#if defined(__arm__) && defined(vlc_CPU_ARM_NEON)
+    if (vlc_CPU_ARM_NEON())
+#endif
+    {
+        kernels->shift_down = ShiftDownNEON;
+        kernels->shift_up = ShiftUpNEON;
+        kernels->widen = WidenNEON;
+        kernels->narrow = NarrowNEON;
+        kernels->interleave = InterleaveNEON;
+        kernels->interleave16 = Interleave16NEON;
+        kernels->name = "NEON";
+    }
+#endif
+}
+
+/*****************************************************************************
+ * CopyPlaneLines: copy / convert a range of lines of a plane
+ *****************************************************************************/
+void CopyPlaneLines(const copy_kernels_t *kernels, const copy_plane_t *plane,
+                    int first, int count)
+{
+    const uint8_t *src = plane->src + (ptrdiff_t) first * plane->src_stride;
+    const uint8_t *src2 = plane->src2 != NULL ?
+        plane->src2 + (ptrdiff_t) first * plane->src2_stride : NULL;
+    uint8_t *dst = plane->dst + (ptrdiff_t) first * plane->dst_stride;
+
+    for (int line = 0; line < count; line++) {
+        switch (plane->mode) {
+        case COPY_MODE_SHIFT_DOWN:
+            kernels->shift_down((uint16_t *) dst, (const uint16_t *) src,
+                                plane->width, plane->shift);
+            break;
+        case COPY_MODE_SHIFT_UP:
+            kernels->shift_up((uint16_t *) dst, (const uint16_t *) src,
+                              plane->width, plane->shift);
+            break;
+        case COPY_MODE_WIDEN:
+            kernels->widen((uint16_t *) dst, src, plane->width, plane->shift);
+            break;
+        case COPY_MODE_NARROW:
+            kernels->narrow(dst, (const uint16_t *) src, plane->width, plane->shift);
+            break;
+        case COPY_MODE_INTERLEAVE:
+            kernels->interleave(dst, src, src2, plane->width);
+            break;
+        case COPY_MODE_INTERLEAVE_16:
+            kernels->interleave16((uint16_t *) dst, (const uint16_t *) src,
+                                  (const uint16_t *) src2, plane->width, plane->shift);
+            break;
+        default:
+            memcpy(dst, src, plane->width);
+            break;
+        }
+        src += plane->src_stride;
+        if (src2 != NULL) {
+            src2 += plane->src2_stride;
+        }
+        dst += plane->dst_stride;
+    }
+}
+
+/*****************************************************************************
+ * copy_pool_t: persistent threads copying planes in horizontal bands
+ *****************************************************************************/
+struct copy_band_t
+{
+    const copy_plane_t *plane;
+    int first;
+    int count;
+};
+
+struct copy_pool_t
+{
+    const copy_kernels_t *kernels;
+
+    vlc_mutex_t lock;
+    vlc_cond_t wait;
+    vlc_cond_t done;
+    bool quit;
+
+    struct copy_band_t bands[MAX_BANDS];
+    int band_count;
+    int next_band;
+    int bands_pending;
+
+    int thread_count;
+    vlc_thread_t threads[MAX_POOL_THREADS];
+};
+
+/*****************************************************************************
+ * CopyPoolWork: process queued bands, must be called with the lock held
+ *****************************************************************************/
+static void CopyPoolWork(copy_pool_t *pool)
+{
+    while (pool->next_band < pool->band_count) {
+        struct copy_band_t *band = &pool->bands[pool->next_band++];
+        vlc_mutex_unlock(&pool->lock);
+        CopyPlaneLines(pool->kernels, band->plane, band->first, band->count);
+        vlc_mutex_lock(&pool->lock);
+        if (--pool->bands_pending == 0) {
+            vlc_cond_signal(&pool->done);
+        }
+    }
+}
+
+static void *CopyPoolThread(void *data)
+{
+    copy_pool_t *pool = (copy_pool_t *) data;
+
+    vlc_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        if (pool->next_band >= pool->band_count) {
+            vlc_cond_wait(&pool->wait, &pool->lock);
+            continue;
+        }
+        CopyPoolWork(pool);
+    }
+    vlc_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*****************************************************************************
+ * CopyPoolNew: start a pool with the given number of helper threads
+ *****************************************************************************/
+copy_pool_t *CopyPoolNew(const copy_kernels_t *kernels, int threads)
+{
+    if (threads <= 0) {
+        return NULL;
+    }
+
+    copy_pool_t *pool = (copy_pool_t *) calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->kernels = kernels;
+    vlc_mutex_init(&pool->lock);
+    vlc_cond_init(&pool->wait);
+    vlc_cond_init(&pool->done);
+
+    threads = __MIN(threads, MAX_POOL_THREADS);
+    for (int i=0; i<threads; i++) {
+        if (vlc_clone(&pool->threads[i], CopyPoolThread, pool, VLC_THREAD_PRIORITY_VIDEO)) {
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    if (pool->thread_count == 0) {
+        CopyPoolDelete(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*****************************************************************************
+ * CopyPoolDelete: stop all threads and free the pool
+ *****************************************************************************/
+void CopyPoolDelete(copy_pool_t *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    vlc_mutex_lock(&pool->lock);
+    pool->quit = true;
+    vlc_cond_broadcast(&pool->wait);
+    vlc_mutex_unlock(&pool->lock);
+
+    for (int i=0; i<pool->thread_count; i++) {
+        vlc_join(pool->threads[i], NULL);
+    }
+
+    vlc_cond_destroy(&pool->done);
+    vlc_cond_destroy(&pool->wait);
+    vlc_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/*****************************************************************************
+ * CopyPoolRun: copy planes using the pool threads and the calling thread
+ *****************************************************************************/
+void CopyPoolRun(copy_pool_t *pool, const copy_plane_t *planes, int count)
+{
+    // split every plane into one band per thread (including the caller)
+    int bands_per_plane = pool->thread_count + 1;
+
+    vlc_mutex_lock(&pool->lock);
+    assert(pool->bands_pending == 0);
+    assert(count <= COPY_POOL_MAX_PLANES);
+    pool->band_count = 0;
+    pool->next_band = 0;
+    for (int i=0; i<count; i++) {
+        const copy_plane_t *plane = &planes[i];
+        int band_lines = (plane->lines + bands_per_plane - 1) / bands_per_plane;
+        band_lines = __MAX(band_lines, MIN_BAND_LINES);
+        for (int first = 0; first < plane->lines; first += band_lines) {
+            struct copy_band_t *band = &pool->bands[pool->band_count++];
+            band->plane = plane;
+            band->first = first;
+            band->count = __MIN(band_lines, plane->lines - first);
+        }
+    }
+    pool->bands_pending = pool->band_count;
+    vlc_cond_broadcast(&pool->wait);
+
+    CopyPoolWork(pool);
+    while (pool->bands_pending > 0) {
+        vlc_cond_wait(&pool->done, &pool->lock);
+    }
+    vlc_mutex_unlock(&pool->lock);
+}
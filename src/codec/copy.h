@@ -0,0 +1,107 @@
+/*****************************************************************************
+ * copy.h: plane copy and bit-depth conversion helpers
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _LIBDE265_COPY_H_
+#define _LIBDE265_COPY_H_
+
+#include <stdint.h>
+
+/*****************************************************************************
+ * copy_kernels_t: row conversion functions, selected at runtime
+ *****************************************************************************/
+typedef struct copy_kernels_t
+{
+    // dst = src >> shift (16 bits per sample)
+    void (*shift_down)(uint16_t *dst, const uint16_t *src, int count, int shift);
+    // dst = src << shift (16 bits per sample)
+    void (*shift_up)(uint16_t *dst, const uint16_t *src, int count, int shift);
+    // dst = src << shift (8 bits source, 16 bits destination)
+    void (*widen)(uint16_t *dst, const uint8_t *src, int count, int shift);
+    // dst = src >> shift (16 bits source, 8 bits destination)
+    void (*narrow)(uint8_t *dst, const uint16_t *src, int count, int shift);
+    // dst = u0 v0 u1 v1 ... (8 bits per sample)
+    void (*interleave)(uint8_t *dst, const uint8_t *u, const uint8_t *v, int count);
+    // dst = u0 << shift, v0 << shift, ... (16 bits per sample)
+    void (*interleave16)(uint16_t *dst, const uint16_t *u, const uint16_t *v,
+                         int count, int shift);
+    const char *name;
+} copy_kernels_t;
+
+typedef enum copy_mode_t
+{
+    COPY_MODE_PLAIN,
+    COPY_MODE_SHIFT_DOWN,
+    COPY_MODE_SHIFT_UP,
+    COPY_MODE_WIDEN,
+    COPY_MODE_NARROW,
+    // the chroma planes "src" and "src2" to one semi-planar plane
+    COPY_MODE_INTERLEAVE,
+    COPY_MODE_INTERLEAVE_16,
+} copy_mode_t;
+
+/*****************************************************************************
+ * copy_plane_t: description of one plane to copy / convert
+ *****************************************************************************/
+typedef struct copy_plane_t
+{
+    copy_mode_t mode;
+    int shift;
+    const uint8_t *src;
+    int src_stride;
+    // second source plane of the interleave modes
+    const uint8_t *src2;
+    int src2_stride;
+    uint8_t *dst;
+    int dst_stride;
+    // number of samples per line (bytes for COPY_MODE_PLAIN, samples per
+    // source plane for the interleave modes)
+    int width;
+    int lines;
+} copy_plane_t;
+
+void CopyKernelsInit(copy_kernels_t *kernels);
+
+/* Copy "count" lines of a plane, starting at line "first". */
+void CopyPlaneLines(const copy_kernels_t *kernels, const copy_plane_t *plane,
+                    int first, int count);
+
+static inline void CopyPlane(const copy_kernels_t *kernels, const copy_plane_t *plane)
+{
+    CopyPlaneLines(kernels, plane, 0, plane->lines);
+}
+
+/*****************************************************************************
+ * copy_pool_t: persistent threads copying planes in horizontal bands
+ *****************************************************************************/
+typedef struct copy_pool_t copy_pool_t;
+
+// Maximum number of planes that can be passed to CopyPoolRun
+#define COPY_POOL_MAX_PLANES    4
+
+copy_pool_t *CopyPoolNew(const copy_kernels_t *kernels, int threads);
+void CopyPoolDelete(copy_pool_t *pool);
+
+/* Copy all planes, the calling thread takes part in the work and the
+ * function only returns after all bands have been processed. */
+void CopyPoolRun(copy_pool_t *pool, const copy_plane_t *planes, int count);
+
+#endif  // _LIBDE265_COPY_H_
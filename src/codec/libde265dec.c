@@ -36,6 +36,9 @@
 #include <libde265/de265.h>
 
 #include "../../include/libde265_plugin_common.h"
+#include "copy.h"
+#include "../packetizer/hevc_nal.h"
+#include "../packetizer/startcode_helper.h"
 
 // Default size of length headers for packetized streams.
 // Should always come from the "extra" data.
@@ -44,18 +47,46 @@
 // Maximum number of threads to use
 #define MAX_THREAD_COUNT        32
 
+// Start default number of threads if no parameter sets were found in the
+// first 32 blocks (adaptive thread mode)
+#define ADAPTIVE_THREADS_MAX_BLOCKS 32
+
 // Drop all frames if late frames were available for more than 5 seconds
 #define LATE_FRAMES_DROP_ALWAYS_AGE 5
 
-// Tell decoder to skip decoding if more than 4 late frames
-#define LATE_FRAMES_DROP_DECODER    4
+// Reduce quality if the decoding time is above 95% of the frame interval
+#define QUALITY_LOAD_HIGH           95
+
+// Increase quality again if the decoding time is below 70% of the frame interval
+#define QUALITY_LOAD_LOW            70
+
+// Number of consecutive slow / late pictures before reducing quality
+#define QUALITY_STEP_DOWN_PICTURES  4
+
+// Number of consecutive fast pictures before increasing quality
+#define QUALITY_STEP_UP_PICTURES    50
 
-// Don't pass data to decoder if more than 12 late frames
-#define LATE_FRAMES_DROP_HARD       12
+// Number of blocks to drop before trying to decode again
+#define QUALITY_DROP_BLOCKS         12
+
+// Number of blocks queued for (and pushed ahead by) the decoding thread
+#define PIPELINE_BLOCKS             4
+
+// Number of decoded pictures queued by the decoding thread
+#define PIPELINE_PICTURES           4
 
 #define THREADS_TEXT N_("Threads")
 #define THREADS_LONGTEXT N_("Number of threads used for decoding, 0 meaning auto")
 
+#define ADAPTIVE_THREADS_TEXT N_("Adaptive threads")
+#define ADAPTIVE_THREADS_LONGTEXT N_("Choose the number of threads from the " \
+    "picture size and parallel tools (WPP, tiles) of the stream instead of " \
+    "using twice the number of CPUs. Only used if threads is set to auto.")
+
+#define THREAD_BUDGET_TEXT N_("Thread budget")
+#define THREAD_BUDGET_LONGTEXT N_("Maximum number of worker threads shared " \
+    "by all decoder instances in the process, 0 meaning unlimited")
+
 #define DISABLE_DEBLOCKING_TEXT N_("Disable deblocking?")
 #define DISABLE_DEBLOCKING_LONGTEXT N_("Disabling the deblocking filter " \
     "usually has a detrimental effect on quality. However it provides a big " \
@@ -66,6 +97,38 @@
     "usually has a detrimental effect on quality. However it provides a big " \
     "speedup for high definition streams.")
 
+#define COPY_THREADS_TEXT N_("Copy threads")
+#define COPY_THREADS_LONGTEXT N_("Number of additional threads used to " \
+    "copy and convert pictures if direct rendering is not possible, 0 " \
+    "meaning copy on the decoder thread")
+
+#define DIRECT_RENDERING_TEXT N_("Direct rendering")
+#define DIRECT_RENDERING_LONGTEXT N_("Decode into the pictures of the video " \
+    "output if their format allows it, instead of copying the decoded " \
+    "pictures.")
+
+#define SEMIPLANAR_TEXT N_("Semi-planar output")
+#define SEMIPLANAR_LONGTEXT N_("Output 4:2:0 pictures with interleaved " \
+    "chroma (NV12, or P010 for high bit depths), which some video outputs " \
+    "display without conversion. Disables direct rendering for these " \
+    "pictures.")
+
+#define PIPELINE_TEXT N_("Pipelined decoding")
+#define PIPELINE_LONGTEXT N_("Decode on a separate thread, so the next " \
+    "data can be passed to the decoder while a picture is decoded and the " \
+    "previous one is displayed.")
+
+#define FAST_SEEK_TEXT N_("Fast seeking")
+#define FAST_SEEK_LONGTEXT N_("Skip the data up to the next random access " \
+    "point after a discontinuity and only decode reference pictures while " \
+    "prerolling to the target of a seek. Raw bitstreams are only skipped " \
+    "if their demuxer sends complete access units.")
+
+#define STATS_INTERVAL_TEXT N_("Statistics interval")
+#define STATS_INTERVAL_LONGTEXT N_("Log decoding statistics (time spent " \
+    "pushing, decoding and copying data, direct rendering and late " \
+    "pictures) every given number of seconds, 0 meaning disabled")
+
 #ifndef VLC_CODEC_HEV1
 #define VLC_CODEC_HEV1 VLC_FOURCC('h','e','v','1')
 #endif
@@ -102,10 +165,36 @@ vlc_module_begin ()
     set_subcategory(SUBCAT_INPUT_VCODEC)
     add_shortcut("libde265dec")
     add_integer("libde265-threads", 0, THREADS_TEXT, THREADS_LONGTEXT, true);
+    add_bool("libde265-adaptive-threads", false, ADAPTIVE_THREADS_TEXT, ADAPTIVE_THREADS_LONGTEXT, true)
+    add_integer("libde265-thread-budget", 0, THREAD_BUDGET_TEXT, THREAD_BUDGET_LONGTEXT, true);
     add_bool("libde265-disable-deblocking", false, DISABLE_DEBLOCKING_TEXT, DISABLE_DEBLOCKING_LONGTEXT, false)
     add_bool("libde265-disable-sao", false, DISABLE_SAO_TEXT, DISABLE_SAO_LONGTEXT, false)
+    add_integer("libde265-copy-threads", 0, COPY_THREADS_TEXT, COPY_THREADS_LONGTEXT, true);
+    add_bool("libde265-direct-rendering", true, DIRECT_RENDERING_TEXT, DIRECT_RENDERING_LONGTEXT, true)
+    add_bool("libde265-semiplanar", false, SEMIPLANAR_TEXT, SEMIPLANAR_LONGTEXT, true)
+    add_bool("libde265-pipeline", false, PIPELINE_TEXT, PIPELINE_LONGTEXT, true)
+    add_bool("libde265-fast-seek", false, FAST_SEEK_TEXT, FAST_SEEK_LONGTEXT, true)
+    add_integer("libde265-stats-interval", 0, STATS_INTERVAL_TEXT, STATS_INTERVAL_LONGTEXT, true);
 vlc_module_end ()
 
+/*****************************************************************************
+ * decoder_stats_t: statistics collected since the last report
+ *****************************************************************************/
+typedef struct decoder_stats_t
+{
+    mtime_t last_report;
+    mtime_t push_time;
+    mtime_t decode_time;
+    mtime_t copy_time;
+    unsigned blocks;
+    unsigned dropped_blocks;
+    unsigned pictures;
+    unsigned skipped_pictures;
+    unsigned late_pictures;
+    unsigned direct_pictures;
+    unsigned direct_rendering_changes;
+} decoder_stats_t;
+
 /*****************************************************************************
  * decoder_sys_t: libde265 decoder descriptor
  *****************************************************************************/
@@ -117,20 +206,116 @@ struct decoder_sys_t
     int length_size;
     int late_frames;
     int decode_ratio;
+
+    // graded quality degradation
+    int quality_level;
+    int quality_pressure;
+    int quality_relief;
+    int dropped_blocks;
+    mtime_t decode_start;
+    mtime_t decode_time_pending;
+    mtime_t decode_time;
+    mtime_t frame_interval;
+    mtime_t last_pts;
     bool check_extra;
+    // parameter sets of the "hvcC" extra data, parsed once
+    hevc_hvcc_t hvcc;
     bool packetized;
+    // the last NAL unit pushed with de265_push_data is not terminated yet
+    bool data_pending;
+    // skip NAL units up to the next random access point (and its RASL
+    // pictures) after a discontinuity, decode reference pictures only
+    // while prerolling
+    bool fast_seek;
+    bool skip_to_irap;
+    bool skip_rasl;
+    bool preroll_fast;
+    int skipped_nals;
+    // quality level the decoder context is configured for
+    int applied_quality_level;
     bool disable_deblocking;
     bool disable_sao;
+    bool direct_rendering;
     int direct_rendering_used;
+    // output format of copied pictures, negotiated once per input format
+    bool semiplanar;
+    int output_key;
+    vlc_fourcc_t output_chroma;
+    // image format for which direct rendering failed, only tried again
+    // once the format changes
+    bool direct_rendering_failed;
+    struct de265_image_spec direct_rendering_spec;
+    int direct_rendering_bits;
+
+    // number of worker threads taken from the process-wide budget
+    int worker_threads;
+    // worker threads will be started once parameter sets are known
+    bool threads_pending;
+    int threads_pending_blocks;
+    bool have_sps;
+    bool have_pps;
+    hevc_sps_t sps;
+    hevc_pps_t pps;
+
+    copy_kernels_t copy_kernels;
+    copy_pool_t *copy_pool;
+
+    mtime_t stats_interval;
+    decoder_stats_t stats;
+    // counters of the decoding thread in pipelined mode, only used by it
+    // and passed on through pipe_stats_done
+    decoder_stats_t pipe_stats;
+    // time the decoding thread waited for the vlc decoder thread, only
+    // used by it
+    mtime_t pipe_call_wait;
+
+    // unused picture references, protected by refs_lock
+    vlc_mutex_t refs_lock;
+    struct picture_ref_t *free_refs;
+
+    // pipelined decoding, the decoder context is only used by pipe_thread
+    // and the fields below are protected by pipe_lock
+    bool pipeline;
+    vlc_thread_t pipe_thread;
+    vlc_mutex_t pipe_lock;
+    vlc_cond_t pipe_input_cond;
+    vlc_cond_t pipe_output_cond;
+    block_t *pipe_blocks;
+    block_t **pipe_blocks_last;
+    int pipe_block_count;
+    struct pipe_picture_t {
+        picture_t *picture;
+        bool direct;
+        // time spent by the decoding thread on the picture
+        mtime_t busy;
+    } pipe_pictures[PIPELINE_PICTURES];
+    int pipe_picture_first;
+    int pipe_picture_count;
+    // quality level to apply by the decoding thread, -1 if none
+    int pipe_quality_level;
+    // function the decoding thread waits for to be run on the vlc decoder
+    // thread, which owns the output format and allocates the pictures
+    void (*pipe_call)(decoder_t *, void *);
+    void *pipe_call_arg;
+    decoder_stats_t pipe_stats_done;
+    // pushing the data of a block failed
+    bool pipe_error;
+    bool pipe_reset;
+    bool pipe_quit;
 };
 
 /*****************************************************************************
  * picture_ref_t: an reference to a vlc picture stored in a libde265 image
+ *****************************************************************************
+ * The same reference is stored as user data of all planes of an image and
+ * holds a single link to the vlc picture. Released references are kept in a
+ * per-decoder free list so no allocations are necessary in steady state.
  *****************************************************************************/
 struct picture_ref_t
 {
     decoder_t *decoder;
     picture_t *picture;
+    struct picture_ref_t *next;
 };
 
 static inline enum de265_chroma ImageFormatToChroma(enum de265_image_format format) {
@@ -239,163 +424,713 @@ static vlc_fourcc_t GetVlcCodec(decoder_t *dec, enum de265_chroma chroma, int bi
 }
 
 /*****************************************************************************
- * SetDecodeRation: tell the decoder to decode only a percentage of the framerate
+ * NegotiateOutput: choose the output format of copied pictures
+ *****************************************************************************
+ * Formats keeping the bit depth are preferred, semi-planar ones first if
+ * enabled. Shifting down to 8 bits is the last resort, if the video output
+ * doesn't accept any other format. The size of the output format must have
+ * been set already.
  *****************************************************************************/
-static void SetDecodeRatio(decoder_sys_t *sys, int ratio)
+static vlc_fourcc_t NegotiateOutput(decoder_t *dec, enum de265_chroma chroma,
+                                    int bits_per_pixel, bool same_bits)
 {
-    if (ratio != sys->decode_ratio) {
-        de265_decoder_context *ctx = sys->ctx;
-        sys->decode_ratio = ratio;
-        de265_set_framerate_ratio(ctx, ratio);
-        if (ratio < 100) {
-            de265_set_parameter_bool(sys->ctx, DE265_DECODER_PARAM_DISABLE_DEBLOCKING, true);
-            de265_set_parameter_bool(sys->ctx, DE265_DECODER_PARAM_DISABLE_SAO, true);
+    decoder_sys_t *sys = dec->p_sys;
+
+    int key = chroma | (bits_per_pixel << 8) | (same_bits << 16);
+    if (key == sys->output_key) {
+        return sys->output_chroma;
+    }
+
+    vlc_fourcc_t candidates[3];
+    int count = 0;
+    if (sys->semiplanar && chroma == de265_chroma_420 && same_bits) {
+        if (bits_per_pixel == 8) {
+            candidates[count++] = VLC_CODEC_NV12;
+        }
+#ifdef VLC_CODEC_P010
+        else if (bits_per_pixel <= 10) {
+            candidates[count++] = VLC_CODEC_P010;
+        }
+#endif
+    }
+    candidates[count] = GetVlcCodec(dec, chroma, bits_per_pixel);
+    if (candidates[count] == CODEC_UNKNOWN) {
+        return CODEC_UNKNOWN;
+    }
+    count++;
+    if (bits_per_pixel > 8 && chroma != de265_chroma_mono) {
+        candidates[count++] = GetVlcCodec(dec, chroma, 8);
+    }
+
+#ifdef HAVE_VLC_REFCOUNT_PICTURE
+    vlc_fourcc_t result = candidates[count - 1];
+    for (int i = 0; i < count; i++) {
+        dec->fmt_out.i_codec = candidates[i];
+        dec->fmt_out.video.i_chroma = candidates[i];
+        if (decoder_UpdateVideoFormat(dec) == 0) {
+            result = candidates[i];
+            break;
+        }
+    }
+#else
+    // the video output of vlc 2.x converts from any format
+    vlc_fourcc_t result = candidates[0];
+#endif
+
+    const vlc_chroma_description_t *dsc = vlc_fourcc_GetChromaDescription(result);
+    if (dsc != NULL && dsc->pixel_bits < (unsigned) bits_per_pixel) {
+        msg_Warn(dec, "output format %4.4s, shifting down from %d bits per pixel",
+                 (const char *) &result, bits_per_pixel);
+    } else {
+        msg_Dbg(dec, "output format %4.4s for %d bits per pixel",
+                (const char *) &result, bits_per_pixel);
+    }
+    sys->output_key = key;
+    sys->output_chroma = result;
+    return result;
+}
+
+/*****************************************************************************
+ * StatsNow: current time if statistics are enabled
+ *****************************************************************************/
+static inline mtime_t StatsNow(decoder_sys_t *sys)
+{
+    return sys->stats_interval > 0 ? mdate() : 0;
+}
+
+/*****************************************************************************
+ * DecodingStats: statistics of the thread using the decoder context
+ *****************************************************************************/
+static inline decoder_stats_t *DecodingStats(decoder_sys_t *sys)
+{
+    return sys->pipeline ? &sys->pipe_stats : &sys->stats;
+}
+
+/*****************************************************************************
+ * MoveStats: add the counters of one statistics to another and clear them
+ *****************************************************************************/
+static void MoveStats(decoder_stats_t *stats, decoder_stats_t *from)
+{
+    stats->push_time += from->push_time;
+    stats->decode_time += from->decode_time;
+    stats->copy_time += from->copy_time;
+    stats->blocks += from->blocks;
+    stats->dropped_blocks += from->dropped_blocks;
+    stats->pictures += from->pictures;
+    stats->skipped_pictures += from->skipped_pictures;
+    stats->late_pictures += from->late_pictures;
+    stats->direct_pictures += from->direct_pictures;
+    stats->direct_rendering_changes += from->direct_rendering_changes;
+    memset(from, 0, sizeof(*from));
+}
+
+/*****************************************************************************
+ * ReportStats: log statistics and start a new interval
+ *****************************************************************************/
+static void ReportStats(decoder_t *dec, mtime_t now)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    decoder_stats_t *stats = &sys->stats;
+
+    if (sys->pipeline) {
+        vlc_mutex_lock(&sys->pipe_lock);
+        MoveStats(stats, &sys->pipe_stats_done);
+        vlc_mutex_unlock(&sys->pipe_lock);
+    }
+
+    mtime_t duration = now - stats->last_report;
+    if (duration > 0 && stats->blocks > 0) {
+        unsigned pictures = __MAX(stats->pictures, 1);
+        msg_Dbg(dec, "%u blocks (%u dropped), %u pictures (%u skipped, %u late) "
+                "in %"PRId64" ms: %.1f fps",
+                stats->blocks, stats->dropped_blocks, stats->pictures,
+                stats->skipped_pictures, stats->late_pictures,
+                duration / 1000, stats->pictures * (double) CLOCK_FREQ / duration);
+        msg_Dbg(dec, "per picture: push %"PRId64" us, decode %"PRId64" us, "
+                "copy %"PRId64" us",
+                stats->push_time / pictures, stats->decode_time / pictures,
+                stats->copy_time / pictures);
+        msg_Dbg(dec, "direct rendering %u%% (%u changes), decode ratio %d, "
+                "quality level %d, %d late frames",
+                stats->direct_pictures * 100 / pictures,
+                stats->direct_rendering_changes, sys->decode_ratio,
+                sys->quality_level, sys->late_frames);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->last_report = now;
+}
+
+// Worker threads used by all decoder instances of the process
+static vlc_mutex_t thread_budget_lock = VLC_STATIC_MUTEX;
+static int thread_budget_used = 0;
+
+/*****************************************************************************
+ * GetDefaultThreadCount: number of threads if nothing is known about the stream
+ *****************************************************************************/
+static int GetDefaultThreadCount(void)
+{
+    // NOTE: We start more threads than cores for now, as some threads
+    // might get blocked while waiting for dependent data. Having more
+    // threads increases decoding speed by about 10%.
+    return vlc_GetCPUCount() * 2;
+}
+
+/*****************************************************************************
+ * GetAdaptiveThreadCount: number of threads that can be used for a stream
+ *****************************************************************************/
+static int GetAdaptiveThreadCount(const hevc_sps_t *sps, const hevc_pps_t *pps)
+{
+    int ctb_size = 1 << sps->log2_ctb_size;
+    int ctb_rows = (sps->height + ctb_size - 1) / ctb_size;
+    int ctb_cols = (sps->width + ctb_size - 1) / ctb_size;
+    int units;
+    if (pps->entropy_coding_sync_enabled) {
+        // WPP: each row depends on two CTBs of the previous row
+        units = __MIN(ctb_rows, (ctb_cols + 1) / 2);
+    } else if (pps->tiles_enabled) {
+        units = pps->num_tile_columns * pps->num_tile_rows;
+    } else {
+        // slices are decoded sequentially, only the in-loop
+        // filters can run in parallel
+        units = ctb_rows / 4;
+    }
+    if (pps->entropy_coding_sync_enabled && pps->tiles_enabled) {
+        units *= pps->num_tile_columns * pps->num_tile_rows;
+    }
+    return __MIN(units, GetDefaultThreadCount());
+}
+
+/*****************************************************************************
+ * StartWorkerThreads: start decoder threads, limited by the thread budget
+ *****************************************************************************/
+static void StartWorkerThreads(decoder_t *dec, int threads)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    sys->threads_pending = false;
+    threads = __MIN(threads, MAX_THREAD_COUNT);
+
+    int budget = var_InheritInteger(dec, "libde265-thread-budget");
+    if (budget > 0 && threads > 1) {
+        vlc_mutex_lock(&thread_budget_lock);
+        int available = __MAX(budget - thread_budget_used, 0);
+        if (threads > available) {
+            msg_Dbg(dec, "Thread budget exhausted, using %d instead of %d threads",
+                    available, threads);
+            threads = available;
+        }
+        if (threads > 1) {
+            thread_budget_used += threads;
+            sys->worker_threads = threads;
+        }
+        vlc_mutex_unlock(&thread_budget_lock);
+    }
+
+    if (threads > 1) {
+        de265_error err = de265_start_worker_threads(sys->ctx, threads);
+        if (!de265_isOK(err)) {
+            // don't report to caller, decoding will work anyway...
+            msg_Err(dec, "Failed to start worker threads: %s (%d)", de265_get_error_text(err), err);
         } else {
-            de265_set_parameter_bool(sys->ctx, DE265_DECODER_PARAM_DISABLE_DEBLOCKING, sys->disable_deblocking);
-            de265_set_parameter_bool(sys->ctx, DE265_DECODER_PARAM_DISABLE_SAO, sys->disable_sao);
+            msg_Dbg(dec, "Started %d worker threads", threads);
         }
+    } else {
+        msg_Dbg(dec, "Using single-threaded decoding");
     }
 }
 
-/****************************************************************************
- * Decode: the whole thing
- ****************************************************************************/
-static picture_t *Decode(decoder_t *dec, block_t **pp_block)
+/*****************************************************************************
+ * ReleaseWorkerThreads: return worker threads to the thread budget
+ *****************************************************************************/
+static void ReleaseWorkerThreads(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    if (sys->worker_threads > 0) {
+        vlc_mutex_lock(&thread_budget_lock);
+        thread_budget_used -= sys->worker_threads;
+        vlc_mutex_unlock(&thread_budget_lock);
+        sys->worker_threads = 0;
+    }
+}
+
+/*****************************************************************************
+ * InspectNAL: check for parameter sets while worker threads are pending
+ *****************************************************************************/
+static void InspectNAL(decoder_t *dec, const uint8_t *nal, size_t size)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    if (!sys->threads_pending || size < 2) {
+        return;
+    }
+
+    switch (hevc_getNALType(nal)) {
+    case HEVC_NAL_SPS_NUT:
+        if (!sys->have_sps) {
+            sys->have_sps = hevc_ParseSPS(nal, size, &sys->sps);
+        }
+        break;
+    case HEVC_NAL_PPS_NUT:
+        if (!sys->have_pps) {
+            sys->have_pps = hevc_ParsePPS(nal, size, &sys->pps);
+        }
+        break;
+    default:
+        return;
+    }
+
+    if (sys->have_sps && sys->have_pps) {
+        int threads = GetAdaptiveThreadCount(&sys->sps, &sys->pps);
+        msg_Dbg(dec, "Stream is %dx%d, CTB size %d, WPP %d, tiles %dx%d",
+                sys->sps.width, sys->sps.height, 1 << sys->sps.log2_ctb_size,
+                sys->pps.entropy_coding_sync_enabled,
+                sys->pps.num_tile_columns, sys->pps.num_tile_rows);
+        StartWorkerThreads(dec, threads);
+    }
+}
+
+/*****************************************************************************
+ * InspectStream: check all NAL units of a bytestream for parameter sets
+ *****************************************************************************/
+static void InspectStream(decoder_t *dec, const uint8_t *data, size_t size)
+{
+    const uint8_t *end = data + size;
+    const uint8_t *nal = NULL;
+    const uint8_t *p = data;
+    while ((p = startcode_FindAnnexB(p, end)) != NULL) {
+        if (nal != NULL) {
+            InspectNAL(dec, nal, p - nal);
+        }
+        p += 3;
+        nal = p;
+    }
+    if (nal != NULL) {
+        InspectNAL(dec, nal, end - nal);
+    }
+}
+
+/*****************************************************************************
+ * SkipNAL: check if a NAL unit must be skipped after a discontinuity
+ *****************************************************************************/
+static bool SkipNAL(decoder_t *dec, const uint8_t *nal, size_t size)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    if ((!sys->skip_to_irap && !sys->skip_rasl) || size < 2) {
+        return false;
+    }
+
+    int type = hevc_getNALType(nal);
+    if (!hevc_isVCL(type)) {
+        // parameter sets and SEI messages are always passed
+        return false;
+    }
+
+    if (hevc_isIRAP(type)) {
+        // the RASL pictures of a CRA or BLA picture reference pictures
+        // before it, which have been skipped
+        sys->skip_rasl = sys->skip_to_irap &&
+            type != HEVC_NAL_IDR_W_RADL && type != HEVC_NAL_IDR_N_LP;
+        if (sys->skip_to_irap) {
+            msg_Dbg(dec, "skipped %d NAL units up to random access point", sys->skipped_nals);
+            sys->skip_to_irap = false;
+        }
+        return false;
+    }
+
+    if (sys->skip_to_irap || hevc_isRASL(type)) {
+        sys->skipped_nals++;
+        return true;
+    }
+    if (type < HEVC_NAL_RADL_N) {
+        // trailing pictures follow all leading pictures
+        sys->skip_rasl = false;
+    }
+    return false;
+}
+
+/*****************************************************************************
+ * PushAccessUnit: push the NAL units of a bytestream block holding complete
+ * access units, as flagged by the demuxer
+ *****************************************************************************/
+static int PushAccessUnit(decoder_t *dec, const uint8_t *data, size_t size, mtime_t pts)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    const uint8_t *end = data + size;
+    const uint8_t *nal = NULL;
+    const uint8_t *p = data;
+
+    if (sys->data_pending) {
+        de265_push_end_of_NAL(sys->ctx);
+        sys->data_pending = false;
+    }
+
+    for (;;) {
+        const uint8_t *next = startcode_FindAnnexB(p, end);
+        if (nal != NULL) {
+            // drop the zero bytes before the next start code
+            const uint8_t *nal_end = next ? next : end;
+            while (nal_end > nal && nal_end[-1] == 0) {
+                nal_end--;
+            }
+            if (nal_end > nal && !SkipNAL(dec, nal, nal_end - nal)) {
+                InspectNAL(dec, nal, nal_end - nal);
+                de265_error err = de265_push_NAL(sys->ctx, nal, nal_end - nal, pts, NULL);
+                if (!de265_isOK(err)) {
+                    msg_Err(dec, "Failed to push data: %s (%d)", de265_get_error_text(err), err);
+                    return VLC_EGENERIC;
+                }
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        p = nal = next + 3;
+    }
+    return VLC_SUCCESS;
+}
+
+/*****************************************************************************
+ * ParseExtra: check the format of the extra data once when opening
+ *****************************************************************************/
+static void ParseExtra(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    const uint8_t *extra = (const uint8_t *) dec->fmt_in.p_extra;
+    int extra_length = dec->fmt_in.i_extra;
+
+    sys->hvcc.nal_count = 0;
+    sys->hvcc.nals = NULL;
+    if (extra_length <= 0 || extra == NULL) {
+        return;
+    }
+
+    if (hevc_isHvcC(extra, extra_length)) {
+        sys->packetized = true;
+        if (!hevc_ParseHvcC(extra, extra_length, &sys->hvcc)) {
+            msg_Err(dec, "Invalid hvcC extra data (%d bytes), using %d parameter sets",
+                    extra_length, sys->hvcc.nal_count);
+        }
+        if (sys->hvcc.version > 1) {
+            msg_Warn(dec, "Unsupported extra data version %d, decoding may fail", sys->hvcc.version);
+        }
+        sys->length_size = sys->hvcc.length_size;
+        msg_Dbg(dec, "Assuming packetized data (%d bytes length)", sys->length_size);
+    } else {
+        sys->packetized = false;
+        msg_Dbg(dec, "Assuming non-packetized data");
+    }
+}
+
+/*****************************************************************************
+ * PushExtra: pass the parameter sets of the extra data to the decoder
+ *****************************************************************************/
+static int PushExtra(decoder_t *dec)
 {
     decoder_sys_t *sys = dec->p_sys;
     de265_decoder_context *ctx = sys->ctx;
-    bool drawpicture;
-    bool prerolling;
+    const uint8_t *extra = (const uint8_t *) dec->fmt_in.p_extra;
+    int extra_length = dec->fmt_in.i_extra;
     de265_error err;
     int can_decode_more;
-    const struct de265_image *image;
 
-    block_t *block = *pp_block;
-    if (!block)
-        return NULL;
+    if (extra_length <= 0 || extra == NULL) {
+        return VLC_SUCCESS;
+    }
 
-    if (block->i_flags & (BLOCK_FLAG_DISCONTINUITY|BLOCK_FLAG_CORRUPTED)) {
-        SetDecodeRatio(sys, 100);
-        sys->late_frames = 0;
-        if (block->i_flags & BLOCK_FLAG_DISCONTINUITY) {
-            de265_reset(ctx);
+    if (sys->packetized) {
+        if (sys->hvcc.nal_count == 0) {
+            return VLC_SUCCESS;
+        }
+        for (int i=0; i<sys->hvcc.nal_count; i++) {
+            const hevc_hvcc_nal_t *nal = &sys->hvcc.nals[i];
+            InspectNAL(dec, extra + nal->offset, nal->size);
+            err = de265_push_NAL(ctx, extra + nal->offset, nal->size, 0, NULL);
+            if (!de265_isOK(err)) {
+                msg_Err(dec, "Failed to push data: %s (%d)", de265_get_error_text(err), err);
+                return VLC_EGENERIC;
+            }
+        }
+    } else {
+        InspectStream(dec, extra, extra_length);
+        err = de265_push_data(ctx, extra, extra_length, 0, NULL);
+        if (!de265_isOK(err)) {
+            msg_Err(dec, "Failed to push extra data: %s (%d)", de265_get_error_text(err), err);
+            return VLC_EGENERIC;
         }
-        goto error;
     }
 
-    if (sys->check_extra) {
-        int extra_length = dec->fmt_in.i_extra;
-        sys->check_extra = false;
-        if (extra_length > 0) {
-            unsigned char *extra = (unsigned char *) dec->fmt_in.p_extra;
-            if (extra_length > 3 && extra != NULL && (extra[0] || extra[1] || extra[2] > 1)) {
-                // encoded in "hvcC" format (assume version 0)
-                sys->packetized = true;
-                if (extra_length > 22) {
-                    if (extra[0] != 0) {
-                        msg_Warn(dec, "Unsupported extra data version %d, decoding may fail", extra[0]);
-                    }
-                    sys->length_size = (extra[21] & 3) + 1;
-                    int num_param_sets = extra[22];
-                    int pos = 23;
-                    for (int i=0; i<num_param_sets; i++) {
-                        if (pos + 3 > extra_length) {
-                            msg_Err(dec, "Buffer underrun in extra header (%d >= %d)", pos + 3, extra_length);
-                            goto error;
-                        }
-                        // ignore flags + NAL type (1 byte)
-                        int nal_count  = extra[pos+1] << 8 | extra[pos+2];
-                        pos += 3;
-                        for (int j=0; j<nal_count; j++) {
-                            if (pos + 2 > extra_length) {
-                                msg_Err(dec, "Buffer underrun in extra nal header (%d >= %d)", pos + 2, extra_length);
-                                goto error;
-                            }
-                            int nal_size = extra[pos] << 8 | extra[pos+1];
-                            if (pos + 2 + nal_size > extra_length) {
-                                msg_Err(dec, "Buffer underrun in extra nal (%d >= %d)", pos + 2 + nal_size, extra_length);
-                                goto error;
-                            }
-                            err = de265_push_NAL(ctx, extra + pos + 2, nal_size, 0, NULL);
-                            if (!de265_isOK(err)) {
-                                msg_Err(dec, "Failed to push data: %s (%d)", de265_get_error_text(err), err);
-                                goto error;
-                            }
-                            pos += 2 + nal_size;
-                        }
-                    }
-                }
-                msg_Dbg(dec, "Assuming packetized data (%d bytes length)", sys->length_size);
-            } else {
-                sys->packetized = false;
-                msg_Dbg(dec, "Assuming non-packetized data");
-                err = de265_push_data(ctx, extra, extra_length, 0, NULL);
-                if (!de265_isOK(err)) {
-                    msg_Err(dec, "Failed to push extra data: %s (%d)", de265_get_error_text(err), err);
-                    goto error;
-                }
+    de265_push_end_of_NAL(ctx);
+    do {
+        err = de265_decode(ctx, &can_decode_more);
+        switch (err) {
+        case DE265_OK:
+            break;
+
+        case DE265_ERROR_IMAGE_BUFFER_FULL:
+        case DE265_ERROR_WAITING_FOR_INPUT_DATA:
+            // not really an error
+            can_decode_more = 0;
+            break;
+
+        default:
+            if (!de265_isOK(err)) {
+                msg_Err(dec, "Failed to decode extra data: %s (%d)", de265_get_error_text(err), err);
+                return VLC_EGENERIC;
             }
-            de265_push_end_of_NAL(ctx);
-            do {
-                err = de265_decode(ctx, &can_decode_more);
-                switch (err) {
-                case DE265_OK:
-                    break;
-
-                case DE265_ERROR_IMAGE_BUFFER_FULL:
-                case DE265_ERROR_WAITING_FOR_INPUT_DATA:
-                    // not really an error
-                    can_decode_more = 0;
-                    break;
-
-                default:
-                    if (!de265_isOK(err)) {
-                        msg_Err(dec, "Failed to decode extra data: %s (%d)", de265_get_error_text(err), err);
-                        goto error;
-                    }
-                }
-            } while (can_decode_more);
         }
+    } while (can_decode_more);
+    return VLC_SUCCESS;
+}
+
+/*****************************************************************************
+ * quality_levels: steps of graded quality degradation on slow systems
+ *****************************************************************************/
+static const struct
+{
+    int decode_ratio;
+    bool disable_sao;
+    bool disable_deblocking;
+    const char *name;
+} quality_levels[] = {
+    { 100, false, false, "full quality" },
+    { 100, true,  false, "SAO disabled" },
+    { 100, true,  true,  "SAO and deblocking disabled" },
+    {  75, true,  true,  "decoding 75% of the pictures" },
+    {  50, true,  true,  "decoding 50% of the pictures" },
+    {  25, true,  true,  "decoding 25% of the pictures" },
+    {   0, true,  true,  "decoding reference pictures only" },
+};
+
+// All blocks are dropped on the last level
+#define QUALITY_LEVEL_DROP  ((int) (sizeof(quality_levels) / sizeof(quality_levels[0])))
+
+/*****************************************************************************
+ * ApplyQualityLevel: set the decoder parameters of a quality level
+ *****************************************************************************/
+static void ApplyQualityLevel(decoder_t *dec, int level)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    de265_decoder_context *ctx = sys->ctx;
+
+    // pictures decoded while prerolling are not displayed
+    int ratio = sys->preroll_fast ? 0 : quality_levels[level].decode_ratio;
+    sys->applied_quality_level = level;
+    if (ratio != sys->decode_ratio) {
+        sys->decode_ratio = ratio;
+        de265_set_framerate_ratio(ctx, ratio);
     }
+    de265_set_parameter_bool(ctx, DE265_DECODER_PARAM_DISABLE_DEBLOCKING,
+        sys->disable_deblocking || quality_levels[level].disable_deblocking);
+    de265_set_parameter_bool(ctx, DE265_DECODER_PARAM_DISABLE_SAO,
+        sys->disable_sao || quality_levels[level].disable_sao);
+}
 
-    if ((prerolling = (block->i_flags & BLOCK_FLAG_PREROLL))) {
-        SetDecodeRatio(sys, 100);
-        sys->late_frames = 0;
-        drawpicture = false;
+/*****************************************************************************
+ * SetQualityLevel: configure the decoder for a quality level
+ *****************************************************************************/
+static void SetQualityLevel(decoder_t *dec, int level)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    level = VLC_CLIP(level, 0, QUALITY_LEVEL_DROP);
+    sys->quality_pressure = 0;
+    sys->quality_relief = 0;
+    sys->dropped_blocks = 0;
+    if (level == sys->quality_level) {
+        return;
+    }
+
+    if (level == QUALITY_LEVEL_DROP) {
+        msg_Warn(dec, "decoding too slow, dropping blocks");
     } else {
-        drawpicture = true;
+        msg_Dbg(dec, "quality level %d: %s", level, quality_levels[level].name);
+        if (sys->pipeline) {
+            // the decoding thread owns the decoder context
+            vlc_mutex_lock(&sys->pipe_lock);
+            sys->pipe_quality_level = level;
+            vlc_cond_signal(&sys->pipe_input_cond);
+            vlc_mutex_unlock(&sys->pipe_lock);
+        } else {
+            ApplyQualityLevel(dec, level);
+        }
     }
+    sys->quality_level = level;
+}
 
-    if (!dec->b_pace_control && (sys->late_frames > 0) &&
-        (mdate() - sys->late_frames_start > LATE_FRAMES_DROP_ALWAYS_AGE*CLOCK_FREQ)) {
-        sys->late_frames--;
-        msg_Err(dec, "more than %d seconds of late video -> "
-                "dropping frame (computer too slow ?)", LATE_FRAMES_DROP_ALWAYS_AGE);
-        goto error;
+/*****************************************************************************
+ * ResetQuality: return to full quality (e.g. after seeking)
+ *****************************************************************************/
+static void ResetQuality(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    SetQualityLevel(dec, 0);
+    sys->late_frames = 0;
+    sys->decode_time = 0;
+    sys->decode_time_pending = 0;
+    sys->last_pts = VLC_TS_INVALID;
+}
+
+/*****************************************************************************
+ * UpdateQuality: adjust quality level after a picture has been decoded
+ *****************************************************************************/
+static void UpdateQuality(decoder_t *dec, mtime_t pts, bool late)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    // time spent since the previous picture was decoded
+    mtime_t now = mdate();
+    mtime_t sample = sys->decode_time_pending + (now - sys->decode_start);
+    sys->decode_time_pending = 0;
+    sys->decode_start = now;
+    if (sys->decode_time == 0) {
+        sys->decode_time = sample;
+    } else {
+        sys->decode_time = (sys->decode_time * 7 + sample) / 8;
     }
 
-    if (!dec->b_pace_control &&
-        (sys->late_frames > LATE_FRAMES_DROP_DECODER)) {
-        drawpicture = false;
-        if (sys->late_frames < LATE_FRAMES_DROP_HARD) {
-            // tell the decoder to skip frames
-            SetDecodeRatio(sys, 0);
+    const video_format_t *fmt = &dec->fmt_in.video;
+    if (fmt->i_frame_rate > 0 && fmt->i_frame_rate_base > 0) {
+        sys->frame_interval = CLOCK_FREQ * fmt->i_frame_rate_base / fmt->i_frame_rate;
+    } else if (sys->last_pts != VLC_TS_INVALID && pts > sys->last_pts &&
+               pts - sys->last_pts < CLOCK_FREQ) {
+        mtime_t interval = pts - sys->last_pts;
+        if (sys->frame_interval == 0) {
+            sys->frame_interval = interval;
         } else {
-            // picture too late, won't decode, but break picture until
-            // a new keyframe is available
-            sys->late_frames--; /* needed else it will never be decrease */
-            msg_Warn(dec, "More than %d late frames, dropping frame", LATE_FRAMES_DROP_DECODER);
-            goto error;
+            sys->frame_interval = (sys->frame_interval * 15 + interval) / 16;
         }
     }
+    sys->last_pts = pts;
 
-    mtime_t pts = block->i_pts;
-    bool use_decoder_pts = true;
-    if (pts == 0 || pts == VLC_TS_INVALID) {
-        pts = block->i_dts;
-        use_decoder_pts = false;
+    if (dec->b_pace_control) {
+        return;
+    }
+
+    if (late && sys->late_frames > 0 &&
+        now - sys->late_frames_start > LATE_FRAMES_DROP_ALWAYS_AGE*CLOCK_FREQ) {
+        msg_Err(dec, "more than %d seconds of late video -> "
+                "dropping frames (computer too slow ?)", LATE_FRAMES_DROP_ALWAYS_AGE);
+        SetQualityLevel(dec, QUALITY_LEVEL_DROP);
+        return;
+    }
+
+    int load = 0;
+    if (sys->frame_interval > 0) {
+        load = sys->decode_time * 100 / sys->frame_interval;
+    }
+
+    if (late || load > QUALITY_LOAD_HIGH) {
+        sys->quality_relief = 0;
+        if (++sys->quality_pressure >= QUALITY_STEP_DOWN_PICTURES &&
+            sys->quality_level + 1 < QUALITY_LEVEL_DROP) {
+            SetQualityLevel(dec, sys->quality_level + 1);
+        }
+    } else if (load < QUALITY_LOAD_LOW) {
+        sys->quality_pressure = 0;
+        if (++sys->quality_relief >= QUALITY_STEP_UP_PICTURES &&
+            sys->quality_level > 0) {
+            SetQualityLevel(dec, sys->quality_level - 1);
+        }
+    } else {
+        sys->quality_pressure = 0;
+        sys->quality_relief = 0;
+    }
+}
+
+/*****************************************************************************
+ * DropBlock: check if a block must be dropped because decoding is too slow
+ *****************************************************************************/
+static bool DropBlock(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    if (sys->quality_level != QUALITY_LEVEL_DROP) {
+        return false;
     }
 
+    // picture too late, won't decode, but break picture until
+    // a new keyframe is available
+    sys->stats.dropped_blocks++;
+    if (++sys->dropped_blocks >= QUALITY_DROP_BLOCKS) {
+        sys->late_frames = 0;
+        SetQualityLevel(dec, QUALITY_LEVEL_DROP - 1);
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * ResetDecoder: drop all data and pictures of the decoder after a discontinuity
+ *****************************************************************************/
+static void ResetDecoder(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    de265_reset(sys->ctx);
+    sys->data_pending = false;
+    // push the (already parsed) parameter sets again
+    sys->check_extra = true;
+    sys->skip_to_irap = sys->fast_seek;
+    sys->skip_rasl = false;
+    sys->skipped_nals = 0;
+}
+
+/*****************************************************************************
+ * CallDecoder: run a function on the vlc decoder thread, false if the
+ * decoder is closed before
+ *****************************************************************************
+ * In pipelined mode, the decoding thread waits until the vlc decoder thread
+ * runs the function in DecodePipelined. Pictures may only be created and
+ * the output format changed by the vlc decoder thread.
+ *****************************************************************************/
+static bool CallDecoder(decoder_t *dec, void (*func)(decoder_t *, void *), void *arg)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    if (!sys->pipeline) {
+        func(dec, arg);
+        return true;
+    }
+
+    mtime_t start = mdate();
+    vlc_mutex_lock(&sys->pipe_lock);
+    sys->pipe_call = func;
+    sys->pipe_call_arg = arg;
+    vlc_cond_broadcast(&sys->pipe_output_cond);
+    while (sys->pipe_call != NULL && !sys->pipe_quit) {
+        vlc_cond_wait(&sys->pipe_input_cond, &sys->pipe_lock);
+    }
+    bool done = sys->pipe_call == NULL;
+    sys->pipe_call = NULL;
+    vlc_mutex_unlock(&sys->pipe_lock);
+    sys->pipe_call_wait += mdate() - start;
+    return done;
+}
+
+/*****************************************************************************
+ * PushBlock: pass the data of a block to the decoder
+ *****************************************************************************/
+static int PushBlock(decoder_t *dec, block_t *block, mtime_t pts)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    de265_decoder_context *ctx = sys->ctx;
+    de265_error err;
+
+    if (sys->check_extra) {
+        sys->check_extra = false;
+        if (PushExtra(dec) != VLC_SUCCESS) {
+            return VLC_EGENERIC;
+        }
+    }
+
+    bool preroll_fast = sys->fast_seek && (block->i_flags & BLOCK_FLAG_PREROLL);
+    if (preroll_fast != sys->preroll_fast) {
+        sys->preroll_fast = preroll_fast;
+        ApplyQualityLevel(dec, sys->applied_quality_level);
+    }
+
+    mtime_t push_start = StatsNow(sys);
     uint8_t *p_buffer = block->p_buffer;
     size_t i_buffer = block->i_buffer;
     if (i_buffer > 0) {
@@ -411,31 +1146,365 @@ static picture_t *Decode(decoder_t *dec, block_t **pp_block)
                 i_buffer -= sys->length_size;
                 if (length > i_buffer) {
                     msg_Err(dec, "Buffer underrun while pushing data (%d > %ld)", length, i_buffer);
-                    goto error;
+                    return VLC_EGENERIC;
                 }
 
+                if (SkipNAL(dec, p_buffer, length)) {
+                    p_buffer += length;
+                    i_buffer -= length;
+                    continue;
+                }
+
+                InspectNAL(dec, p_buffer, length);
                 err = de265_push_NAL(ctx, p_buffer, length, pts, NULL);
                 if (!de265_isOK(err)) {
                     msg_Err(dec, "Failed to push data: %s (%d)", de265_get_error_text(err), err);
-                    goto error;
+                    return VLC_EGENERIC;
                 }
 
                 p_buffer += length;
                 i_buffer -= length;
             }
+        } else if (block->i_flags & BLOCK_FLAG_TYPE_MASK) {
+            // complete access units, no need to look for the end of the last NAL unit
+            if (PushAccessUnit(dec, p_buffer, i_buffer, pts) != VLC_SUCCESS) {
+                return VLC_EGENERIC;
+            }
         } else {
+            if (sys->threads_pending) {
+                InspectStream(dec, p_buffer, i_buffer);
+            }
+            // NAL units may span blocks, they can't be skipped here
+            sys->skip_to_irap = false;
+            sys->skip_rasl = false;
             err = de265_push_data(ctx, p_buffer, i_buffer, pts, NULL);
             if (!de265_isOK(err)) {
                 msg_Err(dec, "Failed to push data: %s (%d)", de265_get_error_text(err), err);
-                goto error;
+                return VLC_EGENERIC;
             }
+            sys->data_pending = true;
+        }
+    } else {
+        err = de265_flush_data(ctx);
+        if (!de265_isOK(err)) {
+            msg_Err(dec, "Failed to flush data: %s (%d)", de265_get_error_text(err), err);
+            return VLC_EGENERIC;
+        }
+        sys->data_pending = false;
+    }
+    DecodingStats(sys)->push_time += StatsNow(sys) - push_start;
+
+    if (sys->threads_pending &&
+        ++sys->threads_pending_blocks > ADAPTIVE_THREADS_MAX_BLOCKS) {
+        msg_Warn(dec, "No parameter sets found, using default number of threads");
+        StartWorkerThreads(dec, GetDefaultThreadCount());
+    }
+    return VLC_SUCCESS;
+}
+
+/*****************************************************************************
+ * DecodeImage: decode data until an image is available, NULL if more data
+ * is needed
+ *****************************************************************************/
+static const struct de265_image *DecodeImage(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    de265_decoder_context *ctx = sys->ctx;
+    const struct de265_image *image;
+    de265_error err;
+    int can_decode_more;
+
+    mtime_t decode_start = StatsNow(sys);
+    mtime_t call_wait = sys->pipe_call_wait;
+    do {
+        err = de265_decode(ctx, &can_decode_more);
+        switch (err) {
+        case DE265_OK:
+            break;
+
+        case DE265_ERROR_IMAGE_BUFFER_FULL:
+        case DE265_ERROR_WAITING_FOR_INPUT_DATA:
+            // not really an error
+            can_decode_more = 0;
+            break;
+
+        default:
+            if (!de265_isOK(err)) {
+                msg_Err(dec, "Failed to decode frame: %s (%d)", de265_get_error_text(err), err);
+                return NULL;
+            }
+        }
+
+        image = de265_get_next_picture(ctx);
+    } while (image == NULL && can_decode_more);
+    // without waiting for pictures (see CallDecoder)
+    DecodingStats(sys)->decode_time += StatsNow(sys) - decode_start -
+        (sys->pipe_call_wait - call_wait);
+
+    // log warnings
+    for (;;) {
+        de265_error warning = de265_get_warning(ctx);
+        if (warning == DE265_OK) {
+            break;
+        }
+
+        msg_Warn(dec, "%s", de265_get_error_text(warning));
+    }
+    return image;
+}
+
+/*****************************************************************************
+ * ShouldDisplay: check if a decoded picture is late and adjust the quality
+ *****************************************************************************/
+static bool ShouldDisplay(decoder_t *dec, mtime_t pts, bool prerolling, bool drawpicture)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    mtime_t display_date = 0;
+    if (!prerolling) {
+        display_date = decoder_GetDisplayDate(dec, pts);
+    }
+
+    bool late = display_date > 0 && display_date <= mdate();
+    sys->stats.pictures++;
+    if (late) {
+        sys->stats.late_pictures++;
+        sys->late_frames++;
+        if (sys->late_frames == 1) {
+            sys->late_frames_start = mdate();
+        }
+    } else {
+        sys->late_frames = 0;
+    }
+    if (!prerolling) {
+        UpdateQuality(dec, pts, late);
+    }
+    if (!prerolling) {
+        // while decoding reference pictures only, the late ones are
+        // skipped until the decoder has caught up
+        drawpicture = sys->quality_level < QUALITY_LEVEL_DROP - 1 || !late;
+    }
+    if (!drawpicture) {
+        sys->stats.skipped_pictures++;
+    }
+    return drawpicture;
+}
+
+/*****************************************************************************
+ * copy_picture_call_t: image to copy and the picture created for it
+ *****************************************************************************/
+struct copy_picture_call_t
+{
+    const struct de265_image *image;
+    picture_t *picture;
+    vlc_fourcc_t chroma;
+};
+
+/*****************************************************************************
+ * NewCopyPicture: set up the output format for copying an image and create
+ * the vlc picture (see CallDecoder)
+ *****************************************************************************/
+static void NewCopyPicture(decoder_t *dec, void *data)
+{
+    struct copy_picture_call_t *call = (struct copy_picture_call_t *) data;
+    const struct de265_image *image = call->image;
+
+    call->picture = NULL;
+
+    int bits_per_pixel = __MAX(__MAX(de265_get_bits_per_pixel(image, 0),
+                                     de265_get_bits_per_pixel(image, 1)),
+                               de265_get_bits_per_pixel(image, 2));
+    bool same_bits = de265_get_bits_per_pixel(image, 0) == de265_get_bits_per_pixel(image, 1) &&
+        de265_get_bits_per_pixel(image, 0) == de265_get_bits_per_pixel(image, 2);
+
+    // the (padded and cropped) format of direct rendering pictures
+    // has been set up by GetPicture, the copy only has the visible area
+    video_format_t *v = &dec->fmt_out.video;
+
+    int width = de265_get_image_width(image, 0);
+    int height = de265_get_image_height(image, 0);
+
+    if (width != (int) v->i_width || height != (int) v->i_height) {
+        v->i_width = width;
+        v->i_height = height;
+    }
+    if (width != (int) v->i_visible_width || height != (int) v->i_visible_height) {
+        v->i_visible_width = width;
+        v->i_visible_height = height;
+    }
+    v->i_x_offset = 0;
+    v->i_y_offset = 0;
+
+    vlc_fourcc_t chroma = NegotiateOutput(dec, de265_get_chroma_format(image),
+                                          bits_per_pixel, same_bits);
+    if (chroma == CODEC_UNKNOWN) {
+        return;
+    }
+    dec->fmt_out.i_codec = chroma;
+    v->i_chroma = chroma;
+
+    call->picture = decoder_NewPicture(dec);
+    call->chroma = chroma;
+}
+
+/*****************************************************************************
+ * OutputImage: get the vlc picture of a decoded image, copying it if direct
+ * rendering was not possible
+ *****************************************************************************/
+static picture_t *OutputImage(decoder_t *dec, const struct de265_image *image,
+                              mtime_t pts, bool *direct)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    decoder_stats_t *stats = DecodingStats(sys);
+
+    int bits_per_pixel = __MAX(__MAX(de265_get_bits_per_pixel(image, 0),
+                                     de265_get_bits_per_pixel(image, 1)),
+                               de265_get_bits_per_pixel(image, 2));
+
+    vlc_fourcc_t chroma = GetVlcCodec(dec, de265_get_chroma_format(image), bits_per_pixel);
+    if (chroma == CODEC_UNKNOWN) {
+        return NULL;
+    }
+
+    picture_t *pic;
+    struct picture_ref_t *ref = (struct picture_ref_t *) de265_get_image_plane_user_data(image, 0);
+    *direct = ref != NULL;
+    if (ref != NULL) {
+        // using direct rendering
+        pic = ref->picture;
+        decoder_LinkPicture(dec, pic);
+        stats->direct_pictures++;
+    } else {
+        struct copy_picture_call_t call = { image, NULL, CODEC_UNKNOWN };
+        if (!CallDecoder(dec, NewCopyPicture, &call) || call.picture == NULL)
+            return NULL;
+        pic = call.picture;
+        chroma = call.chroma;
+
+        mtime_t copy_start = StatsNow(sys);
+        const vlc_chroma_description_t *vlc_chroma = vlc_fourcc_GetChromaDescription(chroma);
+        assert(vlc_chroma != NULL);
+
+        int max_bits_per_pixel = vlc_chroma->pixel_bits;
+#ifdef VLC_CODEC_P010
+        if (chroma == VLC_CODEC_P010) {
+            // the samples are stored in the most significant bits
+            max_bits_per_pixel = 16;
+        }
+#endif
+        int dst_pixel_size = max_bits_per_pixel > 8 ? 2 : 1;
+        // the chroma planes are interleaved into the second plane
+        bool semiplanar = vlc_chroma->plane_count == 2;
+        copy_plane_t planes[PICTURE_PLANE_MAX];
+        for (int plane = 0; plane < pic->i_planes; plane++ ) {
+            copy_plane_t copy;
+            int plane_bits_per_pixel = de265_get_bits_per_pixel(image, plane);
+            int src_pixel_size = plane_bits_per_pixel > 8 ? 2 : 1;
+            int dst_samples = semiplanar && plane == 1 ? 2 : 1;
+            copy.src = de265_get_image_plane(image, plane, &copy.src_stride);
+            copy.src2 = NULL;
+            copy.src2_stride = 0;
+            copy.dst = pic->p[plane].p_pixels;
+            copy.dst_stride = pic->p[plane].i_pitch;
+            copy.lines = pic->p[plane].i_visible_lines;
+            copy.width = __MIN(copy.src_stride / src_pixel_size,
+                               copy.dst_stride / (dst_pixel_size * dst_samples));
+            if (semiplanar && plane == 1) {
+                // all planes have the same bits per pixel (see NegotiateOutput)
+                copy.src2 = de265_get_image_plane(image, 2, &copy.src2_stride);
+                copy.mode = dst_pixel_size > 1 ? COPY_MODE_INTERLEAVE_16 : COPY_MODE_INTERLEAVE;
+                copy.shift = max_bits_per_pixel - plane_bits_per_pixel;
+            } else if (plane_bits_per_pixel > max_bits_per_pixel) {
+                // More bits per pixel in this plane than supported by the VLC output format
+                copy.mode = dst_pixel_size > 1 ? COPY_MODE_SHIFT_DOWN : COPY_MODE_NARROW;
+                copy.shift = plane_bits_per_pixel - max_bits_per_pixel;
+            } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel > 8) {
+                // Less bits per pixel in this plane than the rest of the picture
+                // but more than 8bpp.
+                copy.mode = COPY_MODE_SHIFT_UP;
+                copy.shift = max_bits_per_pixel - plane_bits_per_pixel;
+            } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel == 8) {
+                // 8 bits per pixel in this plane, which is less than the rest of the picture.
+                copy.mode = COPY_MODE_WIDEN;
+                copy.shift = max_bits_per_pixel - plane_bits_per_pixel;
+            } else {
+                // Bits per pixel of image match output format.
+                copy.mode = COPY_MODE_PLAIN;
+                copy.shift = 0;
+                copy.width *= src_pixel_size;
+            }
+            planes[plane] = copy;
+        }
+
+        if (sys->copy_pool != NULL && pic->i_planes <= COPY_POOL_MAX_PLANES) {
+            CopyPoolRun(sys->copy_pool, planes, pic->i_planes);
+        } else {
+            for (int plane = 0; plane < pic->i_planes; plane++ ) {
+                CopyPlane(&sys->copy_kernels, &planes[plane]);
+            }
+        }
+        stats->copy_time += StatsNow(sys) - copy_start;
+    }
+
+    pic->b_progressive = true; /* codec does not support interlacing */
+    pic->date = pts;
+
+    return pic;
+}
+
+/*****************************************************************************
+ * DropPicture: release a picture returned by OutputImage
+ *****************************************************************************/
+static void DropPicture(decoder_t *dec, picture_t *pic, bool direct)
+{
+    if (direct) {
+        decoder_UnlinkPicture(dec, pic);
+    } else {
+        decoder_DeletePicture(dec, pic);
+    }
+}
+
+/****************************************************************************
+ * DecodeBlock: the whole thing
+ ****************************************************************************/
+static picture_t *DecodeBlock(decoder_t *dec, block_t **pp_block)
+{
+    bool drawpicture;
+    bool prerolling;
+    const struct de265_image *image;
+
+    block_t *block = *pp_block;
+    if (!block)
+        return NULL;
+
+    if (block->i_flags & (BLOCK_FLAG_DISCONTINUITY|BLOCK_FLAG_CORRUPTED)) {
+        ResetQuality(dec);
+        if (block->i_flags & BLOCK_FLAG_DISCONTINUITY) {
+            ResetDecoder(dec);
         }
+        goto error;
+    }
+
+    if ((prerolling = (block->i_flags & BLOCK_FLAG_PREROLL))) {
+        ResetQuality(dec);
+        drawpicture = false;
     } else {
-        err = de265_flush_data(ctx);
-        if (!de265_isOK(err)) {
-            msg_Err(dec, "Failed to flush data: %s (%d)", de265_get_error_text(err), err);
-            goto error;
-        }
+        drawpicture = true;
+    }
+
+    if (DropBlock(dec)) {
+        goto error;
+    }
+
+    mtime_t pts = block->i_pts;
+    bool use_decoder_pts = true;
+    if (pts == 0 || pts == VLC_TS_INVALID) {
+        pts = block->i_dts;
+        use_decoder_pts = false;
+    }
+
+    if (PushBlock(dec, block, pts) != VLC_SUCCESS) {
+        goto error;
     }
     block_Release(block);
     *pp_block = NULL;
@@ -443,40 +1512,7 @@ static picture_t *Decode(decoder_t *dec, block_t **pp_block)
     // decode (and skip) all available images (e.g. when prerolling
     // after a seek)
     do {
-        // decode data until we get an image or no more data is
-        // available for decoding
-        do {
-            err = de265_decode(ctx, &can_decode_more);
-            switch (err) {
-            case DE265_OK:
-                break;
-
-            case DE265_ERROR_IMAGE_BUFFER_FULL:
-            case DE265_ERROR_WAITING_FOR_INPUT_DATA:
-                // not really an error
-                can_decode_more = 0;
-                break;
-
-            default:
-                if (!de265_isOK(err)) {
-                    msg_Err(dec, "Failed to decode frame: %s (%d)", de265_get_error_text(err), err);
-                    return NULL;
-                }
-            }
-
-            image = de265_get_next_picture(ctx);
-        } while (image == NULL && can_decode_more);
-
-        // log warnings
-        for (;;) {
-            de265_error warning = de265_get_warning(ctx);
-            if (warning == DE265_OK) {
-                break;
-            }
-
-            msg_Warn(dec, "%s", de265_get_error_text(warning));
-        }
-
+        image = DecodeImage(dec);
         if (!image) {
             return NULL;
         }
@@ -484,137 +1520,318 @@ static picture_t *Decode(decoder_t *dec, block_t **pp_block)
         if (use_decoder_pts) {
             pts = de265_get_image_PTS(image);
         }
+        drawpicture = ShouldDisplay(dec, pts, prerolling, drawpicture);
+    } while (!drawpicture);
+
+    bool direct;
+    return OutputImage(dec, image, pts, &direct);
+
+error:
+    block_Release(*pp_block);
+    *pp_block = NULL;
+    return NULL;
+}
+
+/*****************************************************************************
+ * Pipelined decoding
+ *****************************************************************************
+ * The decoding thread pushes the queued blocks, decodes ahead and queues the
+ * output pictures, while the vlc decoder thread only queues blocks and
+ * returns the pictures that are on time. The decoder context is only used
+ * by the decoding thread, so the quality parameters and resets are passed
+ * to it as requests. In turn, the vlc decoder thread creates the pictures
+ * for the decoding thread (see CallDecoder).
+ *****************************************************************************/
+static void FlushPipelineBlocks(decoder_sys_t *sys)
+{
+    block_ChainRelease(sys->pipe_blocks);
+    sys->pipe_blocks = NULL;
+    sys->pipe_blocks_last = &sys->pipe_blocks;
+    sys->pipe_block_count = 0;
+}
+
+static void FlushPipelinePictures(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    for (; sys->pipe_picture_count > 0; sys->pipe_picture_count--) {
+        struct pipe_picture_t *out = &sys->pipe_pictures[sys->pipe_picture_first];
+        DropPicture(dec, out->picture, out->direct);
+        sys->pipe_picture_first = (sys->pipe_picture_first + 1) % PIPELINE_PICTURES;
+    }
+}
+
+static void *PipelineThread(void *data)
+{
+    decoder_t *dec = (decoder_t *) data;
+    decoder_sys_t *sys = dec->p_sys;
+    // whether data was pushed since the decoder ran out of it
+    bool decode = false;
+    // number of blocks pushed ahead of the decoded pictures
+    int ahead = 0;
+    bool prerolling = false;
+    bool use_decoder_pts = false;
+    mtime_t pts = VLC_TS_INVALID;
+    mtime_t busy = 0;
+
+    vlc_mutex_lock(&sys->pipe_lock);
+    while (!sys->pipe_quit) {
+        if (sys->pipe_reset) {
+            vlc_mutex_unlock(&sys->pipe_lock);
+            ResetDecoder(dec);
+            decode = false;
+            ahead = 0;
+            vlc_mutex_lock(&sys->pipe_lock);
+            FlushPipelinePictures(dec);
+            sys->pipe_reset = false;
+            vlc_cond_broadcast(&sys->pipe_output_cond);
+            continue;
+        }
 
-        mtime_t display_date = 0;
-        if (!prerolling) {
-            display_date = decoder_GetDisplayDate(dec, pts);
+        if (sys->pipe_quality_level >= 0) {
+            int level = sys->pipe_quality_level;
+            sys->pipe_quality_level = -1;
+            vlc_mutex_unlock(&sys->pipe_lock);
+            ApplyQualityLevel(dec, level);
+            vlc_mutex_lock(&sys->pipe_lock);
+            continue;
         }
 
-        if (display_date > 0 && display_date <= mdate()) {
-            sys->late_frames++;
-            if (sys->late_frames == 1) {
-                sys->late_frames_start = mdate();
+        if (sys->pipe_blocks != NULL && (!decode || ahead < PIPELINE_BLOCKS)) {
+            block_t *block = sys->pipe_blocks;
+            sys->pipe_blocks = block->p_next;
+            if (sys->pipe_blocks == NULL) {
+                sys->pipe_blocks_last = &sys->pipe_blocks;
+            }
+            sys->pipe_block_count--;
+            vlc_cond_broadcast(&sys->pipe_output_cond);
+            vlc_mutex_unlock(&sys->pipe_lock);
+
+            mtime_t start = mdate();
+            block->p_next = NULL;
+            prerolling = block->i_flags & BLOCK_FLAG_PREROLL;
+            pts = block->i_pts;
+            use_decoder_pts = true;
+            if (pts == 0 || pts == VLC_TS_INVALID) {
+                pts = block->i_dts;
+                use_decoder_pts = false;
+            }
+            bool pushed = PushBlock(dec, block, pts) == VLC_SUCCESS;
+            block_Release(block);
+            if (pushed) {
+                decode = true;
+                ahead++;
+            }
+            busy += mdate() - start;
+
+            vlc_mutex_lock(&sys->pipe_lock);
+            if (!pushed) {
+                sys->pipe_error = true;
             }
+            MoveStats(&sys->pipe_stats_done, &sys->pipe_stats);
+            continue;
+        }
+
+        if (!decode || sys->pipe_picture_count >= PIPELINE_PICTURES) {
+            vlc_cond_wait(&sys->pipe_input_cond, &sys->pipe_lock);
+            continue;
+        }
+        vlc_mutex_unlock(&sys->pipe_lock);
+
+        mtime_t start = mdate();
+        mtime_t call_wait = sys->pipe_call_wait;
+        picture_t *pic = NULL;
+        bool direct = false;
+        const struct de265_image *image = DecodeImage(dec);
+        if (image == NULL) {
+            decode = false;
         } else {
-            SetDecodeRatio(sys, 100);
-            sys->late_frames = 0;
+            if (ahead > 0) {
+                ahead--;
+            }
+            if (use_decoder_pts) {
+                pts = de265_get_image_PTS(image);
+            }
+            if (prerolling) {
+                // pictures decoded while prerolling are never displayed
+                sys->pipe_stats.pictures++;
+                sys->pipe_stats.skipped_pictures++;
+            } else {
+                pic = OutputImage(dec, image, pts, &direct);
+            }
         }
-    } while (!drawpicture);
+        // waiting for the vlc decoder thread is no load
+        busy += mdate() - start - (sys->pipe_call_wait - call_wait);
+
+        vlc_mutex_lock(&sys->pipe_lock);
+        MoveStats(&sys->pipe_stats_done, &sys->pipe_stats);
+        if (pic != NULL) {
+            if (sys->pipe_reset) {
+                DropPicture(dec, pic, direct);
+            } else {
+                int index = (sys->pipe_picture_first + sys->pipe_picture_count) % PIPELINE_PICTURES;
+                sys->pipe_pictures[index].picture = pic;
+                sys->pipe_pictures[index].direct = direct;
+                sys->pipe_pictures[index].busy = busy;
+                sys->pipe_picture_count++;
+                busy = 0;
+                vlc_cond_broadcast(&sys->pipe_output_cond);
+            }
+        }
+    }
+    vlc_mutex_unlock(&sys->pipe_lock);
+    return NULL;
+}
 
-    int bits_per_pixel = __MAX(__MAX(de265_get_bits_per_pixel(image, 0),
-                                     de265_get_bits_per_pixel(image, 1)),
-                               de265_get_bits_per_pixel(image, 2));
+/*****************************************************************************
+ * WaitPipeline: wait for the decoding thread (with pipe_lock held) and run
+ * the function it is waiting for
+ *****************************************************************************/
+static void WaitPipeline(decoder_t *dec)
+{
+    decoder_sys_t *sys = dec->p_sys;
 
-    vlc_fourcc_t chroma = GetVlcCodec(dec,
-        de265_get_chroma_format(image),
-        bits_per_pixel);
-    if (chroma == CODEC_UNKNOWN) {
-        return NULL;
+    if (sys->pipe_call == NULL) {
+        vlc_cond_wait(&sys->pipe_output_cond, &sys->pipe_lock);
+        return;
     }
 
-    dec->fmt_out.i_codec = chroma;
-
-    video_format_t *v = &dec->fmt_out.video;
-    v->i_chroma = chroma;
+    // the decoding thread doesn't change the call until it has been run
+    void (*func)(decoder_t *, void *) = sys->pipe_call;
+    void *arg = sys->pipe_call_arg;
+    vlc_mutex_unlock(&sys->pipe_lock);
+    func(dec, arg);
+    vlc_mutex_lock(&sys->pipe_lock);
+    sys->pipe_call = NULL;
+    vlc_cond_signal(&sys->pipe_input_cond);
+}
 
-    int width = de265_get_image_width(image, 0);
-    int height = de265_get_image_height(image, 0);
+/****************************************************************************
+ * DecodePipelined: pass blocks to the decoding thread and return its pictures
+ ****************************************************************************/
+static picture_t *DecodePipelined(decoder_t *dec, block_t **pp_block)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    block_t *block = *pp_block;
 
-    if (width != (int) v->i_width || height != (int) v->i_height) {
-        v->i_width = width;
-        v->i_height = height;
-    }
-    if (width != (int) v->i_visible_width || height != (int) v->i_visible_height) {
-        v->i_visible_width = width;
-        v->i_visible_height = height;
-    }
+    if (block != NULL) {
+        *pp_block = NULL;
+        if (block->i_flags & (BLOCK_FLAG_DISCONTINUITY|BLOCK_FLAG_CORRUPTED)) {
+            ResetQuality(dec);
+            if (block->i_flags & BLOCK_FLAG_DISCONTINUITY) {
+                // wait for the reset, no picture from before may be returned
+                vlc_mutex_lock(&sys->pipe_lock);
+                FlushPipelineBlocks(sys);
+                sys->pipe_reset = true;
+                vlc_cond_signal(&sys->pipe_input_cond);
+                while (sys->pipe_reset) {
+                    WaitPipeline(dec);
+                }
+                vlc_mutex_unlock(&sys->pipe_lock);
+            }
+            block_Release(block);
+            return NULL;
+        }
 
-    picture_t *pic;
-    struct picture_ref_t *ref = (struct picture_ref_t *) de265_get_image_plane_user_data(image, 0);
-    if (ref != NULL) {
-        // using direct rendering
-        pic = ref->picture;
-        decoder_LinkPicture(dec, pic);
-    } else {
-        pic = decoder_NewPicture(dec);
-        if (!pic)
+        if (block->i_flags & BLOCK_FLAG_PREROLL) {
+            ResetQuality(dec);
+        }
+        if (DropBlock(dec)) {
+            block_Release(block);
             return NULL;
+        }
 
-        const vlc_chroma_description_t *vlc_chroma = vlc_fourcc_GetChromaDescription(chroma);
-        assert(vlc_chroma != NULL);
+        // keep the queue short, unless there is a picture to return
+        vlc_mutex_lock(&sys->pipe_lock);
+        *sys->pipe_blocks_last = block;
+        sys->pipe_blocks_last = &block->p_next;
+        sys->pipe_block_count++;
+        vlc_cond_signal(&sys->pipe_input_cond);
+        while (sys->pipe_block_count > PIPELINE_BLOCKS && sys->pipe_picture_count == 0) {
+            WaitPipeline(dec);
+        }
+        vlc_mutex_unlock(&sys->pipe_lock);
+    }
 
-        int max_bits_per_pixel = vlc_chroma->pixel_bits;
-        for (int plane = 0; plane < pic->i_planes; plane++ ) {
-            int src_stride;
-            const uint8_t *src = de265_get_image_plane(image, plane, &src_stride);
-            int plane_bits_per_pixel = de265_get_bits_per_pixel(image, plane);
-            int dst_stride = pic->p[plane].i_pitch;
-            uint8_t *dst = pic->p[plane].p_pixels;
+    for (;;) {
+        struct pipe_picture_t out;
 
-            int size = __MIN( src_stride, dst_stride );
-            if (plane_bits_per_pixel > max_bits_per_pixel) {
-                // More bits per pixel in this plane than supported by the VLC output format
-                int shift = (plane_bits_per_pixel - max_bits_per_pixel);
-                for( int line = 0; line < pic->p[plane].i_visible_lines; line++ ) {
-                    uint16_t *s = (uint16_t *) src;
-                    uint16_t *d = (uint16_t *) dst;
-                    for (int pos=0; pos<size/2; pos++) {
-                        *d = *s >> shift;
-                        d++;
-                        s++;
-                    }
-                    src += src_stride;
-                    dst += dst_stride;
-                }
-            } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel > 8) {
-                // Less bits per pixel in this plane than the rest of the picture
-                // but more than 8bpp.
-                int shift = (max_bits_per_pixel - plane_bits_per_pixel);
-                for( int line = 0; line < pic->p[plane].i_visible_lines; line++ ) {
-                    uint16_t *s = (uint16_t *) src;
-                    uint16_t *d = (uint16_t *) dst;
-                    for (int pos=0; pos<size/2; pos++) {
-                        *d = *s << shift;
-                        d++;
-                        s++;
-                    }
-                    src += src_stride;
-                    dst += dst_stride;
-                }
-            } else if (plane_bits_per_pixel < max_bits_per_pixel && plane_bits_per_pixel == 8) {
-                // 8 bits per pixel in this plane, which is less than the rest of the picture.
-                int shift = (max_bits_per_pixel - plane_bits_per_pixel);
-                for( int line = 0; line < pic->p[plane].i_visible_lines; line++ ) {
-                    uint8_t *s = (uint8_t *) src;
-                    uint16_t *d = (uint16_t *) dst;
-                    for (int pos=0; pos<size; pos++) {
-                        *d = *s << shift;
-                        d++;
-                        s++;
-                    }
-                    src += src_stride;
-                    dst += dst_stride;
-                }
-            } else {
-                // Bits per pixel of image match output format.
-                for( int line = 0; line < pic->p[plane].i_visible_lines; line++ ) {
-                    memcpy( dst, src, size );
-                    src += src_stride;
-                    dst += dst_stride;
-                }
-            }
+        vlc_mutex_lock(&sys->pipe_lock);
+        if (sys->pipe_call != NULL) {
+            WaitPipeline(dec);
+        }
+        if (sys->pipe_error) {
+            // like DecodeBlock, no picture after a failed push
+            sys->pipe_error = false;
+            vlc_mutex_unlock(&sys->pipe_lock);
+            return NULL;
+        }
+        if (sys->pipe_picture_count == 0) {
+            vlc_mutex_unlock(&sys->pipe_lock);
+            return NULL;
+        }
+        out = sys->pipe_pictures[sys->pipe_picture_first];
+        sys->pipe_picture_first = (sys->pipe_picture_first + 1) % PIPELINE_PICTURES;
+        sys->pipe_picture_count--;
+        vlc_cond_signal(&sys->pipe_input_cond);
+        vlc_mutex_unlock(&sys->pipe_lock);
+
+        // the load is the time the decoding thread spent on the picture
+        sys->decode_time_pending = out.busy;
+        sys->decode_start = mdate();
+        if (ShouldDisplay(dec, out.picture->date, false, true)) {
+            return out.picture;
         }
+        DropPicture(dec, out.picture, out.direct);
     }
+}
 
-    pic->b_progressive = true; /* codec does not support interlacing */
-    pic->date = pts;
+/****************************************************************************
+ * Decode: decode a block and keep track of the time spent decoding
+ ****************************************************************************/
+static picture_t *Decode(decoder_t *dec, block_t **pp_block)
+{
+    decoder_sys_t *sys = dec->p_sys;
 
+    sys->decode_start = mdate();
+    if (*pp_block) {
+        sys->stats.blocks++;
+    }
+    picture_t *pic = sys->pipeline ? DecodePipelined(dec, pp_block)
+                                   : DecodeBlock(dec, pp_block);
+    mtime_t now = mdate();
+    sys->decode_time_pending += now - sys->decode_start;
+    if (sys->stats_interval > 0 && now - sys->stats.last_report >= sys->stats_interval) {
+        ReportStats(dec, now);
+    }
     return pic;
+}
 
-error:
-    block_Release(*pp_block);
-    *pp_block = NULL;
-    return NULL;
+/*****************************************************************************
+ * NewPictureRef: get an unused reference from the free list
+ *****************************************************************************/
+static struct picture_ref_t *NewPictureRef(decoder_t *dec, picture_t *pic)
+{
+    decoder_sys_t *sys = dec->p_sys;
+
+    vlc_mutex_lock(&sys->refs_lock);
+    struct picture_ref_t *ref = sys->free_refs;
+    if (ref != NULL) {
+        sys->free_refs = ref->next;
+    }
+    vlc_mutex_unlock(&sys->refs_lock);
+
+    if (ref == NULL) {
+        ref = (struct picture_ref_t *) malloc(sizeof(*ref));
+        if (ref == NULL) {
+            return NULL;
+        }
+    }
+
+    ref->decoder = dec;
+    ref->picture = pic;
+    ref->next = NULL;
+    return ref;
 }
 
 /*****************************************************************************
@@ -622,8 +1839,16 @@ error:
  *****************************************************************************/
 static void ReleasePictureRef(struct picture_ref_t *ref)
 {
-    decoder_UnlinkPicture(ref->decoder, ref->picture);
-    free(ref);
+    decoder_t *dec = ref->decoder;
+    decoder_sys_t *sys = dec->p_sys;
+
+    decoder_UnlinkPicture(dec, ref->picture);
+    ref->picture = NULL;
+
+    vlc_mutex_lock(&sys->refs_lock);
+    ref->next = sys->free_refs;
+    sys->free_refs = ref;
+    vlc_mutex_unlock(&sys->refs_lock);
 }
 
 /*****************************************************************************
@@ -632,7 +1857,7 @@ static void ReleasePictureRef(struct picture_ref_t *ref)
 static picture_t *GetPicture(decoder_t *dec, struct de265_image_spec* spec, struct de265_image *image)
 {
     decoder_sys_t *sys = dec->p_sys;
-    int width = (spec->width + spec->alignment - 1) / spec->alignment * spec->alignment;
+    int width = spec->width;
     int height = spec->height;
 
     if (width == 0 || height == 0 || width > 8192 || height > 8192) {
@@ -641,6 +1866,10 @@ static picture_t *GetPicture(decoder_t *dec, struct de265_image_spec* spec, stru
     }
 
     enum de265_chroma image_chroma = ImageFormatToChroma(spec->format);
+    if (sys->semiplanar && image_chroma == de265_chroma_420) {
+        // libde265 only decodes into planar images
+        return NULL;
+    }
     if (image_chroma != de265_chroma_mono) {
         if (de265_get_bits_per_pixel(image, 0) != de265_get_bits_per_pixel(image, 1) ||
             de265_get_bits_per_pixel(image, 0) != de265_get_bits_per_pixel(image, 2) ||
@@ -672,6 +1901,15 @@ static picture_t *GetPicture(decoder_t *dec, struct de265_image_spec* spec, stru
         return NULL;
     }
 
+    // pad the width, so the subsampled planes are aligned as well
+    int width_alignment = spec->alignment;
+    for (unsigned int i=0; i<dsc->plane_count; i++) {
+        if (dsc->p[i].w.den > 1 && dsc->p[i].w.num == 1) {
+            width_alignment = __MAX(width_alignment, spec->alignment * dsc->p[i].w.den);
+        }
+    }
+    width = (width + width_alignment - 1) / width_alignment * width_alignment;
+
     for (unsigned int i=0; dsc && i<dsc->plane_count; i++) {
         int plane_width = width * dsc->p[i].w.num / dsc->p[i].w.den;
         int aligned_width = (plane_width + spec->alignment - 1) / spec->alignment * spec->alignment;;
@@ -703,6 +1941,8 @@ static picture_t *GetPicture(decoder_t *dec, struct de265_image_spec* spec, stru
 
     picture_t *pic = decoder_NewPicture(dec);
     if (pic == NULL) {
+        // not caused by the format, try again with the next image
+        sys->direct_rendering_failed = false;
         return NULL;
     }
 
@@ -745,51 +1985,99 @@ error:
 }
 
 /*****************************************************************************
- * GetBuffer: libde265 callback to create images
+ * SameImageSpec: check if two images have the same format
  *****************************************************************************/
-static int GetBuffer(de265_decoder_context* ctx, struct de265_image_spec* spec, struct de265_image* img, void* userdata)
+static bool SameImageSpec(const struct de265_image_spec *a, const struct de265_image_spec *b)
 {
-    decoder_t *dec = (decoder_t *) userdata;
-    decoder_sys_t *sys = dec->p_sys;
+    return a->format == b->format &&
+        a->width == b->width && a->height == b->height &&
+        a->alignment == b->alignment &&
+        a->crop_left == b->crop_left && a->crop_right == b->crop_right &&
+        a->crop_top == b->crop_top && a->crop_bottom == b->crop_bottom;
+}
+
+/*****************************************************************************
+ * direct_picture_call_t: image to allocate and the picture created for it
+ *****************************************************************************/
+struct direct_picture_call_t
+{
+    struct de265_image_spec *spec;
+    struct de265_image *image;
+    picture_t *picture;
+};
 
-    picture_t *pic = GetPicture(dec, spec, img);
+/*****************************************************************************
+ * NewDirectPicture: create a vlc picture to decode an image into, unless
+ * direct rendering isn't possible (see CallDecoder)
+ *****************************************************************************/
+static void NewDirectPicture(decoder_t *dec, void *data)
+{
+    decoder_sys_t *sys = dec->p_sys;
+    struct direct_picture_call_t *call = (struct direct_picture_call_t *) data;
+    struct de265_image_spec *spec = call->spec;
+    struct de265_image *img = call->image;
+
+    int bits = de265_get_bits_per_pixel(img, 0) |
+        (de265_get_bits_per_pixel(img, 1) << 8) |
+        (de265_get_bits_per_pixel(img, 2) << 16);
+    picture_t *pic = NULL;
+    if (!sys->direct_rendering_failed || bits != sys->direct_rendering_bits ||
+        !SameImageSpec(spec, &sys->direct_rendering_spec)) {
+        // remember the format, so pictures are not allocated and
+        // checked for every image if it isn't supported
+        sys->direct_rendering_failed = true;
+        sys->direct_rendering_spec = *spec;
+        sys->direct_rendering_bits = bits;
+        pic = GetPicture(dec, spec, img);
+        if (pic != NULL) {
+            sys->direct_rendering_failed = false;
+        }
+    }
     if (pic == NULL) {
         if (sys->direct_rendering_used != 0) {
             msg_Warn(dec, "disabling direct rendering");
             sys->direct_rendering_used = 0;
+            sys->stats.direct_rendering_changes++;
         }
+    } else if (sys->direct_rendering_used != 1) {
+        msg_Dbg(dec, "enabling direct rendering");
+        sys->direct_rendering_used = 1;
+        sys->stats.direct_rendering_changes++;
+    }
+    call->picture = pic;
+}
+
+/*****************************************************************************
+ * GetBuffer: libde265 callback to create images
+ *****************************************************************************/
+static int GetBuffer(de265_decoder_context* ctx, struct de265_image_spec* spec, struct de265_image* img, void* userdata)
+{
+    decoder_t *dec = (decoder_t *) userdata;
+    decoder_sys_t *sys = dec->p_sys;
+
+    if (!sys->direct_rendering) {
         return de265_get_default_image_allocation_functions()->get_buffer(ctx, spec, img, userdata);
     }
 
-    if (sys->direct_rendering_used != 1) {
-        msg_Dbg(dec, "enabling direct rendering");
-        sys->direct_rendering_used = 1;
+    struct direct_picture_call_t call = { spec, img, NULL };
+    if (!CallDecoder(dec, NewDirectPicture, &call) || call.picture == NULL) {
+        return de265_get_default_image_allocation_functions()->get_buffer(ctx, spec, img, userdata);
     }
-    for (int i = 0; i < pic->i_planes; i++) {
-        struct picture_ref_t *ref = (struct picture_ref_t *) malloc(sizeof (*ref));
-        if (ref == NULL) {
-            goto error;
-        }
-        ref->decoder = dec;
-        ref->picture = pic;
-        decoder_LinkPicture(dec, pic);
 
+    picture_t *pic = call.picture;
+    // the reference takes over the link from decoder_NewPicture
+    struct picture_ref_t *ref = NewPictureRef(dec, pic);
+    if (ref == NULL) {
+        decoder_DeletePicture(dec, pic);
+        return de265_get_default_image_allocation_functions()->get_buffer(ctx, spec, img, userdata);
+    }
+
+    for (int i = 0; i < pic->i_planes; i++) {
         uint8_t *data = pic->p[i].p_pixels;
         int stride = pic->p[i].i_pitch;
         de265_set_image_plane(img, i, data, stride, ref);
     }
-    decoder_UnlinkPicture(dec, pic);
     return 1;
-
-error:
-    for (int i=0; i<3; i++) {
-        struct picture_ref_t *userdata = (struct picture_ref_t *) de265_get_image_plane_user_data(img, i);
-        if (userdata) {
-            ReleasePictureRef(userdata);
-        }
-    }
-    decoder_DeletePicture(dec, pic);
-    return de265_get_default_image_allocation_functions()->get_buffer(ctx, spec, img, userdata);
 }
 
 /*****************************************************************************
@@ -797,16 +2085,11 @@ error:
  *****************************************************************************/
 static void ReleaseBuffer(de265_decoder_context* ctx, struct de265_image* img, void* userdata)
 {
-    int release_default = 1;
-    for (int i=0; i<3; i++) {
-        struct picture_ref_t *ref = (struct picture_ref_t *) de265_get_image_plane_user_data(img, i);
-        if (ref) {
-            ReleasePictureRef(ref);
-            release_default = 0;
-        }
-    }
-
-    if (release_default) {
+    // all planes share the same reference
+    struct picture_ref_t *ref = (struct picture_ref_t *) de265_get_image_plane_user_data(img, 0);
+    if (ref) {
+        ReleasePictureRef(ref);
+    } else {
         // image was created from default allocator
         de265_get_default_image_allocation_functions()->release_buffer(ctx, img, userdata);
     }
@@ -828,9 +2111,13 @@ static int Open(vlc_object_t *p_this)
         return VLC_ENOMEM;
     dec->p_sys = sys;
 
+    vlc_mutex_init(&sys->refs_lock);
+    sys->free_refs = NULL;
+
     msg_Dbg(p_this, "using libde265 version %s", de265_get_version());
     if ((sys->ctx = de265_new_decoder()) == NULL) {
         msg_Err(p_this, "Failed to initialize decoder");
+        vlc_mutex_destroy(&sys->refs_lock);
         free(sys);
         return VLC_EGENERIC;
     }
@@ -840,25 +2127,19 @@ static int Open(vlc_object_t *p_this)
     allocators.release_buffer = ReleaseBuffer;
     de265_set_image_allocation_functions(sys->ctx, &allocators, dec);
 
+    sys->worker_threads = 0;
+    sys->threads_pending = false;
+    sys->threads_pending_blocks = 0;
+    sys->have_sps = false;
+    sys->have_pps = false;
     int threads = var_InheritInteger(dec, "libde265-threads");
-    if (threads <= 0) {
-        threads = vlc_GetCPUCount();
-        // NOTE: We start more threads than cores for now, as some threads
-        // might get blocked while waiting for dependent data. Having more
-        // threads increases decoding speed by about 10%.
-        threads = threads * 2;
-    }
-    if (threads > 1) {
-        threads = __MIN(threads, MAX_THREAD_COUNT);
-        de265_error err = de265_start_worker_threads(sys->ctx, threads);
-        if (!de265_isOK(err)) {
-            // don't report to caller, decoding will work anyway...
-            msg_Err(dec, "Failed to start worker threads: %s (%d)", de265_get_error_text(err), err);
-        } else {
-            msg_Dbg(p_this, "Started %d worker threads", threads);
-        }
+    if (threads > 0) {
+        StartWorkerThreads(dec, threads);
+    } else if (var_InheritBool(dec, "libde265-adaptive-threads")) {
+        msg_Dbg(p_this, "Waiting for parameter sets to start worker threads");
+        sys->threads_pending = true;
     } else {
-        msg_Dbg(p_this, "Using single-threaded decoding");
+        StartWorkerThreads(dec, GetDefaultThreadCount());
     }
 
     dec->pf_decode_video = Decode;
@@ -873,11 +2154,85 @@ static int Open(vlc_object_t *p_this)
     sys->check_extra = true;
     sys->length_size = DEFAULT_LENGTH_SIZE;
     sys->packetized = dec->fmt_in.b_packetized;
+    sys->data_pending = false;
+    sys->fast_seek = var_InheritBool(dec, "libde265-fast-seek");
+    sys->skip_to_irap = false;
+    sys->skip_rasl = false;
+    sys->preroll_fast = false;
+    sys->skipped_nals = 0;
+    sys->applied_quality_level = 0;
+    ParseExtra(dec);
     sys->late_frames = 0;
     sys->decode_ratio = 100;
+    sys->quality_level = 0;
+    sys->quality_pressure = 0;
+    sys->quality_relief = 0;
+    sys->dropped_blocks = 0;
+    sys->decode_start = 0;
+    sys->decode_time_pending = 0;
+    sys->decode_time = 0;
+    sys->frame_interval = 0;
+    sys->last_pts = VLC_TS_INVALID;
+    sys->stats_interval = var_InheritInteger(dec, "libde265-stats-interval") * CLOCK_FREQ;
+    memset(&sys->stats, 0, sizeof(sys->stats));
+    sys->stats.last_report = mdate();
+    memset(&sys->pipe_stats, 0, sizeof(sys->pipe_stats));
+    sys->pipe_call_wait = 0;
+    sys->direct_rendering = var_InheritBool(dec, "libde265-direct-rendering");
     sys->direct_rendering_used = -1;
+    sys->semiplanar = var_InheritBool(dec, "libde265-semiplanar");
+    sys->output_key = -1;
+    sys->output_chroma = CODEC_UNKNOWN;
+    sys->direct_rendering_failed = false;
     sys->disable_deblocking = var_InheritBool(dec, "libde265-disable-deblocking");
     sys->disable_sao = var_InheritBool(dec, "libde265-disable-sao");
+    CopyKernelsInit(&sys->copy_kernels);
+    msg_Dbg(p_this, "Using %s plane conversion", sys->copy_kernels.name);
+
+    sys->copy_pool = NULL;
+    int copy_threads = var_InheritInteger(dec, "libde265-copy-threads");
+    if (copy_threads > 0) {
+        sys->copy_pool = CopyPoolNew(&sys->copy_kernels, copy_threads);
+        if (sys->copy_pool == NULL) {
+            msg_Warn(p_this, "Failed to start copy threads, copying on decoder thread");
+        } else {
+            msg_Dbg(p_this, "Started %d copy threads", copy_threads);
+        }
+    }
+
+    sys->pipeline = false;
+    if (var_InheritBool(dec, "libde265-pipeline")) {
+        vlc_mutex_init(&sys->pipe_lock);
+        vlc_cond_init(&sys->pipe_input_cond);
+        vlc_cond_init(&sys->pipe_output_cond);
+        sys->pipe_blocks = NULL;
+        sys->pipe_blocks_last = &sys->pipe_blocks;
+        sys->pipe_block_count = 0;
+        sys->pipe_picture_first = 0;
+        sys->pipe_picture_count = 0;
+        sys->pipe_quality_level = -1;
+        sys->pipe_call = NULL;
+        sys->pipe_call_arg = NULL;
+        memset(&sys->pipe_stats_done, 0, sizeof(sys->pipe_stats_done));
+        sys->pipe_error = false;
+        sys->pipe_reset = false;
+        sys->pipe_quit = false;
+        // before the thread starts, it selects the statistics to update
+        sys->pipeline = true;
+        if (vlc_clone(&sys->pipe_thread, PipelineThread, dec, VLC_THREAD_PRIORITY_VIDEO)) {
+            msg_Warn(p_this, "Failed to start decoding thread, decoding on decoder thread");
+            sys->pipeline = false;
+            vlc_cond_destroy(&sys->pipe_output_cond);
+            vlc_cond_destroy(&sys->pipe_input_cond);
+            vlc_mutex_destroy(&sys->pipe_lock);
+        } else {
+            msg_Dbg(p_this, "Started decoding thread");
+            // the queued pictures are held in addition to the ones of the
+            // decoder, the video output must not run out of pictures for
+            // direct rendering because of them
+            dec->i_extra_picture_buffers += PIPELINE_PICTURES;
+        }
+    }
 
     return VLC_SUCCESS;
 }
@@ -890,7 +2245,39 @@ static void Close(vlc_object_t *p_this)
     decoder_t *dec = (decoder_t *)p_this;
     decoder_sys_t *sys = dec->p_sys;
 
+    if (sys->pipeline) {
+        vlc_mutex_lock(&sys->pipe_lock);
+        sys->pipe_quit = true;
+        vlc_cond_signal(&sys->pipe_input_cond);
+        vlc_mutex_unlock(&sys->pipe_lock);
+        vlc_join(sys->pipe_thread, NULL);
+        MoveStats(&sys->pipe_stats_done, &sys->pipe_stats);
+    }
+
+    if (sys->stats_interval > 0) {
+        ReportStats(dec, mdate());
+    }
+
+    if (sys->pipeline) {
+        FlushPipelineBlocks(sys);
+        FlushPipelinePictures(dec);
+        vlc_cond_destroy(&sys->pipe_output_cond);
+        vlc_cond_destroy(&sys->pipe_input_cond);
+        vlc_mutex_destroy(&sys->pipe_lock);
+    }
+
     de265_free_decoder(sys->ctx);
+    ReleaseWorkerThreads(dec);
+    hevc_ReleaseHvcC(&sys->hvcc);
+    CopyPoolDelete(sys->copy_pool);
+
+    // all images have been released by the decoder
+    while (sys->free_refs != NULL) {
+        struct picture_ref_t *ref = sys->free_refs;
+        sys->free_refs = ref->next;
+        free(ref);
+    }
+    vlc_mutex_destroy(&sys->refs_lock);
 
     free(sys);
 }
@@ -35,6 +35,8 @@
 #include <assert.h>
 
 #include "../../include/libde265_plugin_common.h"
+#include "../packetizer/hevc_nal.h"
+#include "../packetizer/startcode_helper.h"
 
 /*****************************************************************************
  * Module descriptor
@@ -46,20 +48,25 @@ static void Close(vlc_object_t *);
 
 #define INITIAL_PEEK_SIZE       4096
 
-#define NAL_UNIT_BLA_W_LP       16      // BLA = broken link access
-#define NAL_UNIT_BLA_W_RADL     17
-#define NAL_UNIT_BLA_N_LP       18
-#define NAL_UNIT_IDR_W_RADL     19
-#define NAL_UNIT_IDR_N_LP       20
-#define NAL_UNIT_CRA_NUT        21      // CRA = clean random access
-#define NAL_UNIT_VPS_NUT        32
-#define NAL_UNIT_SPS_NUT        33
-#define NAL_UNIT_PPS_NUT        34
+#define SCAN_BUFFER_SIZE        (1024*1024)
+
+// Don't peek more than 32 MB while searching the end of a NAL unit
+#define MAX_PEEK_SIZE           (32 * 1024 * 1024)
 
 #define FPS_TEXT N_("Frames per Second")
 #define FPS_LONGTEXT N_("This is the desired frame rate when " \
     "playing raw bitstreams. In the form 30000/1001 or 29.97")
 
+#define AGGREGATE_TEXT N_("Aggregate access units")
+#define AGGREGATE_LONGTEXT N_("Send all NAL units of an access unit " \
+    "in one block instead of one block per NAL unit. The blocks are " \
+    "flagged as complete access units, so the decoder can skip to the " \
+    "next random access point after seeking.")
+
+#define PRESCAN_TEXT N_("Pre-scan random access points")
+#define PRESCAN_LONGTEXT N_("Scan local files for random access points " \
+    "in the background for accurate seeking and duration.")
+
 vlc_module_begin()
     set_shortname(N_("Raw HEVC/H.265"))
     set_description(N_("Raw HEVC/H.265 bitstream demuxer"))
@@ -69,11 +76,35 @@ vlc_module_begin()
     set_callbacks(Open, Close)
     add_shortcut("libde265demux")
     add_string("libde265demux-fps", NULL, FPS_TEXT, FPS_LONGTEXT, false)
+    add_bool("libde265demux-aggregate", false, AGGREGATE_TEXT, AGGREGATE_LONGTEXT, true)
+    add_bool("libde265demux-prescan", false, PRESCAN_TEXT, PRESCAN_LONGTEXT, true)
 vlc_module_end()
 
 /*****************************************************************************
  * Definitions of structures used by this plugin
  *****************************************************************************/
+
+// access unit containing an IRAP picture
+typedef struct irap_entry_t
+{
+    // offset of the first NAL unit of the access unit
+    int64_t offset;
+    // number of pictures before the IRAP picture
+    int64_t picture;
+} irap_entry_t;
+
+// state while walking the NAL units of a stream in order
+typedef struct index_scan_t
+{
+    // offset of the first NAL unit of the current access unit
+    int64_t au_start;
+    // number of pictures started so far
+    int64_t picture;
+    bool have_vcl;
+    // false if the position in the stream is not known
+    bool synced;
+} index_scan_t;
+
 struct demux_sys_t
 {
     es_out_id_t *es_video;
@@ -82,6 +113,30 @@ struct demux_sys_t
     int frame_size_estimate;
     int data_peeked;
     const uint8_t *peek;
+    // length of the start code at the current stream position (if known)
+    int32_t next_code_length;
+    bool aggregate;
+    // the last block ended with a complete NAL unit
+    bool last_complete;
+
+    // NAL units sent by Demux
+    index_scan_t scan;
+
+    // IRAP access units sorted by offset, the index covers all NAL units
+    // before "index_end" and is filled by Demux and the pre-scan thread
+    vlc_mutex_t index_lock;
+    irap_entry_t *index;
+    int index_count;
+    int index_size;
+    int64_t index_end;
+    // scan state after the last indexed NAL unit
+    index_scan_t index_state;
+    bool index_complete;
+
+    bool prescan_running;
+    bool prescan_abort;
+    vlc_thread_t prescan_thread;
+    stream_t *prescan_stream;
 };
 
 /*****************************************************************************
@@ -89,6 +144,7 @@ struct demux_sys_t
  *****************************************************************************/
 static int Demux(demux_t *);
 static int Control(demux_t *, int i_query, va_list args);
+static void *PrescanThread(void *);
 
 // supported file extensions
 static const char *extensions[] =
@@ -152,15 +208,15 @@ supported_extension:
             }
 
             switch (type) {
-            case NAL_UNIT_VPS_NUT: vps++; break;
-            case NAL_UNIT_SPS_NUT: sps++; break;
-            case NAL_UNIT_PPS_NUT: pps++; break;
-            case NAL_UNIT_BLA_W_LP:
-            case NAL_UNIT_BLA_W_RADL:
-            case NAL_UNIT_BLA_N_LP:
-            case NAL_UNIT_IDR_W_RADL:
-            case NAL_UNIT_IDR_N_LP:
-            case NAL_UNIT_CRA_NUT: irap++; break;
+            case HEVC_NAL_VPS_NUT: vps++; break;
+            case HEVC_NAL_SPS_NUT: sps++; break;
+            case HEVC_NAL_PPS_NUT: pps++; break;
+            case HEVC_NAL_BLA_W_LP:
+            case HEVC_NAL_BLA_W_RADL:
+            case HEVC_NAL_BLA_N_LP:
+            case HEVC_NAL_IDR_W_RADL:
+            case HEVC_NAL_IDR_N_LP:
+            case HEVC_NAL_CRA_NUT: irap++; break;
             default: break;
             }
         }
@@ -217,14 +273,51 @@ supported_extension:
                sys->fmt_video.video.i_frame_rate_base);
     date_Set(&sys->pcr, 0);
 
-    sys->frame_size_estimate = 0;
     sys->data_peeked = 0;
     sys->frame_size_estimate = INITIAL_PEEK_SIZE;
+    sys->next_code_length = 0;
+    sys->aggregate = var_InheritBool(demux, "libde265demux-aggregate");
+    sys->last_complete = true;
+
+    memset(&sys->scan, 0, sizeof(sys->scan));
+    sys->scan.synced = (stream_Tell(demux->s) == 0);
+    vlc_mutex_init(&sys->index_lock);
+    sys->index = NULL;
+    sys->index_count = 0;
+    sys->index_size = 0;
+    sys->index_end = 0;
+    memset(&sys->index_state, 0, sizeof(sys->index_state));
+    sys->index_state.synced = true;
+    sys->index_complete = false;
+    sys->prescan_running = false;
+    sys->prescan_abort = false;
+    sys->prescan_stream = NULL;
 
     demux->pf_demux = Demux;
     demux->pf_control = Control;
 
     sys->es_video = es_out_Add(demux->out, &sys->fmt_video);
+
+    // a second stream is used for the pre-scan, only do this for files
+    // that can be accessed cheaply
+    bool can_fastseek = false;
+    stream_Control(demux->s, STREAM_CAN_FASTSEEK, &can_fastseek);
+    if (var_InheritBool(demux, "libde265demux-prescan") && can_fastseek &&
+        demux->psz_access && demux->psz_location) {
+        char *url;
+        if (asprintf(&url, "%s://%s", demux->psz_access, demux->psz_location) >= 0) {
+            sys->prescan_stream = stream_UrlNew(demux, url);
+            free(url);
+        }
+        if (sys->prescan_stream) {
+            if (!vlc_clone(&sys->prescan_thread, PrescanThread, demux, VLC_THREAD_PRIORITY_LOW)) {
+                sys->prescan_running = true;
+            } else {
+                stream_Delete(sys->prescan_stream);
+                sys->prescan_stream = NULL;
+            }
+        }
+    }
     return VLC_SUCCESS;
 }
 
@@ -236,22 +329,36 @@ static void Close(vlc_object_t *p_this)
     demux_t *demux = (demux_t *) p_this;
     demux_sys_t *sys = demux->p_sys;
 
+    if (sys->prescan_running) {
+        vlc_mutex_lock(&sys->index_lock);
+        sys->prescan_abort = true;
+        vlc_mutex_unlock(&sys->index_lock);
+        vlc_join(sys->prescan_thread, NULL);
+    }
+    if (sys->prescan_stream) {
+        stream_Delete(sys->prescan_stream);
+    }
+    vlc_mutex_destroy(&sys->index_lock);
+    free(sys->index);
     free(sys);
 }
 
 /*****************************************************************************
- * Peek: Helper function to peek data with incremental size.
+ * Peek: Helper function to peek more data, the size of the peeked data is
+ * doubled if all data peeked so far has been consumed.
  * \return false if peek no more data, true otherwise.
  *****************************************************************************/
-static bool Peek(demux_t *p_demux, bool first)
+static bool Peek(demux_t *p_demux)
 {
     int data;
     demux_sys_t *sys = p_demux->p_sys;
 
-    if (first) {
-        sys->data_peeked = 0;
-    } else if (sys->data_peeked == sys->frame_size_estimate) {
-        sys->frame_size_estimate += 4096;
+    if (sys->data_peeked >= sys->frame_size_estimate) {
+        if (sys->frame_size_estimate >= MAX_PEEK_SIZE) {
+            msg_Warn(p_demux, "NAL unit too large");
+            return false;
+        }
+        sys->frame_size_estimate = __MIN(sys->frame_size_estimate * 2, MAX_PEEK_SIZE);
     }
     data = stream_Peek(p_demux->s, &sys->peek, sys->frame_size_estimate);
     if (data == sys->data_peeked) {
@@ -269,45 +376,279 @@ static bool Peek(demux_t *p_demux, bool first)
 
 /*****************************************************************************
  * SearchStartcode: Helper function to search for next NAL start code
+ * starting at "start", more data is peeked as necessary.
  * \return position of start code or -1 if none was found (or no more data
  * is available.
  *****************************************************************************/
 static int32_t SearchStartcode(demux_t *p_demux, int32_t start, int32_t *length)
 {
     demux_sys_t *sys = p_demux->p_sys;
-    if (start == 0) {
-        if (!Peek(p_demux, true)) {
-            return -1;
-        }
-    }
 
     int32_t pos = start;
-    int32_t remaining = sys->data_peeked - pos;
     for (;;) {
-        if (pos + 4 >= sys->data_peeked) {
-            if (!Peek(p_demux, false)) {
-                // probably EOF
-                pos = -1;
-                break;
-            }
+        const uint8_t *found = NULL;
+        if (pos < sys->data_peeked) {
+            found = startcode_FindAnnexB(sys->peek + pos,
+                                         sys->peek + sys->data_peeked);
         }
-
-        if (sys->peek[pos] == 0 && sys->peek[pos+1] == 0 && sys->peek[pos+2] == 1) {
-            if (length) {
+        if (found) {
+            pos = found - sys->peek;
+            // a leading zero byte belongs to a 4 bytes start code
+            if (pos > start && found[-1] == 0) {
+                pos--;
+                if (length) {
+                    *length = 4;
+                }
+            } else if (length) {
                 *length = 3;
             }
             break;
-        } else if (sys->peek[pos] == 0 && sys->peek[pos+1] == 0 && sys->peek[pos+2] == 0 && sys->peek[pos+3] == 1) {
-            if (length) {
-                *length = 4;
-            }
+        }
+
+        // resume the search after the data already scanned, the start code
+        // could begin in the last bytes already peeked
+        pos = __MAX(start, sys->data_peeked - 3);
+        if (!Peek(p_demux)) {
+            // probably EOF
+            pos = -1;
             break;
         }
-        pos++;
     }
     return pos;
 }
 
+/*****************************************************************************
+ * PictureTime / TimePicture: convert between picture numbers and timestamps
+ *****************************************************************************/
+static mtime_t PictureTime(demux_sys_t *sys, int64_t picture)
+{
+    return picture * CLOCK_FREQ * sys->fmt_video.video.i_frame_rate_base /
+        sys->fmt_video.video.i_frame_rate;
+}
+
+static int64_t TimePicture(demux_sys_t *sys, mtime_t time)
+{
+    return time * sys->fmt_video.video.i_frame_rate /
+        (CLOCK_FREQ * sys->fmt_video.video.i_frame_rate_base);
+}
+
+/*****************************************************************************
+ * IndexNAL: update the scan state with the NAL unit at "offset" (position of
+ * the 00 00 01 sequence) and add it to the index if it has not been seen yet.
+ *****************************************************************************/
+static void IndexNAL(demux_sys_t *sys, index_scan_t *scan, int64_t offset,
+                     int type, bool first_slice)
+{
+    if (scan->have_vcl && hevc_isAUStart(type, first_slice)) {
+        scan->au_start = offset;
+        scan->have_vcl = false;
+    }
+    bool irap = false;
+    if (hevc_isVCL(type)) {
+        if (first_slice) {
+            irap = hevc_isIRAP(type);
+            scan->picture++;
+        }
+        scan->have_vcl = true;
+    }
+
+    if (!scan->synced) {
+        return;
+    }
+
+    vlc_mutex_lock(&sys->index_lock);
+    if (offset >= sys->index_end) {
+        if (irap) {
+            if (sys->index_count == sys->index_size) {
+                int size = sys->index_size ? sys->index_size * 2 : 256;
+                irap_entry_t *index = realloc(sys->index, size * sizeof(*index));
+                if (index) {
+                    sys->index = index;
+                    sys->index_size = size;
+                }
+            }
+            if (sys->index_count < sys->index_size) {
+                irap_entry_t *entry = &sys->index[sys->index_count++];
+                entry->offset = scan->au_start;
+                entry->picture = scan->picture - 1;
+            }
+        }
+        sys->index_end = offset + 3;
+        sys->index_state = *scan;
+    }
+    vlc_mutex_unlock(&sys->index_lock);
+}
+
+/*****************************************************************************
+ * IndexEOF: the scan state reached the end of the stream
+ *****************************************************************************/
+static void IndexEOF(demux_sys_t *sys, const index_scan_t *scan)
+{
+    if (!scan->synced) {
+        return;
+    }
+
+    vlc_mutex_lock(&sys->index_lock);
+    if (!sys->index_complete) {
+        sys->index_complete = true;
+        sys->index_state = *scan;
+    }
+    vlc_mutex_unlock(&sys->index_lock);
+}
+
+/*****************************************************************************
+ * IndexFind: find the last IRAP access unit not after "picture", the index
+ * lock must be held.
+ * \return position in the index or -1 if there is no such entry
+ *****************************************************************************/
+static int IndexFind(demux_sys_t *sys, int64_t picture)
+{
+    int low = 0;
+    int high = sys->index_count - 1;
+    int found = -1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (sys->index[mid].picture <= picture) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+/*****************************************************************************
+ * ScanStream: index the NAL units of "s" starting at "offset" until
+ * more than "last_picture" pictures have been seen or the end of the stream.
+ *****************************************************************************/
+static void ScanStream(demux_t *p_demux, stream_t *s, index_scan_t *scan,
+                       int64_t offset, int64_t last_picture)
+{
+    demux_sys_t *sys = p_demux->p_sys;
+    uint8_t *buffer = malloc(SCAN_BUFFER_SIZE);
+    if (!buffer) {
+        return;
+    }
+
+    size_t kept = 0;
+    while (scan->picture <= last_picture) {
+        vlc_mutex_lock(&sys->index_lock);
+        bool abort = sys->prescan_abort;
+        vlc_mutex_unlock(&sys->index_lock);
+        if (abort) {
+            break;
+        }
+
+        int data = stream_Read(s, buffer + kept, SCAN_BUFFER_SIZE - kept);
+        if (data <= 0) {
+            IndexEOF(sys, scan);
+            break;
+        }
+
+        const uint8_t *pos = buffer;
+        const uint8_t *end = buffer + kept + data;
+        for (;;) {
+            const uint8_t *found = startcode_FindAnnexB(pos, end);
+            if (!found) {
+                // the last bytes could be the beginning of a start code
+                pos = end - __MIN(2, end - pos);
+                break;
+            }
+            if (end - found < 6) {
+                // NAL header not complete yet
+                pos = found;
+                break;
+            }
+
+            int type = (found[3] >> 1) & 0x3f;
+            bool first_slice = hevc_isVCL(type) && (found[5] & 0x80);
+            IndexNAL(sys, scan, offset + (found - buffer), type, first_slice);
+            pos = found + 3;
+        }
+
+        kept = end - pos;
+        memmove(buffer, pos, kept);
+        offset += pos - buffer;
+    }
+    free(buffer);
+}
+
+/*****************************************************************************
+ * PrescanThread: index the whole stream in the background
+ *****************************************************************************/
+static void *PrescanThread(void *data)
+{
+    demux_t *p_demux = data;
+    demux_sys_t *sys = p_demux->p_sys;
+
+    vlc_mutex_lock(&sys->index_lock);
+    index_scan_t scan = sys->index_state;
+    int64_t offset = sys->index_end;
+    vlc_mutex_unlock(&sys->index_lock);
+
+    mtime_t start = mdate();
+    if (stream_Seek(sys->prescan_stream, offset) == VLC_SUCCESS) {
+        ScanStream(p_demux, sys->prescan_stream, &scan, offset, INT64_MAX);
+    }
+
+    vlc_mutex_lock(&sys->index_lock);
+    msg_Dbg(p_demux, "pre-scan %s after %"PRId64" ms, %d random access points",
+            sys->index_complete ? "finished" : "stopped",
+            (mdate() - start) / 1000, sys->index_count);
+    vlc_mutex_unlock(&sys->index_lock);
+    return NULL;
+}
+
+/*****************************************************************************
+ * SeekIndex: continue demuxing at the IRAP access unit before "picture"
+ *****************************************************************************/
+static int SeekIndex(demux_t *p_demux, int64_t picture)
+{
+    demux_sys_t *sys = p_demux->p_sys;
+
+    vlc_mutex_lock(&sys->index_lock);
+    if (!sys->index_complete && picture >= sys->index_state.picture) {
+        // the index doesn't reach the target yet, scan up to it
+        bool can_fastseek = false;
+        stream_Control(p_demux->s, STREAM_CAN_FASTSEEK, &can_fastseek);
+        if (!can_fastseek) {
+            vlc_mutex_unlock(&sys->index_lock);
+            return VLC_EGENERIC;
+        }
+
+        index_scan_t scan = sys->index_state;
+        int64_t offset = sys->index_end;
+        vlc_mutex_unlock(&sys->index_lock);
+        if (stream_Seek(p_demux->s, offset) == VLC_SUCCESS) {
+            ScanStream(p_demux, p_demux->s, &scan, offset, picture);
+        }
+        // the stream position is different now
+        sys->scan.synced = false;
+        vlc_mutex_lock(&sys->index_lock);
+    }
+
+    int pos = IndexFind(sys, picture);
+    irap_entry_t entry;
+    if (pos >= 0) {
+        entry = sys->index[pos];
+    }
+    vlc_mutex_unlock(&sys->index_lock);
+    if (pos < 0 || stream_Seek(p_demux->s, entry.offset) != VLC_SUCCESS) {
+        return VLC_EGENERIC;
+    }
+
+    sys->data_peeked = 0;
+    sys->next_code_length = 0;
+    sys->last_complete = true;
+    sys->scan.au_start = entry.offset;
+    sys->scan.picture = entry.picture;
+    sys->scan.have_vcl = false;
+    sys->scan.synced = true;
+    date_Set(&sys->pcr, PictureTime(sys, entry.picture));
+    return VLC_SUCCESS;
+}
+
 /*****************************************************************************
  * Demux: reads and demuxes data packets
  *****************************************************************************
@@ -318,52 +659,129 @@ static int Demux(demux_t *p_demux)
     demux_sys_t *sys = p_demux->p_sys;
     mtime_t pcr = date_Get(&sys->pcr);
     block_t *p_block;
+    int32_t start;
     int32_t code_length;
+    int64_t offset = stream_Tell(p_demux->s);
 
-    int32_t start = SearchStartcode(p_demux, 0, &code_length);
-    if (start == -1) {
-        if (sys->data_peeked == 0) {
-            return 0;
-        }
-
-        msg_Err(p_demux, "no startcode found");
-        return -1;
+    sys->data_peeked = 0;
+    if (!Peek(p_demux)) {
+        IndexEOF(sys, &sys->scan);
+        return 0;
     }
 
-    // need at least 3 or 4 bytes startcode + 2 bytes header
-    if (sys->data_peeked < start + code_length + 2) {
-        msg_Err(p_demux, "data shortage");
-        return -1;
+    if (sys->next_code_length > 0) {
+        // the previous call already found the start code of this NAL
+        start = 0;
+        code_length = sys->next_code_length;
+    } else {
+        start = SearchStartcode(p_demux, 0, &code_length);
+        if (start == -1) {
+            msg_Err(p_demux, "no startcode found");
+            return -1;
+        }
     }
+    sys->next_code_length = 0;
 
-    // parse NALU header
-    bs_t bitreader;
-    bs_init(&bitreader, sys->peek + start + code_length, sys->data_peeked - start - code_length);
-    bs_skip(&bitreader, 1);  // reserved bit
-    int32_t type = bs_read(&bitreader, 6);
-    int32_t layer_id = bs_read(&bitreader, 6);
-    int32_t temporal_id_plus1 = bs_read(&bitreader, 3);
+    // in aggregation mode, collect NAL units until the next one starts a
+    // new access unit
+    bool new_picture = false;
+    bool have_vcl = false;
+    bool irap = false;
+    // the block ends with a complete NAL unit
+    bool complete = true;
+    int32_t nal = start;
+    int32_t end;
+    for (;;) {
+        // need at least 3 or 4 bytes startcode + 2 bytes header
+        while (sys->data_peeked < nal + code_length + 2) {
+            if (!Peek(p_demux)) {
+                if (nal > start) {
+                    // send what we have so far
+                    break;
+                }
+                msg_Err(p_demux, "data shortage");
+                return -1;
+            }
+        }
+        if (sys->data_peeked < nal + code_length + 2) {
+            end = nal;
+            sys->next_code_length = code_length;
+            break;
+        }
 
-    int32_t end = SearchStartcode(p_demux, start + code_length + 2, NULL);
-    if (end == -1) {
-        end = sys->data_peeked;
-    }
+        // parse NALU header
+        bs_t bitreader;
+        bs_init(&bitreader, sys->peek + nal + code_length, 2);
+        bs_skip(&bitreader, 1);  // reserved bit
+        int32_t type = bs_read(&bitreader, 6);
+        bs_skip(&bitreader, 6);  // layer_id
+        bs_skip(&bitreader, 3);  // temporal_id_plus1
+
+        bool first_slice = false;
+        if (hevc_isVCL(type)) {
+            // + 1 byte slice header, other NAL units (e.g. end of stream)
+            // may only have the header
+            while (sys->data_peeked < nal + code_length + 3 && Peek(p_demux)) {
+            }
+            if (sys->data_peeked >= nal + code_length + 3) {
+                first_slice = (sys->peek[nal + code_length + 2] & 0x80) != 0;
+            }
+        }
 
-    bool new_picture = false;
-    if (type < 32) {
-        int32_t flag = bs_read(&bitreader, 1);
-        new_picture = (flag == 1);
+        if (have_vcl && hevc_isAUStart(type, first_slice)) {
+            // belongs to the next access unit
+            end = nal;
+            sys->next_code_length = code_length;
+            break;
+        }
+        if (hevc_isVCL(type)) {
+            if (!have_vcl) {
+                irap = hevc_isIRAP(type);
+            }
+            have_vcl = true;
+            new_picture |= first_slice;
+        }
+        IndexNAL(sys, &sys->scan, offset + nal + code_length - 3, type,
+                 first_slice);
+
+        end = SearchStartcode(p_demux, nal + code_length + 2, &code_length);
+        if (end == -1) {
+            // the end of the stream, unless the NAL unit was too large
+            end = sys->data_peeked;
+            complete = sys->data_peeked < MAX_PEEK_SIZE;
+            break;
+        }
+        if (!sys->aggregate) {
+            sys->next_code_length = code_length;
+            break;
+        }
+        nal = end;
     }
 
     if (new_picture) {
         /* Call the pace control */
         es_out_Control(p_demux->out, ES_OUT_SET_PCR, VLC_TS_0 + pcr);
     }
-    if ((p_block = stream_Block(p_demux->s, end - start)) == NULL) {
+    // any data before the first start code is passed to the decoder
+    // together with the first NAL
+    if ((p_block = stream_Block(p_demux->s, end)) == NULL) {
         /* EOF */
         return 0;
     }
 
+    // let the peek size follow the size of recent NAL units, so a large
+    // intra picture doesn't cause all following NAL units to peek too much
+    sys->frame_size_estimate = __MAX(sys->frame_size_estimate / 2, end + end / 2);
+    sys->frame_size_estimate = VLC_CLIP(sys->frame_size_estimate, INITIAL_PEEK_SIZE, MAX_PEEK_SIZE);
+
+    // flag complete access units (see the decoder), they must not contain
+    // the rest of a NAL unit sent before
+    if (sys->aggregate && have_vcl && complete && start == 0 &&
+        sys->last_complete) {
+        p_block->i_flags |= irap ? BLOCK_FLAG_TYPE_I : BLOCK_FLAG_TYPE_P;
+    }
+    sys->last_complete = complete;
+
     p_block->i_pts = VLC_TS_INVALID;
     p_block->i_dts = VLC_TS_0 + pcr;
     es_out_Send(p_demux->out, sys->es_video, p_block);
@@ -379,6 +797,81 @@ static int Demux(demux_t *p_demux)
  *****************************************************************************/
 static int Control(demux_t *p_demux, int i_query, va_list args)
 {
+    demux_sys_t *sys = p_demux->p_sys;
+    int64_t *pi64;
+    va_list ap;
+
+    switch (i_query) {
+    case DEMUX_GET_LENGTH:
+    {
+        pi64 = va_arg(args, int64_t *);
+        int64_t pictures;
+        int64_t size = stream_Size(p_demux->s);
+        vlc_mutex_lock(&sys->index_lock);
+        if (sys->index_complete) {
+            pictures = sys->index_state.picture;
+        } else if (sys->index_end > 0 && size > sys->index_end) {
+            // extrapolate from the part that has been indexed so far
+            pictures = (double) sys->index_state.picture * size / sys->index_end;
+        } else {
+            pictures = 0;
+        }
+        vlc_mutex_unlock(&sys->index_lock);
+        if (!pictures) {
+            return VLC_EGENERIC;
+        }
+        *pi64 = PictureTime(sys, pictures);
+        return VLC_SUCCESS;
+    }
+
+    case DEMUX_GET_TIME:
+        pi64 = va_arg(args, int64_t *);
+        if (!sys->scan.synced) {
+            return VLC_EGENERIC;
+        }
+        *pi64 = date_Get(&sys->pcr);
+        return VLC_SUCCESS;
+
+    case DEMUX_SET_TIME:
+    {
+        int64_t time = va_arg(args, int64_t);
+        return SeekIndex(p_demux, TimePicture(sys, __MAX(time, 0)));
+    }
+
+    case DEMUX_SET_POSITION:
+    {
+        va_copy(ap, args);
+        double f = va_arg(ap, double);
+        va_end(ap);
+        // prefer the random access point before the position if it has
+        // been indexed already
+        int64_t target = f * stream_Size(p_demux->s);
+        int64_t picture = -1;
+        vlc_mutex_lock(&sys->index_lock);
+        if (target <= sys->index_end || sys->index_complete) {
+            for (int i=sys->index_count-1; i>=0; i--) {
+                if (sys->index[i].offset <= target) {
+                    picture = sys->index[i].picture;
+                    break;
+                }
+            }
+        }
+        vlc_mutex_unlock(&sys->index_lock);
+        if (picture >= 0 &&
+            SeekIndex(p_demux, picture) == VLC_SUCCESS) {
+            return VLC_SUCCESS;
+        }
+        // stream position will change
+        sys->next_code_length = 0;
+        sys->last_complete = true;
+        sys->scan.synced = false;
+        break;
+    }
+
+    default:
+        break;
+    }
+
     // TODO(fancycode): which queries should we handle directly?
     return demux_vaControlHelper(p_demux->s, 0, -1, -1, -1, i_query, args);
 }
@@ -0,0 +1,341 @@
+/*****************************************************************************
+ * cluster_scan.cpp : matroska demuxer
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "cluster_scan.hpp"
+
+#include "matroska_segment.hpp"
+
+/* EBML IDs used by the scanner */
+#define MKV_ID_EBML             0x1A45DFA3
+#define MKV_ID_SEGMENT          0x18538067
+#define MKV_ID_CLUSTER          0x1F43B675
+#define MKV_ID_CLUSTER_TIMECODE 0xE7
+#define MKV_ID_SIMPLEBLOCK      0xA3
+#define MKV_ID_BLOCKGROUP       0xA0
+#define MKV_ID_BLOCK            0xA1
+#define MKV_ID_REFERENCEBLOCK   0xFB
+
+/*****************************************************************************
+ * EBML element headers
+ *****************************************************************************/
+struct scan_element_t
+{
+    uint32_t i_id;
+    int      i_head;
+    uint64_t i_size;
+    bool     b_unknown_size;
+};
+
+/* Read a variable size integer, the length marker is kept for IDs */
+static int ReadVint( const uint8_t *p, int i_max, bool b_id, uint64_t *pi_value )
+{
+    int i_len = 1;
+    uint8_t i_mask = 0x80;
+
+    if( i_max < 1 )
+        return 0;
+    while( i_len <= 8 && !( p[0] & i_mask ) )
+    {
+        i_len++;
+        i_mask >>= 1;
+    }
+    if( i_len > 8 || i_len > i_max || ( b_id && i_len > 4 ) )
+        return 0;
+
+    uint64_t i_value = b_id ? p[0] : ( p[0] & ( i_mask - 1 ) );
+    for( int i = 1; i < i_len; i++ )
+        i_value = ( i_value << 8 ) | p[i];
+    *pi_value = i_value;
+    return i_len;
+}
+
+static bool ReadElement( stream_t *s, int64_t i_pos, scan_element_t *p_el )
+{
+    const uint8_t *p_peek;
+    uint64_t i_id, i_size;
+    int i_id_len, i_size_len, i_peek;
+
+    if( (int64_t)stream_Tell( s ) != i_pos && stream_Seek( s, i_pos ) )
+        return false;
+    i_peek = stream_Peek( s, &p_peek, 12 );
+
+    i_id_len = ReadVint( p_peek, i_peek, true, &i_id );
+    if( !i_id_len )
+        return false;
+    i_size_len = ReadVint( &p_peek[i_id_len], i_peek - i_id_len, false, &i_size );
+    if( !i_size_len )
+        return false;
+
+    p_el->i_id = i_id;
+    p_el->i_head = i_id_len + i_size_len;
+    p_el->i_size = i_size;
+    /* all value bits set means unknown */
+    p_el->b_unknown_size = i_size == ( UINT64_C(1) << ( 7 * i_size_len ) ) - 1;
+    return true;
+}
+
+/* Level 1 elements end a cluster of unknown size */
+static bool IsTopLevel( uint32_t i_id )
+{
+    switch( i_id )
+    {
+    case MKV_ID_EBML:
+    case MKV_ID_SEGMENT:
+    case MKV_ID_CLUSTER:
+    case 0x114D9B74: /* SeekHead */
+    case 0x1549A966: /* Info */
+    case 0x1654AE6B: /* Tracks */
+    case 0x1C53BB6B: /* Cues */
+    case 0x1941A469: /* Attachments */
+    case 0x1043A770: /* Chapters */
+    case 0x1254C367: /* Tags */
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Read the track number and relative timecode at the start of a block */
+static bool ReadBlockHeader( stream_t *s, int64_t i_pos, unsigned int *pi_track,
+                             int16_t *pi_timecode, uint8_t *pi_flags )
+{
+    const uint8_t *p_peek;
+    uint64_t i_track;
+    int i_len, i_peek;
+
+    if( stream_Seek( s, i_pos ) )
+        return false;
+    i_peek = stream_Peek( s, &p_peek, 8 + 3 );
+
+    i_len = ReadVint( p_peek, i_peek, false, &i_track );
+    if( !i_len || i_peek < i_len + 3 )
+        return false;
+    *pi_track = i_track;
+    *pi_timecode = (int16_t)GetWBE( &p_peek[i_len] );
+    *pi_flags = p_peek[i_len + 2];
+    return true;
+}
+
+/*****************************************************************************
+ * cluster_scanner_c
+ *****************************************************************************/
+cluster_scanner_c *cluster_scanner_c::New( demux_t *p_demux, int64_t i_start,
+                                           int64_t i_end, uint64_t i_timescale,
+                                           const std::vector<unsigned int> & video_tracks )
+{
+    bool b_fastseek = false;
+    stream_t *s = NULL;
+    char *psz_url;
+
+    /* a second stream is used, only do this for files that can be
+     * accessed cheaply */
+    stream_Control( p_demux->s, STREAM_CAN_FASTSEEK, &b_fastseek );
+    if( !b_fastseek || !p_demux->psz_access || !p_demux->psz_location )
+        return NULL;
+
+    if( asprintf( &psz_url, "%s://%s", p_demux->psz_access,
+                  p_demux->psz_location ) >= 0 )
+    {
+        s = stream_UrlNew( p_demux, psz_url );
+        free( psz_url );
+    }
+    if( !s )
+        return NULL;
+
+    cluster_scanner_c *p_scanner = new cluster_scanner_c( p_demux, s, i_start, i_end,
+                                                          i_timescale, video_tracks );
+    if( vlc_clone( &p_scanner->thread, Thread, p_scanner, VLC_THREAD_PRIORITY_LOW ) )
+    {
+        p_scanner->b_abort = true;
+        delete p_scanner;
+        return NULL;
+    }
+    return p_scanner;
+}
+
+cluster_scanner_c::cluster_scanner_c( demux_t *p_demux_, stream_t *s_, int64_t i_start_,
+                                      int64_t i_end_, uint64_t i_timescale_,
+                                      const std::vector<unsigned int> & video_tracks_ )
+    :p_demux(p_demux_)
+    ,s(s_)
+    ,i_start(i_start_)
+    ,i_end(i_end_)
+    ,i_timescale(i_timescale_)
+    ,video_tracks(video_tracks_)
+    ,b_abort(false)
+{
+    vlc_mutex_init( &lock );
+}
+
+cluster_scanner_c::~cluster_scanner_c()
+{
+    if( !b_abort )
+    {
+        vlc_mutex_lock( &lock );
+        b_abort = true;
+        vlc_mutex_unlock( &lock );
+        vlc_join( thread, NULL );
+    }
+    vlc_mutex_destroy( &lock );
+    stream_Delete( s );
+}
+
+void cluster_scanner_c::Collect( mkv_index_c & index )
+{
+    std::vector<mkv_index_t> entries;
+
+    vlc_mutex_lock( &lock );
+    entries.swap( pending );
+    vlc_mutex_unlock( &lock );
+
+    for( size_t i = 0; i < entries.size(); i++ )
+        index.Insert( entries[i] );
+}
+
+void *cluster_scanner_c::Thread( void *data )
+{
+    cluster_scanner_c *p_scanner = static_cast<cluster_scanner_c *>( data );
+
+    p_scanner->Scan();
+    return NULL;
+}
+
+void cluster_scanner_c::Add( std::vector<mkv_index_t> & entries, int i_track,
+                             int64_t i_position, int64_t i_timecode )
+{
+    mkv_index_t idx;
+
+    idx.i_track        = i_track;
+    idx.i_block_number = -1;
+    idx.i_position     = i_position;
+    idx.i_time         = i_timecode * (int64_t)i_timescale / 1000;
+    idx.b_key          = true;
+    entries.push_back( idx );
+}
+
+void cluster_scanner_c::Scan()
+{
+    int64_t i_pos = i_start;
+    int64_t i_next;
+    scan_element_t el;
+    size_t i_clusters = 0;
+
+    msg_Dbg( p_demux, "scanning clusters from %"PRId64, i_start );
+    while( i_pos < i_end && ReadElement( s, i_pos, &el ) )
+    {
+        vlc_mutex_lock( &lock );
+        bool b_stop = b_abort;
+        vlc_mutex_unlock( &lock );
+        if( b_stop )
+            return;
+
+        if( el.i_id == MKV_ID_CLUSTER )
+        {
+            i_next = ScanCluster( i_pos, el.b_unknown_size ? i_end :
+                                  i_pos + el.i_head + (int64_t)el.i_size );
+            i_clusters++;
+        }
+        else if( el.i_id == MKV_ID_EBML || el.i_id == MKV_ID_SEGMENT ||
+                 el.b_unknown_size )
+            break; /* end of this segment */
+        else
+            i_next = i_pos + el.i_head + (int64_t)el.i_size;
+
+        if( i_next <= i_pos )
+            break;
+        i_pos = i_next;
+    }
+    msg_Dbg( p_demux, "scanned %zu clusters", i_clusters );
+}
+
+/* Index one cluster, returns the position of the element following it */
+int64_t cluster_scanner_c::ScanCluster( int64_t i_pos, int64_t i_cluster_end )
+{
+    std::vector<mkv_index_t> entries;
+    scan_element_t cluster, el, sub;
+    int64_t i_timecode = -1;
+
+    if( !ReadElement( s, i_pos, &cluster ) )
+        return -1;
+
+    int64_t i_child = i_pos + cluster.i_head;
+    while( i_child < i_cluster_end && ReadElement( s, i_child, &el ) )
+    {
+        if( cluster.b_unknown_size && IsTopLevel( el.i_id ) )
+            break;
+        if( el.b_unknown_size )
+            return -1;
+
+        int64_t i_data = i_child + el.i_head;
+        if( el.i_id == MKV_ID_CLUSTER_TIMECODE && el.i_size <= 8 )
+        {
+            uint8_t p_buf[8];
+            if( stream_Seek( s, i_data ) ||
+                stream_Read( s, p_buf, el.i_size ) != (int)el.i_size )
+                return -1;
+            i_timecode = 0;
+            for( uint64_t i = 0; i < el.i_size; i++ )
+                i_timecode = ( i_timecode << 8 ) | p_buf[i];
+            Add( entries, -1, i_pos, i_timecode );
+        }
+        else if( i_timecode >= 0 &&
+                 ( el.i_id == MKV_ID_SIMPLEBLOCK || el.i_id == MKV_ID_BLOCKGROUP ) )
+        {
+            unsigned int i_track = 0;
+            int16_t i_block_timecode = 0;
+            uint8_t i_flags = 0;
+            bool b_block = false, b_key;
+
+            if( el.i_id == MKV_ID_SIMPLEBLOCK )
+            {
+                b_block = ReadBlockHeader( s, i_data, &i_track, &i_block_timecode, &i_flags );
+                b_key = i_flags & 0x80;
+            }
+            else
+            {
+                /* a block group is a key frame unless it references another one */
+                b_key = true;
+                for( int64_t i_sub = i_data; i_sub < i_data + (int64_t)el.i_size;
+                     i_sub += sub.i_head + sub.i_size )
+                {
+                    if( !ReadElement( s, i_sub, &sub ) || sub.b_unknown_size )
+                        break;
+                    if( sub.i_id == MKV_ID_BLOCK )
+                        b_block = ReadBlockHeader( s, i_sub + sub.i_head, &i_track,
+                                                   &i_block_timecode, &i_flags );
+                    else if( sub.i_id == MKV_ID_REFERENCEBLOCK )
+                        b_key = false;
+                }
+            }
+
+            if( b_block && b_key &&
+                std::find( video_tracks.begin(), video_tracks.end(), i_track ) != video_tracks.end() )
+                Add( entries, i_track, i_pos, i_timecode + i_block_timecode );
+        }
+        i_child = i_data + (int64_t)el.i_size;
+    }
+
+    vlc_mutex_lock( &lock );
+    pending.insert( pending.end(), entries.begin(), entries.end() );
+    vlc_mutex_unlock( &lock );
+    return i_child;
+}
@@ -0,0 +1,74 @@
+/*****************************************************************************
+ * cluster_scan.hpp : matroska demuxer
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _CLUSTER_SCAN_HPP_
+#define _CLUSTER_SCAN_HPP_
+
+#include "mkv.hpp"
+
+class mkv_index_c;
+
+/*****************************************************************************
+ * cluster_scanner_c: index the clusters of a segment without cues
+ *****************************************************************************
+ * A low priority thread walks the clusters with its own stream, so the
+ * demuxer stream is never touched. Only the element headers and the
+ * first bytes of the blocks are read: every cluster is indexed, and so
+ * are the key frames of the video tracks. The entries are picked up by
+ * the demuxer thread with Collect().
+ *****************************************************************************/
+class cluster_scanner_c
+{
+public:
+    static cluster_scanner_c *New( demux_t *p_demux, int64_t i_start,
+                                   int64_t i_end, uint64_t i_timescale,
+                                   const std::vector<unsigned int> & video_tracks );
+    ~cluster_scanner_c();
+
+    /* move the entries found so far to the index */
+    void Collect( mkv_index_c & index );
+
+private:
+    cluster_scanner_c( demux_t *p_demux, stream_t *s, int64_t i_start,
+                       int64_t i_end, uint64_t i_timescale,
+                       const std::vector<unsigned int> & video_tracks );
+
+    static void *Thread( void * );
+    void    Scan();
+    int64_t ScanCluster( int64_t i_pos, int64_t i_end );
+    void    Add( std::vector<mkv_index_t> & entries, int i_track,
+                 int64_t i_position, int64_t i_timecode );
+
+    demux_t                   *p_demux;
+    stream_t                  *s;
+    int64_t                   i_start;
+    int64_t                   i_end;
+    uint64_t                  i_timescale;
+    std::vector<unsigned int> video_tracks;
+
+    vlc_thread_t              thread;
+    vlc_mutex_t               lock;
+    bool                      b_abort;
+    std::vector<mkv_index_t>  pending;
+};
+
+#endif
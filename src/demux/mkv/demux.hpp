@@ -340,6 +340,7 @@ public:
         ,p_current_segment(NULL)
         ,dvd_interpretor( *this )
         ,f_duration(-1.0)
+        ,i_demux_budget(0)
         ,p_input(NULL)
         ,p_ev(NULL)
     {
@@ -372,6 +373,9 @@ public:
     /* duration of the stream */
     float                   f_duration;
 
+    /* stream time demuxed by a Demux() call */
+    mtime_t                 i_demux_budget;
+
     matroska_segment_c *FindSegment( const EbmlBinary & uid ) const;
     virtual_chapter_c *BrowseCodecPrivate( unsigned int codec_id,
                                         bool (*match)(const chapter_codec_cmds_c &data, const void *p_cookie, size_t i_cookie_size ),
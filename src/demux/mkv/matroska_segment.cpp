@@ -27,6 +27,8 @@
 #include "demux.hpp"
 #include "util.hpp"
 #include "Ebml_parser.hpp"
+#include "stream_io_callback.hpp"
+#include "cluster_scan.hpp"
 
 matroska_segment_c::matroska_segment_c( demux_sys_t & demuxer, EbmlStream & estream )
     :segment(NULL)
@@ -50,8 +52,7 @@ matroska_segment_c::matroska_segment_c( demux_sys_t & demuxer, EbmlStream & estr
     ,p_prev_segment_uid(NULL)
     ,p_next_segment_uid(NULL)
     ,b_cues(false)
-    ,i_index(0)
-    ,i_index_max(1024)
+    ,p_scanner(NULL)
     ,psz_muxing_application(NULL)
     ,psz_writing_application(NULL)
     ,psz_segment_filename(NULL)
@@ -63,7 +64,6 @@ matroska_segment_c::matroska_segment_c( demux_sys_t & demuxer, EbmlStream & estr
     ,b_preloaded(false)
     ,b_ref_external_segments(false)
 {
-    p_indexes = (mkv_index_t*)malloc( sizeof( mkv_index_t ) * i_index_max );
 }
 
 matroska_segment_c::~matroska_segment_c()
@@ -83,8 +83,8 @@ matroska_segment_c::~matroska_segment_c()
     free( psz_segment_filename );
     free( psz_title );
     free( psz_date_utc );
-    free( p_indexes );
 
+    delete p_scanner;
     delete ep;
     delete segment;
     delete p_segment_uid;
@@ -121,9 +121,9 @@ void matroska_segment_c::LoadCues( KaxCues *cues )
     {
         if( MKV_IS_ID( el, KaxCuePoint ) )
         {
-            b_invalid_cue = false;
-#define idx p_indexes[i_index]
+            mkv_index_t idx;
 
+            b_invalid_cue = false;
             idx.i_track       = -1;
             idx.i_block_number= -1;
             idx.i_position    = -1;
@@ -217,16 +217,7 @@ void matroska_segment_c::LoadCues( KaxCues *cues )
                      idx.i_track, idx.i_block_number );
 #endif
             if( likely( !b_invalid_cue ) )
-            {
-                i_index++;
-                if( i_index >= i_index_max )
-                {
-                    i_index_max += 1024;
-                    p_indexes = (mkv_index_t*)xrealloc( p_indexes,
-                                                        sizeof( mkv_index_t ) * i_index_max );
-                }
-            }
-#undef idx
+                index.Insert( idx );
         }
         else
         {
@@ -577,23 +568,114 @@ void matroska_segment_c::InformationCreate( )
  * Misc
  *****************************************************************************/
 
+static bool IndexTimeLess( const mkv_index_t & a, const mkv_index_t & b )
+{
+    if( a.i_time != b.i_time )
+        return a.i_time < b.i_time;
+    return a.i_position < b.i_position;
+}
+
+static bool IndexPositionLess( const mkv_index_t & a, int64_t i_pos )
+{
+    return a.i_position < i_pos;
+}
+
+void mkv_index_c::Insert( const mkv_index_t & idx )
+{
+    entries_t & entries = tracks[ idx.i_track ];
+
+    /* entries mostly arrive in order, so this is usually an append */
+    entries_t::iterator it = entries.end();
+    if( !entries.empty() && IndexTimeLess( idx, entries.back() ) )
+        it = std::upper_bound( entries.begin(), entries.end(), idx, IndexTimeLess );
+
+    if( it != entries.begin() &&
+        (it - 1)->i_position == idx.i_position && (it - 1)->i_time == idx.i_time )
+    {
+        /* already known, keep the more precise block number */
+        if( idx.i_block_number >= 0 )
+            *(it - 1) = idx;
+        return;
+    }
+
+    entries.insert( it, idx );
+    i_count++;
+    if( idx.i_position > i_last_position )
+        i_last_position = idx.i_position;
+}
+
+const mkv_index_t *mkv_index_c::Find( mtime_t i_time, bool b_strict ) const
+{
+    const mkv_index_t *p_best = NULL;
+    mkv_index_t key;
+
+    key.i_time     = i_time;
+    key.i_position = b_strict ? INT64_MIN : INT64_MAX;
+
+    for( tracks_t::const_iterator t = tracks.begin(); t != tracks.end(); ++t )
+    {
+        const entries_t & entries = t->second;
+        entries_t::const_iterator it =
+            std::lower_bound( entries.begin(), entries.end(), key, IndexTimeLess );
+        if( it == entries.begin() )
+            continue;
+        --it;
+        if( !p_best || IndexTimeLess( *p_best, *it ) )
+            p_best = &*it;
+    }
+    return p_best;
+}
+
+const mkv_index_t *mkv_index_c::FindTime( mtime_t i_time ) const
+{
+    const mkv_index_t *p_idx = Find( i_time, false );
+    if( p_idx )
+        return p_idx;
+
+    /* everything is later, use the earliest entry */
+    for( tracks_t::const_iterator t = tracks.begin(); t != tracks.end(); ++t )
+    {
+        const entries_t & entries = t->second;
+        if( !entries.empty() && ( !p_idx || IndexTimeLess( entries.front(), *p_idx ) ) )
+            p_idx = &entries.front();
+    }
+    return p_idx;
+}
+
+const mkv_index_t *mkv_index_c::FindBefore( mtime_t i_time ) const
+{
+    return Find( i_time, true );
+}
+
+const mkv_index_t *mkv_index_c::FindPosition( int64_t i_pos ) const
+{
+    const mkv_index_t *p_best = NULL;
+
+    /* within a track positions grow with time */
+    for( tracks_t::const_iterator t = tracks.begin(); t != tracks.end(); ++t )
+    {
+        const entries_t & entries = t->second;
+        entries_t::const_iterator it =
+            std::lower_bound( entries.begin(), entries.end(), i_pos, IndexPositionLess );
+        while( it != entries.end() && it->i_time <= 0 )
+            ++it;
+        if( it != entries.end() && ( !p_best || it->i_position < p_best->i_position ) )
+            p_best = &*it;
+    }
+    return p_best;
+}
+
 void matroska_segment_c::IndexAppendCluster( KaxCluster *cluster )
 {
-#define idx p_indexes[i_index]
+    mkv_index_t idx;
+
     idx.i_track       = -1;
     idx.i_block_number= -1;
     idx.i_position    = cluster->GetElementPosition();
     idx.i_time        = cluster->GlobalTimecode()/ (mtime_t) 1000;
     idx.b_key         = true;
 
-    i_index++;
-    if( i_index >= i_index_max )
-    {
-        i_index_max += 1024;
-        p_indexes = (mkv_index_t*)xrealloc( p_indexes,
-                                        sizeof( mkv_index_t ) * i_index_max );
-    }
-#undef idx
+    index.Insert( idx );
 }
 
 bool matroska_segment_c::PreloadFamily( const matroska_segment_c & of_segment )
@@ -737,6 +819,30 @@ bool matroska_segment_c::Preload( )
     return true;
 }
 
+/* Index the clusters of a segment without cues in the background */
+void matroska_segment_c::ScanClusters( )
+{
+    std::vector<unsigned int> video_tracks;
+
+    if( b_cues || p_scanner || !b_preloaded )
+        return;
+
+    for( size_t i = 0; i < tracks.size(); i++ )
+        if( tracks[i]->fmt.i_cat == VIDEO_ES )
+            video_tracks.push_back( tracks[i]->i_number );
+
+    p_scanner = cluster_scanner_c::New( &sys.demuxer, i_start_pos,
+                                        segment->IsFiniteSize() ? segment->GetEndPosition() : INT64_MAX,
+                                        i_timescale, video_tracks );
+}
+
+/* Merge the entries found by the cluster scanner */
+void matroska_segment_c::IndexUpdate( )
+{
+    if( p_scanner )
+        p_scanner->Collect( index );
+}
+
 /* Here we try to load elements that were found in Seek Heads, but not yet parsed */
 bool matroska_segment_c::LoadSeekHeadItem( const EbmlCallbacks & ClassInfos, int64_t i_element_position )
 {
@@ -853,17 +959,21 @@ void matroska_segment_c::Seek( mtime_t i_date, mtime_t i_time_offset, int64_t i_
     for( size_t i = 0; i < tracks.size(); i++)
         tracks[i]->i_last_dts = VLC_TS_INVALID;
 
+    /* a seek to a position was decided on the index collected by the
+     * caller, later entries of the scanner may lie beyond that position */
+    if( i_global_position < 0 )
+        IndexUpdate();
+
     if( i_global_position >= 0 )
     {
         /* Special case for seeking in files with no cues */
         EbmlElement *el = NULL;
 
         /* Start from the last known index instead of the beginning eachtime */
-        if( i_index == 0)
+        if( index.empty() || index.LastPosition() > i_global_position )
             es.I_O().setFilePointer( i_start_pos, seek_beginning );
         else
-            es.I_O().setFilePointer( p_indexes[ i_index - 1 ].i_position,
-                                     seek_beginning );
+            es.I_O().setFilePointer( index.LastPosition(), seek_beginning );
         delete ep;
         ep = new EbmlParser( &es, segment, &sys.demuxer );
         cluster = NULL;
@@ -874,9 +984,7 @@ void matroska_segment_c::Seek( mtime_t i_date, mtime_t i_time_offset, int64_t i_
             {
                 cluster = (KaxCluster *)el;
                 i_cluster_pos = cluster->GetElementPosition();
-                if( i_index == 0 ||
-                    ( i_index > 0 &&
-                      p_indexes[i_index - 1].i_position < (int64_t)cluster->GetElementPosition() ) )
+                if( index.LastPosition() < (int64_t)cluster->GetElementPosition() )
                 {
                     ParseCluster(false);
                     IndexAppendCluster( cluster );
@@ -904,19 +1012,13 @@ void matroska_segment_c::Seek( mtime_t i_date, mtime_t i_time_offset, int64_t i_
         return;
     }
 
-    int i_idx = 0;
-    if ( i_index > 0 )
+    /* BlockGet() below may grow the index, keep entries by value */
+    const mkv_index_t *p_idx = index.FindTime( i_date - i_time_offset );
+    bool b_idx = p_idx != NULL;
+    if( b_idx )
     {
-
-        for( ; i_idx < i_index; i_idx++ )
-            if( p_indexes[i_idx].i_time + i_time_offset > i_date )
-                break;
-
-        if( i_idx > 0 )
-            i_idx--;
-
-        i_seek_position = p_indexes[i_idx].i_position;
-        i_seek_time = p_indexes[i_idx].i_time;
+        i_seek_position = p_idx->i_position;
+        i_seek_time = p_idx->i_time;
     }
 
     msg_Dbg( &sys.demuxer, "seek got %"PRId64" (%d%%)",
@@ -1019,14 +1121,17 @@ void matroska_segment_c::Seek( mtime_t i_date, mtime_t i_time_offset, int64_t i_
 
             delete block;
         } while( i_pts < i_date );
-        if( b_has_key || !i_idx )
+        if( b_has_key || !b_idx )
+            break;
+        p_idx = index.FindBefore( i_seek_time );
+        if( !p_idx )
             break;
 
         /* No key picture was found in the cluster seek to previous seekpoint */
-        i_date = i_time_offset + p_indexes[i_idx].i_time;
-        i_idx--;
+        i_date = i_time_offset + i_seek_time;
+        i_seek_time = p_idx->i_time;
         i_pts = 0;
-        es.I_O().setFilePointer( p_indexes[i_idx].i_position );
+        es.I_O().setFilePointer( p_idx->i_position );
         delete ep;
         ep = new EbmlParser( &es, segment, &sys.demuxer );
         cluster = NULL;
@@ -1253,17 +1358,6 @@ int matroska_segment_c::BlockGet( KaxBlock * & pp_block, KaxSimpleBlock * & pp_s
                 }
             }
 
-            /* update the index */
-#define idx p_indexes[i_index - 1]
-            if( i_index > 0 && idx.i_time == -1 )
-            {
-                if ( pp_simpleblock != NULL )
-                    idx.i_time        = pp_simpleblock->GlobalTimecode() / (mtime_t)1000;
-                else
-                    idx.i_time        = (*pp_block).GlobalTimecode() / (mtime_t)1000;
-                idx.b_key         = *pb_key_picture;
-            }
-#undef idx
             return VLC_SUCCESS;
         }
 
@@ -1312,6 +1406,13 @@ int matroska_segment_c::BlockGet( KaxBlock * & pp_block, KaxSimpleBlock * & pp_s
                         }
 
                         ep->Down();
+
+                        /* serve the element headers and frames of the
+                         * cluster from memory */
+                        if( cluster->IsFiniteSize() )
+                            static_cast<vlc_stream_io_callback &>( es.I_O() ).readAhead(
+                                cluster->GetElementPosition() + cluster->HeadSize() +
+                                cluster->GetSize() );
                     }
                     else if( MKV_IS_ID( el, KaxCues ) )
                     {
@@ -1337,11 +1438,8 @@ int matroska_segment_c::BlockGet( KaxBlock * & pp_block, KaxSimpleBlock * & pp_s
                         ctc.ReadData( es.I_O(), SCOPE_ALL_DATA );
                         cluster->InitTimecode( uint64( ctc ), i_timescale );
 
-                        /* add it to the index */
-                        if( i_index == 0 ||
-                            ( i_index > 0 &&
-                              p_indexes[i_index - 1].i_position < (int64_t)cluster->GetElementPosition() ) )
-                            IndexAppendCluster( cluster );
+                        /* add it to the index, known clusters are merged */
+                        IndexAppendCluster( cluster );
                     }
                     else if( MKV_IS_ID( el, KaxClusterSilentTracks ) )
                     {
@@ -32,6 +32,7 @@ class EbmlParser;
 class chapter_edition_c;
 class chapter_translation_c;
 class chapter_item_c;
+class cluster_scanner_c;
 
 struct mkv_track_t;
 struct mkv_index_t;
@@ -69,6 +70,40 @@ public:
     std::vector<SimpleTag*> simple_tags;
 };
 
+/* Cues and clusters of a segment, kept per track (clusters found while
+ * demuxing are stored under track -1) and sorted by time, so that they can
+ * be looked up by time or by position with a binary search. Entries are
+ * merged in as they are discovered, known ones are not duplicated. */
+class mkv_index_c
+{
+public:
+    mkv_index_c():i_count(0),i_last_position(-1){}
+
+    void Insert( const mkv_index_t & idx );
+
+    /* last entry at or before i_time, the first one if all are later */
+    const mkv_index_t *FindTime( mtime_t i_time ) const;
+    /* last entry strictly before i_time */
+    const mkv_index_t *FindBefore( mtime_t i_time ) const;
+    /* first entry with a known time at or after i_pos */
+    const mkv_index_t *FindPosition( int64_t i_pos ) const;
+
+    size_t  size() const { return i_count; }
+    bool    empty() const { return i_count == 0; }
+    /* highest indexed position, -1 when empty */
+    int64_t LastPosition() const { return i_last_position; }
+
+private:
+    typedef std::vector<mkv_index_t> entries_t;
+    typedef std::map<int, entries_t> tracks_t;
+
+    const mkv_index_t *Find( mtime_t i_time, bool b_strict ) const;
+
+    tracks_t tracks;
+    size_t   i_count;
+    int64_t  i_last_position;
+};
+
 class matroska_segment_c
 {
 public:
@@ -107,9 +142,8 @@ public:
     KaxNextUID              *p_next_segment_uid;
 
     bool                    b_cues;
-    int                     i_index;
-    int                     i_index_max;
-    mkv_index_t             *p_indexes;
+    mkv_index_c             index;
+    cluster_scanner_c       *p_scanner;
 
     /* info */
     char                    *psz_muxing_application;
@@ -134,6 +168,8 @@ public:
     bool                           b_ref_external_segments;
 
     bool Preload();
+    void ScanClusters();
+    void IndexUpdate();
     bool PreloadFamily( const matroska_segment_c & segment );
     void InformationCreate();
     void Seek( mtime_t i_date, mtime_t i_time_offset, int64_t i_global_position );
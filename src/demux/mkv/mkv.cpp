@@ -32,6 +32,7 @@
 #include "Ebml_parser.hpp"
 
 #include "stream_io_callback.hpp"
+#include "segment_cache.hpp"
 
 #include <vlc_fs.h>
 #include <vlc_url.h>
@@ -70,11 +71,23 @@ vlc_module_begin ()
             N_("Dummy Elements"),
             N_("Read and discard unknown EBML elements (not good for broken files)."), true );
 
+    add_integer( "mkv-demux-budget", 40,
+            N_("Demux budget"),
+            N_("Stream time in milliseconds demuxed at once, a smaller value gives up the input lock more often."), true );
+
+    add_bool( "mkv-prescan", false,
+            N_("Scan files without cues"),
+            N_("Index the clusters of local files without cues in the background, so that seeking does not need to parse the file."), true );
+
     add_shortcut( "mka", "mkv" )
 vlc_module_end ()
 
 class demux_sys_t;
 
+/* limits of a single Demux() call, whatever the budget */
+#define MKV_DEMUX_MAX_BLOCKS 1024
+#define MKV_DEMUX_MAX_BYTES  (4 * 1024 * 1024)
+
 static int  Demux  ( demux_t * );
 static int  Control( demux_t *, int, va_list );
 static void Seek   ( demux_t *, mtime_t i_date, double f_percent, virtual_chapter_c *p_chapter );
@@ -105,6 +118,7 @@ static int Open( vlc_object_t * p_this )
     p_demux->pf_demux   = Demux;
     p_demux->pf_control = Control;
     p_demux->p_sys      = p_sys = new demux_sys_t( *p_demux );
+    p_sys->i_demux_budget = INT64_C(1000) * var_InheritInteger( p_demux, "mkv-demux-budget" );
 
     p_io_callback = new vlc_stream_io_callback( p_demux->s, false );
     p_io_stream = new EbmlStream( *p_io_callback );
@@ -132,6 +146,8 @@ static int Open( vlc_object_t * p_this )
     {
         p_stream->segments[i]->Preload();
         b_need_preload |= p_stream->segments[i]->b_ref_external_segments;
+        if( var_InheritBool( p_demux, "mkv-prescan" ) )
+            p_stream->segments[i]->ScanClusters();
     }
 
     p_segment = p_stream->segments[0];
@@ -166,6 +182,7 @@ static int Open( vlc_object_t * p_this )
 
             if (p_src_dir != NULL)
             {
+                std::vector<linked_file_t> files;
                 char *psz_file;
                 while ((psz_file = vlc_readdir(p_src_dir)) != NULL)
                 {
@@ -186,52 +203,53 @@ static int Open( vlc_object_t * p_this )
                         if (!s_filename.compare(s_filename.length() - 3, 3, "mkv") ||
                             !s_filename.compare(s_filename.length() - 3, 3, "mka"))
                         {
-                            // test whether this file belongs to our family
-                            const uint8_t *p_peek;
-                            bool          file_ok = false;
-#warning Memory leak!
-                            std::string   s_url = make_URI( s_filename.c_str(), "file" );
-                            stream_t      *p_file_stream = stream_UrlNew(
-                                                            p_demux,
-                                                            s_url.c_str() );
-                            /* peek the begining */
-                            if( p_file_stream &&
-                                stream_Peek( p_file_stream, &p_peek, 4 ) >= 4
-                                && p_peek[0] == 0x1a && p_peek[1] == 0x45 &&
-                                p_peek[2] == 0xdf && p_peek[3] == 0xa3 ) file_ok = true;
-
-                            if ( file_ok )
-                            {
-                                vlc_stream_io_callback *p_file_io = new vlc_stream_io_callback( p_file_stream, true );
-                                EbmlStream *p_estream = new EbmlStream(*p_file_io);
-
-                                p_stream = p_sys->AnalyseAllSegmentsFound( p_demux, p_estream );
-
-                                if ( p_stream == NULL )
-                                {
-                                    msg_Dbg( p_demux, "the file '%s' will not be used", s_filename.c_str() );
-                                    delete p_estream;
-                                    delete p_file_io;
-                                }
-                                else
-                                {
-                                    p_stream->p_io_callback = p_file_io;
-                                    p_stream->p_estream = p_estream;
-                                    p_sys->streams.push_back( p_stream );
-                                }
-                            }
-                            else
-                            {
-                                if( p_file_stream ) {
-                                    stream_Delete( p_file_stream );
-                                }
-                                msg_Dbg( p_demux, "the file '%s' cannot be opened", s_filename.c_str() );
-                            }
+                            linked_file_t file;
+                            file.s_filename = s_filename;
+                            file.p_stream = NULL;
+                            files.push_back( file );
                         }
                     }
                     free (psz_file);
                 }
                 closedir( p_src_dir );
+
+                // skip the files known to belong to other families, open
+                // the others at once and test them in the directory order
+                SegmentCacheFilter( p_demux, files, *p_sys->streams[0] );
+                OpenLinkedFiles( p_demux, files );
+
+                for( size_t i = 0; i < files.size(); i++ )
+                {
+                    // test whether this file belongs to our family
+                    stream_t *p_file_stream = files[i].p_stream;
+                    s_filename = files[i].s_filename;
+
+                    if ( p_file_stream )
+                    {
+                        vlc_stream_io_callback *p_file_io = new vlc_stream_io_callback( p_file_stream, true );
+                        EbmlStream *p_estream = new EbmlStream(*p_file_io);
+
+                        p_stream = p_sys->AnalyseAllSegmentsFound( p_demux, p_estream );
+
+                        if ( p_stream == NULL )
+                        {
+                            msg_Dbg( p_demux, "the file '%s' will not be used", s_filename.c_str() );
+                            delete p_estream;
+                            delete p_file_io;
+                        }
+                        else
+                        {
+                            SegmentCacheStore( s_filename, *p_stream );
+                            p_stream->p_io_callback = p_file_io;
+                            p_stream->p_estream = p_estream;
+                            p_sys->streams.push_back( p_stream );
+                        }
+                    }
+                    else
+                    {
+                        msg_Dbg( p_demux, "the file '%s' cannot be opened", s_filename.c_str() );
+                    }
+                }
             }
         }
 
@@ -429,8 +447,6 @@ static void Seek( demux_t *p_demux, mtime_t i_date, double f_percent, virtual_ch
     mtime_t            i_time_offset = 0;
     int64_t            i_global_position = -1;
 
-    int         i_index;
-
     msg_Dbg( p_demux, "seek request to %"PRId64" (%f%%)", i_date, f_percent );
     if( i_date < 0 && f_percent < 0 )
     {
@@ -457,16 +473,8 @@ static void Seek( demux_t *p_demux, mtime_t i_date, double f_percent, virtual_ch
             int64_t i_pos = int64_t( f_percent * stream_Size( p_demux->s ) );
 
             msg_Dbg( p_demux, "lengthy way of seeking for pos:%"PRId64, i_pos );
-            for( i_index = 0; i_index < p_segment->i_index; i_index++ )
-            {
-                if( p_segment->p_indexes[i_index].i_position >= i_pos &&
-                    p_segment->p_indexes[i_index].i_time > 0 )
-                    break;
-            }
-            if( i_index == p_segment->i_index )
-                i_index--;
-
-            if( p_segment->p_indexes[i_index].i_position < i_pos )
+            p_segment->IndexUpdate();
+            if( !p_segment->index.FindPosition( i_pos ) )
             {
                 msg_Dbg( p_demux, "no cues, seek request to global pos: %"PRId64, i_pos );
                 i_global_position = i_pos;
@@ -668,6 +676,21 @@ msg_Dbg( p_demux, "block i_dts: %"PRId64" / i_pts: %"PRId64, p_block->i_dts, p_b
  *****************************************************************************
  * Returns -1 in case of error, 0 in case of EOF, 1 otherwise
  *****************************************************************************/
+/* Lowest DTS of all tracks and the track it belongs to */
+static mtime_t TracksMinDts( const matroska_segment_c *p_segment, size_t *pi_track )
+{
+    mtime_t i_dts = VLC_TS_INVALID;
+
+    for( size_t i = 0; i < p_segment->tracks.size(); i++)
+        if( p_segment->tracks[i]->i_last_dts > VLC_TS_INVALID &&
+            ( p_segment->tracks[i]->i_last_dts < i_dts || i_dts == VLC_TS_INVALID ))
+        {
+            i_dts = p_segment->tracks[i]->i_last_dts;
+            *pi_track = i;
+        }
+    return i_dts;
+}
+
 static int Demux( demux_t *p_demux)
 {
     demux_sys_t        *p_sys = p_demux->p_sys;
@@ -683,6 +706,12 @@ static int Demux( demux_t *p_demux)
     }
     int                i_block_count = 0;
     int                i_return = 0;
+    size_t             i_bytes = 0;
+    mtime_t            i_first_pts = VLC_TS_INVALID;
+
+    /* the PCR only needs a full update when the track it comes from moves */
+    size_t             i_pcr_track = 0;
+    mtime_t            i_pcr = TracksMinDts( p_segment, &i_pcr_track );
 
     for( ;; )
     {
@@ -734,12 +763,6 @@ static int Demux( demux_t *p_demux)
         else
             p_sys->i_pts = p_sys->i_chapter_time + ( (mtime_t)block->GlobalTimecode() / INT64_C(1000) );
 
-        mtime_t i_pcr = VLC_TS_INVALID;
-        for( size_t i = 0; i < p_segment->tracks.size(); i++)
-            if( p_segment->tracks[i]->i_last_dts > VLC_TS_INVALID &&
-                ( p_segment->tracks[i]->i_last_dts < i_pcr || i_pcr == VLC_TS_INVALID ))
-                i_pcr = p_segment->tracks[i]->i_last_dts;
-
         if( i_pcr > p_sys->i_pcr + 300000 )
         {
             es_out_Control( p_demux->out, ES_OUT_SET_PCR, VLC_TS_0 + p_sys->i_pcr );
@@ -767,11 +790,28 @@ static int Demux( demux_t *p_demux)
 
         BlockDecode( p_demux, block, simpleblock, p_sys->i_pts, i_block_duration, b_key_picture || b_discardable_picture );
 
+        size_t i_track;
+        if( !p_segment->BlockFindTrackIndex( &i_track, block, simpleblock ) )
+        {
+            mtime_t i_dts = p_segment->tracks[i_track]->i_last_dts;
+            if( i_pcr == VLC_TS_INVALID || i_track == i_pcr_track )
+                i_pcr = TracksMinDts( p_segment, &i_pcr_track );
+            else if( i_dts > VLC_TS_INVALID && i_dts < i_pcr )
+            {
+                i_pcr = i_dts;
+                i_pcr_track = i_track;
+            }
+        }
+
+        i_bytes += simpleblock != NULL ? simpleblock->GetSize() : block->GetSize();
         delete block;
         i_block_count++;
+        if( i_first_pts == VLC_TS_INVALID )
+            i_first_pts = p_sys->i_pts;
 
-        // TODO optimize when there is need to leave or when seeking has been called
-        if( i_block_count > 5 )
+        /* leave once the budget of stream time is used */
+        if( p_sys->i_pts - i_first_pts >= p_sys->i_demux_budget ||
+            i_bytes >= MKV_DEMUX_MAX_BYTES || i_block_count >= MKV_DEMUX_MAX_BLOCKS )
         {
             i_return = 1;
             break;
@@ -59,6 +59,7 @@
 #include <typeinfo>
 #include <string>
 #include <vector>
+#include <map>
 #include <algorithm>
 
 /* libebml and matroska */
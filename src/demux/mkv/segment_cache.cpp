@@ -0,0 +1,288 @@
+/*****************************************************************************
+ * segment_cache.cpp : matroska demuxer
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "segment_cache.hpp"
+
+#include "matroska_segment.hpp"
+#include "chapters.hpp"
+
+#include <vlc_fs.h>
+#include <vlc_url.h>
+
+#include <set>
+
+#include <sys/stat.h>
+
+/* files whose headers are kept at most */
+#define SEGMENT_CACHE_MAX 1024
+
+/* threads opening the candidate files */
+#define LINKED_OPEN_THREADS 4
+/* data buffered by these threads, enough for the EBML header and the
+ * segment Info in usual files */
+#define LINKED_OPEN_PEEK (64 * 1024)
+
+struct segment_cache_entry_t
+{
+    int64_t                       i_size;
+    int64_t                       i_mtime;
+    std::vector<segment_header_t> headers;
+};
+
+typedef std::map<std::string, segment_cache_entry_t> segment_cache_t;
+
+static vlc_mutex_t     cache_lock = VLC_STATIC_MUTEX;
+static segment_cache_t cache;
+
+static bool FileStat( const std::string & s_filename, int64_t *pi_size, int64_t *pi_mtime )
+{
+    struct stat st;
+
+    if( vlc_stat( s_filename.c_str(), &st ) )
+        return false;
+    *pi_size = st.st_size;
+    *pi_mtime = st.st_mtime;
+    return true;
+}
+
+static std::string UidString( const EbmlBinary *p_uid )
+{
+    if( p_uid == NULL || p_uid->GetBuffer() == NULL )
+        return std::string();
+    return std::string( (const char *)p_uid->GetBuffer(), p_uid->GetSize() );
+}
+
+static segment_header_t SegmentHeader( const matroska_segment_c & segment )
+{
+    segment_header_t header;
+
+    header.uid = UidString( segment.p_segment_uid );
+    header.prev_uid = UidString( segment.p_prev_segment_uid );
+    header.next_uid = UidString( segment.p_next_segment_uid );
+    for( size_t i = 0; i < segment.families.size(); i++ )
+        header.families.push_back( UidString( segment.families[i] ) );
+    return header;
+}
+
+void SegmentCacheStore( const std::string & s_filename, const matroska_stream_c & stream )
+{
+    segment_cache_entry_t entry;
+
+    if( !FileStat( s_filename, &entry.i_size, &entry.i_mtime ) )
+        return;
+    for( size_t i = 0; i < stream.segments.size(); i++ )
+        entry.headers.push_back( SegmentHeader( *stream.segments[i] ) );
+
+    vlc_mutex_lock( &cache_lock );
+    if( cache.size() >= SEGMENT_CACHE_MAX )
+        cache.clear();
+    cache[s_filename] = entry;
+    vlc_mutex_unlock( &cache_lock );
+}
+
+/*****************************************************************************
+ * Family filter
+ *****************************************************************************/
+typedef std::set<std::string> uid_set_t;
+
+static void AddUid( uid_set_t & uids, const std::string & uid )
+{
+    if( !uid.empty() )
+        uids.insert( uid );
+}
+
+static void AddHeaderUids( uid_set_t & uids, const segment_header_t & header )
+{
+    AddUid( uids, header.uid );
+    AddUid( uids, header.prev_uid );
+    AddUid( uids, header.next_uid );
+    for( size_t i = 0; i < header.families.size(); i++ )
+        AddUid( uids, header.families[i] );
+}
+
+/* segments used by ordered chapters */
+static void AddChapterUids( uid_set_t & uids, const chapter_item_c & chapter )
+{
+    AddUid( uids, UidString( chapter.p_segment_uid ) );
+    for( size_t i = 0; i < chapter.sub_chapters.size(); i++ )
+        AddChapterUids( uids, *chapter.sub_chapters[i] );
+}
+
+static bool HasUid( const uid_set_t & uids, const std::string & uid )
+{
+    return !uid.empty() && uids.find( uid ) != uids.end();
+}
+
+static bool IsLinked( const uid_set_t & uids, const segment_header_t & header )
+{
+    if( HasUid( uids, header.uid ) || HasUid( uids, header.prev_uid ) ||
+        HasUid( uids, header.next_uid ) )
+        return true;
+    for( size_t i = 0; i < header.families.size(); i++ )
+        if( HasUid( uids, header.families[i] ) )
+            return true;
+    return false;
+}
+
+void SegmentCacheFilter( demux_t *p_demux, std::vector<linked_file_t> & files,
+                         const matroska_stream_c & main_stream )
+{
+    std::vector<const segment_cache_entry_t *> cached( files.size(), NULL );
+    std::vector<bool> linked( files.size(), false );
+    uid_set_t uids;
+
+    for( size_t i = 0; i < main_stream.segments.size(); i++ )
+    {
+        const matroska_segment_c *p_segment = main_stream.segments[i];
+
+        AddHeaderUids( uids, SegmentHeader( *p_segment ) );
+        for( size_t j = 0; j < p_segment->stored_editions.size(); j++ )
+            AddChapterUids( uids, *p_segment->stored_editions[j] );
+    }
+
+    vlc_mutex_lock( &cache_lock );
+    for( size_t i = 0; i < files.size(); i++ )
+    {
+        segment_cache_t::const_iterator it = cache.find( files[i].s_filename );
+        int64_t i_size, i_mtime;
+
+        if( it != cache.end() &&
+            FileStat( files[i].s_filename, &i_size, &i_mtime ) &&
+            it->second.i_size == i_size && it->second.i_mtime == i_mtime )
+            cached[i] = &it->second;
+    }
+
+    /* files that are not cached are always linked, the others are when
+     * they refer to the UIDs gathered so far */
+    bool b_changed = true;
+    while( b_changed )
+    {
+        b_changed = false;
+        for( size_t i = 0; i < files.size(); i++ )
+        {
+            if( linked[i] || cached[i] == NULL )
+                continue;
+            for( size_t j = 0; j < cached[i]->headers.size(); j++ )
+            {
+                if( IsLinked( uids, cached[i]->headers[j] ) )
+                {
+                    linked[i] = true;
+                    break;
+                }
+            }
+            if( linked[i] )
+            {
+                for( size_t j = 0; j < cached[i]->headers.size(); j++ )
+                    AddHeaderUids( uids, cached[i]->headers[j] );
+                b_changed = true;
+            }
+        }
+    }
+    vlc_mutex_unlock( &cache_lock );
+
+    std::vector<linked_file_t> kept;
+    for( size_t i = 0; i < files.size(); i++ )
+    {
+        if( cached[i] == NULL || linked[i] )
+            kept.push_back( files[i] );
+        else
+            msg_Dbg( p_demux, "the file '%s' is known not to be linked", files[i].s_filename.c_str() );
+    }
+    files.swap( kept );
+}
+
+/*****************************************************************************
+ * Concurrent opening
+ *****************************************************************************/
+struct linked_open_t
+{
+    demux_t                    *p_demux;
+    std::vector<linked_file_t> *p_files;
+    vlc_mutex_t                lock;
+    size_t                     i_next;
+};
+
+static void *OpenThread( void *data )
+{
+    linked_open_t *p_open = static_cast<linked_open_t *>( data );
+
+    for( ;; )
+    {
+        vlc_mutex_lock( &p_open->lock );
+        size_t i = p_open->i_next++;
+        vlc_mutex_unlock( &p_open->lock );
+        if( i >= p_open->p_files->size() )
+            break;
+
+        /* each file is only touched by the thread that took it */
+        linked_file_t & file = (*p_open->p_files)[i];
+        const uint8_t *p_peek;
+        stream_t *p_stream = NULL;
+
+        char *psz_url = make_URI( file.s_filename.c_str(), "file" );
+        if( psz_url )
+        {
+            p_stream = stream_UrlNew( p_open->p_demux, psz_url );
+            free( psz_url );
+        }
+
+        /* peek the begining */
+        if( p_stream &&
+            ( stream_Peek( p_stream, &p_peek, 4 ) < 4 ||
+              p_peek[0] != 0x1a || p_peek[1] != 0x45 ||
+              p_peek[2] != 0xdf || p_peek[3] != 0xa3 ) )
+        {
+            stream_Delete( p_stream );
+            p_stream = NULL;
+        }
+        if( p_stream )
+            stream_Peek( p_stream, &p_peek, LINKED_OPEN_PEEK );
+        file.p_stream = p_stream;
+    }
+    return NULL;
+}
+
+void OpenLinkedFiles( demux_t *p_demux, std::vector<linked_file_t> & files )
+{
+    vlc_thread_t threads[LINKED_OPEN_THREADS];
+    linked_open_t open;
+    size_t i_threads = 0;
+
+    open.p_demux = p_demux;
+    open.p_files = &files;
+    open.i_next = 0;
+    vlc_mutex_init( &open.lock );
+
+    for( size_t i = 0; i < files.size(); i++ )
+        files[i].p_stream = NULL;
+
+    while( i_threads < LINKED_OPEN_THREADS && i_threads + 1 < files.size() &&
+           !vlc_clone( &threads[i_threads], OpenThread, &open, VLC_THREAD_PRIORITY_INPUT ) )
+        i_threads++;
+
+    /* take part in the work, this also does it all if no thread started */
+    OpenThread( &open );
+
+    for( size_t i = 0; i < i_threads; i++ )
+        vlc_join( threads[i], NULL );
+    vlc_mutex_destroy( &open.lock );
+}
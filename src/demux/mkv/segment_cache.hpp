@@ -0,0 +1,61 @@
+/*****************************************************************************
+ * segment_cache.hpp : matroska demuxer
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _SEGMENT_CACHE_HPP_
+#define _SEGMENT_CACHE_HPP_
+
+#include "mkv.hpp"
+
+/* UIDs from the Info of a segment as raw bytes, empty when absent */
+struct segment_header_t
+{
+    std::string              uid;
+    std::string              prev_uid;
+    std::string              next_uid;
+    std::vector<std::string> families;
+};
+
+/* file of the same directory that may hold linked segments */
+struct linked_file_t
+{
+    std::string s_filename;
+    stream_t    *p_stream;
+};
+
+/*****************************************************************************
+ * The segment headers of the files analysed while looking for linked
+ * segments are kept for the lifetime of the plugin (as long as the files
+ * don't change), so that files of other families are not opened again
+ * the next time.
+ *****************************************************************************/
+void SegmentCacheStore( const std::string & s_filename, const matroska_stream_c & stream );
+
+/* Drop the files whose cached headers aren't linked to the main stream,
+ * directly or through other files */
+void SegmentCacheFilter( demux_t *p_demux, std::vector<linked_file_t> & files,
+                         const matroska_stream_c & main_stream );
+
+/* Open the files concurrently, the stream of a file is left NULL when it
+ * can't be opened or isn't a Matroska file */
+void OpenLinkedFiles( demux_t *p_demux, std::vector<linked_file_t> & files );
+
+#endif
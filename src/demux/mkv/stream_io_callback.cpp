@@ -27,6 +27,9 @@
 #include "matroska_segment.hpp"
 #include "demux.hpp"
 
+/* largest read done ahead of the demuxer */
+#define MKV_READ_AHEAD_MAX (4 * 1024 * 1024)
+
 /*****************************************************************************
  * Stream managment
  *****************************************************************************/
@@ -34,6 +37,63 @@ vlc_stream_io_callback::vlc_stream_io_callback( stream_t *s_, bool b_owner_ )
                        : s( s_), b_owner( b_owner_ )
 {
     mb_eof = false;
+    p_ra_buffer = NULL;
+    i_ra_alloc = 0;
+    i_ra_start = 0;
+    i_ra_size = 0;
+    i_ra_end = 0;
+    i_pos = s ? stream_Tell( s ) : 0;
+}
+
+void vlc_stream_io_callback::ReadAheadDrop( void )
+{
+    i_ra_size = 0;
+    i_ra_end = 0;
+}
+
+void vlc_stream_io_callback::ReadAheadFill( void )
+{
+    /* the stream is positioned at i_pos */
+    size_t i_size = __MIN( i_ra_end - i_pos, (uint64_t)MKV_READ_AHEAD_MAX );
+
+    i_ra_size = 0;
+    if( i_size > i_ra_alloc )
+    {
+        uint8_t *p_buffer = (uint8_t *)realloc( p_ra_buffer, i_size );
+        if( p_buffer == NULL )
+        {
+            i_ra_end = 0;
+            return;
+        }
+        p_ra_buffer = p_buffer;
+        i_ra_alloc = i_size;
+    }
+
+    int i_read = stream_Read( s, p_ra_buffer, i_size );
+    if( i_read <= 0 )
+    {
+        i_ra_end = 0;
+        return;
+    }
+    i_ra_start = i_pos;
+    i_ra_size = i_read;
+}
+
+void vlc_stream_io_callback::readAhead( uint64_t i_end )
+{
+    if( s == NULL || mb_eof || i_end <= i_pos )
+        return;
+
+    if( i_ra_size && i_pos >= i_ra_start && i_pos <= i_ra_start + i_ra_size )
+    {
+        /* the buffer is filled again once it's been read */
+        i_ra_end = __MAX( i_end, i_ra_start + i_ra_size );
+        return;
+    }
+
+    ReadAheadDrop();
+    i_ra_end = i_end;
+    ReadAheadFill();
 }
 
 uint32 vlc_stream_io_callback::read( void *p_buffer, size_t i_size )
@@ -41,33 +101,80 @@ uint32 vlc_stream_io_callback::read( void *p_buffer, size_t i_size )
     if( i_size <= 0 || mb_eof )
         return 0;
 
-    return stream_Read( s, p_buffer, i_size );
+    uint8_t *p_dst = (uint8_t *)p_buffer;
+    size_t  i_done = 0;
+    while( i_ra_size && i_done < i_size )
+    {
+        uint64_t i_buffer_end = i_ra_start + i_ra_size;
+        if( i_pos >= i_ra_start && i_pos < i_buffer_end )
+        {
+            size_t i_copy = __MIN( i_size - i_done, i_buffer_end - i_pos );
+            memcpy( p_dst + i_done, p_ra_buffer + ( i_pos - i_ra_start ), i_copy );
+            i_done += i_copy;
+            i_pos  += i_copy;
+        }
+        else if( i_pos == i_buffer_end && i_pos < i_ra_end )
+        {
+            /* next part of the data to read ahead */
+            ReadAheadFill();
+            if( !i_ra_size )
+                i_ra_end = 0;
+        }
+        else
+        {
+            /* past the buffer, continue reading from the stream */
+            if( (uint64_t)stream_Tell( s ) != i_pos )
+                stream_Seek( s, i_pos );
+            ReadAheadDrop();
+        }
+    }
+
+    if( i_done < i_size )
+    {
+        int i_read = stream_Read( s, p_dst + i_done, i_size - i_done );
+        if( i_read > 0 )
+        {
+            i_done += i_read;
+            i_pos  += i_read;
+        }
+    }
+    return i_done;
 }
 
 void vlc_stream_io_callback::setFilePointer(int64_t i_offset, seek_mode mode )
 {
-    int64_t i_pos, i_size;
+    int64_t i_target, i_size;
 
     switch( mode )
     {
         case seek_beginning:
-            i_pos = i_offset;
+            i_target = i_offset;
             break;
         case seek_end:
-            i_pos = stream_Size( s ) - i_offset;
+            i_target = stream_Size( s ) - i_offset;
             break;
         default:
-            i_pos= stream_Tell( s ) + i_offset;
+            i_target = i_pos + i_offset;
             break;
     }
 
-    if( i_pos < 0 || ( ( i_size = stream_Size( s ) ) != 0 && i_pos >= i_size ) )
+    if( i_target < 0 || ( ( i_size = stream_Size( s ) ) != 0 && i_target >= i_size ) )
     {
         mb_eof = true;
         return;
     }
 
     mb_eof = false;
+    if( i_ra_size && (uint64_t)i_target >= i_ra_start &&
+        (uint64_t)i_target <= i_ra_start + i_ra_size )
+    {
+        /* still in the read-ahead buffer */
+        i_pos = i_target;
+        return;
+    }
+
+    ReadAheadDrop();
+    i_pos = i_target;
     if( stream_Seek( s, i_pos ) )
     {
         mb_eof = true;
@@ -79,7 +186,7 @@ uint64 vlc_stream_io_callback::getFilePointer( void )
 {
     if ( s == NULL )
         return 0;
-    return stream_Tell( s );
+    return i_pos;
 }
 
 size_t vlc_stream_io_callback::write(const void *, size_t )
@@ -99,6 +206,5 @@ uint64 vlc_stream_io_callback::toRead( void )
     if( i_size == 0 )
         return UINT64_MAX;
 
-    return (uint64) i_size - stream_Tell( s );
+    return (uint64) i_size - i_pos;
 }
-
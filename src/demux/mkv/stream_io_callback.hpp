@@ -33,11 +33,24 @@ class vlc_stream_io_callback: public IOCallback
     bool           mb_eof;
     bool           b_owner;
 
+    /* read-ahead buffer, the stream is positioned at its end when it is
+     * in use, otherwise at i_pos */
+    uint8_t        *p_ra_buffer;
+    size_t         i_ra_alloc;
+    uint64_t       i_ra_start;
+    size_t         i_ra_size;
+    uint64_t       i_ra_end;        /* end of the data to read ahead */
+    uint64_t       i_pos;
+
+    void           ReadAheadFill( void );
+    void           ReadAheadDrop( void );
+
   public:
     vlc_stream_io_callback( stream_t *, bool );
 
     virtual ~vlc_stream_io_callback()
     {
+        free( p_ra_buffer );
         if( b_owner )
             stream_Delete( s );
     }
@@ -48,5 +61,9 @@ class vlc_stream_io_callback: public IOCallback
     virtual uint64   getFilePointer  ( void );
     virtual void     close           ( void ) { return; }
     uint64           toRead          ( void );
+
+    /* read the data up to i_end (e.g. the end of a cluster) in large chunks
+     * and serve the following reads from memory */
+    void             readAhead       ( uint64_t i_end );
 };
 
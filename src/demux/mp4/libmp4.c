@@ -1917,8 +1917,98 @@ static int MP4_ReadBox_stsd( stream_t *p_stream, MP4_Box_t *p_box )
 }
 
 
+/* Large sample size tables are only loaded on demand in compact mode,
+ * this reads the fixed part of such a box */
+#define MP4_COMPACT_TABLE_SIZE (64 * 1024)
+
+static bool MP4_UseCompactTable( stream_t *p_stream, MP4_Box_t *p_box )
+{
+    bool b_seekable = false;
+
+    if( p_box->i_size < MP4_COMPACT_TABLE_SIZE ||
+        !var_InheritBool( p_stream, "mp4-compact-tables" ) )
+        return false;
+
+    stream_Control( p_stream, STREAM_CAN_SEEK, &b_seekable );
+    return b_seekable;
+}
+
+static int MP4_ReadBox_sizes_compact( stream_t *p_stream, MP4_Box_t *p_box )
+{
+    const size_t i_header = mp4_box_headersize( p_box );
+    const uint8_t *p_peek;
+    int64_t i_read = stream_Peek( p_stream, &p_peek, i_header + 12 );
+    uint32_t i_sample_size, i_sample_count;
+    uint8_t i_version, i_field_size;
+    uint32_t i_flags;
+
+    if( i_read < (int64_t)( i_header + 12 ) )
+        return 0;
+    p_peek += i_header;
+    i_read -= i_header;
+
+    MP4_GET1BYTE( i_version );
+    MP4_GET3BYTES( i_flags );
+    if( p_box->i_type == ATOM_stz2 )
+    {
+        MP4_GET3BYTES( i_sample_size ); /* reserved */
+        MP4_GET1BYTE( i_field_size );
+        i_sample_size = 0;
+    }
+    else
+    {
+        MP4_GET4BYTES( i_sample_size );
+        i_field_size = 32;
+    }
+    MP4_GET4BYTES( i_sample_count );
+
+    const uint64_t i_entries = p_box->i_pos + i_header + 12;
+    if( i_sample_size == 0 &&
+        ( ( i_field_size != 4 && i_field_size != 8 &&
+            i_field_size != 16 && i_field_size != 32 ) ||
+          i_entries + ( (uint64_t)i_sample_count * i_field_size + 7 ) / 8 >
+            p_box->i_pos + p_box->i_size ) )
+    {
+        msg_Warn( p_stream, "invalid sample size table" );
+        return 0;
+    }
+
+    if( p_box->i_type == ATOM_stz2 )
+    {
+        MP4_Box_data_stz2_t *p_stz2 = calloc( 1, sizeof( *p_stz2 ) );
+        if( !p_stz2 )
+            return 0;
+        p_stz2->i_version = i_version;
+        p_stz2->i_flags = i_flags;
+        p_stz2->i_field_size = i_field_size;
+        p_stz2->i_sample_count = i_sample_count;
+        p_stz2->i_entries_offset = i_entries;
+        p_box->data.p_stz2 = p_stz2;
+    }
+    else
+    {
+        MP4_Box_data_stsz_t *p_stsz = calloc( 1, sizeof( *p_stsz ) );
+        if( !p_stsz )
+            return 0;
+        p_stsz->i_version = i_version;
+        p_stsz->i_flags = i_flags;
+        p_stsz->i_sample_size = i_sample_size;
+        p_stsz->i_sample_count = i_sample_count;
+        if( i_sample_size == 0 )
+            p_stsz->i_entries_offset = i_entries;
+        p_box->data.p_stsz = p_stsz;
+    }
+
+    msg_Dbg( p_stream, "read box: \"%4.4s\" sample-count %d (compact)",
+             (char *)&p_box->i_type, i_sample_count );
+    return 1;
+}
+
 static int MP4_ReadBox_stsz( stream_t *p_stream, MP4_Box_t *p_box )
 {
+    if( MP4_UseCompactTable( p_stream, p_box ) )
+        return MP4_ReadBox_sizes_compact( p_stream, p_box );
+
     MP4_READBOX_ENTER( MP4_Box_data_stsz_t );
 
     MP4_GETVERSIONFLAGS( p_box->data.p_stsz );
@@ -1955,6 +2045,68 @@ static void MP4_FreeBox_stsz( MP4_Box_t *p_box )
     FREENULL( p_box->data.p_stsz->i_entry_size );
 }
 
+static int MP4_ReadBox_stz2( stream_t *p_stream, MP4_Box_t *p_box )
+{
+    if( MP4_UseCompactTable( p_stream, p_box ) )
+        return MP4_ReadBox_sizes_compact( p_stream, p_box );
+
+    MP4_READBOX_ENTER( MP4_Box_data_stz2_t );
+    MP4_Box_data_stz2_t *p_stz2 = p_box->data.p_stz2;
+    uint32_t i_reserved;
+
+    MP4_GETVERSIONFLAGS( p_stz2 );
+
+    MP4_GET3BYTES( i_reserved );
+    VLC_UNUSED( i_reserved );
+    MP4_GET1BYTE( p_stz2->i_field_size );
+    MP4_GET4BYTES( p_stz2->i_sample_count );
+
+    if( p_stz2->i_field_size != 4 && p_stz2->i_field_size != 8 &&
+        p_stz2->i_field_size != 16 )
+    {
+        msg_Warn( p_stream, "invalid stz2 field size %d", p_stz2->i_field_size );
+        MP4_READBOX_EXIT( 0 );
+    }
+
+    p_stz2->i_entry_size = calloc( p_stz2->i_sample_count, sizeof(uint32_t) );
+    if( unlikely( !p_stz2->i_entry_size ) )
+        MP4_READBOX_EXIT( 0 );
+
+    for( unsigned int i = 0; i < p_stz2->i_sample_count && i_read > 0; i++ )
+    {
+        switch( p_stz2->i_field_size )
+        {
+        case 4:
+            /* two entries per byte, the first one in the upper nibble */
+            p_stz2->i_entry_size[i] = ( i & 1 ) ? *p_peek & 0x0f : *p_peek >> 4;
+            if( i & 1 )
+            {
+                p_peek++;
+                i_read--;
+            }
+            break;
+        case 8:
+            MP4_GET1BYTE( p_stz2->i_entry_size[i] );
+            break;
+        default:
+            MP4_GET2BYTES( p_stz2->i_entry_size[i] );
+            break;
+        }
+    }
+
+#ifdef MP4_VERBOSE
+    msg_Dbg( p_stream, "read box: \"stz2\" field-size %d sample-count %d",
+                      p_stz2->i_field_size, p_stz2->i_sample_count );
+
+#endif
+    MP4_READBOX_EXIT( 1 );
+}
+
+static void MP4_FreeBox_stz2( MP4_Box_t *p_box )
+{
+    FREENULL( p_box->data.p_stz2->i_entry_size );
+}
+
 static void MP4_FreeBox_stsc( MP4_Box_t *p_box )
 {
     FREENULL( p_box->data.p_stsc->i_first_chunk );
@@ -2992,8 +3144,9 @@ static int MP4_ReadBox_tfra( stream_t *p_stream, MP4_Box_t *p_box )
     {
         if( p_tfra->i_version == 1 )
         {
-            MP4_GET8BYTES( p_tfra->p_time[i*2] );
-            MP4_GET8BYTES( p_tfra->p_moof_offset[i*2] );
+            /* the arrays hold 64 bits entries in that case */
+            MP4_GET8BYTES( ((uint64_t *)p_tfra->p_time)[i] );
+            MP4_GET8BYTES( ((uint64_t *)p_tfra->p_moof_offset)[i] );
         }
         else
         {
@@ -3190,6 +3343,7 @@ static const struct
     { ATOM_ctts,    MP4_ReadBox_ctts,         MP4_FreeBox_ctts },
     { ATOM_stsd,    MP4_ReadBox_stsd,         MP4_FreeBox_Common },
     { ATOM_stsz,    MP4_ReadBox_stsz,         MP4_FreeBox_stsz },
+    { ATOM_stz2,    MP4_ReadBox_stz2,         MP4_FreeBox_stz2 },
     { ATOM_stsc,    MP4_ReadBox_stsc,         MP4_FreeBox_stsc },
     { ATOM_stco,    MP4_ReadBox_stco_co64,    MP4_FreeBox_stco_co64 },
     { ATOM_co64,    MP4_ReadBox_stco_co64,    MP4_FreeBox_stco_co64 },
@@ -624,6 +624,8 @@ typedef struct MP4_Box_data_stsz_s
     uint32_t i_sample_count;
 
     uint32_t *i_entry_size; /* array , empty if i_sample_size != 0 */
+    uint64_t i_entries_offset; /* compact tables: position of the entries
+                                  in the file, i_entry_size isn't loaded */
 
 } MP4_Box_data_stsz_t;
 
@@ -637,6 +639,8 @@ typedef struct MP4_Box_data_stz2_s
     uint32_t i_sample_count;
 
     uint32_t *i_entry_size; /* array: unsigned int(i_field_size) entry_size */
+    uint64_t i_entries_offset; /* compact tables: position of the entries
+                                  in the file, i_entry_size isn't loaded */
 
 } MP4_Box_data_stz2_t;
 
@@ -1126,8 +1130,8 @@ typedef struct
     uint8_t i_length_size_of_trun_num;
     uint8_t i_length_size_of_sample_num;
 
-    uint32_t *p_time;
-    uint32_t *p_moof_offset;
+    uint32_t *p_time;           /* 64 bits entries if i_version == 1 */
+    uint32_t *p_moof_offset;    /* 64 bits entries if i_version == 1 */
     uint8_t *p_traf_number;
     uint8_t *p_trun_number;
     uint8_t *p_sample_number;
@@ -1295,8 +1299,17 @@ typedef struct
     uint32_t     *p_sample_count_pts;
     int32_t      *p_sample_offset_pts;  /* pts-dts */
 
+    /* compact tables: stts/ctts entry of the first sample of the chunk and
+     * the number of samples of that entry used by previous chunks */
+    uint32_t     i_stts_index;
+    uint32_t     i_stts_used;
+    uint32_t     i_ctts_index;
+    uint32_t     i_ctts_used;
+
     uint8_t      **p_sample_data;     /* set when b_fragmented is true */
     uint32_t     *p_sample_size;
+    bool         *p_sample_sync;      /* set when b_fragmented is true and
+                                         the sample flags are known */
     /* TODO if needed add pts
         but quickly *add* support for edts and seeking */
 
@@ -1348,6 +1361,25 @@ typedef struct
     uint32_t         *p_sample_size; /* XXX perhaps add file offset if take
                                     too much time to do sumations each time*/
 
+    /* compact tables: the sample sizes are read from the file on demand
+     * and p_sample_size only holds the sizes starting at i_size_page */
+    stream_t         *p_size_stream;
+    uint64_t         i_size_offset;  /* position of the entries, 0 if loaded */
+    uint8_t          i_size_field;   /* bits per entry */
+    uint32_t         i_size_page;
+    uint32_t         i_size_page_count;
+
+    /* compact tables: timing is read from the runs of these tables */
+    MP4_Box_data_stts_t *p_stts;
+    MP4_Box_data_ctts_t *p_ctts;
+
+    /* sorted sync samples (from stss or sdtp), NULL if all samples are
+     * sync samples */
+    uint32_t         *p_sync_samples;
+    uint32_t         i_sync_count;
+    /* fragmented: skip samples up to the next sync sample (after seeking) */
+    bool             b_wait_sync;
+
     uint32_t     i_sample_first; /* i_sample_first value
                                                    of the next chunk */
     uint64_t     i_first_dts;    /* i_first_dts value
@@ -46,6 +46,15 @@
 static int  Open ( vlc_object_t * );
 static void Close( vlc_object_t * );
 
+#define COMPACT_TEXT N_("Compact sample tables")
+#define COMPACT_LONGTEXT N_("Keep the sample tables of large files in " \
+    "their compressed form and read sample sizes on demand, so memory " \
+    "usage and opening time don't grow with the duration.")
+
+#define PREFETCH_TEXT N_("Prefetch fragments")
+#define PREFETCH_LONGTEXT N_("Read the next fragment of local fragmented " \
+    "files in the background while the current one is being demuxed.")
+
 vlc_module_begin ()
     set_category( CAT_INPUT )
     set_subcategory( SUBCAT_INPUT_DEMUX )
@@ -53,6 +62,8 @@ vlc_module_begin ()
     set_shortname( N_("MP4 (HEVC/H.265)") )
     set_capability( "demux", 241 )
     set_callbacks( Open, Close )
+    add_bool( "mp4-compact-tables", false, COMPACT_TEXT, COMPACT_LONGTEXT, true )
+    add_bool( "mp4-prefetch", false, PREFETCH_TEXT, PREFETCH_LONGTEXT, true )
 vlc_module_end ()
 
 /*****************************************************************************
@@ -64,6 +75,45 @@ static int   DemuxFrg( demux_t * );
 static int   Seek    ( demux_t *, mtime_t );
 static int   Control ( demux_t *, int, va_list );
 
+/* Data read in one go, shared by the blocks sliced from it */
+typedef struct
+{
+    unsigned int i_refs;
+    block_t      *p_block;
+} mp4_shared_data_t;
+
+typedef struct
+{
+    mp4_shared_data_t *p_data;
+    uint64_t          i_offset;     /* file position of the data */
+    unsigned int      i_tick;       /* last use */
+} mp4_read_cache_t;
+
+#define MP4_READ_CACHE_SLOTS 4
+
+/* Start of a fragment of the indexed track */
+typedef struct
+{
+    uint64_t i_offset;
+    mtime_t  i_time;
+} mp4_fragment_t;
+
+/* Background reader of the next fragment, using its own stream */
+typedef struct
+{
+    vlc_mutex_t  lock;
+    vlc_cond_t   wait;
+    vlc_thread_t thread;
+    stream_t     *s;
+
+    bool         b_abort;
+    uint64_t     i_request;     /* offset to read next, UINT64_MAX if none */
+    bool         b_busy;        /* reading the fragment at i_busy */
+    uint64_t     i_busy;
+    block_t      *p_block;      /* fragment read at i_offset */
+    uint64_t     i_offset;
+} mp4_prefetch_t;
+
 struct demux_sys_t
 {
     MP4_Box_t    *p_root;      /* container for the whole file */
@@ -85,6 +135,21 @@ struct demux_sys_t
 
     /* */
     input_title_t *p_title;
+
+    /* recently read file ranges, samples are sliced from them */
+    mp4_read_cache_t cache[MP4_READ_CACHE_SLOTS];
+    unsigned int     i_cache_tick;
+
+    /* fragmented: fragments of one track, sorted by offset and time */
+    uint32_t       i_frg_track_ID;
+    mp4_fragment_t *p_frg_index;
+    unsigned int   i_frg_count;
+    unsigned int   i_frg_size;
+    uint64_t       i_frg_end_offset;    /* end of the indexed part */
+    uint64_t       i_frg_end_dts;       /* in the indexed track timescale */
+    bool           b_frg_complete;
+
+    mp4_prefetch_t *p_prefetch;
 };
 
 /*****************************************************************************
@@ -101,12 +166,134 @@ static int  MP4_TrackSeek   ( demux_t *, mp4_track_t *, mtime_t );
 
 static uint64_t MP4_TrackGetPos    ( mp4_track_t * );
 static int      MP4_TrackSampleSize( mp4_track_t * );
+static uint64_t MP4_TrackChunkSize ( mp4_track_t *, uint32_t );
 static int      MP4_TrackNextSample( demux_t *, mp4_track_t * );
 static void     MP4_TrackSetELST( demux_t *, mp4_track_t *, int64_t );
 
 static void     MP4_UpdateSeekpoint( demux_t * );
 static const char *MP4_ConvertMacCode( uint16_t );
 
+static mp4_track_t *MP4_frg_GetTrack( demux_t *, const uint32_t );
+static bool     MP4_frg_HasIndex( demux_t * );
+static void     MP4_frg_IndexInit( demux_t * );
+static void     MP4_frg_PrefetchNew( demux_t * );
+static void     MP4_frg_PrefetchDelete( demux_t * );
+
+/* Get run "i_run" of the dts table of a chunk, the runs of compact tables
+ * are not clipped to the chunk */
+static inline void MP4_ChunkGetDTSRun( const mp4_track_t *p_track,
+                                       const mp4_chunk_t *ck, unsigned int i_run,
+                                       uint32_t *pi_count, uint32_t *pi_delta )
+{
+    if( !p_track->p_stts )
+    {
+        *pi_count = ck->p_sample_count_dts[i_run];
+        *pi_delta = ck->p_sample_delta_dts[i_run];
+        return;
+    }
+
+    const MP4_Box_data_stts_t *stts = p_track->p_stts;
+    unsigned int i_index = ck->i_stts_index + i_run;
+    if( i_index >= stts->i_entry_count )
+    {
+        /* past the table, continue with the last delta */
+        *pi_count = UINT32_MAX;
+        *pi_delta = stts->i_entry_count ?
+                    stts->i_sample_delta[stts->i_entry_count - 1] : 0;
+        return;
+    }
+    *pi_count = stts->i_sample_count[i_index] - ( i_run ? 0 : ck->i_stts_used );
+    *pi_delta = stts->i_sample_delta[i_index];
+}
+
+/* Get run "i_run" of the pts offset table of a chunk
+ * \return false if there is no such run */
+static inline bool MP4_ChunkGetPTSRun( const mp4_track_t *p_track,
+                                       const mp4_chunk_t *ck, unsigned int i_run,
+                                       uint32_t *pi_count, int32_t *pi_offset )
+{
+    if( !p_track->p_ctts )
+    {
+        if( ck->p_sample_count_pts == NULL || ck->p_sample_offset_pts == NULL )
+            return false;
+        *pi_count = ck->p_sample_count_pts[i_run];
+        *pi_offset = ck->p_sample_offset_pts[i_run];
+        return true;
+    }
+
+    const MP4_Box_data_ctts_t *ctts = p_track->p_ctts;
+    unsigned int i_index = ck->i_ctts_index + i_run;
+    if( i_index >= ctts->i_entry_count )
+        return false;
+    *pi_count = ctts->i_sample_count[i_index] - ( i_run ? 0 : ck->i_ctts_used );
+    *pi_offset = ctts->i_sample_offset[i_index];
+    return true;
+}
+
+#define MP4_SIZE_PAGE 4096  /* sample sizes loaded at once for compact tables */
+
+/* Read the page of the sample size table containing sample "i_sample", this
+ * moves the stream of the table (the one of the demuxer)
+ * \return VLC_SUCCESS, or an error if the table couldn't be read */
+static int MP4_TrackLoadSizePage( mp4_track_t *p_track, uint32_t i_sample )
+{
+    const uint32_t i_first = i_sample - i_sample % MP4_SIZE_PAGE;
+    const uint32_t i_count = __MIN( MP4_SIZE_PAGE, p_track->i_sample_count - i_first );
+    const unsigned int i_field = p_track->i_size_field;
+    const int i_bytes = ( (uint64_t)i_count * i_field + 7 ) / 8;
+    uint8_t *p_buffer = malloc( i_bytes );
+    int i_read;
+
+    if( !p_buffer )
+        return VLC_ENOMEM;
+    if( stream_Seek( p_track->p_size_stream, p_track->i_size_offset +
+                     (uint64_t)i_first * i_field / 8 ) ||
+        ( i_read = stream_Read( p_track->p_size_stream, p_buffer, i_bytes ) ) <= 0 )
+    {
+        free( p_buffer );
+        return VLC_EGENERIC;
+    }
+
+    /* the entries after a short read (truncated file) are empty */
+    for( uint32_t i = 0; i < i_count; i++ )
+    {
+        const uint32_t i_bit = i * i_field;
+        uint32_t i_size = 0;
+
+        if( (int)( ( i_bit + i_field + 7 ) / 8 ) <= i_read )
+        {
+            const uint8_t *p = &p_buffer[i_bit / 8];
+            switch( i_field )
+            {
+            case 4:  i_size = ( i & 1 ) ? *p & 0x0f : *p >> 4; break;
+            case 8:  i_size = *p; break;
+            case 16: i_size = GetWBE( p ); break;
+            default: i_size = GetDWBE( p ); break;
+            }
+        }
+        p_track->p_sample_size[i] = i_size;
+    }
+    free( p_buffer );
+
+    p_track->i_size_page = i_first;
+    p_track->i_size_page_count = i_count;
+    return VLC_SUCCESS;
+}
+
+/* Size of a sample for tracks with a sample size table, 0 if it can't be
+ * read */
+static inline uint32_t MP4_TrackGetSampleSizeAt( mp4_track_t *p_track,
+                                                 uint32_t i_sample )
+{
+    if( !p_track->i_size_offset )
+        return p_track->p_sample_size[i_sample];
+
+    if( i_sample - p_track->i_size_page >= p_track->i_size_page_count &&
+        MP4_TrackLoadSizePage( p_track, i_sample ) )
+        return 0;
+    return p_track->p_sample_size[i_sample - p_track->i_size_page];
+}
+
 /* Return time in microsecond of a track */
 static inline int64_t MP4_TrackGetDTS( demux_t *p_demux, mp4_track_t *p_track )
 {
@@ -123,16 +310,18 @@ static inline int64_t MP4_TrackGetDTS( demux_t *p_demux, mp4_track_t *p_track )
 
     while( i_sample > 0 )
     {
-        if( i_sample > chunk.p_sample_count_dts[i_index] )
+        uint32_t i_count, i_delta;
+
+        MP4_ChunkGetDTSRun( p_track, &chunk, i_index, &i_count, &i_delta );
+        if( i_sample > i_count )
         {
-            i_dts += chunk.p_sample_count_dts[i_index] *
-                chunk.p_sample_delta_dts[i_index];
-            i_sample -= chunk.p_sample_count_dts[i_index];
+            i_dts += (int64_t)i_count * i_delta;
+            i_sample -= i_count;
             i_index++;
         }
         else
         {
-            i_dts += i_sample * chunk.p_sample_delta_dts[i_index];
+            i_dts += (int64_t)i_sample * i_delta;
             break;
         }
     }
@@ -173,16 +362,19 @@ static inline int64_t MP4_TrackGetPTSDelta( demux_t *p_demux, mp4_track_t *p_tra
     unsigned int i_index = 0;
     unsigned int i_sample = p_track->i_sample - ck->i_sample_first;
 
-    if( ck->p_sample_count_pts == NULL || ck->p_sample_offset_pts == NULL )
-        return -1;
-
     for( i_index = 0;; i_index++ )
     {
-        if( i_sample < ck->p_sample_count_pts[i_index] )
-            return ck->p_sample_offset_pts[i_index] * INT64_C(1000000) /
+        uint32_t i_count;
+        int32_t i_offset;
+
+        if( !MP4_ChunkGetPTSRun( p_track, ck, i_index, &i_count, &i_offset ) )
+            return -1;
+
+        if( i_sample < i_count )
+            return i_offset * INT64_C(1000000) /
                    (int64_t)p_track->i_timescale;
 
-        i_sample -= ck->p_sample_count_pts[i_index];
+        i_sample -= i_count;
     }
 }
 
@@ -378,11 +570,14 @@ static int Open( vlc_object_t * p_this )
         CreateTracksFromSmooBox( p_demux );
         return VLC_SUCCESS;
     }
-    else if( p_sys->b_fragmented && b_seekable )
+    else if( p_sys->b_fragmented && b_seekable &&
+             ( MP4_BoxCount( p_sys->p_root, "/moov/trak" ) != 1 ||
+               !MP4_frg_HasIndex( p_demux ) ) )
     {
-        /* We are not yet able to demux a fragmented MP4 file, using the 'mfra'
-         * box. So if STREAM_CAN_FASTSEEK is true, we're assuming we've got such
-         * a file, and we let avformat do the job. */
+        /* Fragmented files are demuxed by reading their fragments in order,
+         * which only works for single track files (like DASH representations).
+         * Seeking needs a fragment index (sidx or mfra) too, so we let
+         * avformat do the job for other files. */
         msg_Warn( p_demux, "MP4 plugin discarded "\
                 "(fast-seekable and fragmented, let avformat demux it)" );
         stream_Seek( p_demux->s, 0 ); /* rewind, for other demux */
@@ -628,6 +823,9 @@ static int Open( vlc_object_t * p_this )
         }
     }
 
+    if( p_sys->b_fragmented )
+        MP4_frg_IndexInit( p_demux );
+
     /* */
     LoadChapter( p_demux );
 
@@ -642,6 +840,196 @@ error:
     return VLC_EGENERIC;
 }
 
+/*****************************************************************************
+ * Read cache: instead of seeking to every sample, the chunks of all selected
+ * tracks that are close to each other in the file are fetched with a single
+ * read, and the samples are sent as slices of that data without copying.
+ *****************************************************************************/
+#define MP4_READ_MAX_SIZE   (4 * 1024 * 1024)   /* size of one read */
+#define MP4_READ_MAX_GAP    (64 * 1024)         /* unused data read between chunks */
+#define MP4_READ_MAX_CHUNKS 8                   /* chunks per track to plan */
+
+typedef struct
+{
+    block_t           self;
+    mp4_shared_data_t *p_data;
+} mp4_slice_t;
+
+typedef struct
+{
+    uint64_t i_offset;
+    uint64_t i_end;
+} mp4_read_range_t;
+
+static vlc_mutex_t slice_lock = VLC_STATIC_MUTEX;
+
+static void SharedDataRelease( mp4_shared_data_t *p_data )
+{
+    vlc_mutex_lock( &slice_lock );
+    bool b_last = --p_data->i_refs == 0;
+    vlc_mutex_unlock( &slice_lock );
+
+    if( b_last )
+    {
+        block_Release( p_data->p_block );
+        free( p_data );
+    }
+}
+
+static void SliceRelease( block_t *p_block )
+{
+    mp4_slice_t *p_slice = (mp4_slice_t *)p_block;
+
+    SharedDataRelease( p_slice->p_data );
+    free( p_slice );
+}
+
+static block_t *SliceNew( mp4_shared_data_t *p_data, size_t i_offset,
+                          size_t i_size )
+{
+    mp4_slice_t *p_slice = malloc( sizeof( *p_slice ) );
+    if( !p_slice )
+        return NULL;
+
+    block_Init( &p_slice->self, p_data->p_block->p_buffer + i_offset, i_size );
+    p_slice->self.pf_release = SliceRelease;
+    p_slice->p_data = p_data;
+
+    vlc_mutex_lock( &slice_lock );
+    p_data->i_refs++;
+    vlc_mutex_unlock( &slice_lock );
+    return &p_slice->self;
+}
+
+static int RangeCmp( const void *a, const void *b )
+{
+    const mp4_read_range_t *ra = a, *rb = b;
+
+    if( ra->i_offset != rb->i_offset )
+        return ra->i_offset < rb->i_offset ? -1 : 1;
+    return 0;
+}
+
+/* Plan a read starting at i_pos that covers the following chunks of all
+ * selected tracks in file order, as long as they are close together */
+static uint64_t ReadCachePlan( demux_t *p_demux, uint64_t i_pos, uint64_t i_end )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_read_range_t *p_ranges;
+    unsigned int i_ranges = 0;
+
+    p_ranges = malloc( p_sys->i_tracks * MP4_READ_MAX_CHUNKS *
+                       sizeof( *p_ranges ) );
+    if( !p_ranges )
+        return i_end;
+
+    for( unsigned int i_track = 0; i_track < p_sys->i_tracks; i_track++ )
+    {
+        mp4_track_t *tk = &p_sys->track[i_track];
+
+        if( !tk->b_ok || tk->b_chapter || !tk->b_selected ||
+            tk->i_sample >= tk->i_sample_count || tk->fmt.i_cat == SPU_ES )
+            continue;
+
+        for( uint32_t i_chunk = tk->i_chunk;
+             i_chunk < tk->i_chunk_count &&
+             i_chunk < tk->i_chunk + MP4_READ_MAX_CHUNKS; i_chunk++ )
+        {
+            mp4_read_range_t *r = &p_ranges[i_ranges++];
+
+            r->i_offset = tk->chunk[i_chunk].i_offset;
+            r->i_end = r->i_offset + MP4_TrackChunkSize( tk, i_chunk );
+            if( i_chunk == tk->i_chunk )
+                r->i_offset = MP4_TrackGetPos( tk );
+        }
+    }
+
+    qsort( p_ranges, i_ranges, sizeof( *p_ranges ), RangeCmp );
+
+    for( unsigned int i = 0; i < i_ranges; i++ )
+    {
+        const mp4_read_range_t *r = &p_ranges[i];
+
+        if( r->i_end <= i_end )
+            continue;
+        if( r->i_offset > i_end + MP4_READ_MAX_GAP ||
+            r->i_end - i_pos > MP4_READ_MAX_SIZE )
+            break;
+        i_end = r->i_end;
+    }
+
+    free( p_ranges );
+    return i_end;
+}
+
+/* Read i_size bytes at i_pos, from the cache if possible */
+static block_t *ReadCacheBlock( demux_t *p_demux, uint64_t i_pos, size_t i_size )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_read_cache_t *p_slot = NULL;
+
+    for( unsigned int i = 0; i < MP4_READ_CACHE_SLOTS; i++ )
+    {
+        mp4_read_cache_t *c = &p_sys->cache[i];
+
+        if( c->p_data && i_pos >= c->i_offset &&
+            i_pos + i_size <= c->i_offset + c->p_data->p_block->i_buffer )
+        {
+            c->i_tick = ++p_sys->i_cache_tick;
+            return SliceNew( c->p_data, i_pos - c->i_offset, i_size );
+        }
+        if( !p_slot || !c->p_data ||
+            ( p_slot->p_data && c->i_tick < p_slot->i_tick ) )
+            p_slot = c;
+    }
+
+    uint64_t i_end = i_pos + i_size;
+    if( i_size <= MP4_READ_MAX_SIZE )
+        i_end = ReadCachePlan( p_demux, i_pos, i_end );
+
+    if( stream_Tell( p_demux->s ) != i_pos &&
+        stream_Seek( p_demux->s, i_pos ) )
+        return NULL;
+
+    block_t *p_block = stream_Block( p_demux->s, i_end - i_pos );
+    if( !p_block || i_end == i_pos + i_size )
+        return p_block;
+    if( p_block->i_buffer < i_size )
+    {
+        block_Release( p_block );
+        return NULL;
+    }
+
+    mp4_shared_data_t *p_data = malloc( sizeof( *p_data ) );
+    if( !p_data )
+    {
+        block_Release( p_block );
+        return NULL;
+    }
+    p_data->i_refs = 1;
+    p_data->p_block = p_block;
+
+    if( p_slot->p_data )
+        SharedDataRelease( p_slot->p_data );
+    p_slot->p_data = p_data;
+    p_slot->i_offset = i_pos;
+    p_slot->i_tick = ++p_sys->i_cache_tick;
+
+    return SliceNew( p_data, 0, i_size );
+}
+
+static void ReadCacheFlush( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+
+    for( unsigned int i = 0; i < MP4_READ_CACHE_SLOTS; i++ )
+    {
+        if( p_sys->cache[i].p_data )
+            SharedDataRelease( p_sys->cache[i].p_data );
+        p_sys->cache[i].p_data = NULL;
+    }
+}
+
 /*****************************************************************************
  * Demux: read packet and send them to decoders
  *****************************************************************************
@@ -728,23 +1116,29 @@ static int Demux( demux_t *p_demux )
                      MP4_GetMoviePTS( p_sys ) );
 #endif
 
-            if( MP4_TrackSampleSize( tk ) > 0 )
+            /* both may read the sample size table, which moves the stream */
+            const int i_block_size = MP4_TrackSampleSize( tk );
+            if( i_block_size > 0 )
             {
+                const uint64_t i_block_pos = MP4_TrackGetPos( tk );
                 block_t *p_block;
                 int64_t i_delta;
 
                 /* go,go go ! */
-                if( stream_Seek( p_demux->s, MP4_TrackGetPos( tk ) ) )
+                if( tk->fmt.i_cat == SPU_ES )
                 {
-                    msg_Warn( p_demux, "track[0x%x] will be disabled (eof?)",
-                              tk->i_track_ID );
-                    MP4_TrackUnselect( p_demux, tk );
-                    break;
+                    /* the text samples are modified in place */
+                    if( stream_Seek( p_demux->s, i_block_pos ) )
+                        p_block = NULL;
+                    else
+                        p_block = stream_Block( p_demux->s, i_block_size );
+                }
+                else
+                {
+                    p_block = ReadCacheBlock( p_demux, i_block_pos, i_block_size );
                 }
 
-                /* now read pes */
-                if( !(p_block =
-                         stream_Block( p_demux->s, MP4_TrackSampleSize(tk) )) )
+                if( !p_block )
                 {
                     msg_Warn( p_demux, "track[0x%x] will be disabled (eof?)",
                               tk->i_track_ID );
@@ -840,17 +1234,401 @@ static int Seek( demux_t *p_demux, mtime_t i_date )
     /* Now for each stream try to go to this time */
     for( i_track = 0; i_track < p_sys->i_tracks; i_track++ )
     {
-        mp4_track_t *tk = &p_sys->track[i_track];
-        MP4_TrackSeek( p_demux, tk, i_date );
+        mp4_track_t *tk = &p_sys->track[i_track];
+        MP4_TrackSeek( p_demux, tk, i_date );
+    }
+    MP4_UpdateSeekpoint( p_demux );
+
+    es_out_Control( p_demux->out, ES_OUT_SET_NEXT_DISPLAY_TIME, i_date );
+
+    return VLC_SUCCESS;
+}
+
+/*****************************************************************************
+ * Fragment index: start offset and time of the fragments of one track, taken
+ * from sidx or mfra/tfra boxes and from the fragments read so far. Seeking in
+ * a fragmented file uses it instead of guessing a byte position.
+ *****************************************************************************/
+#define MP4_FRG_SCAN_MAX 4096       /* fragments to scan for one seek */
+#define MP4_PREFETCH_MAX_SIZE (32 * 1024 * 1024)
+
+static void MP4_frg_IndexAdd( demux_sys_t *p_sys, uint64_t i_offset, mtime_t i_time )
+{
+    if( p_sys->i_frg_count > 0 )
+    {
+        const mp4_fragment_t *p_last = &p_sys->p_frg_index[p_sys->i_frg_count - 1];
+        if( i_offset <= p_last->i_offset || i_time < p_last->i_time )
+            return; /* already known */
+    }
+
+    if( p_sys->i_frg_count == p_sys->i_frg_size )
+    {
+        unsigned int i_size = __MAX( 2 * p_sys->i_frg_size, 64 );
+        mp4_fragment_t *p_index = realloc( p_sys->p_frg_index,
+                                           i_size * sizeof( mp4_fragment_t ) );
+        if( !p_index )
+            return;
+        p_sys->p_frg_index = p_index;
+        p_sys->i_frg_size = i_size;
+    }
+    p_sys->p_frg_index[p_sys->i_frg_count].i_offset = i_offset;
+    p_sys->p_frg_index[p_sys->i_frg_count].i_time = i_time;
+    p_sys->i_frg_count++;
+}
+
+/* Record a fragment [i_offset, i_end) of a track, starting at i_dts and
+ * ending at i_end_dts in the track timescale. It is only used if it follows
+ * the indexed part of the file, otherwise its time may be a guess. */
+static void MP4_frg_IndexFragment( demux_sys_t *p_sys, const mp4_track_t *tk,
+                                   uint64_t i_offset, uint64_t i_end,
+                                   uint64_t i_dts, uint64_t i_end_dts )
+{
+    if( p_sys->b_frg_complete || i_offset != p_sys->i_frg_end_offset )
+        return;
+
+    p_sys->i_frg_end_offset = i_end;
+    if( tk->i_track_ID == p_sys->i_frg_track_ID && tk->i_timescale > 0 )
+    {
+        MP4_frg_IndexAdd( p_sys, i_offset, CLOCK_FREQ * i_dts / tk->i_timescale );
+        p_sys->i_frg_end_dts = i_end_dts;
+    }
+}
+
+/* Index the subsegments referenced by a sidx box, i_base is the file offset
+ * of the stream the box was read from */
+static void MP4_frg_IndexSidx( demux_t *p_demux, MP4_Box_t *p_sidx, uint64_t i_base )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    MP4_Box_data_sidx_t *p_data = p_sidx->data.p_sidx;
+    mp4_track_t *tk = MP4_frg_GetTrack( p_demux, p_sys->i_frg_track_ID );
+
+    if( !p_data || p_data->i_reference_ID != p_sys->i_frg_track_ID ||
+        p_data->i_timescale == 0 || !tk || tk->i_timescale == 0 )
+        return;
+
+    /* references to other sidx boxes are indexed like segments, the
+     * subsegments they index are added when they are read */
+    uint64_t i_offset = i_base + p_sidx->i_pos + p_sidx->i_size +
+                        p_data->i_first_offset;
+    uint64_t i_time = p_data->i_earliest_presentation_time;
+    for( unsigned i = 0; i < p_data->i_reference_count; i++ )
+    {
+        MP4_frg_IndexAdd( p_sys, i_offset, CLOCK_FREQ * i_time / p_data->i_timescale );
+        i_offset += p_data->p_items[i].i_referenced_size;
+        i_time += p_data->p_items[i].i_subsegment_duration;
+    }
+
+    if( i_offset > p_sys->i_frg_end_offset )
+    {
+        p_sys->i_frg_end_offset = i_offset;
+        p_sys->i_frg_end_dts = i_time * tk->i_timescale / p_data->i_timescale;
+    }
+    msg_Dbg( p_demux, "sidx: %u fragments indexed", p_sys->i_frg_count );
+}
+
+/* Index the fragments listed by the mfra box at the end of the file */
+static void MP4_frg_IndexMfra( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_track_t *tk = MP4_frg_GetTrack( p_demux, p_sys->i_frg_track_ID );
+    uint64_t i_pos = stream_Tell( p_demux->s );
+    uint64_t i_size = stream_Size( p_demux->s );
+    const uint8_t *p_peek;
+
+    if( !tk || tk->i_timescale == 0 || i_size < 16 ||
+        stream_Seek( p_demux->s, i_size - 16 ) ||
+        stream_Peek( p_demux->s, &p_peek, 16 ) < 16 ||
+        VLC_FOURCC( p_peek[4], p_peek[5], p_peek[6], p_peek[7] ) != ATOM_mfro )
+        goto end;
+
+    uint32_t i_mfra_size = GetDWBE( &p_peek[12] );
+    if( i_mfra_size < 16 || i_mfra_size > i_size ||
+        stream_Seek( p_demux->s, i_size - i_mfra_size ) )
+        goto end;
+
+    MP4_Box_t *p_chunk = MP4_BoxGetNextChunk( p_demux->s );
+    MP4_Box_t *p_mfra = p_chunk ? MP4_BoxGet( p_chunk, "mfra" ) : NULL;
+    for( MP4_Box_t *p_tfra = p_mfra ? p_mfra->p_first : NULL; p_tfra;
+         p_tfra = p_tfra->p_next )
+    {
+        MP4_Box_data_tfra_t *p_data = p_tfra->data.p_tfra;
+        if( p_tfra->i_type != ATOM_tfra || !p_data ||
+            p_data->i_track_ID != p_sys->i_frg_track_ID )
+            continue;
+
+        for( uint32_t i = 0; i < p_data->i_number_of_entries; i++ )
+        {
+            uint64_t i_time, i_offset;
+            if( p_data->i_version == 1 )
+            {
+                i_time = ((uint64_t *)p_data->p_time)[i];
+                i_offset = ((uint64_t *)p_data->p_moof_offset)[i];
+            }
+            else
+            {
+                i_time = p_data->p_time[i];
+                i_offset = p_data->p_moof_offset[i];
+            }
+            /* only random access points at the start of a fragment */
+            if( p_data->p_trun_number[i * ( 1 + p_data->i_length_size_of_trun_num )] != 1 ||
+                p_data->p_sample_number[i * ( 1 + p_data->i_length_size_of_sample_num )] != 1 )
+                continue;
+            MP4_frg_IndexAdd( p_sys, i_offset, CLOCK_FREQ * i_time / tk->i_timescale );
+        }
+        p_sys->b_frg_complete = p_sys->i_frg_count > 0;
+        p_sys->i_frg_end_offset = i_size - i_mfra_size;
+        msg_Dbg( p_demux, "mfra: %u fragments indexed", p_sys->i_frg_count );
+        break;
+    }
+    if( p_chunk )
+        MP4_BoxFree( p_demux->s, p_chunk );
+
+end:
+    stream_Seek( p_demux->s, i_pos );
+}
+
+/* Check if a fast-seekable fragmented file has a fragment index: a sidx box
+ * after the moov, or a mfro box at the end */
+static bool MP4_frg_HasIndex( demux_t *p_demux )
+{
+    const uint8_t *p_peek;
+    uint64_t i_pos = stream_Tell( p_demux->s );
+    uint64_t i_size = stream_Size( p_demux->s );
+    bool b_index = false;
+
+    if( stream_Peek( p_demux->s, &p_peek, 8 ) == 8 &&
+        VLC_FOURCC( p_peek[4], p_peek[5], p_peek[6], p_peek[7] ) == ATOM_sidx )
+        b_index = true;
+    else if( i_size > 16 && !stream_Seek( p_demux->s, i_size - 16 ) &&
+             stream_Peek( p_demux->s, &p_peek, 8 ) == 8 &&
+             VLC_FOURCC( p_peek[4], p_peek[5], p_peek[6], p_peek[7] ) == ATOM_mfro )
+        b_index = true;
+
+    stream_Seek( p_demux->s, i_pos );
+    return b_index;
+}
+
+/* Read one fragment (the boxes up to and including a mdat) at i_offset */
+static block_t *MP4_frg_ReadFragment( stream_t *s, uint64_t i_offset )
+{
+    const uint8_t *p_peek;
+    uint64_t i_size = 0;
+
+    for( ;; )
+    {
+        if( stream_Seek( s, i_offset + i_size ) ||
+            stream_Peek( s, &p_peek, 16 ) < 8 )
+            return NULL;
+
+        uint64_t i_box_size = GetDWBE( p_peek );
+        uint32_t i_type = VLC_FOURCC( p_peek[4], p_peek[5], p_peek[6], p_peek[7] );
+        if( i_box_size == 1 )
+            i_box_size = GetQWBE( &p_peek[8] );
+        if( i_box_size < 8 || i_size + i_box_size > MP4_PREFETCH_MAX_SIZE ||
+            i_type == ATOM_ftyp || i_type == ATOM_uuid )
+            return NULL;
+
+        i_size += i_box_size;
+        if( i_type == ATOM_mdat )
+            break;
+    }
+
+    if( stream_Seek( s, i_offset ) )
+        return NULL;
+    block_t *p_block = stream_Block( s, i_size );
+    if( p_block && p_block->i_buffer < i_size )
+    {
+        block_Release( p_block );
+        p_block = NULL;
+    }
+    return p_block;
+}
+
+/* Skip the fragments after the indexed part of the file up to i_time, to
+ * index them */
+static void MP4_frg_IndexScan( demux_t *p_demux, mtime_t i_time )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_track_t *tk = MP4_frg_GetTrack( p_demux, p_sys->i_frg_track_ID );
+    const uint8_t *p_peek;
+
+    if( !tk || tk->i_timescale == 0 ||
+        stream_Seek( p_demux->s, p_sys->i_frg_end_offset ) )
+        return;
+
+    for( unsigned i = 0; i < MP4_FRG_SCAN_MAX && !p_sys->b_frg_complete &&
+         CLOCK_FREQ * p_sys->i_frg_end_dts / tk->i_timescale <= (uint64_t)i_time; i++ )
+    {
+        uint64_t i_offset = stream_Tell( p_demux->s );
+        MP4_Box_t *p_chunk = MP4_BoxGetNextChunk( p_demux->s );
+        if( !p_chunk )
+        {
+            p_sys->b_frg_complete = true;
+            break;
+        }
+
+        MP4_Box_t *p_traf = MP4_BoxGet( p_chunk, "moof/traf" );
+        MP4_Box_t *p_tfhd = p_traf ? MP4_BoxGet( p_traf, "tfhd" ) : NULL;
+        MP4_Box_t *p_trun = p_traf ? MP4_BoxGet( p_traf, "trun" ) : NULL;
+        MP4_Box_t *p_sidx = MP4_BoxGet( p_chunk, "sidx" );
+        uint64_t i_mdat_size = 0;
+
+        if( p_sidx )
+            MP4_frg_IndexSidx( p_demux, p_sidx, 0 );
+
+        if( !p_tfhd || !p_trun || p_chunk->p_first->i_type == ATOM_ftyp ||
+            stream_Peek( p_demux->s, &p_peek, 16 ) < 8 ||
+            VLC_FOURCC( p_peek[4], p_peek[5], p_peek[6], p_peek[7] ) != ATOM_mdat ||
+            ( i_mdat_size = GetDWBE( p_peek ) ) == 0 )
+        {
+            /* end of the fragments or unexpected layout */
+            p_sys->b_frg_complete = true;
+            MP4_BoxFree( p_demux->s, p_chunk );
+            break;
+        }
+        if( i_mdat_size == 1 )
+            i_mdat_size = GetQWBE( &p_peek[8] );
+
+        mp4_track_t *p_track = MP4_frg_GetTrack( p_demux, p_tfhd->data.p_tfhd->i_track_ID );
+        if( p_track && p_track == tk )
+        {
+            MP4_Box_data_tfhd_t *p_tfhd_data = p_tfhd->data.p_tfhd;
+            MP4_Box_data_trun_t *p_trun_data = p_trun->data.p_trun;
+            MP4_Box_t *p_trex = MP4_BoxGet( p_sys->p_root, "moov/mvex/trex" );
+            uint64_t i_duration = 0;
+            uint32_t i_default = 0;
+
+            if( p_tfhd_data->i_flags & MP4_TFHD_DFLT_SAMPLE_DURATION )
+                i_default = p_tfhd_data->i_default_sample_duration;
+            else if( p_trex && p_trex->data.p_trex )
+                i_default = p_trex->data.p_trex->i_default_sample_duration;
+
+            for( uint32_t j = 0; j < p_trun_data->i_sample_count; j++ )
+                i_duration += ( p_trun_data->i_flags & MP4_TRUN_SAMPLE_DURATION ) ?
+                              p_trun_data->p_samples[j].i_duration : i_default;
+
+            MP4_frg_IndexFragment( p_sys, tk, i_offset,
+                                   stream_Tell( p_demux->s ) + i_mdat_size,
+                                   p_sys->i_frg_end_dts,
+                                   p_sys->i_frg_end_dts + i_duration );
+        }
+        else if( p_track )
+        {
+            MP4_frg_IndexFragment( p_sys, p_track, i_offset,
+                                   stream_Tell( p_demux->s ) + i_mdat_size, 0, 0 );
+        }
+        MP4_BoxFree( p_demux->s, p_chunk );
+
+        if( p_sys->i_frg_end_offset != stream_Tell( p_demux->s ) + i_mdat_size ||
+            stream_Seek( p_demux->s, p_sys->i_frg_end_offset ) )
+            break;
+    }
+}
+
+/* Choose the track to index and load the index of the file */
+static void MP4_frg_IndexInit( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    bool b_fastseek = false;
+
+    for( unsigned i = 0; i < p_sys->i_tracks; i++ )
+    {
+        mp4_track_t *tk = &p_sys->track[i];
+        if( !tk->b_ok || tk->b_chapter )
+            continue;
+        if( p_sys->i_frg_track_ID == 0 || tk->fmt.i_cat == VIDEO_ES )
+            p_sys->i_frg_track_ID = tk->i_track_ID;
+        if( tk->fmt.i_cat == VIDEO_ES )
+            break;
+    }
+    p_sys->i_frg_end_offset = stream_Tell( p_demux->s );
+
+    stream_Control( p_demux->s, STREAM_CAN_FASTSEEK, &b_fastseek );
+    if( !b_fastseek || p_sys->i_frg_track_ID == 0 )
+        return;
+
+    MP4_frg_IndexMfra( p_demux );
+
+    /* fragments of local files can be read ahead with a second stream */
+    if( var_InheritBool( p_demux, "mp4-prefetch" ) &&
+        p_demux->psz_access && p_demux->psz_location )
+        MP4_frg_PrefetchNew( p_demux );
+}
+
+/* Reset the tracks to continue with the fragment at the stream position,
+ * starting at i_time */
+static void MP4_frg_ResetTracks( demux_t *p_demux, mtime_t i_time )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+
+    /* update global time */
+    p_sys->i_time = i_time * p_sys->i_timescale / CLOCK_FREQ;
+    p_sys->i_pcr  = MP4_GetMoviePTS( p_sys );
+
+    for( unsigned i_track = 0; i_track < p_sys->i_tracks; i_track++ )
+    {
+        mp4_track_t *tk = &p_sys->track[i_track];
+
+        /* We don't want the current chunk to be flushed */
+        tk->cchunk->i_sample = tk->cchunk->i_sample_count;
+
+        /* reset/update some values */
+        tk->i_sample = tk->i_sample_first = 0;
+        tk->i_first_dts = i_time * tk->i_timescale / CLOCK_FREQ;
+
+        /* We want to discard the current chunk and get the next one at once */
+        tk->b_has_non_empty_cchunk = false;
+
+        /* don't send samples the decoder can't use */
+        tk->b_wait_sync = tk->fmt.i_cat == VIDEO_ES;
+    }
+}
+
+/* Seek to the indexed fragment containing i_time */
+static int MP4_frg_SeekIndex( demux_t *p_demux, mtime_t i_time )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_track_t *tk = MP4_frg_GetTrack( p_demux, p_sys->i_frg_track_ID );
+    bool b_fastseek = false;
+
+    if( !tk || tk->i_timescale == 0 )
+        return VLC_EGENERIC;
+
+    if( !p_sys->b_frg_complete &&
+        (uint64_t)i_time >= CLOCK_FREQ * p_sys->i_frg_end_dts / tk->i_timescale )
+    {
+        /* the index doesn't reach the target yet, scan up to it */
+        stream_Control( p_demux->s, STREAM_CAN_FASTSEEK, &b_fastseek );
+        if( !b_fastseek )
+            return VLC_EGENERIC;
+        MP4_frg_IndexScan( p_demux, i_time );
+    }
+    if( p_sys->i_frg_count == 0 )
+        return VLC_EGENERIC;
+
+    unsigned int i_low = 0, i_high = p_sys->i_frg_count;
+    while( i_high - i_low > 1 )
+    {
+        unsigned int i_mid = i_low + ( i_high - i_low ) / 2;
+        if( p_sys->p_frg_index[i_mid].i_time <= i_time )
+            i_low = i_mid;
+        else
+            i_high = i_mid;
     }
-    MP4_UpdateSeekpoint( p_demux );
 
-    es_out_Control( p_demux->out, ES_OUT_SET_NEXT_DISPLAY_TIME, i_date );
+    const mp4_fragment_t *p_frg = &p_sys->p_frg_index[i_low];
+    if( stream_Seek( p_demux->s, p_frg->i_offset ) )
+        return VLC_EGENERIC;
 
+    msg_Dbg( p_demux, "seek to fragment %u at %"PRIu64" (%"PRId64" ms)",
+             i_low, p_frg->i_offset, p_frg->i_time / 1000 );
+    MP4_frg_ResetTracks( p_demux, p_frg->i_time );
+    es_out_Control( p_demux->out, ES_OUT_SET_NEXT_DISPLAY_TIME, i_time );
     return VLC_SUCCESS;
 }
 
-static int MP4_frg_Seek( demux_t *p_demux, double f )
+/* Seek to a byte position, for files without a usable index */
+static int MP4_frg_SeekPosition( demux_t *p_demux, double f )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
 
@@ -861,27 +1639,39 @@ static int MP4_frg_Seek( demux_t *p_demux, double f )
     }
     else
     {
-        /* update global time */
-        p_sys->i_time = (uint64_t)(f * (double)p_sys->i_duration);
-        p_sys->i_pcr  = MP4_GetMoviePTS( p_sys );
+        /* the time of the following fragments is a guess from here on */
+        MP4_frg_ResetTracks( p_demux, (mtime_t)( f * CLOCK_FREQ *
+                             (double)p_sys->i_duration /
+                             (double)__MAX( p_sys->i_timescale, 1 ) ) );
+        es_out_Control( p_demux->out, ES_OUT_SET_NEXT_DISPLAY_TIME, p_sys->i_pcr );
+        return VLC_SUCCESS;
+    }
+}
 
-        for( unsigned i_track = 0; i_track < p_sys->i_tracks; i_track++ )
-        {
-            mp4_track_t *tk = &p_sys->track[i_track];
+static int MP4_frg_Seek( demux_t *p_demux, double f )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+
+    if( p_sys->i_timescale > 0 &&
+        MP4_frg_SeekIndex( p_demux, (mtime_t)( f * CLOCK_FREQ *
+                           (double)p_sys->i_duration /
+                           (double)p_sys->i_timescale ) ) == VLC_SUCCESS )
+        return VLC_SUCCESS;
 
-            /* We don't want the current chunk to be flushed */
-            tk->cchunk->i_sample = tk->cchunk->i_sample_count;
+    return MP4_frg_SeekPosition( p_demux, f );
+}
 
-            /* reset/update some values */
-            tk->i_sample = tk->i_sample_first = 0;
-            tk->i_first_dts = p_sys->i_time;
+static int MP4_frg_SeekTime( demux_t *p_demux, mtime_t i_time )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
 
-            /* We want to discard the current chunk and get the next one at once */
-            tk->b_has_non_empty_cchunk = false;
-        }
-        es_out_Control( p_demux->out, ES_OUT_SET_NEXT_DISPLAY_TIME, p_sys->i_pcr );
+    if( MP4_frg_SeekIndex( p_demux, i_time ) == VLC_SUCCESS )
         return VLC_SUCCESS;
-    }
+    if( p_sys->i_duration == 0 || p_sys->i_timescale == 0 )
+        return VLC_EGENERIC;
+
+    return MP4_frg_SeekPosition( p_demux, (double)i_time * p_sys->i_timescale /
+                                          ( (double)CLOCK_FREQ * p_sys->i_duration ) );
 }
 
 /*****************************************************************************
@@ -936,6 +1726,10 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
 
         case DEMUX_SET_TIME:
             i64 = (int64_t)va_arg( args, int64_t );
+            if( p_sys->b_fragmented )
+            {
+                return MP4_frg_SeekTime( p_demux, i64 );
+            }
             return Seek( p_demux, i64 );
 
         case DEMUX_GET_LENGTH:
@@ -1169,6 +1963,10 @@ static void Close ( vlc_object_t * p_this )
 
     msg_Dbg( p_demux, "freeing all memory" );
 
+    ReadCacheFlush( p_demux );
+    MP4_frg_PrefetchDelete( p_demux );
+    free( p_sys->p_frg_index );
+
     MP4_BoxFree( p_demux->s, p_sys->p_root );
     for( i_track = 0; i_track < p_sys->i_tracks; i_track++ )
     {
@@ -1371,6 +2169,8 @@ static int TrackCreateChunksIndex( demux_t *p_demux,
     return VLC_SUCCESS;
 }
 
+static int TrackCreateSyncIndex( demux_t *, mp4_track_t * );
+
 static int TrackCreateSamplesIndex( demux_t *p_demux,
                                     mp4_track_t *p_demux_track )
 {
@@ -1379,7 +2179,6 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
         return VLC_SUCCESS;
 
     MP4_Box_t *p_box;
-    MP4_Box_data_stsz_t *stsz;
     MP4_Box_data_stts_t *stts;
     /* TODO use also stss and stsh table for seeking */
     /* FIXME use edit table */
@@ -1391,17 +2190,43 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
 
     int64_t i_next_dts;
 
+    uint32_t i_sample_size, i_sample_count;
+    uint32_t *p_entry_size;
+    uint64_t i_entries_offset;
+    uint8_t  i_field_size;
+
+    /* compact tables keep stts/ctts as they are and don't create
+     * per chunk extracts */
+    const bool b_compact = var_InheritBool( p_demux, "mp4-compact-tables" );
+
     /* Find stsz
      *  Gives the sample size for each samples. There is also a stz2 table
-     *  (compressed form) that we need to implement TODO */
-    p_box = MP4_BoxGet( p_demux_track->p_stbl, "stsz" );
-    if( !p_box )
+     *  (compressed form with 4, 8 or 16 bits per entry) */
+    if( ( p_box = MP4_BoxGet( p_demux_track->p_stbl, "stsz" ) ) )
+    {
+        MP4_Box_data_stsz_t *stsz = p_box->data.p_stsz;
+
+        i_sample_size = stsz->i_sample_size;
+        i_sample_count = stsz->i_sample_count;
+        p_entry_size = stsz->i_entry_size;
+        i_entries_offset = stsz->i_entries_offset;
+        i_field_size = 32;
+    }
+    else if( ( p_box = MP4_BoxGet( p_demux_track->p_stbl, "stz2" ) ) )
+    {
+        MP4_Box_data_stz2_t *stz2 = p_box->data.p_stz2;
+
+        i_sample_size = 0;
+        i_sample_count = stz2->i_sample_count;
+        p_entry_size = stz2->i_entry_size;
+        i_entries_offset = stz2->i_entries_offset;
+        i_field_size = stz2->i_field_size;
+    }
+    else
     {
-        /* FIXME and stz2 */
-        msg_Warn( p_demux, "cannot find STSZ box" );
+        msg_Warn( p_demux, "cannot find STSZ/STZ2 box" );
         return VLC_EGENERIC;
     }
-    stsz = p_box->data.p_stsz;
 
     /* Find stts
      *  Gives mapping between sample and decoding time
@@ -1415,16 +2240,29 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
     stts = p_box->data.p_stts;
 
     /* Use stsz table to create a sample number -> sample size table */
-    p_demux_track->i_sample_count = stsz->i_sample_count;
-    if( stsz->i_sample_size )
+    p_demux_track->i_sample_count = i_sample_count;
+    if( i_sample_size )
     {
         /* 1: all sample have the same size, so no need to construct a table */
-        p_demux_track->i_sample_size = stsz->i_sample_size;
+        p_demux_track->i_sample_size = i_sample_size;
         p_demux_track->p_sample_size = NULL;
     }
+    else if( i_entries_offset )
+    {
+        /* 2: the table is read from the file when needed */
+        p_demux_track->i_sample_size = 0;
+        p_demux_track->p_sample_size = malloc( MP4_SIZE_PAGE * sizeof( uint32_t ) );
+        if( p_demux_track->p_sample_size == NULL )
+            return VLC_ENOMEM;
+        p_demux_track->p_size_stream = p_demux->s;
+        p_demux_track->i_size_offset = i_entries_offset;
+        p_demux_track->i_size_field = i_field_size;
+        p_demux_track->i_size_page = 0;
+        p_demux_track->i_size_page_count = 0;
+    }
     else
     {
-        /* 2: each sample can have a different size */
+        /* 3: each sample can have a different size */
         p_demux_track->i_sample_size = 0;
         p_demux_track->p_sample_size =
             calloc( p_demux_track->i_sample_count, sizeof( uint32_t ) );
@@ -1434,7 +2272,7 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
         for( i_sample = 0; i_sample < p_demux_track->i_sample_count; i_sample++ )
         {
             p_demux_track->p_sample_size[i_sample] =
-                    stsz->i_entry_size[i_sample];
+                    p_entry_size[i_sample];
         }
     }
 
@@ -1446,7 +2284,40 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
 
     i_next_dts = 0;
     i_index = 0; i_index_sample_used = 0;
-    for( i_chunk = 0; i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
+    if( b_compact )
+    {
+        /* only remember where each chunk starts in the stts table */
+        p_demux_track->p_stts = stts;
+        for( i_chunk = 0; i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
+        {
+            mp4_chunk_t *ck = &p_demux_track->chunk[i_chunk];
+            int64_t i_sample_count = ck->i_sample_count;
+
+            ck->i_first_dts = i_next_dts;
+            ck->i_last_dts  = i_next_dts;
+            ck->i_stts_index = i_index;
+            ck->i_stts_used = i_index_sample_used;
+
+            while( i_sample_count > 0 && i_index < stts->i_entry_count )
+            {
+                int64_t i_used = __MIN( stts->i_sample_count[i_index] -
+                                        i_index_sample_used, i_sample_count );
+
+                i_index_sample_used += i_used;
+                i_sample_count -= i_used;
+                i_next_dts += i_used * stts->i_sample_delta[i_index];
+                if( i_used > 0 )
+                    ck->i_last_dts = i_next_dts - stts->i_sample_delta[i_index];
+
+                if( i_index_sample_used >= stts->i_sample_count[i_index] )
+                {
+                    i_index++;
+                    i_index_sample_used = 0;
+                }
+            }
+        }
+    }
+    for( i_chunk = 0; !b_compact && i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
     {
         mp4_chunk_t *ck = &p_demux_track->chunk[i_chunk];
         int64_t i_entry, i_sample_count, i;
@@ -1515,9 +2386,38 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
 
         msg_Warn( p_demux, "CTTS table" );
 
-        /* Create pts-dts table per chunk */
         i_index = 0; i_index_sample_used = 0;
-        for( i_chunk = 0; i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
+        if( b_compact )
+        {
+            /* only remember where each chunk starts in the ctts table */
+            p_demux_track->p_ctts = ctts;
+            for( i_chunk = 0; i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
+            {
+                mp4_chunk_t *ck = &p_demux_track->chunk[i_chunk];
+                int64_t i_sample_count = ck->i_sample_count;
+
+                ck->i_ctts_index = i_index;
+                ck->i_ctts_used = i_index_sample_used;
+
+                while( i_sample_count > 0 && i_index < ctts->i_entry_count )
+                {
+                    int64_t i_used = __MIN( ctts->i_sample_count[i_index] -
+                                            i_index_sample_used, i_sample_count );
+
+                    i_index_sample_used += i_used;
+                    i_sample_count -= i_used;
+
+                    if( i_index_sample_used >= ctts->i_sample_count[i_index] )
+                    {
+                        i_index++;
+                        i_index_sample_used = 0;
+                    }
+                }
+            }
+        }
+
+        /* Create pts-dts table per chunk */
+        for( i_chunk = 0; !b_compact && i_chunk < p_demux_track->i_chunk_count; i_chunk++ )
         {
             mp4_chunk_t *ck = &p_demux_track->chunk[i_chunk];
             int64_t i_entry, i_sample_count, i;
@@ -1578,6 +2478,113 @@ static int TrackCreateSamplesIndex( demux_t *p_demux,
     return VLC_SUCCESS;
 }
 
+static int SyncSampleCmp( const void *a, const void *b )
+{
+    const uint32_t i_a = *(const uint32_t *)a, i_b = *(const uint32_t *)b;
+
+    return i_a < i_b ? -1 : i_a > i_b;
+}
+
+/* Create the sorted list of sync samples used for seeking, from stss or
+ * (if there is none) from the dependency information of sdtp */
+static int TrackCreateSyncIndex( demux_t *p_demux, mp4_track_t *p_demux_track )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    MP4_Box_t *p_box;
+    uint32_t i_count = 0;
+
+    if( p_sys->b_fragmented )
+        return VLC_SUCCESS;
+
+    if( ( p_box = MP4_BoxGet( p_demux_track->p_stbl, "stss" ) ) )
+    {
+        MP4_Box_data_stss_t *p_stss = p_box->data.p_stss;
+
+        p_demux_track->p_sync_samples =
+            malloc( __MAX( p_stss->i_entry_count, 1 ) * sizeof( uint32_t ) );
+        if( !p_demux_track->p_sync_samples )
+            return VLC_ENOMEM;
+
+        for( uint32_t i = 0; i < p_stss->i_entry_count; i++ )
+        {
+            if( p_stss->i_sample_number[i] < p_demux_track->i_sample_count )
+                p_demux_track->p_sync_samples[i_count++] =
+                    p_stss->i_sample_number[i];
+        }
+        /* they should be sorted already, but don't rely on it */
+        qsort( p_demux_track->p_sync_samples, i_count, sizeof( uint32_t ),
+               SyncSampleCmp );
+    }
+    else if( ( p_box = MP4_BoxGet( p_demux_track->p_stbl, "sdtp" ) ) &&
+             p_demux_track->i_sample_count > 0 )
+    {
+        MP4_Box_data_sdtp_t *p_sdtp = p_box->data.p_sdtp;
+        /* the table has one byte per sample after version and flags */
+        uint32_t i_entries = __MIN( p_box->i_size - mp4_box_headersize( p_box ) - 4,
+                                    p_demux_track->i_sample_count );
+
+        p_demux_track->p_sync_samples = malloc( i_entries * sizeof( uint32_t ) );
+        if( !p_demux_track->p_sync_samples )
+            return VLC_ENOMEM;
+
+        for( uint32_t i = 0; i < i_entries; i++ )
+        {
+            /* sample_depends_on == 2: doesn't depend on other samples */
+            if( ( ( p_sdtp->p_sample_table[i] >> 4 ) & 0x03 ) == 2 )
+                p_demux_track->p_sync_samples[i_count++] = i;
+        }
+        if( i_count == 0 )
+        {
+            /* no useful information */
+            FREENULL( p_demux_track->p_sync_samples );
+        }
+    }
+    p_demux_track->i_sync_count = i_count;
+
+    if( p_demux_track->p_sync_samples )
+        msg_Dbg( p_demux, "track[Id 0x%x] has %"PRIu32" sync samples",
+                 p_demux_track->i_track_ID, i_count );
+    return VLC_SUCCESS;
+}
+
+/* Last sync sample not after i_sample (or the first one if there is none) */
+static uint32_t TrackGetSyncSample( const mp4_track_t *p_track, uint32_t i_sample )
+{
+    if( !p_track->p_sync_samples || p_track->i_sync_count == 0 )
+        return i_sample;
+
+    uint32_t i_low = 0, i_high = p_track->i_sync_count;
+    while( i_high - i_low > 1 )
+    {
+        uint32_t i_mid = i_low + ( i_high - i_low ) / 2;
+        if( p_track->p_sync_samples[i_mid] <= i_sample )
+            i_low = i_mid;
+        else
+            i_high = i_mid;
+    }
+    return p_track->p_sync_samples[i_low];
+}
+
+/* Chunk containing i_sample */
+static uint32_t TrackGetSampleChunk( const mp4_track_t *p_track, uint32_t i_sample )
+{
+    uint32_t i_low = 0, i_high = p_track->i_chunk_count;
+    while( i_high - i_low > 1 )
+    {
+        uint32_t i_mid = i_low + ( i_high - i_low ) / 2;
+        if( p_track->chunk[i_mid].i_sample_first <= i_sample )
+            i_low = i_mid;
+        else
+            i_high = i_mid;
+    }
+    /* skip empty chunks */
+    while( i_low + 1 < p_track->i_chunk_count &&
+           i_sample >= p_track->chunk[i_low].i_sample_first +
+                       p_track->chunk[i_low].i_sample_count )
+        i_low++;
+    return i_low;
+}
+
 /**
  * It computes the sample rate for a video track using the given sample
  * description index
@@ -2271,7 +3278,6 @@ static int TrackTimeToSampleChunk( demux_t *p_demux, mp4_track_t *p_track,
                                    uint32_t *pi_sample )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
-    MP4_Box_t   *p_box_stss;
     uint64_t     i_dts;
     unsigned int i_sample;
     unsigned int i_chunk;
@@ -2319,23 +3325,19 @@ static int TrackTimeToSampleChunk( demux_t *p_demux, mp4_track_t *p_track,
         i_start = i_start * p_track->i_timescale / (int64_t)1000000;
     }
 
-    /* we start from sample 0/chunk 0, hope it won't take too much time */
     /* *** find good chunk *** */
-    for( i_chunk = 0; ; i_chunk++ )
     {
-        if( i_chunk + 1 >= p_track->i_chunk_count )
-        {
-            /* at the end and can't check if i_start in this chunk,
-               it will be check while searching i_sample */
-            i_chunk = p_track->i_chunk_count - 1;
-            break;
-        }
-
-        if( (uint64_t)i_start >= p_track->chunk[i_chunk].i_first_dts &&
-            (uint64_t)i_start <  p_track->chunk[i_chunk + 1].i_first_dts )
+        /* last chunk starting before i_start, the chunks are sorted by dts */
+        unsigned int i_low = 0, i_high = p_track->i_chunk_count;
+        while( i_high - i_low > 1 )
         {
-            break;
+            unsigned int i_mid = i_low + ( i_high - i_low ) / 2;
+            if( (uint64_t)i_start >= p_track->chunk[i_mid].i_first_dts )
+                i_low = i_mid;
+            else
+                i_high = i_mid;
         }
+        i_chunk = i_low;
     }
 
     /* *** find sample in the chunk *** */
@@ -2343,25 +3345,24 @@ static int TrackTimeToSampleChunk( demux_t *p_demux, mp4_track_t *p_track,
     i_dts    = p_track->chunk[i_chunk].i_first_dts;
     for( i_index = 0; i_sample < p_track->chunk[i_chunk].i_sample_count; )
     {
-        if( i_dts +
-            p_track->chunk[i_chunk].p_sample_count_dts[i_index] *
-            p_track->chunk[i_chunk].p_sample_delta_dts[i_index] < (uint64_t)i_start )
+        uint32_t i_count, i_delta;
+
+        MP4_ChunkGetDTSRun( p_track, &p_track->chunk[i_chunk], i_index,
+                            &i_count, &i_delta );
+        if( i_dts + (uint64_t)i_count * i_delta < (uint64_t)i_start )
         {
-            i_dts    +=
-                p_track->chunk[i_chunk].p_sample_count_dts[i_index] *
-                p_track->chunk[i_chunk].p_sample_delta_dts[i_index];
+            i_dts    += (uint64_t)i_count * i_delta;
 
-            i_sample += p_track->chunk[i_chunk].p_sample_count_dts[i_index];
+            i_sample += i_count;
             i_index++;
         }
         else
         {
-            if( p_track->chunk[i_chunk].p_sample_delta_dts[i_index] <= 0 )
+            if( i_delta <= 0 )
             {
                 break;
             }
-            i_sample += ( i_start - i_dts ) /
-                p_track->chunk[i_chunk].p_sample_delta_dts[i_index];
+            i_sample += ( i_start - i_dts ) / i_delta;
             break;
         }
     }
@@ -2375,43 +3376,20 @@ static int TrackTimeToSampleChunk( demux_t *p_demux, mp4_track_t *p_track,
     }
 
 
-    /* *** Try to find nearest sync points *** */
-    if( ( p_box_stss = MP4_BoxGet( p_track->p_stbl, "stss" ) ) )
+    /* *** Go back to the preceding sync sample *** */
+    if( p_track->p_sync_samples )
     {
-        MP4_Box_data_stss_t *p_stss = p_box_stss->data.p_stss;
-        msg_Dbg( p_demux, "track[Id 0x%x] using Sync Sample Box (stss)",
-                 p_track->i_track_ID );
-        for( unsigned i_index = 0; i_index < p_stss->i_entry_count; i_index++ )
-        {
-            if( i_index >= p_stss->i_entry_count - 1 ||
-                i_sample < p_stss->i_sample_number[i_index+1] )
-            {
-                unsigned i_sync_sample = p_stss->i_sample_number[i_index];
-                msg_Dbg( p_demux, "stts gives %d --> %d (sample number)",
-                         i_sample, i_sync_sample );
+        unsigned i_sync_sample = TrackGetSyncSample( p_track, i_sample );
+        msg_Dbg( p_demux, "track[Id 0x%x] sync samples give %d --> %d "
+                 "(sample number)", p_track->i_track_ID, i_sample, i_sync_sample );
 
-                if( i_sync_sample <= i_sample )
-                {
-                    while( i_chunk > 0 &&
-                           i_sync_sample < p_track->chunk[i_chunk].i_sample_first )
-                        i_chunk--;
-                }
-                else
-                {
-                    while( i_chunk < p_track->i_chunk_count - 1 &&
-                           i_sync_sample >= p_track->chunk[i_chunk].i_sample_first +
-                                            p_track->chunk[i_chunk].i_sample_count )
-                        i_chunk++;
-                }
-                i_sample = i_sync_sample;
-                break;
-            }
-        }
+        i_sample = i_sync_sample;
+        i_chunk = TrackGetSampleChunk( p_track, i_sample );
     }
     else
     {
-        msg_Dbg( p_demux, "track[Id 0x%x] does not provide Sync "
-                 "Sample Box (stss)", p_track->i_track_ID );
+        msg_Dbg( p_demux, "track[Id 0x%x] does not provide sync "
+                 "samples", p_track->i_track_ID );
     }
 
     *pi_chunk  = i_chunk;
@@ -2637,7 +3615,8 @@ static void MP4_TrackCreate( demux_t *p_demux, mp4_track_t *p_track,
 
     /* Create chunk index table and sample index table */
     if( TrackCreateChunksIndex( p_demux,p_track  ) ||
-        TrackCreateSamplesIndex( p_demux, p_track ) )
+        TrackCreateSamplesIndex( p_demux, p_track ) ||
+        TrackCreateSyncIndex( p_demux, p_track ) )
     {
         return; /* cannot create chunks index */
     }
@@ -2703,6 +3682,7 @@ static void FreeAndResetChunk( mp4_chunk_t *ck )
     free( ck->p_sample_count_pts );
     free( ck->p_sample_offset_pts );
     free( ck->p_sample_size );
+    free( ck->p_sample_sync );
     for( uint32_t i = 0; i < ck->i_sample_count; i++ )
         free( ck->p_sample_data[i] );
     free( ck->p_sample_data );
@@ -2745,6 +3725,7 @@ static void MP4_TrackDestroy( mp4_track_t *p_track )
     {
         FREENULL( p_track->p_sample_size );
     }
+    FREENULL( p_track->p_sync_samples );
 }
 
 static int MP4_TrackSelect( demux_t *p_demux, mp4_track_t *p_track,
@@ -2828,7 +3809,7 @@ static int MP4_TrackSampleSize( mp4_track_t *p_track )
     if( p_track->i_sample_size == 0 )
     {
         /* most simple case */
-        return p_track->p_sample_size[p_track->i_sample];
+        return MP4_TrackGetSampleSizeAt( p_track, p_track->i_sample );
     }
     if( p_track->fmt.i_cat != AUDIO_ES )
     {
@@ -2866,6 +3847,38 @@ static int MP4_TrackSampleSize( mp4_track_t *p_track )
     return i_size;
 }
 
+/* Size of all samples of a chunk in the file */
+static uint64_t MP4_TrackChunkSize( mp4_track_t *p_track, uint32_t i_chunk )
+{
+    const mp4_chunk_t *ck = &p_track->chunk[i_chunk];
+    uint64_t i_size = 0;
+
+    if( p_track->i_sample_size == 0 )
+    {
+        for( uint32_t i_sample = ck->i_sample_first;
+             i_sample < ck->i_sample_first + ck->i_sample_count &&
+             i_sample < p_track->i_sample_count; i_sample++ )
+        {
+            i_size += MP4_TrackGetSampleSizeAt( p_track, i_sample );
+        }
+    }
+    else if( p_track->fmt.i_cat == AUDIO_ES &&
+             p_track->p_sample->data.p_sample_soun->i_qt_version == 1 &&
+             p_track->p_sample->data.p_sample_soun->i_sample_per_packet )
+    {
+        MP4_Box_data_sample_soun_t *p_soun =
+            p_track->p_sample->data.p_sample_soun;
+
+        i_size = (uint64_t)ck->i_sample_count / p_soun->i_sample_per_packet *
+                 p_soun->i_bytes_per_frame;
+    }
+    else
+    {
+        i_size = (uint64_t)ck->i_sample_count * p_track->i_sample_size;
+    }
+    return i_size;
+}
+
 static uint64_t MP4_TrackGetPos( mp4_track_t *p_track )
 {
     unsigned int i_sample;
@@ -2897,7 +3910,7 @@ static uint64_t MP4_TrackGetPos( mp4_track_t *p_track )
         for( i_sample = p_track->chunk[p_track->i_chunk].i_sample_first;
              i_sample < p_track->i_sample; i_sample++ )
         {
-            i_pos += p_track->p_sample_size[i_sample];
+            i_pos += MP4_TrackGetSampleSizeAt( p_track, i_sample );
         }
     }
 
@@ -3377,13 +4390,77 @@ static int ReInitDecoder( demux_t *p_demux, mp4_track_t *p_track )
     return VLC_SUCCESS;
 }
 
+/* Default sample flags of a track from the trex box */
+static bool MP4_frg_GetTrexFlags( demux_t *p_demux, uint32_t i_track_ID,
+                                  uint32_t *pi_flags )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    MP4_Box_t *p_mvex = MP4_BoxGet( p_sys->p_root, "moov/mvex" );
+
+    for( MP4_Box_t *p_trex = p_mvex ? p_mvex->p_first : NULL; p_trex;
+         p_trex = p_trex->p_next )
+    {
+        if( p_trex->i_type == ATOM_trex && p_trex->data.p_trex &&
+            p_trex->data.p_trex->i_track_ID == i_track_ID )
+        {
+            *pi_flags = p_trex->data.p_trex->i_default_sample_flags;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Check if the sync samples of a track fragment can be told apart */
+static bool MP4_frg_HasSampleFlags( demux_t *p_demux, MP4_Box_t *p_traf,
+                                    uint32_t i_track_ID )
+{
+    MP4_Box_t *p_tfhd = MP4_BoxGet( p_traf, "tfhd" );
+    MP4_Box_t *p_trun = MP4_BoxGet( p_traf, "trun" );
+    uint32_t i_flags;
+
+    return ( p_trun && ( p_trun->data.p_trun->i_flags &
+                         ( MP4_TRUN_SAMPLE_FLAGS | MP4_TRUN_FIRST_FLAGS ) ) ) ||
+           ( p_tfhd && ( p_tfhd->data.p_tfhd->i_flags & MP4_TFHD_DFLT_SAMPLE_FLAGS ) ) ||
+           MP4_BoxGet( p_traf, "sdtp" ) ||
+           MP4_frg_GetTrexFlags( p_demux, i_track_ID, &i_flags );
+}
+
+/* Check if sample i of a track fragment is a sync sample, using the sample
+ * flags of trun, tfhd or trex, or the dependencies given by sdtp */
+static bool MP4_frg_IsSyncSample( demux_t *p_demux, MP4_Box_t *p_traf,
+                                  uint32_t i_track_ID, uint32_t i )
+{
+    MP4_Box_t *p_tfhd = MP4_BoxGet( p_traf, "tfhd" );
+    MP4_Box_t *p_trun = MP4_BoxGet( p_traf, "trun" );
+    MP4_Box_t *p_sdtp = MP4_BoxGet( p_traf, "sdtp" );
+    MP4_Box_data_trun_t *p_trun_data = p_trun->data.p_trun;
+    uint32_t i_flags;
+
+    if( p_trun_data->i_flags & MP4_TRUN_SAMPLE_FLAGS )
+        i_flags = p_trun_data->p_samples[i].i_flags;
+    else if( i == 0 && ( p_trun_data->i_flags & MP4_TRUN_FIRST_FLAGS ) )
+        i_flags = p_trun_data->i_first_sample_flags;
+    else if( p_sdtp && i < p_sdtp->i_size - mp4_box_headersize( p_sdtp ) - 4 )
+        /* sample_depends_on == 2: doesn't depend on other samples */
+        return ( ( p_sdtp->data.p_sdtp->p_sample_table[i] >> 4 ) & 0x03 ) == 2;
+    else if( p_tfhd && ( p_tfhd->data.p_tfhd->i_flags & MP4_TFHD_DFLT_SAMPLE_FLAGS ) )
+        i_flags = p_tfhd->data.p_tfhd->i_default_sample_flags;
+    else if( !MP4_frg_GetTrexFlags( p_demux, i_track_ID, &i_flags ) )
+        return true;
+
+    /* sample_is_non_sync_sample */
+    return !( i_flags & 0x00010000 );
+}
+
 /**
  * This function fills a mp4_chunk_t structure from a MP4_Box_t (p_chunk).
+ * The samples are read from s, which is p_demux->s or a prefetched fragment.
  * The 'i_tk_id' argument returns the ID of the track the chunk belongs to.
  * \note p_chunk usually contains a 'moof' and a 'mdat', and might contain a 'sidx'.
  * \return VLC_SUCCESS, VLC_EGENERIC or VLC_ENOMEM.
  */
-static int MP4_frg_GetChunk( demux_t *p_demux, MP4_Box_t *p_chunk, unsigned *i_tk_id )
+static int MP4_frg_GetChunk( demux_t *p_demux, stream_t *s, MP4_Box_t *p_chunk,
+                             unsigned *i_tk_id )
 {
     MP4_Box_t *p_sidx = MP4_BoxGet( p_chunk, "sidx" );
     MP4_Box_t *p_moof = MP4_BoxGet( p_chunk, "moof" );
@@ -3511,11 +4588,18 @@ static int MP4_frg_GetChunk( demux_t *p_demux, MP4_Box_t *p_chunk, unsigned *i_t
     if( !ret->p_sample_data )
         return VLC_ENOMEM;
 
+    if( MP4_frg_HasSampleFlags( p_demux, p_traf, i_track_ID ) )
+    {
+        ret->p_sample_sync = calloc( ret->i_sample_count, sizeof( bool ) );
+        if( !ret->p_sample_sync )
+            return VLC_ENOMEM;
+    }
+
     uint32_t dur = 0, len;
     uint32_t chunk_duration = 0, chunk_size = 0;
 
     /* Skip header of mdat */
-    stream_Read( p_demux->s, NULL, 8 );
+    stream_Read( s, NULL, 8 );
 
     for( uint32_t i = 0; i < ret->i_sample_count; i++)
     {
@@ -3539,10 +4623,14 @@ static int MP4_frg_GetChunk( demux_t *p_demux, MP4_Box_t *p_chunk, unsigned *i_t
         else
             len = ret->p_sample_size[i] = default_size;
 
+        if( ret->p_sample_sync )
+            ret->p_sample_sync[i] = MP4_frg_IsSyncSample( p_demux, p_traf,
+                                                          i_track_ID, i );
+
         ret->p_sample_data[i] = malloc( len );
         if( ret->p_sample_data[i] == NULL )
             return VLC_ENOMEM;
-        int read = stream_Read( p_demux->s, ret->p_sample_data[i], len );
+        int read = stream_Read( s, ret->p_sample_data[i], len );
         if( read < (int)len )
             return VLC_EGENERIC;
         chunk_size += len;
@@ -3558,6 +4646,155 @@ static int MP4_frg_GetChunk( demux_t *p_demux, MP4_Box_t *p_chunk, unsigned *i_t
     return VLC_SUCCESS;
 }
 
+/*****************************************************************************
+ * Prefetch: the fragment following the one just read is read in the
+ * background with a second stream, and parsed from memory when it is needed.
+ *****************************************************************************/
+static void *MP4_frg_PrefetchThread( void *data )
+{
+    mp4_prefetch_t *p_pf = data;
+
+    vlc_mutex_lock( &p_pf->lock );
+    for( ;; )
+    {
+        while( !p_pf->b_abort && p_pf->i_request == UINT64_MAX )
+            vlc_cond_wait( &p_pf->wait, &p_pf->lock );
+        if( p_pf->b_abort )
+            break;
+
+        p_pf->b_busy = true;
+        p_pf->i_busy = p_pf->i_request;
+        p_pf->i_request = UINT64_MAX;
+        if( p_pf->p_block )
+        {
+            block_Release( p_pf->p_block );
+            p_pf->p_block = NULL;
+        }
+        vlc_mutex_unlock( &p_pf->lock );
+
+        block_t *p_block = MP4_frg_ReadFragment( p_pf->s, p_pf->i_busy );
+
+        vlc_mutex_lock( &p_pf->lock );
+        p_pf->p_block = p_block;
+        p_pf->i_offset = p_pf->i_busy;
+        p_pf->b_busy = false;
+        vlc_cond_broadcast( &p_pf->wait );
+    }
+    vlc_mutex_unlock( &p_pf->lock );
+    return NULL;
+}
+
+static void MP4_frg_PrefetchNew( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    mp4_prefetch_t *p_pf = calloc( 1, sizeof( mp4_prefetch_t ) );
+    char *psz_url;
+
+    if( !p_pf )
+        return;
+    if( asprintf( &psz_url, "%s://%s", p_demux->psz_access,
+                  p_demux->psz_location ) >= 0 )
+    {
+        p_pf->s = stream_UrlNew( p_demux, psz_url );
+        free( psz_url );
+    }
+    if( !p_pf->s )
+    {
+        free( p_pf );
+        return;
+    }
+
+    vlc_mutex_init( &p_pf->lock );
+    vlc_cond_init( &p_pf->wait );
+    p_pf->i_request = UINT64_MAX;
+    if( vlc_clone( &p_pf->thread, MP4_frg_PrefetchThread, p_pf,
+                   VLC_THREAD_PRIORITY_INPUT ) )
+    {
+        vlc_cond_destroy( &p_pf->wait );
+        vlc_mutex_destroy( &p_pf->lock );
+        stream_Delete( p_pf->s );
+        free( p_pf );
+        return;
+    }
+    p_sys->p_prefetch = p_pf;
+}
+
+static void MP4_frg_PrefetchDelete( demux_t *p_demux )
+{
+    mp4_prefetch_t *p_pf = p_demux->p_sys->p_prefetch;
+
+    if( !p_pf )
+        return;
+
+    vlc_mutex_lock( &p_pf->lock );
+    p_pf->b_abort = true;
+    vlc_cond_signal( &p_pf->wait );
+    vlc_mutex_unlock( &p_pf->lock );
+    vlc_join( p_pf->thread, NULL );
+
+    if( p_pf->p_block )
+        block_Release( p_pf->p_block );
+    vlc_cond_destroy( &p_pf->wait );
+    vlc_mutex_destroy( &p_pf->lock );
+    stream_Delete( p_pf->s );
+    free( p_pf );
+    p_demux->p_sys->p_prefetch = NULL;
+}
+
+/* Start reading the fragment at i_offset */
+static void MP4_frg_Prefetch( demux_t *p_demux, uint64_t i_offset )
+{
+    mp4_prefetch_t *p_pf = p_demux->p_sys->p_prefetch;
+
+    if( !p_pf )
+        return;
+
+    vlc_mutex_lock( &p_pf->lock );
+    if( !( p_pf->b_busy && p_pf->i_busy == i_offset ) &&
+        !( p_pf->p_block && p_pf->i_offset == i_offset ) )
+    {
+        p_pf->i_request = i_offset;
+        vlc_cond_signal( &p_pf->wait );
+    }
+    vlc_mutex_unlock( &p_pf->lock );
+}
+
+/* Get the fragment at i_offset if it was prefetched (or is being read) */
+static block_t *MP4_frg_PrefetchGet( demux_t *p_demux, uint64_t i_offset )
+{
+    mp4_prefetch_t *p_pf = p_demux->p_sys->p_prefetch;
+    block_t *p_block = NULL;
+
+    if( !p_pf )
+        return NULL;
+
+    vlc_mutex_lock( &p_pf->lock );
+    while( p_pf->i_request == i_offset ||
+           ( p_pf->b_busy && p_pf->i_busy == i_offset ) )
+        vlc_cond_wait( &p_pf->wait, &p_pf->lock );
+    if( p_pf->p_block && p_pf->i_offset == i_offset )
+    {
+        p_block = p_pf->p_block;
+        p_pf->p_block = NULL;
+    }
+    vlc_mutex_unlock( &p_pf->lock );
+    return p_block;
+}
+
+/* Done with a chunk read from s, which is a memory stream over p_frag if
+ * the fragment was prefetched: continue after it in the demuxer stream */
+static void MP4_frg_ChunkDone( demux_t *p_demux, stream_t *s, block_t *p_frag,
+                               uint64_t i_pos )
+{
+    if( s == p_demux->s )
+        return;
+
+    uint64_t i_read = stream_Tell( s );
+    stream_Delete( s );
+    block_Release( p_frag );
+    stream_Seek( p_demux->s, i_pos + i_read );
+}
+
 /**
  * Get the next chunk of the track identified by i_tk_id.
  * \Note We don't want to seek all the time, so if the first chunk given by the
@@ -3573,9 +4810,22 @@ static int MP4_frg_GetChunks( demux_t *p_demux, const unsigned i_tk_id )
 
     for( unsigned i = 0; i < p_sys->i_tracks; i++ )
     {
-        MP4_Box_t *p_chunk = MP4_BoxGetNextChunk( p_demux->s );
+        uint64_t i_pos = stream_Tell( p_demux->s );
+        block_t *p_frag = MP4_frg_PrefetchGet( p_demux, i_pos );
+        stream_t *s = p_demux->s;
+        if( p_frag &&
+            !( s = stream_MemoryNew( p_demux, p_frag->p_buffer, p_frag->i_buffer, true ) ) )
+        {
+            block_Release( p_frag );
+            s = p_demux->s;
+        }
+
+        MP4_Box_t *p_chunk = MP4_BoxGetNextChunk( s );
         if( !p_chunk )
+        {
+            MP4_frg_ChunkDone( p_demux, s, p_frag, i_pos );
             return VLC_EGENERIC;
+        }
 
         if( !p_chunk->p_first )
             goto MP4_frg_GetChunks_Error;
@@ -3583,6 +4833,7 @@ static int MP4_frg_GetChunks( demux_t *p_demux, const unsigned i_tk_id )
         uint32_t tid = 0;
         if( i_type == ATOM_uuid || i_type == ATOM_ftyp )
         {
+            MP4_frg_ChunkDone( p_demux, s, p_frag, i_pos );
             MP4_BoxFree( p_demux->s, p_sys->p_root );
             p_sys->p_root = p_chunk;
 
@@ -3592,7 +4843,7 @@ static int MP4_frg_GetChunks( demux_t *p_demux, const unsigned i_tk_id )
                 if( !p_tkhd )
                 {
                     msg_Warn( p_demux, "No tkhd found!" );
-                    goto MP4_frg_GetChunks_Error;
+                    return VLC_EGENERIC;
                 }
                 tid = p_tkhd->data.p_tkhd->i_track_ID;
             }
@@ -3603,23 +4854,36 @@ static int MP4_frg_GetChunks( demux_t *p_demux, const unsigned i_tk_id )
                 if( !p_stra || CmpUUID( &p_stra->i_uuid, &StraBoxUUID ) )
                 {
                     msg_Warn( p_demux, "No StraBox found!" );
-                    goto MP4_frg_GetChunks_Error;
+                    return VLC_EGENERIC;
                 }
                 tid = p_stra->data.p_stra->i_track_ID;
             }
 
             p_track = MP4_frg_GetTrack( p_demux, tid );
             if( !p_track )
-                goto MP4_frg_GetChunks_Error;
+                return VLC_EGENERIC;
             p_track->b_codec_need_restart = true;
 
             return MP4_frg_GetChunks( p_demux, i_tk_id );
         }
 
-        if( MP4_frg_GetChunk( p_demux, p_chunk, &tid ) != VLC_SUCCESS )
+        if( MP4_frg_GetChunk( p_demux, s, p_chunk, &tid ) != VLC_SUCCESS )
             goto MP4_frg_GetChunks_Error;
+        MP4_frg_ChunkDone( p_demux, s, p_frag, i_pos );
+
+        /* index the fragment, positions in s are relative to i_pos if it is
+         * a memory stream */
+        MP4_Box_t *p_sidx = MP4_BoxGet( p_chunk, "sidx" );
+        if( p_sidx )
+            MP4_frg_IndexSidx( p_demux, p_sidx, s == p_demux->s ? 0 : i_pos );
+        p_track = MP4_frg_GetTrack( p_demux, tid );
+        if( p_track )
+            MP4_frg_IndexFragment( p_sys, p_track, i_pos, stream_Tell( p_demux->s ),
+                                   p_track->cchunk->i_first_dts,
+                                   p_track->i_first_dts );
 
         MP4_BoxFree( p_demux->s, p_chunk );
+        MP4_frg_Prefetch( p_demux, stream_Tell( p_demux->s ) );
 
         if( tid == i_tk_id )
             break;
@@ -3627,6 +4891,7 @@ static int MP4_frg_GetChunks( demux_t *p_demux, const unsigned i_tk_id )
             continue;
 
 MP4_frg_GetChunks_Error:
+        MP4_frg_ChunkDone( p_demux, s, p_frag, i_pos );
         MP4_BoxFree( p_demux->s, p_chunk );
         return VLC_EGENERIC;
     }
@@ -3745,6 +5010,21 @@ int DemuxFrg( demux_t *p_demux )
                 return 0;
             }
 
+            if( tk->b_wait_sync && ck->p_sample_sync &&
+                !ck->p_sample_sync[ck->i_sample] )
+            {
+                /* decoding can only restart at a sync sample after seeking */
+                ck->i_sample++;
+                tk->i_sample++;
+                if( ck->i_sample == ck->i_sample_count )
+                {
+                    tk->b_has_non_empty_cchunk = false;
+                    break;
+                }
+                continue;
+            }
+            tk->b_wait_sync = false;
+
             uint32_t sample_size = ck->p_sample_size[ck->i_sample];
             p_block = block_Alloc( sample_size );
             uint8_t *src = ck->p_sample_data[ck->i_sample];
@@ -34,6 +34,7 @@
 #include <vlc_plugin.h>
 
 #include <assert.h>
+#include <errno.h>
 
 #include <vlc_access.h>    /* DVB-specific things */
 #include <vlc_demux.h>
@@ -44,6 +45,9 @@
 #include <vlc_network.h>   /* net_ for ts-out mode */
 
 #include "../mux/mpeg/csa.h"
+#include "ts_index.h"
+#include "../packetizer/hevc_nal.h"
+#include "../packetizer/startcode_helper.h"
 
 /* Include dvbpsi headers */
 # include <dvbpsi/dvbpsi.h>
@@ -124,6 +128,10 @@ static void Close ( vlc_object_t * );
     "The decryption routines subtract the TS-header from the value before " \
     "decrypting. " )
 
+#define CSA_THREADS_TEXT N_("Descrambling threads")
+#define CSA_THREADS_LONGTEXT N_("Number of additional threads to descramble " \
+    "CSA packets with, 0 descrambles on the demuxer thread only." )
+
 #define SPLIT_ES_TEXT N_("Separate sub-streams")
 #define SPLIT_ES_LONGTEXT N_( \
     "Separate teletex/dvbs pages into independent ES. " \
@@ -134,6 +142,12 @@ static void Close ( vlc_object_t * );
     "Seek and position based on a percent byte position, not a PCR generated " \
     "time position. If seeking doesn't work property, turn on this option." )
 
+#define PRESCAN_TEXT N_("Index local files")
+#define PRESCAN_LONGTEXT N_( \
+    "Map the PCRs and HEVC random access points of local files in the " \
+    "background, so that seeking doesn't need to search the file and starts " \
+    "on a random access point." )
+
 
 vlc_module_begin ()
     set_description( N_("MPEG Transport Stream demuxer with support for HEVC/H.265 video") )
@@ -154,9 +168,11 @@ vlc_module_begin ()
         change_safe()
     add_integer( "ts-csa-pkt", 188, CPKT_TEXT, CPKT_LONGTEXT, true )
         change_safe()
+    add_integer( "ts-csa-threads", 0, CSA_THREADS_TEXT, CSA_THREADS_LONGTEXT, true )
 
     add_bool( "ts-split-es", true, SPLIT_ES_TEXT, SPLIT_ES_LONGTEXT, false )
     add_bool( "ts-seek-percent", false, SEEK_PERCENT_TEXT, SEEK_PERCENT_LONGTEXT, true )
+    add_bool( "ts-prescan", false, PRESCAN_TEXT, PRESCAN_LONGTEXT, true )
 
     add_obsolete_bool( "ts-silent" );
 
@@ -246,8 +262,13 @@ typedef struct
     ts_es_data_type_t data_type;
     int         i_data_size;
     int         i_data_gathered;
+    /* the unit is reassembled in a single block with room for i_data_alloc
+     * bytes, i_data_avg is the running average size of the units */
     block_t     *p_data;
-    block_t     **pp_last;
+    int         i_data_alloc;
+    int         i_data_avg;
+    /* HEVC access units are only flagged while every PES starts one */
+    bool        b_au_unaligned;
 
     es_mpeg4_descriptor_t *p_mpeg4desc;
 
@@ -286,6 +307,15 @@ struct demux_sys_t
     /* how many TS packet we read at once */
     int         i_ts_read;
 
+    /* packets are read from the stream in batches into a reusable buffer,
+     * the bytes from i_read_pos to i_read_len haven't been demuxed yet */
+    uint8_t     *p_read;
+    int         i_read_size;
+    int         i_read_pos;
+    int         i_read_len;
+    /* stream offset modulo the packet size of the last synchronized packet */
+    int         i_sync_phase;
+
     /* to determine length and time */
     int         i_pid_ref_pcr;
     mtime_t     i_first_pcr;
@@ -295,10 +325,20 @@ struct demux_sys_t
     int         i_pcrs_num;
     mtime_t     *p_pcrs;
     int64_t     *p_pos;
+    /* built in the background when ts-prescan is set */
+    ts_index_t  *p_index;
+    bool        b_index_done;
 
     /* All pid */
     ts_pid_t    pid[8192];
 
+    /* Once a program is selected, the packets of the PIDs that are neither
+     * selected with SetPIDFilter() nor always demuxed (PSI, user PMT) are
+     * dropped right after they are read */
+    bool        b_pid_filter;
+    uint32_t    pid_selected[8192/32];
+    uint32_t    pid_always[8192/32];
+
     /* All PMT */
     bool        b_user_pmt;
     int         i_pmt;
@@ -309,11 +349,14 @@ struct demux_sys_t
     bool        b_es_id_pid;
     csa_t       *csa;
     int         i_csa_pkt_size;
+    /* the packets of the read buffer before this offset are descrambled */
+    int         i_csa_end;
     bool        b_split_es;
 
+    /* in ts-out mode, datagrams of i_ts_read packets are sent straight
+     * from the read buffer */
     bool        b_udp_out;
     int         fd; /* udp socket */
-    uint8_t     *buffer;
 
     /* */
     bool        b_access_control;
@@ -334,6 +377,7 @@ struct demux_sys_t
 };
 
 static int Demux    ( demux_t *p_demux );
+static int Forward  ( demux_t *p_demux );
 static int Control( demux_t *p_demux, int i_query, va_list args );
 
 static void PIDInit ( ts_pid_t *pid, bool b_psi, ts_psi_t *p_owner );
@@ -352,21 +396,25 @@ static void PSINewTableCallBack( demux_t *, dvbpsi_handle,
 
 static int ChangeKeyCallback( vlc_object_t *, char const *, vlc_value_t, vlc_value_t, void * );
 
-static inline int PIDGet( block_t *p )
+static inline int PIDGet( const uint8_t *p )
 {
-    return ( (p->p_buffer[1]&0x1f)<<8 )|p->p_buffer[2];
+    return ( (p[1]&0x1f)<<8 )|p[2];
 }
 
-static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk );
+static bool GatherData( demux_t *p_demux, ts_pid_t *pid, uint8_t *p );
 
-static block_t* ReadTSPacket( demux_t *p_demux );
-static mtime_t GetPCR( block_t *p_pkt );
+static uint8_t *ReadTSPacket( demux_t *p_demux );
+static int64_t TSTell( demux_t *p_demux );
+static int TSSeek( demux_t *p_demux, int64_t i_pos );
+static mtime_t GetPCR( const uint8_t *p );
 static int SeekToPCR( demux_t *p_demux, int64_t i_pos );
 static int Seek( demux_t *p_demux, double f_percent );
+static int SeekIndex( demux_t *p_demux, mtime_t i_target_pcr );
+static void StartIndex( demux_t *p_demux );
 static void GetFirstPCR( demux_t *p_demux );
 static void GetLastPCR( demux_t *p_demux );
 static void CheckPCR( demux_t *p_demux );
-static void PCRHandle( demux_t *p_demux, ts_pid_t *, block_t * );
+static void PCRHandle( demux_t *p_demux, ts_pid_t *, const uint8_t * );
 
 static void              IODFree( iod_descriptor_t * );
 
@@ -376,6 +424,27 @@ static int UserPmt( demux_t *p_demux, const char * );
 static int  SetPIDFilter( demux_t *, int i_pid, bool b_selected );
 static void SetPrgFilter( demux_t *, int i_prg, bool b_selected );
 
+static inline void PIDBitSet( uint32_t *p_map, int i_pid, bool b_set )
+{
+    if( b_set )
+        p_map[i_pid >> 5] |= 1u << ( i_pid & 31 );
+    else
+        p_map[i_pid >> 5] &= ~( 1u << ( i_pid & 31 ) );
+}
+
+/* Whether the packets of the PID pass the pre-filter */
+static inline bool PIDWanted( const demux_sys_t *p_sys, int i_pid )
+{
+    return !p_sys->b_pid_filter ||
+           ( ( p_sys->pid_selected[i_pid >> 5] | p_sys->pid_always[i_pid >> 5] )
+             & ( 1u << ( i_pid & 31 ) ) );
+}
+
+/* number of packets read from the stream at once */
+#define TS_READ_BATCH 32
+/* number of datagrams sent at once in ts-out mode */
+#define TS_FORWARD_DATAGRAMS 8
+
 #define TS_PACKET_SIZE_188 188
 #define TS_PACKET_SIZE_192 192
 #define TS_PACKET_SIZE_204 204
@@ -458,36 +527,38 @@ static int DetectPacketSize( demux_t *p_demux )
         return TS_PACKET_SIZE_188;
     }
 
-    for( int i_sync = 0; i_sync < TS_PACKET_SIZE_MAX; i_sync++ )
+    /* Check the 3 next sync bytes of every candidate, the window is peeked
+     * once and the candidates are found with memchr() */
+    int i_peek = stream_Peek( p_demux->s, &p_peek, TS_PACKET_SIZE_MAX * 4 );
+    const uint8_t *p_sync = p_peek;
+    while( ( p_sync = memchr( p_sync, 0x47,
+                              &p_peek[TS_PACKET_SIZE_MAX] - p_sync ) ) )
     {
-        if( p_peek[i_sync] != 0x47 )
-            continue;
-
-        /* Check next 3 sync bytes */
-        int i_peek = TS_PACKET_SIZE_MAX * 3 + i_sync + 1;
-        if( ( stream_Peek( p_demux->s, &p_peek, i_peek ) ) < i_peek )
+        const int i_sync = p_sync - p_peek;
+        if( i_peek < TS_PACKET_SIZE_MAX * 3 + i_sync + 1 )
         {
             msg_Err( p_demux, "cannot peek" );
             return -1;
         }
-        if( p_peek[i_sync + 1 * TS_PACKET_SIZE_188] == 0x47 &&
-            p_peek[i_sync + 2 * TS_PACKET_SIZE_188] == 0x47 &&
-            p_peek[i_sync + 3 * TS_PACKET_SIZE_188] == 0x47 )
+        if( p_sync[1 * TS_PACKET_SIZE_188] == 0x47 &&
+            p_sync[2 * TS_PACKET_SIZE_188] == 0x47 &&
+            p_sync[3 * TS_PACKET_SIZE_188] == 0x47 )
         {
             return TS_PACKET_SIZE_188;
         }
-        else if( p_peek[i_sync + 1 * TS_PACKET_SIZE_192] == 0x47 &&
-                 p_peek[i_sync + 2 * TS_PACKET_SIZE_192] == 0x47 &&
-                 p_peek[i_sync + 3 * TS_PACKET_SIZE_192] == 0x47 )
+        else if( p_sync[1 * TS_PACKET_SIZE_192] == 0x47 &&
+                 p_sync[2 * TS_PACKET_SIZE_192] == 0x47 &&
+                 p_sync[3 * TS_PACKET_SIZE_192] == 0x47 )
         {
             return TS_PACKET_SIZE_192;
         }
-        else if( p_peek[i_sync + 1 * TS_PACKET_SIZE_204] == 0x47 &&
-                 p_peek[i_sync + 2 * TS_PACKET_SIZE_204] == 0x47 &&
-                 p_peek[i_sync + 3 * TS_PACKET_SIZE_204] == 0x47 )
+        else if( p_sync[1 * TS_PACKET_SIZE_204] == 0x47 &&
+                 p_sync[2 * TS_PACKET_SIZE_204] == 0x47 &&
+                 p_sync[3 * TS_PACKET_SIZE_204] == 0x47 )
         {
             return TS_PACKET_SIZE_204;
         }
+        p_sync++;
     }
 
     if( p_demux->b_force )
@@ -567,7 +638,6 @@ static int Open( vlc_object_t *p_this )
     p_sys->i_packet_size = i_packet_size;
     vlc_mutex_init( &p_sys->csa_lock );
 
-    p_sys->buffer = NULL;
     p_demux->pf_demux = Demux;
     p_demux->pf_control = Control;
 
@@ -623,6 +693,7 @@ static int Open( vlc_object_t *p_this )
     /* Init PAT handler */
     pat = &p_sys->pid[0];
     PIDInit( pat, true, NULL );
+    PIDBitSet( p_sys->pid_always, 0, true );
 #if (DVBPSI_VERSION_INT >= DVBPSI_VERSION_WANTED(1,0,0))
     pat->psi->handle = dvbpsi_new( &dvbpsi_messages, DVBPSI_MSG_DEBUG );
     if( !pat->psi->handle )
@@ -648,6 +719,7 @@ static int Open( vlc_object_t *p_this )
         ts_pid_t *eit = &p_sys->pid[0x12];
 
         PIDInit( sdt, true, NULL );
+        PIDBitSet( p_sys->pid_always, 0x11, true );
 #if (DVBPSI_VERSION_INT >= DVBPSI_VERSION_WANTED(1,0,0))
         VLC_DVBPSI_DEMUX_TABLE_INIT( sdt, p_demux )
 #else
@@ -656,6 +728,7 @@ static int Open( vlc_object_t *p_this )
                                 p_demux );
 #endif
         PIDInit( eit, true, NULL );
+        PIDBitSet( p_sys->pid_always, 0x12, true );
 #if (DVBPSI_VERSION_INT >= DVBPSI_VERSION_WANTED(1,0,0))
         VLC_DVBPSI_DEMUX_TABLE_INIT( eit, p_demux )
 #else
@@ -665,6 +738,7 @@ static int Open( vlc_object_t *p_this )
 #endif
         ts_pid_t *tdt = &p_sys->pid[0x14];
         PIDInit( tdt, true, NULL );
+        PIDBitSet( p_sys->pid_always, 0x14, true );
 #if (DVBPSI_VERSION_INT >= DVBPSI_VERSION_WANTED(1,0,0))
         VLC_DVBPSI_DEMUX_TABLE_INIT( tdt, p_demux )
 #else
@@ -723,11 +797,20 @@ static int Open( vlc_object_t *p_this )
             {
                 p_sys->i_ts_read = 1500 / p_sys->i_packet_size;
             }
-            p_sys->buffer = xmalloc( p_sys->i_packet_size * p_sys->i_ts_read );
+            p_demux->pf_demux = Forward;
         }
     }
     free( psz_string );
 
+    /* one more packet is needed to check the sync when resynchronizing */
+    int i_read_packets = TS_READ_BATCH;
+    if( p_sys->b_udp_out )
+        i_read_packets = __MAX( i_read_packets, p_sys->i_ts_read * TS_FORWARD_DATAGRAMS );
+    p_sys->i_read_size = p_sys->i_packet_size * ( i_read_packets + 1 );
+    p_sys->p_read = xmalloc( p_sys->i_read_size );
+    p_sys->i_read_pos = p_sys->i_read_len = 0;
+    p_sys->i_sync_phase = -1;
+
     /* We handle description of an extra PMT */
     psz_string = var_CreateGetString( p_demux, "ts-extra-pmt" );
     p_sys->b_user_pmt = false;
@@ -777,6 +860,11 @@ static int Open( vlc_object_t *p_this )
             else
                 p_sys->i_csa_pkt_size = i_pkt;
             msg_Dbg( p_demux, "decrypting %d bytes of packet", p_sys->i_csa_pkt_size );
+
+            int i_threads = var_CreateGetInteger( p_demux, "ts-csa-threads" );
+            if( i_threads > 0 )
+                msg_Dbg( p_demux, "descrambling with %d threads",
+                         csa_StartThreads( p_sys->csa, i_threads ) );
         }
         free( psz_csa2 );
     }
@@ -812,6 +900,11 @@ static int Open( vlc_object_t *p_this )
             break;
     }
 
+    /* the video PID is known once the PMT has been parsed */
+    if( can_seek && !p_sys->b_force_seek_per_percent && !p_sys->b_udp_out &&
+        var_InheritBool( p_demux, "ts-prescan" ) )
+        StartIndex( p_demux );
+
     return VLC_SUCCESS;
 }
 
@@ -898,8 +991,10 @@ static void Close( vlc_object_t *p_this )
         net_Close( p_sys->fd );
     }
 
-    free( p_sys->buffer );
+    free( p_sys->p_read );
 
+    if( p_sys->p_index )
+        TsIndexDelete( p_sys->p_index );
     free( p_sys->p_pcrs );
     free( p_sys->p_pos );
 
@@ -929,6 +1024,40 @@ static int ChangeKeyCallback( vlc_object_t *p_this, char const *psz_cmd,
     return i_tmp;
 }
 
+/*****************************************************************************
+ * DescrambleAhead: descramble the packets GatherData() will get in the rest
+ * of the read buffer at once, GatherData() still handles the packets of PIDs
+ * that become valid in between.
+ *****************************************************************************/
+static void DescrambleAhead( demux_t *p_demux, uint8_t *p_pkt )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    uint8_t *pp_pkt[TS_READ_BATCH + 1];
+    int i_count = 0;
+
+    uint8_t *p = p_pkt;
+    const uint8_t *p_end = &p_sys->p_read[p_sys->i_read_len];
+    for( ; p + p_sys->i_packet_size <= p_end && p[0] == 0x47 &&
+           i_count < TS_READ_BATCH + 1; p += p_sys->i_packet_size )
+    {
+        const int i_pid = PIDGet( p );
+        if( !( p[3]&0x80 ) || !PIDWanted( p_sys, i_pid ) )
+            continue;
+
+        const ts_pid_t *pid = &p_sys->pid[i_pid];
+        if( pid->b_valid && !pid->psi )
+            pp_pkt[i_count++] = p;
+    }
+    p_sys->i_csa_end = p - p_sys->p_read;
+
+    if( i_count > 0 )
+    {
+        vlc_mutex_lock( &p_sys->csa_lock );
+        csa_DecryptBatch( p_sys->csa, pp_pkt, i_count, p_sys->i_csa_pkt_size );
+        vlc_mutex_unlock( &p_sys->csa_lock );
+    }
+}
+
 /*****************************************************************************
  * Demux:
  *****************************************************************************/
@@ -941,12 +1070,18 @@ static int Demux( demux_t *p_demux )
     for( int i_pkt = 0; i_pkt < p_sys->i_ts_read; i_pkt++ )
     {
         bool         b_frame = false;
-        block_t     *p_pkt;
+        uint8_t     *p_pkt;
         if( !(p_pkt = ReadTSPacket( p_demux )) )
         {
             return 0;
         }
 
+        if( p_sys->csa &&
+            p_pkt - p_sys->p_read >= p_sys->i_csa_end )
+        {
+            DescrambleAhead( p_demux, p_pkt );
+        }
+
         if( p_sys->b_start_record )
         {
             /* Enable recording once synchronized */
@@ -954,14 +1089,12 @@ static int Demux( demux_t *p_demux )
             p_sys->b_start_record = false;
         }
 
-        if( p_sys->b_udp_out )
-        {
-            memcpy( &p_sys->buffer[i_pkt * p_sys->i_packet_size],
-                    p_pkt->p_buffer, p_sys->i_packet_size );
-        }
-
         /* Parse the TS packet */
-        ts_pid_t *p_pid = &p_sys->pid[PIDGet( p_pkt )];
+        const int i_pid = PIDGet( p_pkt );
+        if( !PIDWanted( p_sys, i_pid ) )
+            continue;
+
+        ts_pid_t *p_pid = &p_sys->pid[i_pid];
 
         if( p_pid->b_valid )
         {
@@ -969,26 +1102,20 @@ static int Demux( demux_t *p_demux )
             {
                 if( p_pid->i_pid == 0 || ( p_sys->b_dvb_meta && ( p_pid->i_pid == 0x11 || p_pid->i_pid == 0x12 || p_pid->i_pid == 0x14 ) ) )
                 {
-                    dvbpsi_PushPacket( p_pid->psi->handle, p_pkt->p_buffer );
+                    dvbpsi_PushPacket( p_pid->psi->handle, p_pkt );
                 }
                 else
                 {
                     for( int i_prg = 0; i_prg < p_pid->psi->i_prg; i_prg++ )
                     {
                         dvbpsi_PushPacket( p_pid->psi->prg[i_prg]->handle,
-                                           p_pkt->p_buffer );
+                                           p_pkt );
                     }
                 }
-                block_Release( p_pkt );
-            }
-            else if( !p_sys->b_udp_out )
-            {
-                b_frame = GatherData( p_demux, p_pid, p_pkt );
             }
             else
             {
-                PCRHandle( p_demux, p_pid, p_pkt );
-                block_Release( p_pkt );
+                b_frame = GatherData( p_demux, p_pid, p_pkt );
             }
         }
         else
@@ -999,7 +1126,6 @@ static int Demux( demux_t *p_demux )
             }
             /* We have to handle PCR if present */
             PCRHandle( p_demux, p_pid, p_pkt );
-            block_Release( p_pkt );
         }
         p_pid->b_seen = true;
 
@@ -1007,12 +1133,117 @@ static int Demux( demux_t *p_demux )
             break;
     }
 
-    if( p_sys->b_udp_out )
+    return 1;
+}
+
+/*****************************************************************************
+ * Forward: ts-out mode
+ *****************************************************************************
+ * Runs of synchronized packets are sent from the read buffer without being
+ * copied, up to TS_FORWARD_DATAGRAMS datagrams of i_ts_read packets per
+ * call. Only the PSI is parsed and the headers of the other packets are
+ * checked for a PCR.
+ *****************************************************************************/
+static int Forward( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    const int i_size = p_sys->i_packet_size;
+    uint8_t *pp_datagram[TS_FORWARD_DATAGRAMS];
+    int pi_datagram[TS_FORWARD_DATAGRAMS];
+    int i_datagrams = 0;
+
+    /* the buffer may move while resynchronizing, do it before collecting */
+    if( !ReadFill( p_demux, i_size ) ||
+        ( p_sys->p_read[p_sys->i_read_pos] != 0x47 &&
+          ( !Resync( p_demux ) || !ReadFill( p_demux, i_size ) ) ) )
     {
-        /* Send the complete block */
-        net_Write( p_demux, p_sys->fd, NULL, p_sys->buffer,
-                   p_sys->i_ts_read * p_sys->i_packet_size );
+        msg_Dbg( p_demux, "eof ?" );
+        return 0;
     }
+    if( p_sys->i_sync_phase < 0 )
+        p_sys->i_sync_phase = TSTell( p_demux ) % i_size;
+
+    if( p_sys->b_start_record )
+    {
+        /* Enable recording once synchronized */
+        stream_Control( p_demux->s, STREAM_SET_RECORD_STATE, true, "ts" );
+        p_sys->b_start_record = false;
+    }
+
+    ReadFill( p_demux, p_sys->i_read_size - i_size );
+
+    /* stop at the first lost sync byte, the next call resynchronizes */
+    while( i_datagrams < TS_FORWARD_DATAGRAMS &&
+           p_sys->i_read_len - p_sys->i_read_pos >= i_size &&
+           p_sys->p_read[p_sys->i_read_pos] == 0x47 )
+    {
+        uint8_t *p_datagram = &p_sys->p_read[p_sys->i_read_pos];
+        int i_pkt = 0;
+
+        while( i_pkt < p_sys->i_ts_read &&
+               p_sys->i_read_len - p_sys->i_read_pos >= i_size &&
+               p_sys->p_read[p_sys->i_read_pos] == 0x47 )
+        {
+            uint8_t *p_pkt = &p_sys->p_read[p_sys->i_read_pos];
+            const int i_pid = PIDGet( p_pkt );
+            ts_pid_t *p_pid = &p_sys->pid[i_pid];
+
+            if( p_pid->b_valid && p_pid->psi )
+            {
+                if( i_pid == 0 || ( p_sys->b_dvb_meta && ( i_pid == 0x11 || i_pid == 0x12 || i_pid == 0x14 ) ) )
+                {
+                    dvbpsi_PushPacket( p_pid->psi->handle, p_pkt );
+                }
+                else
+                {
+                    for( int i_prg = 0; i_prg < p_pid->psi->i_prg; i_prg++ )
+                        dvbpsi_PushPacket( p_pid->psi->prg[i_prg]->handle,
+                                           p_pkt );
+                }
+            }
+            else if( p_pkt[3]&0x20 )
+            {
+                PCRHandle( p_demux, p_pid, p_pkt );
+            }
+            p_pid->b_seen = true;
+
+            p_sys->i_read_pos += i_size;
+            i_pkt++;
+        }
+
+        pp_datagram[i_datagrams] = p_datagram;
+        pi_datagram[i_datagrams] = i_pkt * i_size;
+        i_datagrams++;
+    }
+
+#ifdef HAVE_SENDMMSG
+    struct iovec iov[TS_FORWARD_DATAGRAMS];
+    struct mmsghdr msg[TS_FORWARD_DATAGRAMS];
+
+    memset( msg, 0, sizeof( msg ) );
+    for( int i = 0; i < i_datagrams; i++ )
+    {
+        iov[i].iov_base = pp_datagram[i];
+        iov[i].iov_len = pi_datagram[i];
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+    for( int i_sent = 0; i_sent < i_datagrams; )
+    {
+        int i_ret = sendmmsg( p_sys->fd, &msg[i_sent], i_datagrams - i_sent, 0 );
+        if( i_ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            msg_Warn( p_demux, "cannot send datagrams: %m" );
+            break;
+        }
+        i_sent += i_ret;
+    }
+#else
+    for( int i = 0; i < i_datagrams; i++ )
+        net_Write( p_demux, p_sys->fd, NULL, pp_datagram[i], pi_datagram[i] );
+#endif
 
     return 1;
 }
@@ -1053,6 +1284,11 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
     int64_t *pi64;
     int i_int;
 
+    /* the length is exact once the whole file has been indexed */
+    if( p_sys->p_index && !p_sys->b_index_done &&
+        !TsIndexGetLastPCR( p_sys->p_index, &p_sys->i_last_pcr ) )
+        p_sys->b_index_done = true;
+
     switch( i_query )
     {
     case DEMUX_GET_POSITION:
@@ -1067,7 +1303,7 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
             if( !DVBEventInformation( p_demux, &i_time, &i_length ) && i_length > 0 )
                 *pf = (double)i_time/(double)i_length;
             else if( (i64 = stream_Size( p_demux->s) ) > 0 )
-                *pf = (double)stream_Tell( p_demux->s ) / (double)i64;
+                *pf = (double)TSTell( p_demux ) / (double)i64;
             else
                 *pf = 0.0;
         }
@@ -1085,10 +1321,11 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
             p_sys->i_last_pcr - p_sys->i_first_pcr <= 0 )
         {
             i64 = stream_Size( p_demux->s );
-            if( stream_Seek( p_demux->s, (int64_t)(i64 * f) ) )
+            if( TSSeek( p_demux, (int64_t)(i64 * f) ) )
                 return VLC_EGENERIC;
         }
-        else
+        else if( SeekIndex( p_demux, p_sys->i_first_pcr +
+                            ( p_sys->i_last_pcr - p_sys->i_first_pcr ) * f ) )
         {
             if( Seek( p_demux, f ) )
             {
@@ -1098,6 +1335,16 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
         }
         return VLC_SUCCESS;
 
+    case DEMUX_SET_TIME:
+        i64 = (int64_t)va_arg( args, int64_t );
+
+        /* without the index, SET_POSITION does the job */
+        if( (p_sys->b_dvb_meta && p_sys->b_access_control) ||
+            p_sys->b_force_seek_per_percent ||
+            SeekIndex( p_demux, p_sys->i_first_pcr + i64 * 9 / 100 ) )
+            return VLC_EGENERIC;
+        return VLC_SUCCESS;
+
     case DEMUX_GET_TIME:
         pi64 = (int64_t*)va_arg( args, int64_t * );
         if( (p_sys->b_dvb_meta && p_sys->b_access_control) ||
@@ -1181,6 +1428,11 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
                 }
             }
         }
+
+        /* the pre-filter follows ProgramIsSelected() */
+        p_sys->b_pid_filter = !( p_sys->i_current_program == 0 ||
+                                 ( p_sys->i_current_program == -1 &&
+                                   p_sys->programs_list.i_count == 0 ) );
         return VLC_SUCCESS;
     }
 
@@ -1198,7 +1450,6 @@ static int Control( demux_t *p_demux, int i_query, va_list args )
         return VLC_SUCCESS;
 
     case DEMUX_GET_FPS:
-    case DEMUX_SET_TIME:
     default:
         return VLC_EGENERIC;
     }
@@ -1234,6 +1485,7 @@ static int UserPmt( demux_t *p_demux, const char *psz_fmt )
 
     msg_Dbg( p_demux, "user pmt specified (pid=%d,number=%d)", i_pid, i_number );
     PIDInit( pmt, true, NULL );
+    PIDBitSet( p_sys->pid_always, i_pid, true );
 
     /* Dummy PMT */
     prg = calloc( 1, sizeof( ts_prg_psi_t ) );
@@ -1293,6 +1545,7 @@ static int UserPmt( demux_t *p_demux, const char *psz_fmt )
                 *psz_arg++ = '\0';
 
             PIDInit( pid, false, pmt->psi);
+            PIDBitSet( p_sys->pid_always, i_pid, true );
             if( prg->i_pid_pcr <= 0 )
                 prg->i_pid_pcr = i_pid;
 
@@ -1351,6 +1604,8 @@ static int SetPIDFilter( demux_t *p_demux, int i_pid, bool b_selected )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
 
+    PIDBitSet( p_sys->pid_selected, i_pid, b_selected );
+
     if( !p_sys->b_access_control )
         return VLC_EGENERIC;
 
@@ -1461,7 +1716,6 @@ static void PIDInit( ts_pid_t *pid, bool b_psi, ts_psi_t *p_owner )
 
         es_format_Init( &pid->es->fmt, UNKNOWN_ES, 0 );
         pid->es->data_type = TS_ES_DATA_PES;
-        pid->es->pp_last = &pid->es->p_data;
     }
 }
 
@@ -1542,6 +1796,53 @@ static void PIDClean( demux_t *p_demux, ts_pid_t *pid )
 /****************************************************************************
  * gathering stuff
  ****************************************************************************/
+/* Flag the payload of an HEVC PES with BLOCK_FLAG_TYPE_I if it starts with
+ * an IRAP picture, BLOCK_FLAG_TYPE_P otherwise, as holding complete access
+ * units. The decoder can then push their NAL units without searching for
+ * the end of the last one. A PES with several access units isn't split, as
+ * they would have no timestamps. A PES doesn't have to end an access unit,
+ * but as it has to start one for that, nothing is flagged anymore once a
+ * PES doesn't. */
+static block_t *FlagHEVC( demux_t *p_demux, ts_es_t *es, block_t *p_block )
+{
+    const uint8_t *p_start = p_block->p_buffer;
+    const uint8_t *p_end = &p_start[p_block->i_buffer];
+    const uint8_t *p_sc = p_start;
+    bool b_au = false;
+
+    if( es->b_au_unaligned )
+        return p_block;
+
+    /* the slice header flag is 3 bytes after the start code */
+    while( ( p_sc = startcode_FindAnnexB( p_sc, p_end ) ) && p_end - p_sc >= 6 )
+    {
+        const uint8_t *p_nal = &p_sc[3];
+        const int i_type = hevc_getNALType( p_nal );
+
+        if( !b_au )
+        {
+            /* only a zero_byte may come before the first start code */
+            if( !hevc_isAUStart( i_type, p_nal[2]&0x80 ) || p_sc - p_start > 1 )
+                break;
+            b_au = true;
+        }
+        if( hevc_isVCL( i_type ) )
+        {
+            p_block->i_flags |= hevc_isIRAP( i_type ) ? BLOCK_FLAG_TYPE_I
+                                                      : BLOCK_FLAG_TYPE_P;
+            return p_block;
+        }
+        p_sc = p_nal;
+    }
+
+    if( !b_au )
+    {
+        msg_Dbg( p_demux, "HEVC access units not aligned on PES, not flagging" );
+        es->b_au_unaligned = true;
+    }
+    return p_block;
+}
+
 static void ParsePES( demux_t *p_demux, ts_pid_t *pid, block_t *p_pes )
 {
     uint8_t header[34];
@@ -1714,6 +2015,7 @@ static void ParsePES( demux_t *p_demux, ts_pid_t *pid, block_t *p_pes )
 
         p_pes->i_length = i_length * 100 / 9;
 
+        /* GatherData() reassembles the PES in a single block */
         p_block = block_ChainGather( p_pes );
         if( pid->es->fmt.i_codec == VLC_CODEC_SUBT )
         {
@@ -1745,14 +2047,25 @@ static void ParsePES( demux_t *p_demux, ts_pid_t *pid, block_t *p_pes )
                 }
             }
         }
-
-        for( int i = 0; i < pid->i_extra_es; i++ )
+        else if( pid->es->fmt.i_codec == VLC_CODEC_HEVC )
         {
-            es_out_Send( p_demux->out, pid->extra_es[i]->id,
-                         block_Duplicate( p_block ) );
+            p_block = FlagHEVC( p_demux, pid->es, p_block );
         }
 
-        es_out_Send( p_demux->out, pid->es->id, p_block );
+        while( p_block )
+        {
+            block_t *p_next = p_block->p_next;
+            p_block->p_next = NULL;
+
+            for( int i = 0; i < pid->i_extra_es; i++ )
+            {
+                es_out_Send( p_demux->out, pid->extra_es[i]->id,
+                             block_Duplicate( p_block ) );
+            }
+
+            es_out_Send( p_demux->out, pid->es->id, p_block );
+            p_block = p_next;
+        }
     }
     else
     {
@@ -1813,10 +2126,11 @@ static void ParseData( demux_t *p_demux, ts_pid_t *pid )
     block_t *p_data = pid->es->p_data;
 
     /* remove the pes from pid */
+    pid->es->i_data_avg = ( 7 * pid->es->i_data_avg + pid->es->i_data_gathered ) / 8;
     pid->es->p_data = NULL;
     pid->es->i_data_size = 0;
     pid->es->i_data_gathered = 0;
-    pid->es->pp_last = &pid->es->p_data;
+    pid->es->i_data_alloc = 0;
 
     if( pid->es->data_type == TS_ES_DATA_PES )
     {
@@ -1832,60 +2146,144 @@ static void ParseData( demux_t *p_demux, ts_pid_t *pid )
     }
 }
 
-static block_t* ReadTSPacket( demux_t *p_demux )
+/* Keep the unread bytes and refill the read buffer, returns false if less
+ * than i_min bytes are available */
+static bool ReadFill( demux_t *p_demux, int i_min )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
+    int i_left = p_sys->i_read_len - p_sys->i_read_pos;
+
+    if( i_left >= i_min )
+        return true;
 
-    block_t     *p_pkt;
+    memmove( p_sys->p_read, &p_sys->p_read[p_sys->i_read_pos], i_left );
+    p_sys->i_csa_end = __MAX( p_sys->i_csa_end - p_sys->i_read_pos, 0 );
+    p_sys->i_read_pos = 0;
+    p_sys->i_read_len = i_left;
 
-    /* Get a new TS packet */
-    if( !( p_pkt = stream_Block( p_demux->s, p_sys->i_packet_size ) ) )
+    /* read whole packets, the buffer has room for one more */
+    int i_want = ( p_sys->i_read_size - p_sys->i_packet_size - i_left )
+               / p_sys->i_packet_size * p_sys->i_packet_size;
+    if( i_want < i_min - i_left )
+        i_want = i_min - i_left;
+
+    int i_read = stream_Read( p_demux->s, &p_sys->p_read[i_left], i_want );
+    if( i_read > 0 )
+        p_sys->i_read_len += i_read;
+
+    return p_sys->i_read_len >= i_min;
+}
+
+/* Position in the stream of the next packet to demux */
+static int64_t TSTell( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+
+    return stream_Tell( p_demux->s ) - ( p_sys->i_read_len - p_sys->i_read_pos );
+}
+
+static int TSSeek( demux_t *p_demux, int64_t i_pos )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+
+    /* land on a packet start instead of resynchronizing */
+    if( p_sys->i_sync_phase >= 0 )
+        i_pos += ( p_sys->i_sync_phase - i_pos % p_sys->i_packet_size
+                   + p_sys->i_packet_size ) % p_sys->i_packet_size;
+
+    p_sys->i_read_pos = p_sys->i_read_len = 0;
+    p_sys->i_csa_end = 0;
+    return stream_Seek( p_demux->s, i_pos );
+}
+
+/* Offset of the first sync byte followed by another one a packet later,
+ * and by a third one when the buffer is long enough, or -1 */
+static int FindSync( const uint8_t *p, int i_len, int i_size )
+{
+    const uint8_t *p_sync = p;
+    const uint8_t *p_end = &p[i_len - i_size];
+
+    while( p_sync < p_end &&
+           ( p_sync = memchr( p_sync, 0x47, p_end - p_sync ) ) )
     {
-        msg_Dbg( p_demux, "eof ?" );
-        return NULL;
+        if( p_sync[i_size] == 0x47 &&
+            ( p_sync + 2 * i_size >= &p[i_len] || p_sync[2 * i_size] == 0x47 ) )
+            return p_sync - p;
+        p_sync++;
     }
+    return -1;
+}
 
-    /* Check sync byte and re-sync if needed */
-    if( p_pkt->p_buffer[0] != 0x47 )
+/* Move the read position to the next packet start, returns false at the
+ * end of the stream */
+static bool Resync( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    const int i_size = p_sys->i_packet_size;
+
+    msg_Warn( p_demux, "lost synchro" );
+
+    /* A damaged sync byte doesn't move the next packets, only drop this one */
+    if( ReadFill( p_demux, 2 * i_size + 1 ) )
     {
-        msg_Warn( p_demux, "lost synchro" );
-        block_Release( p_pkt );
-        while( vlc_object_alive (p_demux) )
+        const uint8_t *p = &p_sys->p_read[p_sys->i_read_pos];
+        if( p[i_size] == 0x47 && p[2 * i_size] == 0x47 )
         {
-            const uint8_t *p_peek;
-            int i_peek, i_skip = 0;
+            msg_Dbg( p_demux, "skipping corrupted packet" );
+            p_sys->i_read_pos += i_size;
+            return true;
+        }
+    }
 
-            i_peek = stream_Peek( p_demux->s, &p_peek,
-                    p_sys->i_packet_size * 10 );
-            if( i_peek < p_sys->i_packet_size + 1 )
-            {
-                msg_Dbg( p_demux, "eof ?" );
-                return NULL;
-            }
+    while( vlc_object_alive (p_demux) )
+    {
+        if( !ReadFill( p_demux, i_size + 1 ) )
+            return false;
 
-            while( i_skip < i_peek - p_sys->i_packet_size )
-            {
-                if( p_peek[i_skip] == 0x47 &&
-                        p_peek[i_skip + p_sys->i_packet_size] == 0x47 )
-                {
-                    break;
-                }
-                i_skip++;
-            }
+        int i_peek = p_sys->i_read_len - p_sys->i_read_pos;
+        int i_skip = FindSync( &p_sys->p_read[p_sys->i_read_pos], i_peek, i_size );
+        if( i_skip >= 0 )
+        {
             msg_Dbg( p_demux, "skipping %d bytes of garbage", i_skip );
-            stream_Read( p_demux->s, NULL, i_skip );
-
-            if( i_skip < i_peek - p_sys->i_packet_size )
-            {
-                break;
-            }
+            p_sys->i_read_pos += i_skip;
+            p_sys->i_sync_phase = TSTell( p_demux ) % i_size;
+            break;
         }
-        if( !( p_pkt = stream_Block( p_demux->s, p_sys->i_packet_size ) ) )
+        /* keep the last bytes, they can still start a packet */
+        p_sys->i_read_pos += i_peek - i_size;
+    }
+    return true;
+}
+
+/* Returns the next packet, it is only valid until the next call */
+static uint8_t *ReadTSPacket( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    const int i_size = p_sys->i_packet_size;
+
+    /* Get a new TS packet */
+    if( !ReadFill( p_demux, i_size ) )
+    {
+        msg_Dbg( p_demux, "eof ?" );
+        return NULL;
+    }
+
+    /* Check sync byte and re-sync if needed */
+    if( p_sys->p_read[p_sys->i_read_pos] != 0x47 )
+    {
+        if( !Resync( p_demux ) || !ReadFill( p_demux, i_size ) )
         {
             msg_Dbg( p_demux, "eof ?" );
             return NULL;
         }
     }
+    else if( p_sys->i_sync_phase < 0 )
+    {
+        p_sys->i_sync_phase = TSTell( p_demux ) % i_size;
+    }
+
+    uint8_t *p_pkt = &p_sys->p_read[p_sys->i_read_pos];
+    p_sys->i_read_pos += i_size;
     return p_pkt;
 }
 
@@ -1897,7 +2295,7 @@ static mtime_t AdjustPCRWrapAround( demux_t *p_demux, mtime_t i_pcr )
      * So, need to add 0x1FFFFFFFF, for calculating duration or current position.
      */
     mtime_t i_adjust = 0;
-    int64_t i_pos = stream_Tell( p_demux->s );
+    int64_t i_pos = TSTell( p_demux );
     int i;
     for( i = 1; i < p_sys->i_pcrs_num && p_sys->p_pos[i] <= i_pos; ++i )
     {
@@ -1910,10 +2308,8 @@ static mtime_t AdjustPCRWrapAround( demux_t *p_demux, mtime_t i_pcr )
     return i_pcr + i_adjust;
 }
 
-static mtime_t GetPCR( block_t *p_pkt )
+static mtime_t GetPCR( const uint8_t *p )
 {
-    const uint8_t *p = p_pkt->p_buffer;
-
     mtime_t i_pcr = -1;
 
     if( ( p[3]&0x20 ) && /* adaptation */
@@ -1935,7 +2331,7 @@ static int SeekToPCR( demux_t *p_demux, int64_t i_pos )
     demux_sys_t *p_sys = p_demux->p_sys;
 
     mtime_t i_pcr = -1;
-    int64_t i_initial_pos = stream_Tell( p_demux->s );
+    int64_t i_initial_pos = TSTell( p_demux );
 
     if( i_pos < 0 )
         return VLC_EGENERIC;
@@ -1946,12 +2342,12 @@ static int SeekToPCR( demux_t *p_demux, int64_t i_pos )
         i_last_pos = stream_Size( p_demux->s ) - p_sys->i_packet_size;
     }
 
-    if( stream_Seek( p_demux->s, i_pos ) )
+    if( TSSeek( p_demux, i_pos ) )
         return VLC_EGENERIC;
 
     while( vlc_object_alive( p_demux ) )
     {
-        block_t     *p_pkt;
+        uint8_t     *p_pkt;
         if( !( p_pkt = ReadTSPacket( p_demux ) ) )
         {
             break;
@@ -1960,15 +2356,14 @@ static int SeekToPCR( demux_t *p_demux, int64_t i_pos )
         {
             i_pcr = GetPCR( p_pkt );
         }
-        block_Release( p_pkt );
         if( i_pcr >= 0 )
             break;
-        if( stream_Tell( p_demux->s ) >= i_last_pos )
+        if( TSTell( p_demux ) >= i_last_pos )
             break;
     }
     if( i_pcr < 0 )
     {
-        stream_Seek( p_demux->s, i_initial_pos );
+        TSSeek( p_demux, i_initial_pos );
         return VLC_EGENERIC;
     }
     else
@@ -1982,7 +2377,7 @@ static int Seek( demux_t *p_demux, double f_percent )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
 
-    int64_t i_initial_pos = stream_Tell( p_demux->s );
+    int64_t i_initial_pos = TSTell( p_demux );
     mtime_t i_initial_pcr = p_sys->i_current_pcr;
 
     /*
@@ -2035,7 +2430,7 @@ static int Seek( demux_t *p_demux, double f_percent )
     if( !b_found )
     {
         msg_Dbg( p_demux, "Seek():cannot find a time position. i_cnt:%d", i_cnt );
-        stream_Seek( p_demux->s, i_initial_pos );
+        TSSeek( p_demux, i_initial_pos );
         p_sys->i_current_pcr = i_initial_pcr;
         return VLC_EGENERIC;
     }
@@ -2046,18 +2441,51 @@ static int Seek( demux_t *p_demux, double f_percent )
     }
 }
 
+/* Seek to the last indexed random access point before the PCR */
+static int SeekIndex( demux_t *p_demux, mtime_t i_target_pcr )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    int64_t i_pos;
+    mtime_t i_pcr;
+
+    if( !p_sys->p_index ||
+        TsIndexFind( p_sys->p_index, i_target_pcr, &i_pos, &i_pcr ) ||
+        TSSeek( p_demux, i_pos ) )
+        return VLC_EGENERIC;
+
+    msg_Dbg( p_demux, "SeekIndex(): %"PRId64" found at %"PRId64,
+             i_target_pcr, i_pos );
+    p_sys->i_current_pcr = i_pcr;
+    return VLC_SUCCESS;
+}
+
+static void StartIndex( demux_t *p_demux )
+{
+    demux_sys_t *p_sys = p_demux->p_sys;
+    int i_video_pid = -1;
+
+    for( int i = 0; i < 8192 && i_video_pid < 0; i++ )
+    {
+        const ts_pid_t *pid = &p_sys->pid[i];
+        if( pid->b_valid && !pid->psi && pid->es->fmt.i_codec == VLC_CODEC_HEVC )
+            i_video_pid = i;
+    }
+    p_sys->p_index = TsIndexNew( p_demux, p_sys->i_packet_size,
+                                 p_sys->i_pid_ref_pcr, i_video_pid );
+}
+
 static void GetFirstPCR( demux_t *p_demux )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
 
-    int64_t i_initial_pos = stream_Tell( p_demux->s );
+    int64_t i_initial_pos = TSTell( p_demux );
 
-    if( stream_Seek( p_demux->s, 0 ) )
+    if( TSSeek( p_demux, 0 ) )
         return;
 
     while( vlc_object_alive (p_demux) )
     {
-        block_t     *p_pkt;
+        uint8_t     *p_pkt;
         if( !( p_pkt = ReadTSPacket( p_demux ) ) )
         {
             break;
@@ -2069,18 +2497,17 @@ static void GetFirstPCR( demux_t *p_demux )
             p_sys->i_first_pcr = i_pcr;
             p_sys->i_current_pcr = i_pcr;
         }
-        block_Release( p_pkt );
         if( p_sys->i_first_pcr >= 0 )
             break;
     }
-    stream_Seek( p_demux->s, i_initial_pos );
+    TSSeek( p_demux, i_initial_pos );
 }
 
 static void GetLastPCR( demux_t *p_demux )
 {
     demux_sys_t *p_sys = p_demux->p_sys;
 
-    int64_t i_initial_pos = stream_Tell( p_demux->s );
+    int64_t i_initial_pos = TSTell( p_demux );
     mtime_t i_initial_pcr = p_sys->i_current_pcr;
 
     int64_t i_last_pos = stream_Size( p_demux->s ) - p_sys->i_packet_size;
@@ -2093,7 +2520,7 @@ static void GetLastPCR( demux_t *p_demux )
         if( SeekToPCR( p_demux, i_pos ) )
             break;
         p_sys->i_last_pcr = AdjustPCRWrapAround( p_demux, p_sys->i_current_pcr );
-        if( ( i_pos = stream_Tell( p_demux->s ) ) >= i_last_pos )
+        if( ( i_pos = TSTell( p_demux ) ) >= i_last_pos )
             break;
     }
     if( p_sys->i_last_pcr >= 0 )
@@ -2110,7 +2537,7 @@ static void GetLastPCR( demux_t *p_demux )
             p_sys->i_last_pcr = -1;
         }
     }
-    stream_Seek( p_demux->s, i_initial_pos );
+    TSSeek( p_demux, i_initial_pos );
     p_sys->i_current_pcr = i_initial_pcr;
 }
 
@@ -2118,7 +2545,7 @@ static void CheckPCR( demux_t *p_demux )
 {
     demux_sys_t   *p_sys = p_demux->p_sys;
 
-    int64_t i_initial_pos = stream_Tell( p_demux->s );
+    int64_t i_initial_pos = TSTell( p_demux );
     mtime_t i_initial_pcr = p_sys->i_current_pcr;
 
     int64_t i_size = stream_Size( p_demux->s );
@@ -2133,7 +2560,7 @@ static void CheckPCR( demux_t *p_demux )
         if( SeekToPCR( p_demux, i_pos ) )
             break;
         p_sys->p_pcrs[i] = p_sys->i_current_pcr;
-        p_sys->p_pos[i] = stream_Tell( p_demux->s );
+        p_sys->p_pos[i] = TSTell( p_demux );
         if( p_sys->p_pcrs[i-1] > p_sys->p_pcrs[i] )
         {
             msg_Dbg( p_demux, "PCR Wrap Around found between %d%% and %d%% (pcr:%"PRId64"(0x%09"PRIx64") pcr:%"PRId64"(0x%09"PRIx64"))",
@@ -2146,18 +2573,18 @@ static void CheckPCR( demux_t *p_demux )
         p_sys->b_force_seek_per_percent = true;
     }
 
-    stream_Seek( p_demux->s, i_initial_pos );
+    TSSeek( p_demux, i_initial_pos );
     p_sys->i_current_pcr = i_initial_pcr;
 }
 
-static void PCRHandle( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
+static void PCRHandle( demux_t *p_demux, ts_pid_t *pid, const uint8_t *p )
 {
     demux_sys_t   *p_sys = p_demux->p_sys;
 
     if( p_sys->i_pmt_es <= 0 )
         return;
 
-    mtime_t i_pcr = GetPCR( p_bk );
+    mtime_t i_pcr = GetPCR( p );
     if( i_pcr < 0 )
         return;
 
@@ -2176,11 +2603,45 @@ static void PCRHandle( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
             }
 }
 
-static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
+/* Append to the reassembly block of the ES, a new one is allocated with room
+ * for i_expected bytes. The data is only moved again if the guess was too
+ * small, the block then grows geometrically. */
+static void GatherAppend( ts_es_t *es, const uint8_t *p, int i_size, int i_expected )
+{
+    if( es->p_data == NULL )
+    {
+        es->i_data_alloc = __MAX( i_expected, i_size );
+        es->p_data = block_Alloc( es->i_data_alloc );
+        if( !es->p_data )
+            return;
+        es->p_data->i_buffer = 0;
+    }
+    else if( (int)es->p_data->i_buffer + i_size > es->i_data_alloc )
+    {
+        const size_t i_used = es->p_data->i_buffer;
+        const int i_alloc = __MAX( 2 * es->i_data_alloc, (int)i_used + i_size );
+
+        /* block_Realloc() releases the block on failure */
+        es->p_data = block_Realloc( es->p_data, 0, i_alloc );
+        if( !es->p_data )
+        {
+            es->i_data_size = 0;
+            es->i_data_gathered = 0;
+            return;
+        }
+        es->i_data_alloc = i_alloc;
+        es->p_data->i_buffer = i_used;
+    }
+    memcpy( &es->p_data->p_buffer[es->p_data->i_buffer], p, i_size );
+    es->p_data->i_buffer += i_size;
+    es->i_data_gathered += i_size;
+}
+
+/* p points to the packet in the read buffer, the payload is copied once
+ * into the reassembly block of the ES */
+static bool GatherData( demux_t *p_demux, ts_pid_t *pid, uint8_t *p )
 {
-    const uint8_t *p = p_bk->p_buffer;
     const bool b_unit_start = p[1]&0x40;
-    const bool b_scrambled  = p[3]&0x80;
     const bool b_adaptation = p[3]&0x20;
     const bool b_payload    = p[3]&0x10;
     const int  i_cc         = p[3]&0x0f; /* continuity counter */
@@ -2196,10 +2657,6 @@ static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
              b_payload, i_cc );
 #endif
 
-    /* For now, ignore additional error correction
-     * TODO: handle Reed-Solomon 204,188 error correction */
-    p_bk->i_buffer = TS_PACKET_SIZE_188;
-
     if( p[1]&0x80 )
     {
         msg_Dbg( p_demux, "transport_error_indicator set (pid=%d)",
@@ -2208,12 +2665,15 @@ static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
             pid->es->p_data->i_flags |= BLOCK_FLAG_CORRUPTED;
     }
 
-    if( p_demux->p_sys->csa )
+    /* most packets are already descrambled by DescrambleAhead() */
+    if( p_demux->p_sys->csa && ( p[3]&0x80 ) )
     {
         vlc_mutex_lock( &p_demux->p_sys->csa_lock );
-        csa_Decrypt( p_demux->p_sys->csa, p_bk->p_buffer, p_demux->p_sys->i_csa_pkt_size );
+        csa_Decrypt( p_demux->p_sys->csa, p, p_demux->p_sys->i_csa_pkt_size );
         vlc_mutex_unlock( &p_demux->p_sys->csa_lock );
     }
+    /* descrambling clears the scrambling control bits */
+    const bool b_scrambled = p[3]&0x80;
 
     if( !b_adaptation )
     {
@@ -2277,13 +2737,10 @@ static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
         }
     }
 
-    PCRHandle( p_demux, pid, p_bk );
+    PCRHandle( p_demux, pid, p );
 
     if( i_skip >= 188 || pid->es->id == NULL || p_demux->p_sys->b_udp_out )
-    {
-        block_Release( p_bk );
         return i_ret;
-    }
 
     /* */
     if( !pid->b_scrambled != !b_scrambled )
@@ -2302,24 +2759,26 @@ static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
                         pid->es->id, b_scrambled );
     }
 
-    /* We have to gather it */
-    p_bk->p_buffer += i_skip;
-    p_bk->i_buffer -= i_skip;
+    /* Continuation packets without a unit to append to are dropped */
+    if( !b_unit_start && pid->es->p_data == NULL )
+        return i_ret;
+
+    /* We have to gather it
+     * For now, ignore additional error correction
+     * TODO: handle Reed-Solomon 204,188 error correction */
+    const uint8_t *p_payload = &p[i_skip];
+    int i_payload = TS_PACKET_SIZE_188 - i_skip;
 
     if( b_unit_start )
     {
-        if( pid->es->data_type == TS_ES_DATA_TABLE_SECTION && p_bk->i_buffer > 0 )
+        if( pid->es->data_type == TS_ES_DATA_TABLE_SECTION )
         {
-            int i_pointer_field = __MIN( p_bk->p_buffer[0], p_bk->i_buffer - 1 );
-            block_t *p = block_Duplicate( p_bk );
-            if( p )
-            {
-                p->i_buffer = i_pointer_field;
-                p->p_buffer++;
-                block_ChainLastAppend( &pid->es->pp_last, p );
-            }
-            p_bk->i_buffer -= 1 + i_pointer_field;
-            p_bk->p_buffer += 1 + i_pointer_field;
+            /* the bytes before the pointer end the previous section */
+            int i_pointer_field = __MIN( p_payload[0], i_payload - 1 );
+            if( pid->es->p_data )
+                GatherAppend( pid->es, &p_payload[1], i_pointer_field, 0 );
+            p_payload += 1 + i_pointer_field;
+            i_payload -= 1 + i_pointer_field;
         }
         if( pid->es->p_data )
         {
@@ -2327,52 +2786,41 @@ static bool GatherData( demux_t *p_demux, ts_pid_t *pid, block_t *p_bk )
             i_ret = true;
         }
 
-        block_ChainLastAppend( &pid->es->pp_last, p_bk );
+        int i_expected = 0;
         if( pid->es->data_type == TS_ES_DATA_PES )
         {
-            if( p_bk->i_buffer > 6 )
+            if( i_payload > 6 )
             {
-                pid->es->i_data_size = GetWBE( &p_bk->p_buffer[4] );
+                pid->es->i_data_size = GetWBE( &p_payload[4] );
                 if( pid->es->i_data_size > 0 )
                 {
                     pid->es->i_data_size += 6;
                 }
             }
+            /* unbounded (video) PES are sized from the previous ones */
+            i_expected = pid->es->i_data_size > 0 ? pid->es->i_data_size :
+                         pid->es->i_data_avg + pid->es->i_data_avg / 2;
         }
         else if( pid->es->data_type == TS_ES_DATA_TABLE_SECTION )
         {
-            if( p_bk->i_buffer > 3 && p_bk->p_buffer[0] != 0xff )
+            if( i_payload > 3 && p_payload[0] != 0xff )
             {
-                pid->es->i_data_size = 3 + (((p_bk->p_buffer[1] & 0xf) << 8) | p_bk->p_buffer[2]);
+                pid->es->i_data_size = 3 + (((p_payload[1] & 0xf) << 8) | p_payload[2]);
             }
+            i_expected = pid->es->i_data_size;
         }
-        pid->es->i_data_gathered += p_bk->i_buffer;
-        if( pid->es->i_data_size > 0 &&
-            pid->es->i_data_gathered >= pid->es->i_data_size )
-        {
-            ParseData( p_demux, pid );
-            i_ret = true;
-        }
+        GatherAppend( pid->es, p_payload, i_payload, i_expected );
     }
     else
     {
-        if( pid->es->p_data == NULL )
-        {
-            /* msg_Dbg( p_demux, "broken packet" ); */
-            block_Release( p_bk );
-        }
-        else
-        {
-            block_ChainLastAppend( &pid->es->pp_last, p_bk );
-            pid->es->i_data_gathered += p_bk->i_buffer;
+        GatherAppend( pid->es, p_payload, i_payload, 0 );
+    }
 
-            if( pid->es->i_data_size > 0 &&
-                pid->es->i_data_gathered >= pid->es->i_data_size )
-            {
-                ParseData( p_demux, pid );
-                i_ret = true;
-            }
-        }
+    if( pid->es->p_data && pid->es->i_data_size > 0 &&
+        pid->es->i_data_gathered >= pid->es->i_data_size )
+    {
+        ParseData( p_demux, pid );
+        i_ret = true;
     }
 
     return i_ret;
@@ -3495,7 +3943,9 @@ static void PMTSetupEsTeletext( demux_t *p_demux, ts_pid_t *pid,
                 p_es->p_data  = NULL;
                 p_es->i_data_size = 0;
                 p_es->i_data_gathered = 0;
-                p_es->pp_last = &p_es->p_data;
+                p_es->i_data_alloc = 0;
+                p_es->i_data_avg = 0;
+                p_es->b_au_unaligned = false;
                 p_es->data_type = TS_ES_DATA_PES;
                 p_es->p_mpeg4desc = NULL;
 
@@ -3579,7 +4029,9 @@ static void PMTSetupEsDvbSubtitle( demux_t *p_demux, ts_pid_t *pid,
                 p_es->p_data   = NULL;
                 p_es->i_data_size = 0;
                 p_es->i_data_gathered = 0;
-                p_es->pp_last = &p_es->p_data;
+                p_es->i_data_alloc = 0;
+                p_es->i_data_avg = 0;
+                p_es->b_au_unaligned = false;
                 p_es->data_type = TS_ES_DATA_PES;
                 p_es->p_mpeg4desc = NULL;
 
@@ -4322,6 +4774,7 @@ static void PATCallBack( void *data, dvbpsi_pat_t *p_pat )
         }
 
         PIDInit( pmt, true, pat->psi );
+        PIDBitSet( p_sys->pid_always, p_program->i_pid, true );
         ts_prg_psi_t *prg = pmt->psi->prg[pmt->psi->i_prg-1];
 #if (DVBPSI_VERSION_INT >= DVBPSI_VERSION_WANTED(1,0,0))
         prg->handle = dvbpsi_new( &dvbpsi_messages, DVBPSI_MSG_DEBUG );
@@ -0,0 +1,341 @@
+/*****************************************************************************
+ * ts_index.c: MPEG Transport Stream seek index
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <vlc_common.h>
+#include <vlc_demux.h>
+
+#include "ts_index.h"
+#include "../packetizer/hevc_nal.h"
+#include "../packetizer/startcode_helper.h"
+
+/* number of packets read at once */
+#define TS_INDEX_READ 512
+/* number of packets of a PES searched for the first slice */
+#define TS_INDEX_PES_PACKETS 8
+/* PCR interval of the entries without video PID */
+#define TS_INDEX_PCR_INTERVAL 90000
+
+typedef struct
+{
+    int64_t i_pos;
+    mtime_t i_pcr;
+} ts_index_entry_t;
+
+struct ts_index_t
+{
+    demux_t     *p_demux;
+    stream_t    *s;
+    int         i_packet_size;
+    int         i_pcr_pid;
+    int         i_video_pid;
+
+    vlc_thread_t thread;
+    vlc_mutex_t lock;
+    bool        b_abort;
+    bool        b_done;
+
+    /* sorted by position and PCR */
+    ts_index_entry_t *p_entries;
+    int         i_entries;
+    int         i_alloc;
+    mtime_t     i_last_pcr;
+
+    /* scanner state, only used by the thread */
+    mtime_t     i_pcr;
+    mtime_t     i_pcr_raw;
+    int64_t     i_pes_pos;
+    int         i_pes_packets;
+};
+
+static void *Thread( void * );
+
+ts_index_t *TsIndexNew( demux_t *p_demux, int i_packet_size,
+                        int i_pcr_pid, int i_video_pid )
+{
+    bool b_fastseek = false;
+    stream_t *s = NULL;
+    char *psz_url;
+
+    /* a second stream is used, only do this for files that can be
+     * accessed cheaply */
+    stream_Control( p_demux->s, STREAM_CAN_FASTSEEK, &b_fastseek );
+    if( !b_fastseek || !p_demux->psz_access || !p_demux->psz_location )
+        return NULL;
+
+    if( asprintf( &psz_url, "%s://%s", p_demux->psz_access,
+                  p_demux->psz_location ) >= 0 )
+    {
+        s = stream_UrlNew( p_demux, psz_url );
+        free( psz_url );
+    }
+    if( !s )
+        return NULL;
+
+    ts_index_t *p_index = calloc( 1, sizeof( *p_index ) );
+    if( !p_index )
+    {
+        stream_Delete( s );
+        return NULL;
+    }
+    p_index->p_demux = p_demux;
+    p_index->s = s;
+    p_index->i_packet_size = i_packet_size;
+    p_index->i_pcr_pid = i_pcr_pid;
+    p_index->i_video_pid = i_video_pid;
+    p_index->i_last_pcr = -1;
+    p_index->i_pcr = -1;
+    p_index->i_pcr_raw = -1;
+    p_index->i_pes_pos = -1;
+    vlc_mutex_init( &p_index->lock );
+
+    if( vlc_clone( &p_index->thread, Thread, p_index, VLC_THREAD_PRIORITY_LOW ) )
+    {
+        vlc_mutex_destroy( &p_index->lock );
+        stream_Delete( s );
+        free( p_index );
+        return NULL;
+    }
+    return p_index;
+}
+
+void TsIndexDelete( ts_index_t *p_index )
+{
+    vlc_mutex_lock( &p_index->lock );
+    p_index->b_abort = true;
+    vlc_mutex_unlock( &p_index->lock );
+    vlc_join( p_index->thread, NULL );
+
+    vlc_mutex_destroy( &p_index->lock );
+    stream_Delete( p_index->s );
+    free( p_index->p_entries );
+    free( p_index );
+}
+
+int TsIndexFind( ts_index_t *p_index, mtime_t i_pcr,
+                 int64_t *pi_pos, mtime_t *pi_pcr )
+{
+    int i_ret = VLC_EGENERIC;
+
+    vlc_mutex_lock( &p_index->lock );
+    /* past the last entry, the next one may still come before i_pcr */
+    if( p_index->i_entries > 0 &&
+        ( p_index->b_done || p_index->i_last_pcr > i_pcr ) )
+    {
+        int i_low = 0, i_high = p_index->i_entries - 1;
+        while( i_low < i_high )
+        {
+            int i_mid = ( i_low + i_high + 1 ) / 2;
+            if( p_index->p_entries[i_mid].i_pcr <= i_pcr )
+                i_low = i_mid;
+            else
+                i_high = i_mid - 1;
+        }
+        *pi_pos = p_index->p_entries[i_low].i_pos;
+        *pi_pcr = p_index->p_entries[i_low].i_pcr;
+        i_ret = VLC_SUCCESS;
+    }
+    vlc_mutex_unlock( &p_index->lock );
+    return i_ret;
+}
+
+int TsIndexGetLastPCR( ts_index_t *p_index, mtime_t *pi_pcr )
+{
+    int i_ret = VLC_EGENERIC;
+
+    vlc_mutex_lock( &p_index->lock );
+    if( p_index->b_done && p_index->i_last_pcr >= 0 )
+    {
+        *pi_pcr = p_index->i_last_pcr;
+        i_ret = VLC_SUCCESS;
+    }
+    vlc_mutex_unlock( &p_index->lock );
+    return i_ret;
+}
+
+/*****************************************************************************
+ * Scanner
+ *****************************************************************************/
+static void Add( ts_index_t *p_index, int64_t i_pos )
+{
+    vlc_mutex_lock( &p_index->lock );
+    if( p_index->i_entries > 0 &&
+        p_index->p_entries[p_index->i_entries - 1].i_pcr >= p_index->i_pcr )
+        goto out; /* the PCR didn't progress, keep the first position */
+
+    if( p_index->i_entries >= p_index->i_alloc )
+    {
+        int i_alloc = __MAX( 2 * p_index->i_alloc, 256 );
+        ts_index_entry_t *p_entries = realloc( p_index->p_entries,
+                                               i_alloc * sizeof( *p_entries ) );
+        if( !p_entries )
+            goto out;
+        p_index->p_entries = p_entries;
+        p_index->i_alloc = i_alloc;
+    }
+    p_index->p_entries[p_index->i_entries].i_pos = i_pos;
+    p_index->p_entries[p_index->i_entries].i_pcr = p_index->i_pcr;
+    p_index->i_entries++;
+out:
+    vlc_mutex_unlock( &p_index->lock );
+}
+
+/* Look for the first slice of the PES, returns false once it is found */
+static bool ScanPES( ts_index_t *p_index, const uint8_t *p, const uint8_t *p_end )
+{
+    const uint8_t *p_sc;
+
+    while( ( p_sc = startcode_FindAnnexB( p, p_end ) ) && p_sc + 3 < p_end )
+    {
+        int i_type = hevc_getNALType( &p_sc[3] );
+        if( hevc_isVCL( i_type ) )
+        {
+            if( hevc_isIRAP( i_type ) )
+                Add( p_index, p_index->i_pes_pos );
+            return false;
+        }
+        p = &p_sc[3];
+    }
+    return true;
+}
+
+static void ScanPacket( ts_index_t *p_index, const uint8_t *p, int64_t i_pos )
+{
+    const int i_pid = ( (p[1]&0x1f)<<8 )|p[2];
+    const bool b_unit_start = p[1]&0x40;
+    const uint8_t *p_end = &p[188];
+    const uint8_t *p_payload = &p[4];
+
+    if( i_pid == p_index->i_pcr_pid && ( p[3]&0x20 ) && ( p[5]&0x10 ) && p[4] >= 7 )
+    {
+        mtime_t i_pcr = ( (mtime_t)p[6] << 25 ) |
+                        ( (mtime_t)p[7] << 17 ) |
+                        ( (mtime_t)p[8] << 9 ) |
+                        ( (mtime_t)p[9] << 1 ) |
+                        ( (mtime_t)p[10] >> 7 );
+
+        if( p_index->i_pcr_raw < 0 )
+            p_index->i_pcr = i_pcr;
+        else if( i_pcr < p_index->i_pcr_raw && p_index->i_pcr_raw - i_pcr > 0xFFFFFFFF )
+            p_index->i_pcr += i_pcr + 0x1FFFFFFFF - p_index->i_pcr_raw;
+        else
+            p_index->i_pcr += i_pcr - p_index->i_pcr_raw;
+        p_index->i_pcr_raw = i_pcr;
+
+        vlc_mutex_lock( &p_index->lock );
+        p_index->i_last_pcr = p_index->i_pcr;
+        bool b_add = p_index->i_video_pid < 0 &&
+                     ( p_index->i_entries == 0 ||
+                       p_index->i_pcr >= p_index->p_entries[p_index->i_entries - 1].i_pcr
+                                         + TS_INDEX_PCR_INTERVAL );
+        vlc_mutex_unlock( &p_index->lock );
+        if( b_add )
+            Add( p_index, i_pos );
+    }
+
+    if( i_pid != p_index->i_video_pid || p_index->i_pcr < 0 || !( p[3]&0x10 ) )
+        return;
+
+    if( p[3]&0x20 )
+        p_payload += 1 + p[4];
+
+    if( b_unit_start )
+    {
+        /* skip the PES header */
+        if( p_end - p_payload < 9 || p_payload[0] != 0 || p_payload[1] != 0 ||
+            p_payload[2] != 1 )
+        {
+            p_index->i_pes_pos = -1;
+            return;
+        }
+        p_payload += 9 + p_payload[8];
+        p_index->i_pes_pos = i_pos;
+        p_index->i_pes_packets = 0;
+    }
+    else if( p_index->i_pes_pos < 0 )
+        return;
+
+    if( p_payload >= p_end ||
+        !ScanPES( p_index, p_payload, p_end ) ||
+        ++p_index->i_pes_packets >= TS_INDEX_PES_PACKETS )
+        p_index->i_pes_pos = -1;
+}
+
+static void *Thread( void *data )
+{
+    ts_index_t *p_index = data;
+    const int i_size = p_index->i_packet_size;
+    const int i_buffer = i_size * TS_INDEX_READ;
+    uint8_t *p_buffer = malloc( i_buffer );
+    int64_t i_pos = 0; /* of the start of the buffer */
+    int i_len = 0;
+
+    if( !p_buffer )
+        goto end;
+
+    msg_Dbg( p_index->p_demux, "indexing PCR pid %d, video pid %d",
+             p_index->i_pcr_pid, p_index->i_video_pid );
+    for( ;; )
+    {
+        vlc_mutex_lock( &p_index->lock );
+        bool b_stop = p_index->b_abort;
+        vlc_mutex_unlock( &p_index->lock );
+        if( b_stop )
+            break;
+
+        int i_read = stream_Read( p_index->s, &p_buffer[i_len], i_buffer - i_len );
+        if( i_read <= 0 )
+            break;
+        i_len += i_read;
+
+        int i_offset = 0;
+        while( i_len - i_offset >= i_size )
+        {
+            const uint8_t *p = &p_buffer[i_offset];
+            if( p[0] != 0x47 ||
+                ( i_len - i_offset >= 2 * i_size && p[i_size] != 0x47 ) )
+            {
+                /* lost sync, a PES can't be followed across it */
+                p_index->i_pes_pos = -1;
+                i_offset++;
+                continue;
+            }
+            ScanPacket( p_index, p, i_pos + i_offset );
+            i_offset += i_size;
+        }
+        memmove( p_buffer, &p_buffer[i_offset], i_len - i_offset );
+        i_len -= i_offset;
+        i_pos += i_offset;
+    }
+    free( p_buffer );
+
+end:
+    vlc_mutex_lock( &p_index->lock );
+    p_index->b_done = !p_index->b_abort;
+    msg_Dbg( p_index->p_demux, "indexed %d entries up to %"PRId64,
+             p_index->i_entries, i_pos );
+    vlc_mutex_unlock( &p_index->lock );
+    return NULL;
+}
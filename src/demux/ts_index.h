@@ -0,0 +1,48 @@
+/*****************************************************************************
+ * ts_index.h: MPEG Transport Stream seek index
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _TS_INDEX_H_
+#define _TS_INDEX_H_
+
+/*****************************************************************************
+ * ts_index_t: map of byte positions to PCRs
+ *****************************************************************************
+ * A low priority thread reads the file with its own stream and records the
+ * packets starting a PES with an HEVC random access point of the video PID,
+ * or one PCR per second if there is no video PID. The PCRs are those of the
+ * reference PID, without the 33 bits wrap around.
+ *****************************************************************************/
+typedef struct ts_index_t ts_index_t;
+
+ts_index_t *TsIndexNew( demux_t *p_demux, int i_packet_size,
+                        int i_pcr_pid, int i_video_pid );
+void TsIndexDelete( ts_index_t *p_index );
+
+/* Find the last entry at or before i_pcr, fails if that part of the file
+ * hasn't been indexed yet */
+int TsIndexFind( ts_index_t *p_index, mtime_t i_pcr,
+                 int64_t *pi_pos, mtime_t *pi_pcr );
+
+/* Last PCR of the file, fails until the whole file has been indexed */
+int TsIndexGetLastPCR( ts_index_t *p_index, mtime_t *pi_pcr );
+
+#endif
@@ -27,9 +27,25 @@
 #endif
 
 #include <vlc_common.h>
+#include <assert.h>
 
 #include "csa.h"
 
+#define CSA_MAX_THREADS 16
+/* packets taken at once by a worker */
+#define CSA_BATCH_CHUNK 4
+
+/* stream cypher state, kept on the stack so that several packets can be
+ * (de)scrambled in parallel with the same keys */
+typedef struct
+{
+    int     A[11];
+    int     B[11];
+    int     X, Y, Z;
+    int     D, E, F;
+    int     p, q, r;
+} csa_stream_t;
+
 struct csa_t
 {
     /* odd and even keys */
@@ -39,21 +55,29 @@ struct csa_t
     uint8_t o_kk[57];
     uint8_t e_kk[57];
 
-    /* cypher state */
-    int     A[11];
-    int     B[11];
-    int     X, Y, Z;
-    int     D, E, F;
-    int     p, q, r;
-
     bool    use_odd;
+
+    /* workers of csa_DecryptBatch */
+    vlc_mutex_t  lock;
+    vlc_cond_t   wait;
+    vlc_cond_t   done;
+    bool         quit;
+
+    uint8_t      **pp_pkt;
+    int          i_pkt;
+    int          i_pkt_next;
+    int          i_pkt_pending;
+    int          i_pkt_size;
+
+    int          i_threads;
+    vlc_thread_t threads[CSA_MAX_THREADS];
 };
 
 static void csa_ComputeKey( uint8_t kk[57], uint8_t ck[8] );
 
-static void csa_StreamCypher( csa_t *c, int b_init, uint8_t *ck, uint8_t *sb, uint8_t *cb );
+static void csa_StreamCypher( csa_stream_t *c, int b_init, const uint8_t *ck, uint8_t *sb, uint8_t *cb );
 
-static void csa_BlockDecypher( uint8_t kk[57], uint8_t ib[8], uint8_t bd[8] );
+static void csa_BlockDecypher( const uint8_t kk[57], uint8_t ib[8], uint8_t bd[8] );
 static void csa_BlockCypher( uint8_t kk[57], uint8_t bd[8], uint8_t ib[8] );
 
 /*****************************************************************************
@@ -61,7 +85,14 @@ static void csa_BlockCypher( uint8_t kk[57], uint8_t bd[8], uint8_t ib[8] );
  *****************************************************************************/
 csa_t *csa_New( void )
 {
-    return calloc( 1, sizeof( csa_t ) );
+    csa_t *c = calloc( 1, sizeof( csa_t ) );
+    if( !c )
+        return NULL;
+
+    vlc_mutex_init( &c->lock );
+    vlc_cond_init( &c->wait );
+    vlc_cond_init( &c->done );
+    return c;
 }
 
 /*****************************************************************************
@@ -69,6 +100,17 @@ csa_t *csa_New( void )
  *****************************************************************************/
 void csa_Delete( csa_t *c )
 {
+    vlc_mutex_lock( &c->lock );
+    c->quit = true;
+    vlc_cond_broadcast( &c->wait );
+    vlc_mutex_unlock( &c->lock );
+
+    for( int i = 0; i < c->i_threads; i++ )
+        vlc_join( c->threads[i], NULL );
+
+    vlc_cond_destroy( &c->done );
+    vlc_cond_destroy( &c->wait );
+    vlc_mutex_destroy( &c->lock );
     free( c );
 }
 
@@ -136,13 +178,14 @@ int csa_UseKey( vlc_object_t *p_caller, csa_t *c, bool use_odd )
 }
 
 /*****************************************************************************
- * csa_Decrypt:
+ * csa_DecryptPacket: only reads the keys from c
  *****************************************************************************/
-void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
+static void csa_DecryptPacket( const csa_t *c, uint8_t *pkt, int i_pkt_size )
 {
-    uint8_t *ck;
-    uint8_t *kk;
+    const uint8_t *ck;
+    const uint8_t *kk;
 
+    csa_stream_t s;
     uint8_t  ib[8], stream[8], block[8];
 
     int     i_hdr, i_residue;
@@ -179,7 +222,7 @@ void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
         return;
 
     /* init csa state */
-    csa_StreamCypher( c, 1, ck, &pkt[i_hdr], ib );
+    csa_StreamCypher( &s, 1, ck, &pkt[i_hdr], ib );
 
     /* */
     n = (i_pkt_size - i_hdr) / 8;
@@ -192,7 +235,7 @@ void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
         csa_BlockDecypher( kk, ib, block );
         if( i != n )
         {
-            csa_StreamCypher( c, 0, ck, NULL, stream );
+            csa_StreamCypher( &s, 0, ck, NULL, stream );
             for( j = 0; j < 8; j++ )
             {
                 /* xor ib with stream */
@@ -216,7 +259,7 @@ void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
 
     if( i_residue > 0 )
     {
-        csa_StreamCypher( c, 0, ck, NULL, stream );
+        csa_StreamCypher( &s, 0, ck, NULL, stream );
         for( j = 0; j < i_residue; j++ )
         {
             pkt[i_pkt_size - i_residue + j] ^= stream[j];
@@ -224,6 +267,102 @@ void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
     }
 }
 
+/*****************************************************************************
+ * csa_Decrypt:
+ *****************************************************************************/
+void csa_Decrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
+{
+    csa_DecryptPacket( c, pkt, i_pkt_size );
+}
+
+/*****************************************************************************
+ * csa_DecryptBatch workers
+ *****************************************************************************/
+/* Descramble chunks of the queued packets, must be called with the lock */
+static void csa_BatchWork( csa_t *c )
+{
+    while( c->i_pkt_next < c->i_pkt )
+    {
+        const int i_first = c->i_pkt_next;
+        const int i_count = __MIN( CSA_BATCH_CHUNK, c->i_pkt - i_first );
+
+        c->i_pkt_next += i_count;
+        vlc_mutex_unlock( &c->lock );
+        for( int i = i_first; i < i_first + i_count; i++ )
+            csa_DecryptPacket( c, c->pp_pkt[i], c->i_pkt_size );
+        vlc_mutex_lock( &c->lock );
+
+        c->i_pkt_pending -= i_count;
+        if( c->i_pkt_pending == 0 )
+            vlc_cond_signal( &c->done );
+    }
+}
+
+static void *csa_BatchThread( void *data )
+{
+    csa_t *c = data;
+
+    vlc_mutex_lock( &c->lock );
+    while( !c->quit )
+    {
+        if( c->i_pkt_next >= c->i_pkt )
+        {
+            vlc_cond_wait( &c->wait, &c->lock );
+            continue;
+        }
+        csa_BatchWork( c );
+    }
+    vlc_mutex_unlock( &c->lock );
+    return NULL;
+}
+
+/*****************************************************************************
+ * csa_StartThreads: descramble the batches with i_threads helper threads
+ *****************************************************************************/
+int csa_StartThreads( csa_t *c, int i_threads )
+{
+    i_threads = __MIN( i_threads, CSA_MAX_THREADS );
+    while( c->i_threads < i_threads )
+    {
+        if( vlc_clone( &c->threads[c->i_threads], csa_BatchThread, c,
+                       VLC_THREAD_PRIORITY_INPUT ) )
+            break;
+        c->i_threads++;
+    }
+    return c->i_threads;
+}
+
+/*****************************************************************************
+ * csa_DecryptBatch: the calling thread takes part and the function returns
+ * once all packets are descrambled
+ *****************************************************************************/
+void csa_DecryptBatch( csa_t *c, uint8_t **pp_pkt, int i_count, int i_pkt_size )
+{
+    if( c->i_threads == 0 || i_count <= CSA_BATCH_CHUNK )
+    {
+        for( int i = 0; i < i_count; i++ )
+            csa_DecryptPacket( c, pp_pkt[i], i_pkt_size );
+        return;
+    }
+
+    vlc_mutex_lock( &c->lock );
+    assert( c->i_pkt_pending == 0 );
+    c->pp_pkt = pp_pkt;
+    c->i_pkt = i_count;
+    c->i_pkt_next = 0;
+    c->i_pkt_pending = i_count;
+    c->i_pkt_size = i_pkt_size;
+    vlc_cond_broadcast( &c->wait );
+
+    csa_BatchWork( c );
+    while( c->i_pkt_pending > 0 )
+        vlc_cond_wait( &c->done, &c->lock );
+
+    c->pp_pkt = NULL;
+    c->i_pkt = c->i_pkt_next = 0;
+    vlc_mutex_unlock( &c->lock );
+}
+
 /*****************************************************************************
  * csa_Encrypt:
  *****************************************************************************/
@@ -232,6 +371,7 @@ void csa_Encrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
     uint8_t *ck;
     uint8_t *kk;
 
+    csa_stream_t s;
     int i, j;
     int i_hdr = 4; /* hdr len */
     uint8_t  ib[184/8+2][8], stream[8], block[8];
@@ -283,7 +423,7 @@ void csa_Encrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
     }
 
     /* init csa state */
-    csa_StreamCypher( c, 1, ck, ib[1], stream );
+    csa_StreamCypher( &s, 1, ck, ib[1], stream );
 
     for( i = 0; i < 8; i++ )
     {
@@ -291,7 +431,7 @@ void csa_Encrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
     }
     for( i = 2; i < n+1; i++ )
     {
-        csa_StreamCypher( c, 0, ck, NULL, stream );
+        csa_StreamCypher( &s, 0, ck, NULL, stream );
         for( j = 0; j < 8; j++ )
         {
             pkt[i_hdr+8*(i-1)+j] = ib[i][j] ^ stream[j];
@@ -299,7 +439,7 @@ void csa_Encrypt( csa_t *c, uint8_t *pkt, int i_pkt_size )
     }
     if( i_residue > 0 )
     {
-        csa_StreamCypher( c, 0, ck, NULL, stream );
+        csa_StreamCypher( &s, 0, ck, NULL, stream );
         for( j = 0; j < i_residue; j++ )
         {
             pkt[i_pkt_size - i_residue + j] ^= stream[j];
@@ -374,7 +514,7 @@ static const int sbox5[0x20] = {2,0,0,1,3,2,3,2, 0,1,3,3,1,0,2,1, 2,3,2,0,0,3,1,
 static const int sbox6[0x20] = {0,1,2,3,1,2,2,0, 0,1,3,0,2,3,1,3, 2,3,0,2,3,0,1,1, 2,1,1,2,0,3,3,0};
 static const int sbox7[0x20] = {0,3,2,2,3,0,0,1, 3,0,1,3,1,2,2,1, 1,0,3,3,0,1,1,2, 2,3,1,0,2,3,0,2};
 
-static void csa_StreamCypher( csa_t *c, int b_init, uint8_t *ck, uint8_t *sb, uint8_t *cb )
+static void csa_StreamCypher( csa_stream_t *c, int b_init, const uint8_t *ck, uint8_t *sb, uint8_t *cb )
 {
     int i,j, k;
     int extra_B;
@@ -538,7 +678,7 @@ static const uint8_t block_perm[256] =
     0x4D,0x4F,0xCD,0xCF,0x6D,0x6F,0xED,0xEF, 0x5D,0x5F,0xDD,0xDF,0x7D,0x7F,0xFD,0xFF,
 };
 
-static void csa_BlockDecypher( uint8_t kk[57], uint8_t ib[8], uint8_t bd[8] )
+static void csa_BlockDecypher( const uint8_t kk[57], uint8_t ib[8], uint8_t bd[8] )
 {
     int i;
     int perm_out;
@@ -30,6 +30,8 @@ typedef struct csa_t csa_t;
 #define csa_SetCW  __csa_SetCW
 #define csa_UseKey  __csa_UseKey
 #define csa_Decrypt __csa_decrypt
+#define csa_DecryptBatch __csa_DecryptBatch
+#define csa_StartThreads __csa_StartThreads
 #define csa_Encrypt __csa_encrypt
 
 csa_t *csa_New( void );
@@ -39,6 +41,9 @@ int    csa_SetCW( vlc_object_t *p_caller, csa_t *c, char *psz_ck, bool odd );
 int    csa_UseKey( vlc_object_t *p_caller, csa_t *, bool use_odd );
 
 void   csa_Decrypt( csa_t *, uint8_t *pkt, int i_pkt_size );
+/* descramble several packets, on the helper threads if any were started */
+void   csa_DecryptBatch( csa_t *, uint8_t **pp_pkt, int i_count, int i_pkt_size );
+int    csa_StartThreads( csa_t *, int i_threads );
 void   csa_Encrypt( csa_t *, uint8_t *pkt, int i_pkt_size );
 
 #endif /* _CSA_H */
@@ -0,0 +1,284 @@
+/*****************************************************************************
+ * hevc_nal.c: HEVC/H.265 NAL unit helpers
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*****************************************************************************
+ * Preamble
+ *****************************************************************************/
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <vlc_common.h>
+#include <vlc_bits.h>
+
+#include "hevc_nal.h"
+
+// Only the beginning of a parameter set is parsed, so don't unescape
+// more data than necessary.
+#define MAX_PARSE_SIZE          256
+
+/*****************************************************************************
+ * Unescape: remove emulation prevention bytes
+ *****************************************************************************/
+static size_t Unescape(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t size)
+{
+    size_t pos = 0;
+    int zeros = 0;
+    for (size_t i=0; i<size && pos<dst_size; i++) {
+        if (zeros == 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = (src[i] == 0) ? zeros + 1 : 0;
+        dst[pos++] = src[i];
+    }
+    return pos;
+}
+
+static uint32_t ReadUE(bs_t *bs)
+{
+    // longer prefixes only occur in corrupt data and don't fit, the
+    // value is then wrong (but defined)
+    int zeros = 0;
+    while (zeros < 31 && !bs_eof(bs) && bs_read1(bs) == 0) {
+        zeros++;
+    }
+    if (zeros == 0) {
+        return 0;
+    }
+    return (1U << zeros) - 1 + bs_read(bs, zeros);
+}
+
+static int32_t ReadSE(bs_t *bs)
+{
+    uint32_t value = ReadUE(bs);
+    return (value & 1) ? (int32_t) ((value + 1) / 2) : -(int32_t) (value / 2);
+}
+
+static void SkipProfileTierLevel(bs_t *bs, int max_sub_layers_minus1)
+{
+    bool profile_present[8];
+    bool level_present[8];
+
+    // general profile space, tier, idc, compatibility and constraint flags
+    bs_skip(bs, 88);
+    // general_level_idc
+    bs_skip(bs, 8);
+    for (int i=0; i<max_sub_layers_minus1; i++) {
+        profile_present[i] = bs_read1(bs);
+        level_present[i] = bs_read1(bs);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        for (int i=max_sub_layers_minus1; i<8; i++) {
+            bs_skip(bs, 2);
+        }
+    }
+    for (int i=0; i<max_sub_layers_minus1; i++) {
+        if (profile_present[i]) {
+            bs_skip(bs, 88);
+        }
+        if (level_present[i]) {
+            bs_skip(bs, 8);
+        }
+    }
+}
+
+/*****************************************************************************
+ * hevc_ParseSPS: parse the beginning of a sequence parameter set
+ *****************************************************************************/
+bool hevc_ParseSPS(const uint8_t *nal, size_t size, hevc_sps_t *sps)
+{
+    uint8_t buffer[MAX_PARSE_SIZE];
+    bs_t bs;
+
+    if (size < 2 || hevc_getNALType(nal) != HEVC_NAL_SPS_NUT) {
+        return false;
+    }
+
+    size = Unescape(buffer, sizeof(buffer), nal + 2, size - 2);
+    bs_init(&bs, buffer, size);
+
+    bs_skip(&bs, 4);  // sps_video_parameter_set_id
+    int max_sub_layers_minus1 = bs_read(&bs, 3);
+    bs_skip(&bs, 1);  // sps_temporal_id_nesting_flag
+    if (max_sub_layers_minus1 > 6) {
+        return false;
+    }
+    SkipProfileTierLevel(&bs, max_sub_layers_minus1);
+
+    sps->sps_id = ReadUE(&bs);
+    sps->chroma_format_idc = ReadUE(&bs);
+    if (sps->chroma_format_idc == 3) {
+        bs_skip(&bs, 1);  // separate_colour_plane_flag
+    }
+    sps->width = ReadUE(&bs);
+    sps->height = ReadUE(&bs);
+    if (bs_read1(&bs)) {
+        // conformance window offsets
+        for (int i=0; i<4; i++) {
+            ReadUE(&bs);
+        }
+    }
+    sps->bit_depth_luma = ReadUE(&bs) + 8;
+    sps->bit_depth_chroma = ReadUE(&bs) + 8;
+    ReadUE(&bs);  // log2_max_pic_order_cnt_lsb_minus4
+    bool sub_layer_ordering_info = bs_read1(&bs);
+    for (int i=(sub_layer_ordering_info ? 0 : max_sub_layers_minus1); i<=max_sub_layers_minus1; i++) {
+        ReadUE(&bs);  // sps_max_dec_pic_buffering_minus1
+        ReadUE(&bs);  // sps_max_num_reorder_pics
+        ReadUE(&bs);  // sps_max_latency_increase_plus1
+    }
+    int log2_min_cb_size = ReadUE(&bs) + 3;
+    sps->log2_ctb_size = log2_min_cb_size + ReadUE(&bs);
+
+    if (bs_eof(&bs) || sps->sps_id > 15 || sps->chroma_format_idc > 3 ||
+        sps->width == 0 || sps->height == 0 ||
+        sps->log2_ctb_size < 4 || sps->log2_ctb_size > 6) {
+        return false;
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * hevc_ParsePPS: parse the beginning of a picture parameter set
+ *****************************************************************************/
+bool hevc_ParsePPS(const uint8_t *nal, size_t size, hevc_pps_t *pps)
+{
+    uint8_t buffer[MAX_PARSE_SIZE];
+    bs_t bs;
+
+    if (size < 2 || hevc_getNALType(nal) != HEVC_NAL_PPS_NUT) {
+        return false;
+    }
+
+    size = Unescape(buffer, sizeof(buffer), nal + 2, size - 2);
+    bs_init(&bs, buffer, size);
+
+    pps->pps_id = ReadUE(&bs);
+    pps->sps_id = ReadUE(&bs);
+    bs_skip(&bs, 1);  // dependent_slice_segments_enabled_flag
+    bs_skip(&bs, 1);  // output_flag_present_flag
+    bs_skip(&bs, 3);  // num_extra_slice_header_bits
+    bs_skip(&bs, 1);  // sign_data_hiding_enabled_flag
+    bs_skip(&bs, 1);  // cabac_init_present_flag
+    ReadUE(&bs);      // num_ref_idx_l0_default_active_minus1
+    ReadUE(&bs);      // num_ref_idx_l1_default_active_minus1
+    ReadSE(&bs);      // init_qp_minus26
+    bs_skip(&bs, 1);  // constrained_intra_pred_flag
+    bs_skip(&bs, 1);  // transform_skip_enabled_flag
+    if (bs_read1(&bs)) {
+        ReadUE(&bs);  // diff_cu_qp_delta_depth
+    }
+    ReadSE(&bs);      // pps_cb_qp_offset
+    ReadSE(&bs);      // pps_cr_qp_offset
+    bs_skip(&bs, 1);  // pps_slice_chroma_qp_offsets_present_flag
+    bs_skip(&bs, 1);  // weighted_pred_flag
+    bs_skip(&bs, 1);  // weighted_bipred_flag
+    bs_skip(&bs, 1);  // transquant_bypass_enabled_flag
+    pps->tiles_enabled = bs_read1(&bs);
+    pps->entropy_coding_sync_enabled = bs_read1(&bs);
+    pps->num_tile_columns = 1;
+    pps->num_tile_rows = 1;
+    if (pps->tiles_enabled) {
+        pps->num_tile_columns = ReadUE(&bs) + 1;
+        pps->num_tile_rows = ReadUE(&bs) + 1;
+    }
+
+    if (bs_eof(&bs) || pps->pps_id > 63 || pps->sps_id > 15) {
+        return false;
+    }
+    return true;
+}
+
+/*****************************************************************************
+ * ReadHvcCNals: find the NAL units of a "hvcC" record, only counting them
+ * if nals is NULL
+ *****************************************************************************/
+static bool ReadHvcCNals(const uint8_t *data, size_t size, hevc_hvcc_nal_t *nals, int *count)
+{
+    int num_arrays = data[22];
+    size_t pos = 23;
+
+    *count = 0;
+    for (int i=0; i<num_arrays; i++) {
+        if (pos + 3 > size) {
+            return false;
+        }
+        // ignore flags + NAL type (1 byte), the type is taken from the NALs
+        int nal_count = data[pos+1] << 8 | data[pos+2];
+        pos += 3;
+        for (int j=0; j<nal_count; j++) {
+            if (pos + 2 > size) {
+                return false;
+            }
+            uint16_t nal_size = data[pos] << 8 | data[pos+1];
+            pos += 2;
+            if (pos + nal_size > size) {
+                return false;
+            }
+            if (nal_size > 0) {
+                if (nals != NULL) {
+                    hevc_hvcc_nal_t *nal = &nals[*count];
+                    nal->offset = (uint32_t) pos;
+                    nal->size = nal_size;
+                    nal->type = (uint8_t) hevc_getNALType(data + pos);
+                }
+                (*count)++;
+            }
+            pos += nal_size;
+        }
+    }
+    return true;
+}
+
+bool hevc_ParseHvcC(const uint8_t *data, size_t size, hevc_hvcc_t *hvcc)
+{
+    hvcc->version = 0;
+    hvcc->length_size = 4;
+    hvcc->nal_count = 0;
+    hvcc->nals = NULL;
+    if (size <= 22) {
+        return size == 0;
+    }
+
+    hvcc->version = data[0];
+    hvcc->length_size = (data[21] & 3) + 1;
+
+    // count the NAL units first, so the table can be allocated at once
+    int count;
+    bool complete = ReadHvcCNals(data, size, NULL, &count);
+    if (count > 0) {
+        hvcc->nals = (hevc_hvcc_nal_t *) malloc(count * sizeof(*hvcc->nals));
+        if (hvcc->nals == NULL) {
+            return false;
+        }
+        ReadHvcCNals(data, size, hvcc->nals, &hvcc->nal_count);
+    }
+    return complete;
+}
+
+void hevc_ReleaseHvcC(hevc_hvcc_t *hvcc)
+{
+    free(hvcc->nals);
+    hvcc->nals = NULL;
+    hvcc->nal_count = 0;
+}
@@ -0,0 +1,153 @@
+/*****************************************************************************
+ * hevc_nal.h: HEVC/H.265 NAL unit helpers
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _HEVC_NAL_H_
+#define _HEVC_NAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEVC_NAL_RADL_N         6       // RADL = random access decodable leading
+#define HEVC_NAL_RASL_N         8       // RASL = random access skipped leading
+#define HEVC_NAL_RASL_R         9
+#define HEVC_NAL_BLA_W_LP       16      // BLA = broken link access
+#define HEVC_NAL_BLA_W_RADL     17
+#define HEVC_NAL_BLA_N_LP       18
+#define HEVC_NAL_IDR_W_RADL     19
+#define HEVC_NAL_IDR_N_LP       20
+#define HEVC_NAL_CRA_NUT        21      // CRA = clean random access
+#define HEVC_NAL_VPS_NUT        32
+#define HEVC_NAL_SPS_NUT        33
+#define HEVC_NAL_PPS_NUT        34
+#define HEVC_NAL_AUD_NUT        35
+#define HEVC_NAL_EOS_NUT        36
+#define HEVC_NAL_EOB_NUT        37
+#define HEVC_NAL_FD_NUT         38
+#define HEVC_NAL_PREFIX_SEI     39
+#define HEVC_NAL_SUFFIX_SEI     40
+
+/* Type of the NAL unit starting at "nal" (without start code). */
+static inline int hevc_getNALType(const uint8_t *nal)
+{
+    return (nal[0] & 0x7E) >> 1;
+}
+
+static inline bool hevc_isIRAP(int type)
+{
+    return type >= HEVC_NAL_BLA_W_LP && type <= HEVC_NAL_CRA_NUT;
+}
+
+static inline bool hevc_isVCL(int type)
+{
+    return type < 32;
+}
+
+/* Leading pictures that can't be decoded if decoding starts at the
+ * associated CRA or BLA picture. */
+static inline bool hevc_isRASL(int type)
+{
+    return type == HEVC_NAL_RASL_N || type == HEVC_NAL_RASL_R;
+}
+
+/* Check if a NAL unit following a VCL NAL unit starts a new access unit.
+ * "first_slice" is the first_slice_segment_in_pic_flag of VCL NAL units. */
+static inline bool hevc_isAUStart(int type, bool first_slice)
+{
+    if (hevc_isVCL(type)) {
+        return first_slice;
+    }
+    return (type >= HEVC_NAL_VPS_NUT && type <= HEVC_NAL_AUD_NUT) ||
+        type == HEVC_NAL_PREFIX_SEI ||
+        (type >= 41 && type <= 44) ||
+        (type >= 48 && type <= 55);
+}
+
+/*****************************************************************************
+ * hevc_sps_t: the fields of a SPS that are relevant for the plugins
+ *****************************************************************************/
+typedef struct hevc_sps_t
+{
+    int sps_id;
+    int chroma_format_idc;
+    int width;
+    int height;
+    int bit_depth_luma;
+    int bit_depth_chroma;
+    int log2_ctb_size;
+} hevc_sps_t;
+
+/*****************************************************************************
+ * hevc_pps_t: the fields of a PPS that are relevant for the plugins
+ *****************************************************************************/
+typedef struct hevc_pps_t
+{
+    int pps_id;
+    int sps_id;
+    bool tiles_enabled;
+    bool entropy_coding_sync_enabled;
+    int num_tile_columns;
+    int num_tile_rows;
+} hevc_pps_t;
+
+/* Parse a SPS / PPS NAL unit (including the NAL header, without start code).
+ * \return true if the parameter set could be parsed */
+bool hevc_ParseSPS(const uint8_t *nal, size_t size, hevc_sps_t *sps);
+bool hevc_ParsePPS(const uint8_t *nal, size_t size, hevc_pps_t *pps);
+
+/*****************************************************************************
+ * hevc_hvcc_t: the NAL units of a "hvcC" decoder configuration record
+ *****************************************************************************
+ * The NAL units are referenced by their offset in the record, so the parsed
+ * form can be kept next to the record (e.g. the extra data of an ES) and
+ * used without copying the parameter sets.
+ *****************************************************************************/
+typedef struct hevc_hvcc_nal_t
+{
+    uint32_t offset;
+    uint16_t size;
+    uint8_t type;
+} hevc_hvcc_nal_t;
+
+typedef struct hevc_hvcc_t
+{
+    int version;
+    // number of bytes of the NAL unit lengths in the samples
+    int length_size;
+    int nal_count;
+    hevc_hvcc_nal_t *nals;
+} hevc_hvcc_t;
+
+/* Check if extra data is a "hvcC" record rather than Annex B data (which
+ * starts with a start code). */
+static inline bool hevc_isHvcC(const uint8_t *data, size_t size)
+{
+    return size > 3 && data != NULL && (data[0] || data[1] || data[2] > 1);
+}
+
+/* Parse a "hvcC" record, the NAL units before an error are still returned.
+ * The table of NAL units must be released with hevc_ReleaseHvcC.
+ * \return true if the whole record could be parsed */
+bool hevc_ParseHvcC(const uint8_t *data, size_t size, hevc_hvcc_t *hvcc);
+void hevc_ReleaseHvcC(hevc_hvcc_t *hvcc);
+
+#endif  // _HEVC_NAL_H_
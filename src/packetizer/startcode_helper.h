@@ -0,0 +1,90 @@
+/*****************************************************************************
+ * startcode_helper.h: fast search for Annex B start codes
+ *****************************************************************************
+ * Copyright (C) 2014 struktur AG
+ *
+ * Authors: Joachim Bauch <bauch@struktur.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _STARTCODE_HELPER_H_
+#define _STARTCODE_HELPER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Check for a 00 00 01 sequence at p. */
+#define STARTCODE_AT(p) ((p)[0] == 0 && (p)[1] == 0 && (p)[2] == 1)
+
+/*****************************************************************************
+ * startcode_FindAnnexB: find the next 00 00 01 sequence in [p, end)
+ * \return pointer to the first zero byte of the sequence or NULL
+ *****************************************************************************
+ * Blocks that don't contain any zero byte can't contain the start of a
+ * start code and are skipped as a whole: 16 bytes at a time on SSE2 builds
+ * (which includes all x86-64 builds), a machine word at a time otherwise.
+ *****************************************************************************/
+static inline const uint8_t *startcode_FindAnnexB(const uint8_t *p, const uint8_t *end)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    // the last candidate of a block needs two more bytes
+    while (end - p >= 16 + 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        // keep positions where the next byte is zero, too
+        mask &= (mask >> 1) | 0x8000;
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (STARTCODE_AT(p + i)) {
+                return p + i;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#else
+    const size_t ones = ((size_t) -1) / 0xff;
+    const size_t highs = ones << 7;
+    while (end - p >= (ptrdiff_t) sizeof(size_t) + 2) {
+        size_t x;
+        memcpy(&x, p, sizeof(x));
+        if ((x - ones) & ~x & highs) {
+            // at least one zero byte in this word
+            for (size_t i=0; i<sizeof(size_t); i++) {
+                if (STARTCODE_AT(p + i)) {
+                    return p + i;
+                }
+            }
+        }
+        p += sizeof(size_t);
+    }
+#endif
+
+    for (; end - p >= 3; p++) {
+        if (STARTCODE_AT(p)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#endif  // _STARTCODE_HELPER_H_